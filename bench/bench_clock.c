@@ -0,0 +1,88 @@
+/*
+ * bench_clock.c - Per-call cost of the ts clock sources
+ *
+ * Copyright (C) 2025  Michael Rice <michael@riceclan.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+// Reach the static clock functions the same way the coverage tests do
+#define TS_TESTING
+#define main ts_main
+#include "libts.c"
+#include "ts.c"
+#undef main
+
+#define BENCH_CALLS 5000000
+#define BENCH_ROUNDS 5
+
+static double elapsed_ns(const struct timespec *start, const struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) * 1e9 + (double)(end->tv_nsec - start->tv_nsec);
+}
+
+// Best of several rounds of BENCH_CALLS reads, in nanoseconds per call
+static double time_clock_source(clock_source_t *clock) {
+    double best = 0;
+    volatile long sink = 0;
+
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < BENCH_CALLS; i++) {
+            high_res_time_t now = tsi_clock_source_read(clock);
+            sink += now.nanoseconds;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double per_call = elapsed_ns(&start, &end) / BENCH_CALLS;
+        if (round == 0 || per_call < best) {
+            best = per_call;
+        }
+    }
+
+    (void)sink;
+    return best;
+}
+
+int main(void) {
+    printf("%-18s %12s %14s\n", "clock", "ns/call", "resolution ns");
+
+    for (int i = 0; system_clocks[i].name != NULL; i++) {
+        clock_source_t clock;
+        if (tsi_clock_source_open(&clock, system_clocks[i].name) != TS_SUCCESS) {
+            printf("%-18s %12s\n", system_clocks[i].name, "unavailable");
+            continue;
+        }
+        struct timespec resolution;
+        clock_getres(clock.clock_id, &resolution);
+        printf("%-18s %12.1f %14ld\n", system_clocks[i].name, time_clock_source(&clock),
+               resolution.tv_sec * NANOSECONDS_PER_SECOND + resolution.tv_nsec);
+    }
+
+    clock_source_t tsc;
+    tsi_clock_source_open(&tsc, "tsc");
+    if (tsc.kind == CLOCK_SOURCE_TSC) {
+        printf("%-18s %12.1f %14s\n", "tsc", time_clock_source(&tsc), "<1");
+    }
+
+    // The synthetic clock shows the floor: no clock read at all
+    clock_source_t fixed;
+    tsi_clock_source_open(&fixed, "fixed:0+0.000001");
+    printf("%-18s %12.1f %14s\n", "fixed", time_clock_source(&fixed), "-");
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,92 @@
+#!/bin/bash
+#
+# bench_compress.sh - ts --compress against piping ts into a compressor
+#
+# Copyright (C) 2025  Michael Rice <michael@riceclan.org>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Usage: bench/bench_compress.sh [TS [LINES]]
+#
+# Stamps LINES generated log lines (default 1000000) with a fixed clock,
+# once compressing in ts and once through a pipe to gzip or zstd at the
+# same level, and reports wall time, CPU time (user + system, all
+# processes) and input throughput.  The best of BENCH_ROUNDS runs counts.
+
+set -e
+
+TS=${1:-./ts}
+LINES=${2:-1000000}
+BENCH_ROUNDS=${BENCH_ROUNDS:-3}
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+awk -v lines="$LINES" 'BEGIN {
+    for (i = 0; i < lines; i++) {
+        printf "worker-%d request id=%08x path=/api/v1/items/%d status=%d bytes=%d\n",
+               i % 16, i * 2654435761 % 4294967296, i % 5000, i % 97 ? 200 : 503, (i * 7919) % 65536
+    }
+}' > "$work/input"
+input_bytes=$(wc -c < "$work/input")
+
+TIMEFORMAT='%R %U %S'
+STAMP="--clock=fixed:1755921813+0.000001 %.s"
+
+# Best wall time of BENCH_ROUNDS runs of "$@", the CPU time of that run,
+# input throughput and the compression ratio of what it left in output
+measure() {
+    best_real=""
+    for _ in $(seq "$BENCH_ROUNDS"); do
+        rm -f "$work/output"
+        read -r real user sys < <({ time "$@" > /dev/null 2>&1; } 2>&1)
+        if [ -z "$best_real" ] || awk -v a="$real" -v b="$best_real" 'BEGIN { exit !(a < b) }'; then
+            best_real=$real
+            best_cpu=$(awk -v u="$user" -v s="$sys" 'BEGIN { print u + s }')
+        fi
+    done
+    output_bytes=$(wc -c < "$work/output")
+    awk -v r="$best_real" -v c="$best_cpu" -v b="$input_bytes" -v o="$output_bytes" \
+        'BEGIN { printf "%8.2f %8.2f %10.1f %8.1f\n", r, c, b / r / 1048576, b / o }'
+}
+
+plain_run() {
+    # shellcheck disable=SC2086
+    "$TS" $STAMP < "$work/input" > "$work/output"
+}
+
+builtin_run() {
+    # shellcheck disable=SC2086
+    "$TS" $STAMP "--compress=$1" < "$work/input" > "$work/output"
+}
+
+pipe_run() {
+    # shellcheck disable=SC2086
+    "$TS" $STAMP < "$work/input" | "$1" "-$2" -c > "$work/output"
+}
+
+printf "%d lines, %.1f MB of input\n\n" "$LINES" "$(awk -v b="$input_bytes" 'BEGIN { print b / 1048576 }')"
+printf "%-24s %8s %8s %10s %8s\n" "run" "wall s" "cpu s" "MB/s in" "ratio"
+
+printf "%-24s " "ts"
+measure plain_run
+
+for method in gzip:6 zstd:3; do
+    name=${method%%:*}
+    level=${method##*:}
+    if ! "$TS" "--compress=$method" < /dev/null > /dev/null 2>&1; then
+        printf "%-24s %s\n" "ts --compress=$method" "not built in"
+        continue
+    fi
+    printf "%-24s " "ts --compress=$method"
+    measure builtin_run "$method"
+    if command -v "$name" > /dev/null; then
+        printf "%-24s " "ts | $name -$level"
+        measure pipe_run "$name" "$level"
+    else
+        printf "%-24s %s\n" "ts | $name -$level" "no $name command"
+    fi
+done
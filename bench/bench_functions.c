@@ -0,0 +1,314 @@
+/*
+ * bench_functions.c - Per-call cost of the ts hot functions
+ *
+ * Copyright (C) 2025  Michael Rice <michael@riceclan.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Usage: bench_functions [NAME...]
+//
+// Times each formatting and parsing function in a tight loop, in batches
+// sized to take at least BENCH_BATCH_NS so the clock reads vanish in the
+// noise, and reports the median, 99th percentile and fastest batch in
+// nanoseconds per call.  Where perf_event_open() is allowed, CPU cycles
+// and retired instructions per call over all measured batches are shown
+// too.  NAME arguments keep only the cases whose name contains one of
+// them.
+
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+// Reach the static functions the same way the coverage tests do
+#define TS_TESTING
+#define main ts_main
+#include "libts.c"
+#include "ts.c"
+#undef main
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#define BENCH_SAMPLES 2000
+#define BENCH_WARMUP_NS 20000000
+#define BENCH_BATCH_NS 20000
+#define BENCH_INPUTS 8
+#define BENCH_NOW 1755921813
+
+// One benchmark: run() is called with i counting calls, so cases can
+// cycle through their BENCH_INPUTS inputs
+typedef struct {
+    const char *name;
+    long (*run)(unsigned i);
+} bench_case_t;
+
+static const char *syslog_lines[BENCH_INPUTS];
+static const char *iso_lines[BENCH_INPUTS];
+static const char *unix_lines[BENCH_INPUTS];
+static const char *plain_lines[BENCH_INPUTS];
+static high_res_time_t sample_times[BENCH_INPUTS];
+static compiled_format_t default_format;
+static reference_time_t reference;
+
+static char line_storage[4][BENCH_INPUTS][MAX_LINE_LENGTH];
+
+// Lines of each kind differing in their digits, built once up front
+static void setup_inputs(void) {
+    for (int i = 0; i < BENCH_INPUTS; i++) {
+        time_t t = BENCH_NOW - 3600 * (i + 1) - 7 * i;
+        struct tm tm_info;
+        gmtime_r(&t, &tm_info);
+        strftime(line_storage[0][i], MAX_LINE_LENGTH, "%b %d %H:%M:%S host sshd[1234]: session opened", &tm_info);
+        strftime(line_storage[1][i], MAX_LINE_LENGTH, "%Y-%m-%dT%H:%M:%S.123456+0000 level=info msg=done", &tm_info);
+        snprintf(line_storage[2][i], MAX_LINE_LENGTH, "%lld.%06d worker-%d request done", (long long)t,
+                 i * 104729 % 1000000, i);
+        snprintf(line_storage[3][i], MAX_LINE_LENGTH, "worker-%d request id=%08x path=/api/v1/items/%d status=200",
+                 i, (unsigned)(i * 2654435761u), i * 31);
+        syslog_lines[i] = line_storage[0][i];
+        iso_lines[i] = line_storage[1][i];
+        unix_lines[i] = line_storage[2][i];
+        plain_lines[i] = line_storage[3][i];
+        sample_times[i] = (high_res_time_t){t, 123456789L * (i + 1) % NANOSECONDS_PER_SECOND};
+    }
+    tsi_compile_output_format(&default_format, "%b %d %H:%M:%S");
+    high_res_time_t now = {BENCH_NOW, 0};
+    tsi_reference_time_set(&reference, &now);
+}
+
+static long run_format_timestamp_with_subsecond(unsigned i) {
+    char buffer[MAX_FORMAT_LENGTH];
+    format_timestamp_with_subsecond(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%.S", &sample_times[i % BENCH_INPUTS]);
+    return buffer[18];
+}
+
+static long run_format_timestamp_compiled(unsigned i) {
+    char buffer[MAX_FORMAT_LENGTH];
+    tsi_format_timestamp_compiled(buffer, sizeof(buffer), &default_format, &sample_times[i % BENCH_INPUTS]);
+    return buffer[14];
+}
+
+static long find_match(const char **lines, unsigned i) {
+    int start = 0, end = 0;
+    find_timestamp_match(lines[i % BENCH_INPUTS], &start, &end);
+    return end;
+}
+
+static long run_find_syslog(unsigned i) { return find_match(syslog_lines, i); }
+static long run_find_iso(unsigned i) { return find_match(iso_lines, i); }
+static long run_find_unix(unsigned i) { return find_match(unix_lines, i); }
+static long run_find_plain(unsigned i) { return find_match(plain_lines, i); }
+
+static long parse_line(const char **lines, unsigned i) {
+    time_t parsed = 0;
+    long fraction = 0;
+    parse_timestamp_in_line_with_fractional(lines[i % BENCH_INPUTS], &parsed, &fraction, &reference);
+    return (long)parsed + fraction;
+}
+
+static long run_parse_syslog(unsigned i) { return parse_line(syslog_lines, i); }
+static long run_parse_iso(unsigned i) { return parse_line(iso_lines, i); }
+static long run_parse_unix(unsigned i) { return parse_line(unix_lines, i); }
+static long run_parse_plain(unsigned i) { return parse_line(plain_lines, i); }
+
+static long run_format_relative_time(unsigned i) {
+    char buffer[MAX_FORMAT_LENGTH];
+    const high_res_time_t *t = &sample_times[i % BENCH_INPUTS];
+    tsi_format_relative_time(buffer, sizeof(buffer), t->seconds, t->nanoseconds / 1000, &reference);
+    return buffer[0];
+}
+
+static long run_replace_timestamp_in_line(unsigned i) {
+    char buffer[MAX_LINE_LENGTH];
+    replace_timestamp_in_line(buffer, sizeof(buffer), syslog_lines[i % BENCH_INPUTS], "5h ago");
+    return buffer[0];
+}
+
+static const bench_case_t bench_cases[] = {
+    {"format_timestamp_with_subsecond", run_format_timestamp_with_subsecond},
+    {"format_timestamp_compiled", run_format_timestamp_compiled},
+    {"find_timestamp_match/syslog", run_find_syslog},
+    {"find_timestamp_match/iso", run_find_iso},
+    {"find_timestamp_match/unix", run_find_unix},
+    {"find_timestamp_match/none", run_find_plain},
+    {"parse_timestamp_in_line/syslog", run_parse_syslog},
+    {"parse_timestamp_in_line/iso", run_parse_iso},
+    {"parse_timestamp_in_line/unix", run_parse_unix},
+    {"parse_timestamp_in_line/none", run_parse_plain},
+    {"format_relative_time", run_format_relative_time},
+    {"replace_timestamp_in_line", run_replace_timestamp_in_line},
+    {NULL, NULL}
+};
+
+// Hardware counters for this thread, user space only.  Either fd is -1
+// when the kernel or its perf_event_paranoid setting refuses it.
+typedef struct {
+    int cycles_fd;
+    int instructions_fd;
+} perf_counters_t;
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+static int perf_counter_open(uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void perf_counters_open(perf_counters_t *counters) {
+    counters->cycles_fd = perf_counter_open(PERF_COUNT_HW_CPU_CYCLES);
+    counters->instructions_fd = perf_counter_open(PERF_COUNT_HW_INSTRUCTIONS);
+}
+
+static void perf_counter_enable(int fd, bool enable) {
+    if (fd >= 0) {
+        if (enable) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        }
+        ioctl(fd, enable ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+    }
+}
+
+// Count since the last enable, -1 without a counter
+static double perf_counter_read(int fd) {
+    uint64_t count;
+    if (fd < 0 || read(fd, &count, sizeof(count)) != (ssize_t)sizeof(count)) {
+        return -1;
+    }
+    return (double)count;
+}
+#else
+static void perf_counters_open(perf_counters_t *counters) {
+    counters->cycles_fd = -1;
+    counters->instructions_fd = -1;
+}
+
+static void perf_counter_enable(int fd, bool enable) {
+    (void)fd;
+    (void)enable;
+}
+
+static double perf_counter_read(int fd) {
+    (void)fd;
+    return -1;
+}
+#endif
+
+static double elapsed_ns(const struct timespec *start, const struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) * 1e9 + (double)(end->tv_nsec - start->tv_nsec);
+}
+
+static volatile long sink;
+
+// Nanoseconds for one batch of calls starting at call number *call
+static double time_batch(const bench_case_t *bench, unsigned batch, unsigned *call) {
+    struct timespec start, end;
+    long sum = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned i = 0; i < batch; i++) {
+        sum += bench->run((*call)++);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    sink += sum;
+    return elapsed_ns(&start, &end);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void run_case(const bench_case_t *bench, const perf_counters_t *counters) {
+    static double samples[BENCH_SAMPLES];
+    unsigned call = 0;
+
+    // Warm caches and branch predictors for BENCH_WARMUP_NS, then double
+    // the batch until its fastest of three runs outlasts BENCH_BATCH_NS
+    double warm = 0;
+    while (warm < BENCH_WARMUP_NS) {
+        warm += time_batch(bench, 64, &call);
+    }
+    unsigned batch = 1;
+    while (batch < (1u << 24)) {
+        double fastest = time_batch(bench, batch, &call);
+        for (int i = 0; i < 2; i++) {
+            double ns = time_batch(bench, batch, &call);
+            fastest = ns < fastest ? ns : fastest;
+        }
+        if (fastest >= BENCH_BATCH_NS) {
+            break;
+        }
+        batch *= 2;
+    }
+
+    perf_counter_enable(counters->cycles_fd, true);
+    perf_counter_enable(counters->instructions_fd, true);
+    for (int i = 0; i < BENCH_SAMPLES; i++) {
+        samples[i] = time_batch(bench, batch, &call) / batch;
+    }
+    perf_counter_enable(counters->cycles_fd, false);
+    perf_counter_enable(counters->instructions_fd, false);
+    double calls = (double)BENCH_SAMPLES * batch;
+    double cycles = perf_counter_read(counters->cycles_fd);
+    double instructions = perf_counter_read(counters->instructions_fd);
+
+    qsort(samples, BENCH_SAMPLES, sizeof(samples[0]), compare_doubles);
+    printf("%-32s %8u %10.1f %10.1f %10.1f", bench->name, batch, samples[BENCH_SAMPLES / 2],
+           samples[BENCH_SAMPLES * 99 / 100], samples[0]);
+    if (cycles >= 0 && instructions >= 0) {
+        printf(" %10.0f %10.0f %6.2f\n", cycles / calls, instructions / calls,
+               cycles > 0 ? instructions / cycles : 0);
+    } else {
+        printf(" %10s %10s %6s\n", "-", "-", "-");
+    }
+}
+
+static bool case_selected(const char *name, int argc, char **argv) {
+    if (argc < 2) {
+        return true;
+    }
+    for (int i = 1; i < argc; i++) {
+        if (strstr(name, argv[i]) != NULL) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char **argv) {
+    setup_inputs();
+
+    perf_counters_t counters;
+    perf_counters_open(&counters);
+    if (counters.cycles_fd < 0 || counters.instructions_fd < 0) {
+        fprintf(stderr, "Note: hardware counters unavailable (perf_event_open refused); "
+                        "cycles and instructions are not shown\n");
+    }
+
+    printf("%-32s %8s %10s %10s %10s %10s %10s %6s\n", "function", "batch", "median ns", "p99 ns",
+           "min ns", "cycles", "instr", "IPC");
+    for (int i = 0; bench_cases[i].name != NULL; i++) {
+        if (case_selected(bench_cases[i].name, argc, argv)) {
+            run_case(&bench_cases[i], &counters);
+        }
+    }
+    return EXIT_SUCCESS;
+}
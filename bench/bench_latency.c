@@ -0,0 +1,300 @@
+/*
+ * bench_latency.c - Arrival-to-emit latency of ts under live input
+ *
+ * Copyright (C) 2025  Michael Rice <michael@riceclan.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Usage: bench_latency [TS [RATE [LINES]]]
+//
+// Feeds LINES lines (default 2000) into TS (default ./ts) through a pipe
+// at RATE lines per second (default 1000), each carrying the
+// CLOCK_MONOTONIC time it was written at, and reads what ts emits on the
+// other side.  The delay from write to read is measured per line and
+// reported as p50/p99/p99.9/max for every combination of output policy
+// and mode, one tab-separated record each:
+//
+//   policy  mode  rate  lines  p50_us  p99_us  p999_us  max_us
+//
+// Output policies:
+//   pipe         stdout is a pipe, so stdio buffers it fully
+//   pty          stdout is a terminal, so stdio buffers it by line
+//   stdbuf-line  a pipe, with stdbuf -oL forcing line buffering
+//   stdbuf-none  a pipe, with stdbuf -o0 turning buffering off
+//
+// Lines still buffered when input ends come out at exit, so a fully
+// buffered pipe shows latencies up to the whole run.
+
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_DEFAULT_RATE 1000
+#define BENCH_DEFAULT_LINES 2000
+#define BENCH_READ_SIZE 65536
+#define BENCH_MARKER '@'
+
+// The syslog stamp gives -r a timestamp to replace; the send time sits
+// between markers after it
+#define BENCH_LINE_FORMAT "Aug 22 10:00:00 %c%lld%c seq=%u payload=abcdefghijklmnopqrstuvwxyz\n"
+
+typedef struct {
+    const char *name;
+    bool pty;
+    const char *stdbuf;         // stdbuf -o argument, NULL for none
+} output_policy_t;
+
+static const output_policy_t policies[] = {
+    {"pipe", false, NULL},
+    {"pty", true, NULL},
+    {"stdbuf-line", false, "L"},
+    {"stdbuf-none", false, "0"},
+    {NULL, false, NULL}
+};
+
+static const char *modes[][3] = {
+    {"default", NULL, NULL},
+    {"-i", "-i", NULL},
+    {"-s", "-s", NULL},
+    {"-u", "-u", NULL},
+    {"-r", "-r", NULL},
+    {NULL, NULL, NULL}
+};
+
+typedef struct {
+    int fd;
+    double rate;
+    unsigned lines;
+} sender_t;
+
+static int64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Write the lines at the requested rate, each stamped just before its
+// write, then close the pipe so ts sees the end of input
+static void *send_lines(void *arg) {
+    sender_t *sender = arg;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    long interval_ns = (long)(1e9 / sender->rate);
+
+    for (unsigned i = 0; i < sender->lines; i++) {
+        next.tv_nsec += interval_ns;
+        while (next.tv_nsec >= 1000000000) {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+        char line[256];
+        int len = snprintf(line, sizeof(line), BENCH_LINE_FORMAT, BENCH_MARKER, (long long)monotonic_ns(),
+                           BENCH_MARKER, i);
+        if (write(sender->fd, line, (size_t)len) != len) {
+            break;
+        }
+    }
+    close(sender->fd);
+    return NULL;
+}
+
+// Open the read end ts writes to: a pipe, or a raw-mode pty so the
+// terminal adds no carriage returns
+static int open_output(bool pty, int *child_fd) {
+    if (!pty) {
+        int fds[2];
+        if (pipe(fds) != 0) {
+            return -1;
+        }
+        *child_fd = fds[1];
+        return fds[0];
+    }
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+        return -1;
+    }
+    const char *name = ptsname(master);
+    int slave = name ? open(name, O_RDWR | O_NOCTTY) : -1;
+    struct termios attributes;
+    if (slave < 0 || tcgetattr(slave, &attributes) != 0) {
+        close(master);
+        return -1;
+    }
+    cfmakeraw(&attributes);
+    tcsetattr(slave, TCSANOW, &attributes);
+    *child_fd = slave;
+    return master;
+}
+
+static int compare_latencies(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Run ts once under policy and mode.  Returns the number of latencies
+// stored, -1 if ts could not be run.
+static long run_once(const char *ts, const output_policy_t *policy, const char *const *mode,
+                     double rate, unsigned lines, int64_t *latencies) {
+    int input[2];
+    int child_output;
+    if (pipe(input) != 0) {
+        return -1;
+    }
+    int output = open_output(policy->pty, &child_output);
+    if (output < 0) {
+        close(input[0]);
+        close(input[1]);
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(input[0], STDIN_FILENO);
+        dup2(child_output, STDOUT_FILENO);
+        close(input[0]);
+        close(input[1]);
+        close(child_output);
+        close(output);
+
+        const char *argv[8];
+        int argc = 0;
+        char stdbuf_option[8];
+        if (policy->stdbuf) {
+            snprintf(stdbuf_option, sizeof(stdbuf_option), "-o%s", policy->stdbuf);
+            argv[argc++] = "stdbuf";
+            argv[argc++] = stdbuf_option;
+        }
+        argv[argc++] = ts;
+        for (int i = 1; i < 3 && mode[i]; i++) {
+            argv[argc++] = mode[i];
+        }
+        argv[argc] = NULL;
+        execvp(argv[0], (char *const *)argv);
+        _exit(127);
+    }
+    close(input[0]);
+    close(child_output);
+    if (pid < 0) {
+        close(input[1]);
+        close(output);
+        return -1;
+    }
+
+    sender_t sender = {input[1], rate, lines};
+    pthread_t thread;
+    pthread_create(&thread, NULL, send_lines, &sender);
+
+    // Split what arrives into lines and time each at the read that
+    // completed it
+    static char buffer[BENCH_READ_SIZE];
+    size_t held = 0;
+    long count = 0;
+    while (true) {
+        ssize_t got = read(output, buffer + held, sizeof(buffer) - held);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            break;                  // EOF, or EIO once the pty's last writer exits
+        }
+        int64_t now = monotonic_ns();
+        held += (size_t)got;
+
+        char *start = buffer;
+        char *newline;
+        while ((newline = memchr(start, '\n', held - (size_t)(start - buffer))) != NULL) {
+            *newline = '\0';
+            char *marker = strchr(start, BENCH_MARKER);
+            if (marker && (unsigned long)count < lines) {
+                latencies[count++] = now - strtoll(marker + 1, NULL, 10);
+            }
+            start = newline + 1;
+        }
+        held -= (size_t)(start - buffer);
+        memmove(buffer, start, held);
+        if (held == sizeof(buffer)) {
+            held = 0;               // No line this long is ever sent; drop it
+        }
+    }
+
+    pthread_join(thread, NULL);
+    close(output);
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+        return -1;
+    }
+    return count;
+}
+
+static double percentile_us(const int64_t *sorted, long count, double fraction) {
+    long index = (long)(fraction * (double)(count - 1) + 0.5);
+    return (double)sorted[index] / 1000.0;
+}
+
+int main(int argc, char **argv) {
+    const char *ts = argc > 1 ? argv[1] : "./ts";
+    double rate = argc > 2 ? atof(argv[2]) : BENCH_DEFAULT_RATE;
+    long lines = argc > 3 ? atol(argv[3]) : BENCH_DEFAULT_LINES;
+    if (rate <= 0 || lines <= 0) {
+        fprintf(stderr, "Usage: %s [TS [RATE [LINES]]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    int64_t *latencies = malloc(sizeof(*latencies) * (size_t)lines);
+    if (!latencies) {
+        return EXIT_FAILURE;
+    }
+
+    printf("# ts-bench-latency 1\n");
+    printf("# %s at %.0f lines/s\n", ts, rate);
+    printf("# policy\tmode\trate\tlines\tp50_us\tp99_us\tp999_us\tmax_us\n");
+    fflush(stdout);
+    for (int p = 0; policies[p].name; p++) {
+        for (int m = 0; modes[m][0]; m++) {
+            long count = run_once(ts, &policies[p], modes[m], rate, (unsigned)lines, latencies);
+            if (count <= 0) {
+                printf("%s\t%s\t%.0f\t0\t-\t-\t-\t-\n", policies[p].name, modes[m][0], rate);
+                fflush(stdout);
+                continue;
+            }
+            qsort(latencies, (size_t)count, sizeof(*latencies), compare_latencies);
+            printf("%s\t%s\t%.0f\t%ld\t%.1f\t%.1f\t%.1f\t%.1f\n", policies[p].name, modes[m][0], rate, count,
+                   percentile_us(latencies, count, 0.50), percentile_us(latencies, count, 0.99),
+                   percentile_us(latencies, count, 0.999), (double)latencies[count - 1] / 1000.0);
+            fflush(stdout);
+        }
+    }
+
+    free(latencies);
+    return EXIT_SUCCESS;
+}
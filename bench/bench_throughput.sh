@@ -0,0 +1,149 @@
+#!/bin/bash
+#
+# bench_throughput.sh - ts throughput across standard corpora and modes
+#
+# Copyright (C) 2025  Michael Rice <michael@riceclan.org>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Usage: bench/bench_throughput.sh [TS [LINES]]
+#
+# Generates the same corpora on every run (LINES lines each, default
+# 1000000; the 4 KB+ line corpus has LINES/100), runs every mode over
+# every corpus and prints one tab-separated record per run:
+#
+#   corpus  mode  lines  bytes  wall_s  cpu_s  lines_per_s  mb_per_s  cpu_ns_per_line
+#
+# Lines starting with '#' carry the format version and run settings, so
+# results can be collected and compared across releases.  The best wall
+# time of BENCH_ROUNDS runs counts, with the CPU time (user + system) of
+# that run.  Relative mode, an order of magnitude slower per line, reads
+# the first tenth of each corpus, and is pinned to --now so every release
+# parses the same timestamps against the same reference.
+
+set -e
+
+TS=${1:-./ts}
+LINES=${2:-1000000}
+BENCH_ROUNDS=${BENCH_ROUNDS:-3}
+NOW=1755921813
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# Corpora.  Every generator is plain awk arithmetic on the line number,
+# so the bytes are identical on every machine.
+awk -v lines="$LINES" 'BEGIN {
+    # Short lines; every eighth repeats the one before, for -u
+    for (i = 0; i < lines; i++) {
+        n = i % 8 == 7 ? i - 1 : i
+        printf "ok %d status=%d\n", n % 1000, n % 97 ? 200 : 503
+    }
+}' > "$work/short"
+
+awk -v lines="$((LINES / 100))" 'BEGIN {
+    # 4 KB+ lines: a request line followed by a long payload
+    for (i = 0; i < lines; i++) {
+        printf "request %08x payload=", i * 2654435761 % 4294967296
+        for (j = 0; j < 110; j++) {
+            printf "%08x%08x%08x%08x%08x", i * j, i + j, i * 7919 + j, j * 104729, i % 4096
+        }
+        printf "\n"
+    }
+}' > "$work/long"
+
+awk -v lines="$LINES" -v now="$NOW" 'BEGIN {
+    # Syslog stamps, one second apart over the last few days
+    for (i = 0; i < lines; i++) {
+        t = now - lines + i
+        s = t % 60; m = int(t / 60) % 60; h = int(t / 3600) % 24
+        d = 20 + int(i * 3 / lines)
+        printf "Aug %2d %02d:%02d:%02d host worker-%d[%d]: request %d done in %d ms\n",
+               d, h, m, s, i % 16, 1000 + i % 64, i, (i * 7919) % 1000
+    }
+}' > "$work/syslog"
+
+awk -v lines="$LINES" -v now="$NOW" 'BEGIN {
+    # ISO-8601 stamps with microseconds and an offset
+    for (i = 0; i < lines; i++) {
+        t = i % 86400
+        printf "2025-08-22T%02d:%02d:%02d.%06d+0000 level=info worker=%d msg=\"request %d done\"\n",
+               int(t / 3600), int(t / 60) % 60, t % 60, (i * 7919) % 1000000, i % 16, i
+    }
+}' > "$work/iso"
+
+awk -v lines="$LINES" -v now="$NOW" 'BEGIN {
+    # Unix stamps with a fraction
+    for (i = 0; i < lines; i++) {
+        printf "%d.%06d worker-%d request %d done\n", now - lines + i, (i * 7919) % 1000000, i % 16, i
+    }
+}' > "$work/unix"
+
+awk -v lines="$LINES" 'BEGIN {
+    # Log text with digits and colons but no timestamp
+    for (i = 0; i < lines; i++) {
+        printf "worker-%d request id=%08x path=/api/v1/items/%d status=%d bytes=%d\n",
+               i % 16, i * 2654435761 % 4294967296, i % 5000, i % 97 ? 200 : 503, (i * 7919) % 65536
+    }
+}' > "$work/plain"
+
+CORPORA="short long syslog iso unix plain"
+MODES="default -i -s -u -r -r_FORMAT"
+
+for corpus in $CORPORA; do
+    head -n "$(($(wc -l < "$work/$corpus") / 10))" "$work/$corpus" > "$work/$corpus.relative"
+done
+
+# The ts arguments for a mode name
+mode_args() {
+    case "$1" in
+        default) ;;
+        -r) printf '%s\n' -r "--now=$NOW" ;;
+        -r_FORMAT) printf '%s\n' -r "--now=$NOW" "%Y-%m-%d %H:%M:%.S" ;;
+        *) printf '%s\n' "$1" ;;
+    esac
+}
+
+TIMEFORMAT='%R %U %S'
+
+# Best wall time of BENCH_ROUNDS runs of ts over an input, and the CPU
+# time of that run
+measure() {
+    local input=$1 mode=$2 args=()
+    mapfile -t args < <(mode_args "$mode")
+    best_real=""
+    for _ in $(seq "$BENCH_ROUNDS"); do
+        read -r real user sys < <({ time "$TS" "${args[@]}" < "$input" > /dev/null 2>&1; } 2>&1)
+        if [ -z "$best_real" ] || awk -v a="$real" -v b="$best_real" 'BEGIN { exit !(a < b) }'; then
+            best_real=$real
+            best_cpu=$(awk -v u="$user" -v s="$sys" 'BEGIN { print u + s }')
+        fi
+    done
+}
+
+printf "# ts-bench-throughput 1\n"
+printf "# %s\n" "$("$TS" -V 2>&1 | head -n 1)"
+printf "# rounds %d\n" "$BENCH_ROUNDS"
+printf "# corpus\tmode\tlines\tbytes\twall_s\tcpu_s\tlines_per_s\tmb_per_s\tcpu_ns_per_line\n"
+
+for corpus in $CORPORA; do
+    for mode in $MODES; do
+        input=$work/$corpus
+        case "$mode" in
+            -r*) input=$input.relative ;;
+        esac
+        lines=$(wc -l < "$input")
+        bytes=$(wc -c < "$input")
+        measure "$input" "$mode"
+        awk -v c="$corpus" -v m="${mode/_/ }" -v l="$lines" -v b="$bytes" -v r="$best_real" -v u="$best_cpu" \
+            'BEGIN {
+                 # time reports to the millisecond; keep rates finite
+                 if (r < 0.001) r = 0.001
+                 printf "%s\t%s\t%d\t%d\t%.3f\t%.3f\t%.0f\t%.2f\t%.0f\n",
+                        c, m, l, b, r, u, l / r, b / r / 1048576, u * 1e9 / l
+             }'
+    done
+done
@@ -0,0 +1,2368 @@
+/*
+ * libts - timestamping engine and library
+ *
+ * Copyright (C) 2025  Michael Rice <michael@riceclan.org>
+ *
+ * based on work by Joey Hess <joey@kitenet.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "config.h"
+
+/* Feature test macros to enable POSIX functions */
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <regex.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#ifdef HAVE_RDTSC
+#include <x86intrin.h>
+#endif
+#include "ts_internal.h"
+
+#define TZ_DEFAULT_DIR "/usr/share/zoneinfo"
+#define TZ_DEFAULT_LOCALTIME "/etc/localtime"
+#define TZ_MAX_FILE_SIZE (1024 * 1024)
+#define TSC_CALIBRATION_NS 10000000L       // Startup calibration span
+#define TSC_RECALIBRATION_NS 1000000000L   // Re-anchor to the system clocks this often
+#define TSC_SAMPLE_TRIES 5                 // Pairings tried per sample, tightest kept
+
+// One local time type of a zone: offset, DST flag and abbreviation
+typedef struct {
+    long utc_offset;
+    bool is_dst;
+    char abbreviation[TZ_MAX_ABBREVIATION];
+} tz_type_t;
+
+// A day of the year in a POSIX TZ rule and the local time it takes effect
+typedef struct {
+    char kind;                  // 'J' for Jn, 'D' for zero-based n, 'M' for Mm.w.d
+    int day;                    // Day of the year, or weekday (0 = Sunday) for Mm.w.d
+    int week;                   // Week of the month for Mm.w.d, 5 = last
+    int month;
+    long time;                  // Seconds past local midnight, may be negative or past 24h
+} tz_rule_date_t;
+
+// A POSIX TZ rule with DST, e.g. "CET-1CEST,M3.5.0,M10.5.0/3"
+typedef struct {
+    tz_type_t std;
+    tz_type_t dst;
+    tz_rule_date_t start;       // Into DST, in standard local time
+    tz_rule_date_t end;         // Back to standard time, in DST local time
+} tz_rule_t;
+
+// A zone's transition table, loaded from its TZif file
+typedef struct {
+    bool loaded;
+    bool rules_after_table;     // Footer has DST rules past the last transition
+    tz_rule_t rule;             // Those rules, when rules_after_table
+    bool tz_set;                // TZ was set (to source) when loaded
+    char source[MAX_FORMAT_LENGTH];
+    int64_t *transitions;
+    uint8_t *transition_types;
+    size_t transition_count;
+    tz_type_t *types;
+    size_t type_count;
+} tz_zone_t;
+
+// Common timestamp formats
+const timestamp_format_t tsi_timestamp_formats[TIMESTAMP_FORMAT_COUNT] = {
+    // syslog format: Dec 22 22:25:23
+    {"[A-Za-z]{3} [0-9]{1,2} [0-9]{2}:[0-9]{2}:[0-9]{2}", "%b %d %H:%M:%S", "syslog"},
+
+    // ISO-8601 with fractional seconds and timezone: 2025-09-05T10:10:10.124456-0500 (most specific, check first)
+    {"[0-9]{4}-[0-9]{2}-[0-9]{2}T[0-9]{2}:[0-9]{2}:[0-9]{2}\\.[0-9]{1,9}[+-][0-9]{4}", "%Y-%m-%dT%H:%M:%S.%f%z", "ISO-8601-fractional-tz"},
+
+    // ISO-8601 with fractional seconds (no timezone): 2025-09-05T10:10:10.500000 (second most specific)
+    {"[0-9]{4}-[0-9]{2}-[0-9]{2}T[0-9]{2}:[0-9]{2}:[0-9]{2}\\.[0-9]{1,9}", "%Y-%m-%dT%H:%M:%S.%f", "ISO-8601-fractional"},
+
+    // ISO-8601 with timezone: 2025-09-05T10:10:09-0500 (more specific, check third)
+    {"[0-9]{4}-[0-9]{2}-[0-9]{2}T[0-9]{2}:[0-9]{2}:[0-9]{2}[+-][0-9]{4}", "%Y-%m-%dT%H:%M:%S%z", "ISO-8601-tz"},
+
+    // ISO-8601: 2025-12-22T22:25:23.123Z
+    {"[0-9]{4}-[0-9]{2}-[0-9]{2}T[0-9]{2}:[0-9]{2}:[0-9]{2}", "%Y-%m-%dT%H:%M:%S", "ISO-8601"},
+
+    // RFC format: 16 Jun 94 07:29:35
+    {"[0-9]{1,2} [A-Za-z]{3} [0-9]{2} [0-9]{2}:[0-9]{2}:[0-9]{2}", "%d %b %y %H:%M:%S", "RFC"},
+
+    // lastlog format: Mon Dec 22 22:25
+    {"[A-Za-z]{3} [A-Za-z]{3} [0-9]{2} [0-9]{2}:[0-9]{2}", "%a %b %d %H:%M", "lastlog"},
+
+    // 21 dec 17:05 (with optional year)
+    {"[0-9]{2} [a-z]{3} [0-9]{2}:[0-9]{2}", "%d %b %H:%M", "short"},
+
+    // 22 dec/93 17:05:30 with year
+    {"[0-9]{2} [a-z]{3}/[0-9]{2} [0-9]{2}:[0-9]{2}:[0-9]{2}", "%d %b/%y %H:%M:%S", "short_with_year"},
+
+    // Unix timestamp with fractional seconds: 1755921813.123456
+    {"[0-9]{10,}\\.[0-9]{1,9}", NULL, "unix_fractional"},
+
+    // Plain Unix timestamp: 1755921813
+    {"[0-9]{10,}", NULL, "unix_plain"},
+
+    {NULL, NULL, NULL} // terminator
+};
+
+// Safe string concatenation with bounds checking.  The formatters append
+// through field_buffer_t now; this stays available to the test suites.
+#ifdef TS_TESTING
+ts_error_t safe_strcat(char *dest, size_t dest_size, const char *src) {
+    if (!dest || !src) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+
+    size_t dest_len = strnlen(dest, dest_size);
+    size_t src_len = strlen(src);
+
+    if (dest_len + src_len >= dest_size) {
+        return TS_ERROR_BUFFER_OVERFLOW;
+    }
+
+    memcpy(dest + dest_len, src, src_len + 1);
+    return TS_SUCCESS;
+}
+#endif
+
+// Safe string formatting with bounds checking
+#ifdef TS_TESTING
+ts_error_t safe_snprintf(char *dest, size_t dest_size, const char *format, ...) {
+#else
+static ts_error_t safe_snprintf(char *dest, size_t dest_size, const char *format, ...) {
+#endif
+    if (!dest || !format) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+
+    va_list args;
+    va_start(args, format);
+    int result = vsnprintf(dest, dest_size, format, args);
+    va_end(args);
+
+    if (result < 0 || (size_t)result >= dest_size) {
+        return TS_ERROR_BUFFER_OVERFLOW;
+    }
+
+    return TS_SUCCESS;
+}
+
+// Get high-resolution timestamp
+high_res_time_t tsi_get_high_res_time(bool monotonic_mode) {
+    high_res_time_t result = {0};
+    struct timespec ts;
+
+#ifdef HAVE_CLOCK_MONOTONIC
+    clockid_t clock_id = monotonic_mode ? CLOCK_MONOTONIC : CLOCK_REALTIME;
+#else
+    clockid_t clock_id = CLOCK_REALTIME;
+    if (monotonic_mode) {
+        // Fallback to realtime if monotonic is not available
+        fprintf(stderr, "Warning: CLOCK_MONOTONIC not available, using CLOCK_REALTIME\n");
+    }
+#endif
+
+    if (clock_gettime(clock_id, &ts) == 0) {
+        result.seconds = ts.tv_sec;
+        result.nanoseconds = ts.tv_nsec;
+    }
+
+    return result;
+}
+
+// Calendar arithmetic on the proleptic Gregorian calendar, independent of
+// the C library's time zone state
+
+// Days since 1970-01-01 for a proleptic Gregorian date (Hinnant's days_from_civil)
+static int64_t days_from_civil(int64_t year, int month, int day) {
+    year -= month <= 2;
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    int64_t year_of_era = year - era * 400;
+    int64_t day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int64_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + day_of_era - 719468;
+}
+
+// Proleptic Gregorian date for a day count since 1970-01-01 (Hinnant's civil_from_days)
+static void civil_from_days(int64_t days, int *year, int *month, int *day) {
+    days += 719468;
+    int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    int64_t day_of_era = days - era * 146097;
+    int64_t year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 -
+                           day_of_era / 146096) / 365;
+    int64_t day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    int64_t month_index = (5 * day_of_year + 2) / 153;
+    *day = (int)(day_of_year - (153 * month_index + 2) / 5 + 1);
+    *month = (int)(month_index < 10 ? month_index + 3 : month_index - 9);
+    *year = (int)(year_of_era + era * 400 + (*month <= 2));
+}
+
+// Convert broken-down UTC fields to epoch seconds without touching TZ state
+static time_t utc_seconds_from_tm(const struct tm *tm_info) {
+    int64_t days = days_from_civil((int64_t)tm_info->tm_year + 1900,
+                                   tm_info->tm_mon + 1, tm_info->tm_mday);
+    return (time_t)(days * SECONDS_PER_DAY + tm_info->tm_hour * SECONDS_PER_HOUR +
+                    tm_info->tm_min * SECONDS_PER_MINUTE + tm_info->tm_sec);
+}
+
+// Fill every struct tm field for t shifted by a known UTC offset
+static void fill_tm_from_offset(struct tm *tm_info, time_t t, long offset, bool is_dst,
+                                const char *abbreviation) {
+    int64_t wall = (int64_t)t + offset;
+    int64_t days = floor_div(wall, SECONDS_PER_DAY);
+    int second_of_day = (int)(wall - days * SECONDS_PER_DAY);
+    int year, month, day;
+    civil_from_days(days, &year, &month, &day);
+
+    memset(tm_info, 0, sizeof(*tm_info));
+    tm_info->tm_year = year - 1900;
+    tm_info->tm_mon = month - 1;
+    tm_info->tm_mday = day;
+    tm_info->tm_hour = second_of_day / SECONDS_PER_HOUR;
+    tm_info->tm_min = second_of_day / SECONDS_PER_MINUTE % 60;
+    tm_info->tm_sec = second_of_day % SECONDS_PER_MINUTE;
+    // 1970-01-01 was a Thursday
+    tm_info->tm_wday = (int)(days - floor_div(days + 4, 7) * 7 + 4);
+    tm_info->tm_yday = (int)(days - days_from_civil(year, 1, 1));
+    tm_info->tm_isdst = is_dst;
+#ifdef HAVE_STRUCT_TM_TM_GMTOFF
+    tm_info->tm_gmtoff = offset;
+#endif
+#ifdef HAVE_STRUCT_TM_TM_ZONE
+    tm_info->tm_zone = abbreviation;
+#else
+    (void)abbreviation;
+#endif
+}
+
+// Local time zone engine.  The zone's TZif transition table is loaded once
+// and then only read, so lookups are lock-free and safe from any thread;
+// callers keep the interval from their last lookup (utc_offset_cache_t) and
+// only search again once a timestamp leaves it.  Past the last transition
+// the zone's POSIX TZ rule takes over.  Zones the engine cannot load are
+// answered by localtime_r instead.
+
+static tz_zone_t local_zone;
+static bool local_zone_initialized;
+static pthread_mutex_t local_zone_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t local_zone_once = PTHREAD_ONCE_INIT;
+
+static uint32_t read_be32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static int64_t read_be64(const unsigned char *p) {
+    return (int64_t)(((uint64_t)read_be32(p) << 32) | read_be32(p + 4));
+}
+
+static void tz_zone_free(tz_zone_t *zone) {
+    free(zone->transitions);
+    free(zone->transition_types);
+    free(zone->types);
+    memset(zone, 0, sizeof(*zone));
+}
+
+// Parse a POSIX TZ zone name, bare ("EST") or quoted ("<+0330>")
+static const char *tz_rule_parse_name(const char *p, char *name, size_t name_size) {
+    const char *start = p;
+    const char *end;
+    if (*p == '<') {
+        start = ++p;
+        while (*p && *p != '>') {
+            p++;
+        }
+        if (*p != '>') {
+            return NULL;
+        }
+        end = p++;
+    } else {
+        while (isalpha((unsigned char)*p)) {
+            p++;
+        }
+        end = p;
+    }
+    size_t len = (size_t)(end - start);
+    if (len < 3 || len >= name_size) {
+        return NULL;
+    }
+    memcpy(name, start, len);
+    name[len] = '\0';
+    return p;
+}
+
+// Parse a POSIX TZ [+-]hh[:mm[:ss]] into seconds
+static const char *tz_rule_parse_time(const char *p, long max_hours, long *seconds) {
+    long sign = 1;
+    if (*p == '+' || *p == '-') {
+        sign = *p == '-' ? -1 : 1;
+        p++;
+    }
+    long hours = 0;
+    int digits = 0;
+    while (isdigit((unsigned char)*p) && digits < 3) {
+        hours = hours * 10 + (*p++ - '0');
+        digits++;
+    }
+    if (digits == 0 || hours > max_hours) {
+        return NULL;
+    }
+    long value = hours * SECONDS_PER_HOUR;
+    for (long unit = SECONDS_PER_MINUTE; unit >= 1 && *p == ':'; unit /= 60) {
+        if (!isdigit((unsigned char)p[1]) || !isdigit((unsigned char)p[2])) {
+            return NULL;
+        }
+        long part = (p[1] - '0') * 10 + (p[2] - '0');
+        if (part > 59) {
+            return NULL;
+        }
+        value += part * unit;
+        p += 3;
+    }
+    *seconds = sign * value;
+    return p;
+}
+
+// Parse one POSIX TZ rule date: Jn, n or Mm.w.d, then an optional /time
+static const char *tz_rule_parse_date(const char *p, tz_rule_date_t *date) {
+    char *end;
+    if (*p == 'M') {
+        date->kind = 'M';
+        if (!isdigit((unsigned char)p[1])) {
+            return NULL;
+        }
+        date->month = (int)strtol(p + 1, &end, 10);
+        if (*end != '.' || !isdigit((unsigned char)end[1])) {
+            return NULL;
+        }
+        date->week = (int)strtol(end + 1, &end, 10);
+        if (*end != '.' || !isdigit((unsigned char)end[1])) {
+            return NULL;
+        }
+        date->day = (int)strtol(end + 1, &end, 10);
+        if (date->month < 1 || date->month > 12 || date->week < 1 || date->week > 5 ||
+            date->day > 6) {
+            return NULL;
+        }
+    } else {
+        date->kind = *p == 'J' ? 'J' : 'D';
+        if (*p == 'J') {
+            p++;
+        }
+        if (!isdigit((unsigned char)*p)) {
+            return NULL;
+        }
+        date->day = (int)strtol(p, &end, 10);
+        if (date->day < (date->kind == 'J') || date->day > 365) {
+            return NULL;
+        }
+    }
+    p = end;
+    date->time = 2 * SECONDS_PER_HOUR;
+    if (*p == '/') {
+        // RFC 8536 extends the time to -167..167 hours
+        p = tz_rule_parse_time(p + 1, 167, &date->time);
+    }
+    return p;
+}
+
+// Parse a POSIX TZ string with DST rules.  Strings without the rules
+// (no ',') describe zones the transition table already covers.
+#ifdef TS_TESTING
+ts_error_t tz_rule_parse(tz_rule_t *rule, const char *p) {
+#else
+static ts_error_t tz_rule_parse(tz_rule_t *rule, const char *p) {
+#endif
+    memset(rule, 0, sizeof(*rule));
+    long offset;
+    p = tz_rule_parse_name(p, rule->std.abbreviation, sizeof(rule->std.abbreviation));
+    if (!p || !(p = tz_rule_parse_time(p, 24, &offset))) {
+        return TS_ERROR_TIME_PARSE;
+    }
+    // POSIX offsets count hours west of UTC
+    rule->std.utc_offset = -offset;
+
+    p = tz_rule_parse_name(p, rule->dst.abbreviation, sizeof(rule->dst.abbreviation));
+    if (!p) {
+        return TS_ERROR_TIME_PARSE;
+    }
+    rule->dst.is_dst = true;
+    rule->dst.utc_offset = rule->std.utc_offset + SECONDS_PER_HOUR;
+    if (*p != ',') {
+        if (!(p = tz_rule_parse_time(p, 24, &offset))) {
+            return TS_ERROR_TIME_PARSE;
+        }
+        rule->dst.utc_offset = -offset;
+    }
+
+    if (*p != ',' || !(p = tz_rule_parse_date(p + 1, &rule->start)) ||
+        *p != ',' || !(p = tz_rule_parse_date(p + 1, &rule->end)) || *p != '\0') {
+        return TS_ERROR_TIME_PARSE;
+    }
+    return TS_SUCCESS;
+}
+
+// Instant a rule date takes effect in a year, for local time at utc_offset
+static int64_t tz_rule_transition(const tz_rule_date_t *date, int64_t year, long utc_offset) {
+    bool leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+    int64_t days = days_from_civil(year, 1, 1);
+    if (date->kind == 'J') {
+        // Jn never counts February 29
+        days += date->day - 1 + (leap && date->day >= 60);
+    } else if (date->kind == 'D') {
+        days += date->day;
+    } else {
+        int64_t first = days_from_civil(year, date->month, 1);
+        int64_t next = date->month == 12 ? days_from_civil(year + 1, 1, 1)
+                                         : days_from_civil(year, date->month + 1, 1);
+        // 1970-01-01 was a Thursday
+        int first_weekday = (int)(first - floor_div(first + 4, 7) * 7 + 4);
+        int64_t day = first + (date->day - first_weekday + 7) % 7 + (date->week - 1) * 7;
+        while (day >= next) {
+            day -= 7;
+        }
+        days = day;
+    }
+    return days * SECONDS_PER_DAY + date->time - utc_offset;
+}
+
+// Find the interval around t from a zone's DST rule.  The transitions of
+// t's year and the years either side bracket t even when a rule's dates
+// wrap New Year, as they do south of the equator.
+static void tz_rule_lookup(const tz_rule_t *rule, time_t t, utc_offset_cache_t *interval) {
+    int year, month, day;
+    civil_from_days(floor_div((int64_t)t + rule->std.utc_offset, SECONDS_PER_DAY),
+                    &year, &month, &day);
+
+    int64_t from = INT64_MIN;
+    int64_t until = INT64_MAX;
+    const tz_type_t *type = &rule->std;
+    for (int64_t y = (int64_t)year - 1; y <= (int64_t)year + 1; y++) {
+        int64_t changes[2] = {tz_rule_transition(&rule->start, y, rule->std.utc_offset),
+                              tz_rule_transition(&rule->end, y, rule->dst.utc_offset)};
+        for (int i = 0; i < 2; i++) {
+            if (changes[i] <= (int64_t)t && changes[i] >= from) {
+                from = changes[i];
+                type = i == 0 ? &rule->dst : &rule->std;
+            } else if (changes[i] > (int64_t)t && changes[i] < until) {
+                until = changes[i];
+            }
+        }
+    }
+
+    interval->valid_from = from < (int64_t)TIME_T_MIN ? TIME_T_MIN : (time_t)from;
+    interval->valid_until = until > (int64_t)TIME_T_MAX ? TIME_T_MAX : (time_t)until;
+    interval->offset = type->utc_offset;
+    interval->is_dst = type->is_dst;
+    memcpy(interval->abbreviation, type->abbreviation, sizeof(interval->abbreviation));
+}
+
+// Parse a TZif (RFC 8536) image, preferring the 64-bit v2+ data block
+static ts_error_t tz_parse(tz_zone_t *zone, const unsigned char *data, size_t size) {
+    const size_t header_size = 44;
+    if (size < header_size || memcmp(data, "TZif", 4) != 0) {
+        return TS_ERROR_TIME_PARSE;
+    }
+
+    int time_size = 4;
+    const unsigned char *header = data;
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t isutcnt = read_be32(header + 20);
+        uint32_t isstdcnt = read_be32(header + 24);
+        uint32_t leapcnt = read_be32(header + 28);
+        uint32_t timecnt = read_be32(header + 32);
+        uint32_t typecnt = read_be32(header + 36);
+        uint32_t charcnt = read_be32(header + 40);
+        size_t block_size = (size_t)timecnt * time_size + timecnt + (size_t)typecnt * 6 +
+                            charcnt + (size_t)leapcnt * (time_size + 4) + isstdcnt + isutcnt;
+        const unsigned char *block = header + header_size;
+        if ((size_t)(block - data) + block_size > size) {
+            return TS_ERROR_TIME_PARSE;
+        }
+
+        // Version 2+ repeats everything with 64-bit times after the v1 block
+        if (pass == 0 && data[4] >= '2') {
+            header = block + block_size;
+            time_size = 8;
+            if ((size_t)(header - data) + header_size > size ||
+                memcmp(header, "TZif", 4) != 0) {
+                return TS_ERROR_TIME_PARSE;
+            }
+            continue;
+        }
+
+        // Leap-second ("right/") zones count TAI-like seconds; leave them to libc
+        if (leapcnt > 0 || typecnt == 0 || charcnt == 0) {
+            return TS_ERROR_TIME_PARSE;
+        }
+
+        zone->transitions = malloc(sizeof(int64_t) * (timecnt ? timecnt : 1));
+        zone->transition_types = malloc(timecnt ? timecnt : 1);
+        zone->types = malloc(sizeof(tz_type_t) * typecnt);
+        if (!zone->transitions || !zone->transition_types || !zone->types) {
+            return TS_ERROR_SYSTEM;
+        }
+
+        const unsigned char *p = block;
+        for (uint32_t i = 0; i < timecnt; i++, p += time_size) {
+            zone->transitions[i] = time_size == 8 ? read_be64(p) : (int32_t)read_be32(p);
+            if (i > 0 && zone->transitions[i] <= zone->transitions[i - 1]) {
+                return TS_ERROR_TIME_PARSE;
+            }
+        }
+        for (uint32_t i = 0; i < timecnt; i++, p++) {
+            if (*p >= typecnt) {
+                return TS_ERROR_TIME_PARSE;
+            }
+            zone->transition_types[i] = *p;
+        }
+        const unsigned char *abbreviations = p + (size_t)typecnt * 6;
+        for (uint32_t i = 0; i < typecnt; i++, p += 6) {
+            tz_type_t *type = &zone->types[i];
+            type->utc_offset = (int32_t)read_be32(p);
+            type->is_dst = p[4] != 0;
+            size_t index = p[5];
+            if (index >= charcnt) {
+                return TS_ERROR_TIME_PARSE;
+            }
+            size_t len = strnlen((const char *)abbreviations + index, charcnt - index);
+            if (len >= sizeof(type->abbreviation)) {
+                len = sizeof(type->abbreviation) - 1;
+            }
+            memcpy(type->abbreviation, abbreviations + index, len);
+            type->abbreviation[len] = '\0';
+        }
+        zone->transition_count = timecnt;
+        zone->type_count = typecnt;
+
+        // The footer is a newline-framed POSIX TZ string; a ',' means DST
+        // rules continue past the last transition.  A zone whose rules
+        // cannot be read is left to libc.
+        const unsigned char *footer = block + block_size;
+        const unsigned char *footer_end =
+            time_size == 8 && footer < data + size && *footer == '\n'
+                ? memchr(footer + 1, '\n', (size_t)(data + size - footer - 1))
+                : NULL;
+        if (footer_end && memchr(footer, ',', (size_t)(footer_end - footer)) != NULL) {
+            char rule[MAX_FORMAT_LENGTH];
+            size_t len = (size_t)(footer_end - footer - 1);
+            if (len >= sizeof(rule)) {
+                return TS_ERROR_TIME_PARSE;
+            }
+            memcpy(rule, footer + 1, len);
+            rule[len] = '\0';
+            if (tz_rule_parse(&zone->rule, rule) != TS_SUCCESS) {
+                return TS_ERROR_TIME_PARSE;
+            }
+            zone->rules_after_table = true;
+        }
+        return TS_SUCCESS;
+    }
+
+    return TS_ERROR_TIME_PARSE;
+}
+
+// Resolve the TZif file for a TZ value the way the C library does
+static bool tz_resolve_path(const char *tz, char *path, size_t path_size) {
+    if (!tz) {
+        return safe_snprintf(path, path_size, "%s", TZ_DEFAULT_LOCALTIME) == TS_SUCCESS;
+    }
+    if (*tz == ':') {
+        tz++;
+    }
+    if (*tz == '\0') {
+        return safe_snprintf(path, path_size, "%s/UTC", TZ_DEFAULT_DIR) == TS_SUCCESS;
+    }
+    if (*tz == '/') {
+        return safe_snprintf(path, path_size, "%s", tz) == TS_SUCCESS;
+    }
+    if (strstr(tz, "..") != NULL) {
+        return false;
+    }
+    const char *dir = getenv("TZDIR");
+    return safe_snprintf(path, path_size, "%s/%s", dir ? dir : TZ_DEFAULT_DIR, tz) == TS_SUCCESS;
+}
+
+// Load the zone named by a TZ value (NULL for the system default)
+#ifdef TS_TESTING
+ts_error_t tz_load(tz_zone_t *zone, const char *tz) {
+#else
+static ts_error_t tz_load(tz_zone_t *zone, const char *tz) {
+#endif
+    memset(zone, 0, sizeof(*zone));
+
+    char path[MAX_FORMAT_LENGTH];
+    if (!tz_resolve_path(tz, path, sizeof(path))) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        // Not a zone file, e.g. a POSIX rule string like "EST5EDT,M3.2.0,M11.1.0"
+        return TS_ERROR_SYSTEM;
+    }
+    unsigned char *data = malloc(TZ_MAX_FILE_SIZE);
+    size_t size = data ? fread(data, 1, TZ_MAX_FILE_SIZE, file) : 0;
+    fclose(file);
+
+    ts_error_t result = data ? tz_parse(zone, data, size) : TS_ERROR_SYSTEM;
+    free(data);
+    if (result != TS_SUCCESS) {
+        tz_zone_free(zone);
+        return result;
+    }
+
+    zone->loaded = true;
+    return TS_SUCCESS;
+}
+
+// (Re)load the process-wide local zone if TZ changed since the last load.
+// Any thread may call this while TZ stays the same; changing TZ, which
+// the C library does not allow while other threads run either, must
+// wait until no lookups are in flight.  Offset caches filled from the old
+// zone are stale afterwards and have to be reset by their owners.
+#ifdef TS_TESTING
+void tz_refresh_local_zone(void) {
+#else
+static void tz_refresh_local_zone(void) {
+#endif
+    pthread_mutex_lock(&local_zone_lock);
+    const char *tz = getenv("TZ");
+    const char *source = tz ? tz : "";
+    if (!local_zone_initialized || local_zone.tz_set != (tz != NULL) ||
+        strcmp(local_zone.source, source) != 0) {
+        tzset();
+        tz_zone_free(&local_zone);
+        tz_load(&local_zone, tz);
+        strncpy(local_zone.source, source, sizeof(local_zone.source) - 1);
+        local_zone.source[sizeof(local_zone.source) - 1] = '\0';
+        local_zone.tz_set = tz != NULL;
+        local_zone_initialized = true;
+    }
+    pthread_mutex_unlock(&local_zone_lock);
+}
+
+static const tz_zone_t *tz_local_zone(void) {
+    pthread_once(&local_zone_once, tz_refresh_local_zone);
+    return &local_zone;
+}
+
+// Find the interval of the zone containing t, from its table or, past the
+// last transition, its rule.  Fails with TS_ERROR_TIME_PARSE when the
+// zone is not loaded.
+static ts_error_t tz_lookup(const tz_zone_t *zone, time_t t, utc_offset_cache_t *interval) {
+    if (!zone->loaded) {
+        return TS_ERROR_TIME_PARSE;
+    }
+
+    // Binary search for the last transition at or before t
+    size_t low = 0, high = zone->transition_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (zone->transitions[mid] <= (int64_t)t) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    if (low == zone->transition_count && zone->rules_after_table) {
+        tz_rule_lookup(&zone->rule, t, interval);
+        if (low > 0 && interval->valid_from < (time_t)zone->transitions[low - 1]) {
+            interval->valid_from = (time_t)zone->transitions[low - 1];
+        }
+        return TS_SUCCESS;
+    }
+
+    const tz_type_t *type;
+    if (low == 0) {
+        // Before the first transition the zone uses type 0 (RFC 8536)
+        type = &zone->types[0];
+        interval->valid_from = TIME_T_MIN;
+    } else {
+        type = &zone->types[zone->transition_types[low - 1]];
+        interval->valid_from = (time_t)zone->transitions[low - 1];
+    }
+
+    if (low < zone->transition_count) {
+        interval->valid_until = (time_t)zone->transitions[low];
+    } else {
+        interval->valid_until = TIME_T_MAX;
+    }
+
+    interval->offset = type->utc_offset;
+    interval->is_dst = type->is_dst;
+    memcpy(interval->abbreviation, type->abbreviation, sizeof(interval->abbreviation));
+    return TS_SUCCESS;
+}
+
+// Local UTC offset at t, straight from the C library
+static ts_error_t libc_utc_offset(time_t t, long *offset) {
+    struct tm tm_info;
+    if (!localtime_r(&t, &tm_info)) {
+        return TS_ERROR_SYSTEM;
+    }
+    *offset = (long)(utc_seconds_from_tm(&tm_info) - t);
+    return TS_SUCCESS;
+}
+
+// Look up the local UTC offset at t, reusing the cached interval while t
+// stays inside it.  From the zone table the interval runs exactly to the
+// next transition.  Otherwise libc is probed at both ends of t's hour:
+// zones change offset at most once within an hour, so equal offsets at
+// both ends hold for every second in it.
+#ifdef TS_TESTING
+ts_error_t lookup_utc_offset(utc_offset_cache_t *cache, time_t t, long *offset) {
+#else
+static ts_error_t lookup_utc_offset(utc_offset_cache_t *cache, time_t t, long *offset) {
+#endif
+    if (t >= cache->valid_from && t < cache->valid_until) {
+        *offset = cache->offset;
+        return TS_SUCCESS;
+    }
+
+    if (tz_lookup(tz_local_zone(), t, cache) == TS_SUCCESS) {
+        *offset = cache->offset;
+        return TS_SUCCESS;
+    }
+
+    cache->abbreviation[0] = '\0';
+    time_t hour_start = (time_t)(floor_div(t, SECONDS_PER_HOUR) * SECONDS_PER_HOUR);
+    long start_offset, end_offset;
+    if (libc_utc_offset(hour_start, &start_offset) != TS_SUCCESS ||
+        libc_utc_offset(hour_start + SECONDS_PER_HOUR - 1, &end_offset) != TS_SUCCESS) {
+        return TS_ERROR_SYSTEM;
+    }
+
+    if (start_offset == end_offset) {
+        cache->valid_from = hour_start;
+        cache->valid_until = hour_start + SECONDS_PER_HOUR;
+        cache->offset = start_offset;
+        *offset = start_offset;
+        return TS_SUCCESS;
+    }
+
+    // The transition hour itself is looked up one second at a time
+    if (libc_utc_offset(t, offset) != TS_SUCCESS) {
+        return TS_ERROR_SYSTEM;
+    }
+    cache->valid_from = t;
+    cache->valid_until = t + 1;
+    cache->offset = *offset;
+    return TS_SUCCESS;
+}
+
+// Reentrant replacement for localtime(): broken-down local time for t
+ts_error_t tsi_local_time_at(utc_offset_cache_t *cache, time_t t, struct tm *tm_info) {
+    long offset;
+    if (lookup_utc_offset(cache, t, &offset) != TS_SUCCESS) {
+        return TS_ERROR_SYSTEM;
+    }
+
+#if defined(HAVE_STRUCT_TM_TM_ZONE) && defined(HAVE_STRUCT_TM_TM_GMTOFF)
+    if (cache->abbreviation[0] != '\0') {
+        fill_tm_from_offset(tm_info, t, offset, cache->is_dst, cache->abbreviation);
+        return TS_SUCCESS;
+    }
+#endif
+
+    // No zone name for strftime's %Z from the table; let libc fill it all
+    return localtime_r(&t, tm_info) ? TS_SUCCESS : TS_ERROR_SYSTEM;
+}
+
+// Replacement for mktime(): epoch seconds for local wall-clock fields.
+// Ambiguous times in a fall-back hour resolve to the earlier instant and
+// times skipped by a spring-forward gap move forward by the gap.
+#ifdef TS_TESTING
+ts_error_t local_time_to_epoch(utc_offset_cache_t *cache, const struct tm *tm_info, time_t *result) {
+#else
+static ts_error_t local_time_to_epoch(utc_offset_cache_t *cache, const struct tm *tm_info, time_t *result) {
+#endif
+    time_t wall = utc_seconds_from_tm(tm_info);
+    long offset, later_offset;
+
+    // Offset in effect a day either side brackets any single transition
+    if (lookup_utc_offset(cache, wall - SECONDS_PER_DAY, &offset) != TS_SUCCESS ||
+        lookup_utc_offset(cache, wall + SECONDS_PER_DAY, &later_offset) != TS_SUCCESS) {
+        return TS_ERROR_SYSTEM;
+    }
+
+    long check;
+    time_t candidate = wall - offset;
+    if (lookup_utc_offset(cache, candidate, &check) != TS_SUCCESS) {
+        return TS_ERROR_SYSTEM;
+    }
+    if (check != offset) {
+        candidate = wall - later_offset;
+        if (lookup_utc_offset(cache, candidate, &check) != TS_SUCCESS) {
+            return TS_ERROR_SYSTEM;
+        }
+        if (check != later_offset) {
+            // In a gap: keep the earlier offset, which lands past the gap
+            candidate = wall - offset;
+        }
+    }
+
+    *result = candidate;
+    return TS_SUCCESS;
+}
+
+// SWAR (SIMD within a register) helpers for fixed-width digit fields.
+// Up to eight ASCII digits are packed into a 64-bit word with the first
+// digit in the lowest byte, then validated and converted with a few
+// multiplies instead of a per-character strtoul/sscanf loop.
+#define SWAR_ASCII_ZEROS 0x3030303030303030ULL
+
+// Load up to eight digits right-aligned, padding the high-order places with '0'
+static inline uint64_t swar_load_right_aligned(const char *str, size_t len) {
+    char digits[8];
+    memset(digits, '0', sizeof(digits));
+    memcpy(digits + sizeof(digits) - len, str, len);
+    return swar_load_eight(digits);
+}
+
+// Load up to eight digits left-aligned, padding the low-order places with '0'
+static inline uint64_t swar_load_left_aligned(const char *str, size_t len) {
+    char digits[8];
+    memset(digits, '0', sizeof(digits));
+    memcpy(digits, str, len);
+    return swar_load_eight(digits);
+}
+
+static inline bool swar_is_eight_digits(uint64_t word) {
+    return (((word & 0xF0F0F0F0F0F0F0F0ULL) |
+             (((word + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) ==
+            0x3333333333333333ULL);
+}
+
+static inline uint32_t swar_parse_eight_digits(uint64_t word) {
+    const uint64_t mask = 0x000000FF000000FFULL;
+    const uint64_t mul1 = 100 + (1000000ULL << 32);
+    const uint64_t mul2 = 1 + (10000ULL << 32);
+    word -= SWAR_ASCII_ZEROS;
+    word = (word * 10) + (word >> 8);
+    word = (((word & mask) * mul1) + (((word >> 16) & mask) * mul2)) >> 32;
+    return (uint32_t)word;
+}
+
+// Parse a fixed-width field of 1-8 decimal digits
+#ifdef TS_TESTING
+ts_error_t parse_fixed_digits(const char *str, size_t len, unsigned long *value) {
+#else
+static ts_error_t parse_fixed_digits(const char *str, size_t len, unsigned long *value) {
+#endif
+    if (!str || !value || len == 0 || len > 8) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+
+    uint64_t word = swar_load_right_aligned(str, len);
+    if (!swar_is_eight_digits(word)) {
+        return TS_ERROR_TIME_PARSE;
+    }
+
+    *value = swar_parse_eight_digits(word);
+    return TS_SUCCESS;
+}
+
+// Parse a run of 1-19 digits as epoch seconds, eight digits per step
+ts_error_t tsi_parse_epoch_digits(const char *str, size_t len, time_t *result) {
+    if (!str || !result) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+
+    if (len == 0 || len > MAX_EPOCH_DIGITS) {
+        return TS_ERROR_TIME_PARSE;
+    }
+
+    // Leading chunk takes the remainder so every later chunk is a full eight
+    size_t chunk = len % 8 ? len % 8 : 8;
+    uint64_t word = swar_load_right_aligned(str, chunk);
+    if (!swar_is_eight_digits(word)) {
+        return TS_ERROR_TIME_PARSE;
+    }
+    uint64_t seconds = swar_parse_eight_digits(word);
+
+    for (size_t pos = chunk; pos < len; pos += 8) {
+        word = swar_load_eight(str + pos);
+        if (!swar_is_eight_digits(word)) {
+            return TS_ERROR_TIME_PARSE;
+        }
+        seconds = seconds * 100000000ULL + swar_parse_eight_digits(word);
+    }
+
+    if (seconds > (uint64_t)INT64_MAX || (uint64_t)(time_t)seconds != seconds) {
+        return TS_ERROR_TIME_PARSE;
+    }
+
+    *result = (time_t)seconds;
+    return TS_SUCCESS;
+}
+
+// Parse 1-9 fractional-second digits into nanoseconds
+ts_error_t tsi_parse_fraction_digits(const char *str, size_t len, long *nanoseconds) {
+    if (!str || !nanoseconds) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+
+    if (len == 0) {
+        return TS_ERROR_TIME_PARSE;
+    }
+    if (len > MAX_FRACTION_DIGITS) {
+        len = MAX_FRACTION_DIGITS;
+    }
+
+    uint64_t word = swar_load_left_aligned(str, len < 8 ? len : 8);
+    if (!swar_is_eight_digits(word)) {
+        return TS_ERROR_TIME_PARSE;
+    }
+
+    long value = (long)swar_parse_eight_digits(word) * 10;
+    if (len == MAX_FRACTION_DIGITS) {
+        unsigned digit = (unsigned char)str[8] - '0';
+        if (digit > 9) {
+            return TS_ERROR_TIME_PARSE;
+        }
+        value += digit;
+    }
+
+    *nanoseconds = value;
+    return TS_SUCCESS;
+}
+
+// Parse the "YYYY-MM-DDTHH:MM:SS" prefix of an ISO-8601 timestamp.
+// The six fields are gathered into two eight-digit words (YYYYMMDD and
+// 00HHMMSS) so validation and conversion take two SWAR steps.
+#ifdef TS_TESTING
+ts_error_t parse_iso8601_datetime(const char *str, size_t len, struct tm *tm_info) {
+#else
+static ts_error_t parse_iso8601_datetime(const char *str, size_t len, struct tm *tm_info) {
+#endif
+    if (!str || !tm_info) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+
+    if (len < ISO8601_DATETIME_LENGTH ||
+        str[4] != '-' || str[7] != '-' || str[10] != 'T' ||
+        str[13] != ':' || str[16] != ':') {
+        return TS_ERROR_TIME_PARSE;
+    }
+
+    const char date_digits[8] = {str[0], str[1], str[2], str[3],
+                                 str[5], str[6], str[8], str[9]};
+    const char time_digits[8] = {'0', '0', str[11], str[12],
+                                 str[14], str[15], str[17], str[18]};
+    uint64_t date_word = swar_load_eight(date_digits);
+    uint64_t time_word = swar_load_eight(time_digits);
+    if (!swar_is_eight_digits(date_word) || !swar_is_eight_digits(time_word)) {
+        return TS_ERROR_TIME_PARSE;
+    }
+
+    uint32_t date = swar_parse_eight_digits(date_word);
+    uint32_t clock = swar_parse_eight_digits(time_word);
+    int year = (int)(date / 10000);
+    int month = (int)(date / 100 % 100);
+    int day = (int)(date % 100);
+    int hour = (int)(clock / 10000);
+    int minute = (int)(clock / 100 % 100);
+    int second = (int)(clock % 100);
+
+    // Same field ranges strptime accepts for %m, %d, %H, %M and %S
+    if (month < 1 || month > 12 || day < 1 || day > 31 ||
+        hour > 23 || minute > 59 || second > 61) {
+        return TS_ERROR_TIME_PARSE;
+    }
+
+    tm_info->tm_year = year - 1900;
+    tm_info->tm_mon = month - 1;
+    tm_info->tm_mday = day;
+    tm_info->tm_hour = hour;
+    tm_info->tm_min = minute;
+    tm_info->tm_sec = second;
+    return TS_SUCCESS;
+}
+
+// Parse a UTC designator: "Z", "+HHMM" or "-HHMM"
+static bool parse_utc_offset(const char *str, int *offset_seconds) {
+    if (*str == 'Z') {
+        *offset_seconds = 0;
+        return true;
+    }
+    if (*str != '+' && *str != '-') {
+        return false;
+    }
+
+    unsigned long hours, minutes;
+    if (strspn(str + 1, "0123456789") < 4 ||
+        parse_fixed_digits(str + 1, 2, &hours) != TS_SUCCESS ||
+        parse_fixed_digits(str + 3, 2, &minutes) != TS_SUCCESS) {
+        return false;
+    }
+
+    int offset = (int)(hours * SECONDS_PER_HOUR + minutes * SECONDS_PER_MINUTE);
+    *offset_seconds = (*str == '-') ? -offset : offset;
+    return true;
+}
+
+// Convert parsed fields to epoch seconds, as UTC plus an explicit offset
+// when the timestamp carried one, otherwise as local time
+static time_t tm_to_epoch(struct tm *tm_info, bool has_utc_offset, int utc_offset,
+                          reference_time_t *reference) {
+    if (has_utc_offset) {
+        return utc_seconds_from_tm(tm_info) - utc_offset;
+    }
+    time_t result;
+    if (local_time_to_epoch(&reference->utc_offset, tm_info, &result) != TS_SUCCESS) {
+        return (time_t)-1;
+    }
+    return result;
+}
+
+// Set the reference "now" for relative mode and derive the local year
+// that timestamps without one are placed in
+ts_error_t tsi_reference_time_set(reference_time_t *reference, const high_res_time_t *now) {
+    if (!reference || !now) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+
+    // Start from an empty offset interval, so a reference never carries
+    // one over from before a TZ change
+    reference->utc_offset = (utc_offset_cache_t){1, 0, 0, false, ""};
+    struct tm now_tm;
+    if (tsi_local_time_at(&reference->utc_offset, now->seconds, &now_tm) != TS_SUCCESS) {
+        return TS_ERROR_SYSTEM;
+    }
+    reference->now = *now;
+    reference->local_year = now_tm.tm_year;
+    return TS_SUCCESS;
+}
+
+// Parse a --now argument: Unix seconds with an optional fraction
+ts_error_t tsi_parse_reference_time(const char *str, high_res_time_t *now) {
+    const char *dot_pos = strchr(str, '.');
+    size_t seconds_len = dot_pos ? (size_t)(dot_pos - str) : strlen(str);
+
+    now->nanoseconds = 0;
+    if (tsi_parse_epoch_digits(str, seconds_len, &now->seconds) != TS_SUCCESS) {
+        return TS_ERROR_TIME_PARSE;
+    }
+    if (dot_pos && tsi_parse_fraction_digits(dot_pos + 1, strlen(dot_pos + 1),
+                                             &now->nanoseconds) != TS_SUCCESS) {
+        return TS_ERROR_TIME_PARSE;
+    }
+    return TS_SUCCESS;
+}
+
+// Check whether a strptime format starts with the ISO-8601 date and time
+static bool format_is_iso8601(const char *format) {
+    return strncmp(format, "%Y-%m-%dT%H:%M:%S", 17) == 0;
+}
+
+// Parse Unix timestamp with fractional seconds
+#ifdef TS_TESTING
+ts_error_t parse_unix_timestamp_fractional(const char *timestamp_str, time_t *result) {
+#else
+static ts_error_t parse_unix_timestamp_fractional(const char *timestamp_str, time_t *result) {
+#endif
+    if (!timestamp_str || !result) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+
+    const char *dot_pos = strchr(timestamp_str, '.');
+    if (!dot_pos) {
+        return TS_ERROR_TIME_PARSE;
+    }
+
+    time_t seconds;
+    if (tsi_parse_epoch_digits(timestamp_str, dot_pos - timestamp_str, &seconds) != TS_SUCCESS ||
+        seconds == 0) {
+        return TS_ERROR_TIME_PARSE;
+    }
+
+    *result = seconds;
+    return TS_SUCCESS;
+}
+
+// Parse plain Unix timestamp
+#ifdef TS_TESTING
+ts_error_t parse_unix_timestamp_plain(const char *timestamp_str, time_t *result) {
+#else
+static ts_error_t parse_unix_timestamp_plain(const char *timestamp_str, time_t *result) {
+#endif
+    if (!timestamp_str || !result) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+
+    time_t seconds;
+    if (tsi_parse_epoch_digits(timestamp_str, strlen(timestamp_str), &seconds) != TS_SUCCESS ||
+        seconds == 0) {
+        return TS_ERROR_TIME_PARSE;
+    }
+
+    *result = seconds;
+    return TS_SUCCESS;
+}
+
+// Convert the digits after a decimal point to microseconds
+static long parse_fraction_microseconds(const char *digits, size_t len) {
+    long nanoseconds = 0;
+    if (tsi_parse_fraction_digits(digits, len, &nanoseconds) != TS_SUCCESS) {
+        return 0;
+    }
+    return nanoseconds / 1000;
+}
+
+// Parse timestamp with fractional seconds using strptime
+static ts_error_t parse_timestamp_strptime_with_fractional(const char *timestamp_str, const char *format,
+                                                          time_t *result, long *fractional_seconds,
+                                                          reference_time_t *reference) {
+    if (!timestamp_str || !format || !result || !reference) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+
+    // Extract fractional seconds first
+    if (fractional_seconds) {
+        *fractional_seconds = 0;
+        const char *dot_pos = strchr(timestamp_str, '.');
+        if (dot_pos) {
+            // Fraction runs from the dot to the timezone, or to end of string
+            size_t frac_len = strspn(dot_pos + 1, "0123456789");
+            *fractional_seconds = parse_fraction_microseconds(dot_pos + 1, frac_len);
+        }
+    }
+
+    // Extract timezone offset if present.  Only look after the time of day
+    // so the date separators in ISO-8601 are not mistaken for a sign.
+    int tz_offset_seconds = 0;
+    const char *time_pos = strchr(timestamp_str, ':');
+    const char *tz_pos = time_pos ? strpbrk(time_pos, "+-Z") : NULL;
+    bool has_tz_offset = tz_pos && parse_utc_offset(tz_pos, &tz_offset_seconds);
+
+    // Create a modified format string without %f and %z for strptime
+    char modified_format[MAX_FORMAT_LENGTH];
+    char modified_timestamp[MAX_TIMESTAMP_LENGTH];
+
+    // Copy the format and remove %f and %z
+    strncpy(modified_format, format, sizeof(modified_format) - 1);
+    modified_format[sizeof(modified_format) - 1] = '\0';
+
+    // Remove %f from the format string
+    char *f_pos = strstr(modified_format, "%f");
+    if (f_pos) {
+        memmove(f_pos, f_pos + 2, strlen(f_pos + 2) + 1);
+    }
+
+    // Remove %z from the format string
+    char *z_pos = strstr(modified_format, "%z");
+    if (z_pos) {
+        memmove(z_pos, z_pos + 2, strlen(z_pos + 2) + 1);
+    }
+
+    // Copy the timestamp and remove fractional part and timezone
+    strncpy(modified_timestamp, timestamp_str, sizeof(modified_timestamp) - 1);
+    modified_timestamp[sizeof(modified_timestamp) - 1] = '\0';
+
+    // Find and remove fractional part
+    char *dot_pos = strchr(modified_timestamp, '.');
+    if (dot_pos) {
+        char *tz_pos_mod = strpbrk(dot_pos, "+-Z");
+        if (tz_pos_mod) {
+            // Remove fractional part and timezone
+            *dot_pos = '\0';
+        } else {
+            // Remove fractional part to end of string
+            *dot_pos = '\0';
+        }
+    } else {
+        // Remove timezone if no fractional part
+        char *tz_pos_mod = strpbrk(modified_timestamp, "+-Z");
+        if (tz_pos_mod) {
+            *tz_pos_mod = '\0';
+        }
+    }
+
+    struct tm tm_info = {0};
+    if (format_is_iso8601(modified_format)) {
+        if (parse_iso8601_datetime(modified_timestamp, strlen(modified_timestamp),
+                                   &tm_info) != TS_SUCCESS) {
+            return TS_ERROR_TIME_PARSE;
+        }
+    } else if (!strptime(modified_timestamp, modified_format, &tm_info)) {
+        return TS_ERROR_TIME_PARSE;
+    }
+
+    // Set default values for missing fields
+    if (tm_info.tm_year == 0) {
+        tm_info.tm_year = reference->local_year;
+    }
+
+    if (tm_info.tm_mon == 0) {
+        tm_info.tm_mon = 0; // January
+    }
+
+    if (tm_info.tm_mday == 0) {
+        tm_info.tm_mday = 1; // First day
+    }
+
+    // An explicit offset or "Z" pins the fields to UTC; otherwise they are local time
+    *result = tm_to_epoch(&tm_info, has_tz_offset, tz_offset_seconds, reference);
+    if (*result == (time_t)-1) {
+        return TS_ERROR_TIME_PARSE;
+    }
+
+    // Check if the parsed time is in the future (likely wrong year assumption)
+    if (*result > reference->now.seconds + SECONDS_PER_DAY * FUTURE_THRESHOLD_DAYS) {
+        // Try with previous year
+        tm_info.tm_year--;
+        *result = tm_to_epoch(&tm_info, has_tz_offset, tz_offset_seconds, reference);
+        if (*result == (time_t)-1) {
+            return TS_ERROR_TIME_PARSE;
+        }
+    }
+
+    return TS_SUCCESS;
+}
+
+// Parse timestamp using strptime
+static ts_error_t parse_timestamp_strptime(const char *timestamp_str, const char *format, time_t *result,
+                                           reference_time_t *reference) {
+    if (!timestamp_str || !format || !result || !reference) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+
+    struct tm tm_info = {0};
+    bool has_tz_offset = false;
+    int tz_offset_seconds = 0;
+    if (format_is_iso8601(format)) {
+        size_t len = strlen(timestamp_str);
+        if (parse_iso8601_datetime(timestamp_str, len, &tm_info) != TS_SUCCESS) {
+            return TS_ERROR_TIME_PARSE;
+        }
+        if (strstr(format, "%z") != NULL) {
+            has_tz_offset = parse_utc_offset(timestamp_str + ISO8601_DATETIME_LENGTH,
+                                             &tz_offset_seconds);
+            if (!has_tz_offset) {
+                return TS_ERROR_TIME_PARSE;
+            }
+        }
+    } else if (!strptime(timestamp_str, format, &tm_info)) {
+        return TS_ERROR_TIME_PARSE;
+    }
+
+    // Set default values for missing fields
+    if (tm_info.tm_year == 0) {
+        tm_info.tm_year = reference->local_year;
+    }
+
+    if (tm_info.tm_mon == 0) {
+        tm_info.tm_mon = 0; // January
+    }
+
+    if (tm_info.tm_mday == 0) {
+        tm_info.tm_mday = 1; // First day
+    }
+
+    *result = tm_to_epoch(&tm_info, has_tz_offset, tz_offset_seconds, reference);
+    if (*result == (time_t)-1) {
+        return TS_ERROR_TIME_PARSE;
+    }
+
+    // Check if the parsed time is in the future (likely wrong year assumption)
+    if (*result > reference->now.seconds + SECONDS_PER_DAY * FUTURE_THRESHOLD_DAYS) {
+        // Try with previous year
+        tm_info.tm_year--;
+        *result = tm_to_epoch(&tm_info, has_tz_offset, tz_offset_seconds, reference);
+        if (*result == (time_t)-1) {
+            return TS_ERROR_TIME_PARSE;
+        }
+    }
+
+    return TS_SUCCESS;
+}
+
+// tsi_timestamp_formats[] patterns, compiled once on first use by whichever
+// thread gets there first and only read afterwards; regcomp() costs far
+// more than matching a line, and regexec() may share a compiled pattern
+// between threads
+static regex_t timestamp_regexes[TIMESTAMP_FORMAT_COUNT];
+static bool timestamp_regex_valid[TIMESTAMP_FORMAT_COUNT];
+static pthread_once_t timestamp_regexes_once = PTHREAD_ONCE_INIT;
+
+static void compile_timestamp_regexes(void) {
+    for (size_t i = 0; tsi_timestamp_formats[i].pattern != NULL; i++) {
+        timestamp_regex_valid[i] = regcomp(&timestamp_regexes[i], tsi_timestamp_formats[i].pattern,
+                                           REG_EXTENDED) == 0;
+    }
+}
+
+// The compiled pattern of tsi_timestamp_formats[index], NULL if it does not compile
+const regex_t *tsi_timestamp_regex(int index) {
+    pthread_once(&timestamp_regexes_once, compile_timestamp_regexes);
+    return timestamp_regex_valid[index] ? &timestamp_regexes[index] : NULL;
+}
+
+// Convert the text tsi_timestamp_formats[i] matched at found in line
+ts_error_t tsi_parse_timestamp_matched(int i, const char *line, const regmatch_t *found, time_t *result,
+                                       long *fractional_seconds, reference_time_t *reference) {
+    char timestamp_str[MAX_TIMESTAMP_LENGTH];
+    size_t len = found->rm_eo - found->rm_so;
+    if (len >= MAX_TIMESTAMP_LENGTH) {
+        return TS_ERROR_TIME_PARSE; // Timestamp too long
+    }
+
+    memcpy(timestamp_str, line + found->rm_so, len);
+    timestamp_str[len] = '\0';
+
+    ts_error_t parse_result = TS_ERROR_TIME_PARSE;
+
+    // Handle Unix timestamp patterns specially
+    if (strcmp(tsi_timestamp_formats[i].name, "unix_fractional") == 0) {
+        parse_result = parse_unix_timestamp_fractional(timestamp_str, result);
+        if (fractional_seconds) {
+            // Extract fractional part from unix timestamp
+            const char *dot_pos = strchr(timestamp_str, '.');
+            if (dot_pos) {
+                *fractional_seconds = parse_fraction_microseconds(dot_pos + 1,
+                                                                  strlen(dot_pos + 1));
+            } else {
+                *fractional_seconds = 0;
+            }
+        }
+    } else if (strcmp(tsi_timestamp_formats[i].name, "unix_plain") == 0) {
+        parse_result = parse_unix_timestamp_plain(timestamp_str, result);
+        if (fractional_seconds) {
+            *fractional_seconds = 0;
+        }
+    } else if (tsi_timestamp_formats[i].format != NULL) {
+        // Check if this format has fractional seconds
+        if (strstr(tsi_timestamp_formats[i].format, "%f") != NULL) {
+            parse_result = parse_timestamp_strptime_with_fractional(timestamp_str, tsi_timestamp_formats[i].format, result, fractional_seconds, reference);
+        } else {
+            parse_result = parse_timestamp_strptime(timestamp_str, tsi_timestamp_formats[i].format, result, reference);
+            if (fractional_seconds) {
+                *fractional_seconds = 0;
+            }
+        }
+    }
+    return parse_result;
+}
+
+// Parse the first match of tsi_timestamp_formats[i] in line, if there is one.
+// match, unless NULL, receives where it is.
+ts_error_t tsi_parse_timestamp_format(int i, const char *line, time_t *result, long *fractional_seconds,
+                                      reference_time_t *reference, regmatch_t *match) {
+    regmatch_t matches[1];
+    const regex_t *regex = tsi_timestamp_regex(i);
+    if (!regex) {
+        return TS_ERROR_TIME_PARSE; // Skip invalid regex
+    }
+
+    int exec_result = regexec(regex, line, 1, matches, 0);
+    if (exec_result != 0) {
+        return TS_ERROR_TIME_PARSE;
+    }
+
+    ts_error_t parse_result = tsi_parse_timestamp_matched(i, line, &matches[0], result, fractional_seconds,
+                                                          reference);
+    if (parse_result == TS_SUCCESS && match) {
+        *match = matches[0];
+    }
+    return parse_result;
+}
+
+// Detect and parse a timestamp in a line, trying *format_hint (the format
+// that matched last in the same input) before the others.  One log
+// mostly uses one format, so this usually takes a single regexec();
+// where a line would match several formats, the hinted one wins over
+// the usual order.  match, unless NULL, receives where the timestamp is.
+ts_error_t tsi_parse_timestamp_in_line_hinted(const char *line, int *format_hint, time_t *result,
+                                              long *fractional_seconds, reference_time_t *reference,
+                                              regmatch_t *match) {
+    if (*format_hint >= 0 &&
+        tsi_parse_timestamp_format(*format_hint, line, result, fractional_seconds, reference, match) == TS_SUCCESS) {
+        return TS_SUCCESS;
+    }
+    for (int i = 0; tsi_timestamp_formats[i].pattern != NULL; i++) {
+        if (i != *format_hint &&
+            tsi_parse_timestamp_format(i, line, result, fractional_seconds, reference, match) == TS_SUCCESS) {
+            *format_hint = i;
+            return TS_SUCCESS;
+        }
+    }
+    return TS_ERROR_TIME_PARSE;
+}
+
+
+// Format time difference from the reference "now" as "X ago" or "in X"
+// with optional fractional seconds
+ts_error_t tsi_format_relative_time(char *buffer, size_t buffer_size, time_t timestamp, long fractional_seconds,
+                                    reference_time_t *reference) {
+    if (!buffer || !reference) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+
+    time_t diff = reference->now.seconds - timestamp;
+
+    // If we have fractional seconds, we need to be more precise
+    bool has_fractional = (fractional_seconds > 0);
+    double precise_diff = (double)diff;
+
+    if (has_fractional) {
+        double current_fractional = (double)reference->now.nanoseconds / 1000000000.0;
+        double timestamp_fractional = (double)fractional_seconds / 1000000.0;
+        precise_diff = (double)diff + current_fractional - timestamp_fractional;
+    }
+
+    if (diff < 0) {
+        // Future time
+        diff = -diff;
+        if (diff < SECONDS_PER_MINUTE) {
+            if (has_fractional) {
+                return safe_snprintf(buffer, buffer_size, "in %.3fs", -precise_diff);
+            } else {
+                return safe_snprintf(buffer, buffer_size, "in %lds", diff);
+            }
+        } else if (diff < SECONDS_PER_HOUR) {
+            long minutes = diff / SECONDS_PER_MINUTE;
+            long seconds = diff % SECONDS_PER_MINUTE;
+            if (seconds > 0) {
+                if (has_fractional) {
+                    double remaining_seconds = -precise_diff - (minutes * SECONDS_PER_MINUTE);
+                    return safe_snprintf(buffer, buffer_size, "in %ldm%.3fs", minutes, remaining_seconds);
+                } else {
+                    return safe_snprintf(buffer, buffer_size, "in %ldm%lds", minutes, seconds);
+                }
+            } else {
+                return safe_snprintf(buffer, buffer_size, "in %ldm", minutes);
+            }
+        } else if (diff < SECONDS_PER_DAY) {
+            long hours = diff / SECONDS_PER_HOUR;
+            long minutes = (diff % SECONDS_PER_HOUR) / SECONDS_PER_MINUTE;
+            if (minutes > 0) {
+                return safe_snprintf(buffer, buffer_size, "in %ldh%ldm", hours, minutes);
+            } else {
+                return safe_snprintf(buffer, buffer_size, "in %ldh", hours);
+            }
+        } else {
+            long days = diff / SECONDS_PER_DAY;
+            long hours = (diff % SECONDS_PER_DAY) / SECONDS_PER_HOUR;
+            if (hours > 0) {
+                return safe_snprintf(buffer, buffer_size, "in %ldd%ldh", days, hours);
+            } else {
+                return safe_snprintf(buffer, buffer_size, "in %ldd", days);
+            }
+        }
+    } else {
+        // Past time
+        if (diff < SECONDS_PER_MINUTE) {
+            if (has_fractional) {
+                return safe_snprintf(buffer, buffer_size, "%.3fs ago", precise_diff);
+            } else {
+                return safe_snprintf(buffer, buffer_size, "%lds ago", diff);
+            }
+        } else if (diff < SECONDS_PER_HOUR) {
+            long minutes = diff / SECONDS_PER_MINUTE;
+            long seconds = diff % SECONDS_PER_MINUTE;
+            if (seconds > 0) {
+                if (has_fractional) {
+                    double remaining_seconds = precise_diff - (minutes * SECONDS_PER_MINUTE);
+                    return safe_snprintf(buffer, buffer_size, "%ldm%.3fs ago", minutes, remaining_seconds);
+                } else {
+                    return safe_snprintf(buffer, buffer_size, "%ldm%lds ago", minutes, seconds);
+                }
+            } else {
+                return safe_snprintf(buffer, buffer_size, "%ldm ago", minutes);
+            }
+        } else if (diff < SECONDS_PER_DAY) {
+            long hours = diff / SECONDS_PER_HOUR;
+            long minutes = (diff % SECONDS_PER_HOUR) / SECONDS_PER_MINUTE;
+            if (minutes > 0) {
+                return safe_snprintf(buffer, buffer_size, "%ldh%ldm ago", hours, minutes);
+            } else {
+                return safe_snprintf(buffer, buffer_size, "%ldh ago", hours);
+            }
+        } else {
+            long days = diff / SECONDS_PER_DAY;
+            long hours = (diff % SECONDS_PER_DAY) / SECONDS_PER_HOUR;
+            if (hours > 0) {
+                return safe_snprintf(buffer, buffer_size, "%ldd%ldh ago", days, hours);
+            } else {
+                return safe_snprintf(buffer, buffer_size, "%ldd ago", days);
+            }
+        }
+    }
+}
+
+// Two-digit lookup table for integer-to-ASCII conversion.  Converting two
+// digits per division halves the divide count and avoids vsnprintf, which
+// dominates the cost of the fixed-width numeric fields on the hot path.
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static const uint64_t powers_of_ten[20] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+    100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL,
+    1000000000000ULL, 10000000000000ULL, 100000000000000ULL,
+    1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+    1000000000000000000ULL, 10000000000000000000ULL
+};
+
+// Digit count from the bit length: log10(2) ~= 1233/4096, then one compare
+static inline int count_decimal_digits(uint64_t value) {
+    int bits = 64 - __builtin_clzll(value | 1);
+    int approx = (bits * 1233) >> 12;
+    return approx + ((value | 1) >= powers_of_ten[approx]);
+}
+
+// Write a value backwards from end, four digits per division so the two
+// pair lookups in each step are independent
+static inline char *write_digits_backwards(char *end, uint64_t value) {
+    while (value >= 10000) {
+        uint32_t chunk = (uint32_t)(value % 10000);
+        value /= 10000;
+        end -= 4;
+        memcpy(end, &digit_pairs[(chunk / 100) * 2], 2);
+        memcpy(end + 2, &digit_pairs[(chunk % 100) * 2], 2);
+    }
+    uint32_t rest = (uint32_t)value;
+    if (rest >= 100) {
+        end -= 2;
+        memcpy(end, &digit_pairs[(rest % 100) * 2], 2);
+        rest /= 100;
+    }
+    if (rest >= 10) {
+        end -= 2;
+        memcpy(end, &digit_pairs[rest * 2], 2);
+    } else {
+        *--end = (char)('0' + rest);
+    }
+    return end;
+}
+
+// Render value the way printf("%0*ld", width, value) does, without the
+// terminating NUL.  dst must hold at least max(width, 20) bytes.
+#ifdef TS_TESTING
+size_t format_padded_decimal(char *dst, long value, int width) {
+#else
+static size_t format_padded_decimal(char *dst, long value, int width) {
+#endif
+    char *start = dst;
+    uint64_t magnitude = (uint64_t)value;
+    if (value < 0) {
+        // The sign counts toward the field width, as it does for printf
+        *dst++ = '-';
+        magnitude = 0 - magnitude;
+        width--;
+    }
+
+    int digits = count_decimal_digits(magnitude);
+    if (digits < width) {
+        digits = width;
+    }
+
+    char *p = write_digits_backwards(dst + digits, magnitude);
+    while (p > dst) {
+        *--p = '0';
+    }
+
+    return (size_t)(dst + digits - start);
+}
+
+ts_error_t tsi_field_buffer_append_decimal(field_buffer_t *out, long value, int width) {
+    char digits[24];
+    size_t n = format_padded_decimal(digits, value, width);
+    if (!field_buffer_reserve(out, n)) {
+        return TS_ERROR_BUFFER_OVERFLOW;
+    }
+    memcpy(out->data + out->len, digits, n);
+    out->len += n;
+    out->data[out->len] = '\0';
+    return TS_SUCCESS;
+}
+
+ts_error_t tsi_field_buffer_append_char(field_buffer_t *out, char c) {
+    if (!field_buffer_reserve(out, 1)) {
+        return TS_ERROR_BUFFER_OVERFLOW;
+    }
+    out->data[out->len++] = c;
+    out->data[out->len] = '\0';
+    return TS_SUCCESS;
+}
+
+// Append "<seconds>.<microseconds>" as printf("%ld.%06ld") would
+ts_error_t tsi_field_buffer_append_seconds_micros(field_buffer_t *out, long seconds,
+                                                  int seconds_width, long nanoseconds) {
+    ts_error_t result_code = tsi_field_buffer_append_decimal(out, seconds, seconds_width);
+    if (result_code == TS_SUCCESS) {
+        result_code = tsi_field_buffer_append_char(out, '.');
+    }
+    if (result_code == TS_SUCCESS) {
+        result_code = tsi_field_buffer_append_decimal(out, nanoseconds / 1000, 6);
+    }
+    return result_code;
+}
+
+static const char month_abbreviations[12][4] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+// Compile an output format, recognizing the ones with a dedicated renderer
+void tsi_compile_output_format(compiled_format_t *compiled, const char *format) {
+    strncpy(compiled->format, format, sizeof(compiled->format) - 1);
+    compiled->format[sizeof(compiled->format) - 1] = '\0';
+
+    if (strcmp(format, "%Y-%m-%dT%H:%M:%S") == 0) {
+        compiled->fast = FAST_FORMAT_ISO8601;
+    } else if (strcmp(format, "%b %d %H:%M:%S") == 0) {
+        compiled->fast = FAST_FORMAT_SYSLOG;
+    } else if (strcmp(format, "%H:%M:%S") == 0 || strcmp(format, "%T") == 0) {
+        compiled->fast = FAST_FORMAT_CLOCK;
+    } else if (strcmp(format, "%.T") == 0) {
+        compiled->fast = FAST_FORMAT_CLOCK_SUBSEC;
+    } else {
+        compiled->fast = FAST_FORMAT_NONE;
+    }
+
+    // Empty interval; the first lookup fills it
+    compiled->utc_offset.valid_from = 1;
+    compiled->utc_offset.valid_until = 0;
+    compiled->utc_offset.offset = 0;
+    compiled->utc_offset.is_dst = false;
+    compiled->utc_offset.abbreviation[0] = '\0';
+    tz_refresh_local_zone();
+}
+
+static inline char *write_two_digits(char *dst, int value) {
+    memcpy(dst, &digit_pairs[value * 2], 2);
+    return dst + 2;
+}
+
+// Render a fast format from wall-clock seconds (already shifted to the
+// target zone).  Returns TS_ERROR_TIME_PARSE when the value falls outside
+// what the renderer reproduces byte for byte, so callers fall back.
+ts_error_t tsi_render_fast_format(char *buffer, size_t buffer_size, fast_format_t kind,
+                                  int64_t wall_seconds, long nanoseconds) {
+    int64_t days = floor_div(wall_seconds, SECONDS_PER_DAY);
+    int second_of_day = (int)(wall_seconds - days * SECONDS_PER_DAY);
+    int hour = second_of_day / SECONDS_PER_HOUR;
+    int minute = second_of_day / SECONDS_PER_MINUTE % 60;
+    int second = second_of_day % SECONDS_PER_MINUTE;
+
+    char rendered[32];
+    char *p = rendered;
+
+    if (kind == FAST_FORMAT_ISO8601 || kind == FAST_FORMAT_SYSLOG) {
+        int year, month, day;
+        civil_from_days(days, &year, &month, &day);
+        if (kind == FAST_FORMAT_ISO8601) {
+            // strftime prints %Y unpadded, so only four-digit years match
+            if (year < 1000 || year > 9999) {
+                return TS_ERROR_TIME_PARSE;
+            }
+            p = write_two_digits(p, year / 100);
+            p = write_two_digits(p, year % 100);
+            *p++ = '-';
+            p = write_two_digits(p, month);
+            *p++ = '-';
+            p = write_two_digits(p, day);
+            *p++ = 'T';
+        } else {
+            memcpy(p, month_abbreviations[month - 1], 3);
+            p += 3;
+            *p++ = ' ';
+            p = write_two_digits(p, day);
+            *p++ = ' ';
+        }
+    }
+
+    p = write_two_digits(p, hour);
+    *p++ = ':';
+    p = write_two_digits(p, minute);
+    *p++ = ':';
+    p = write_two_digits(p, second);
+
+    if (kind == FAST_FORMAT_CLOCK_SUBSEC) {
+        *p++ = '.';
+        p += format_padded_decimal(p, nanoseconds / 1000, 6);
+    }
+
+    size_t len = (size_t)(p - rendered);
+    if (len >= buffer_size) {
+        return TS_ERROR_BUFFER_OVERFLOW;
+    }
+    memcpy(buffer, rendered, len);
+    buffer[len] = '\0';
+    return TS_SUCCESS;
+}
+
+// Format timestamp with subsecond resolution, converting to local time
+// through the caller's offset cache
+static ts_error_t format_timestamp_local(char *buffer, size_t buffer_size, const char *format,
+                                         const high_res_time_t *timestamp,
+                                         utc_offset_cache_t *utc_offset) {
+    char temp_buffer[MAX_FORMAT_LENGTH];
+    struct tm local_tm;
+    if (tsi_local_time_at(utc_offset, timestamp->seconds, &local_tm) != TS_SUCCESS) {
+        return TS_ERROR_SYSTEM;
+    }
+    const struct tm *tm_info = &local_tm;
+
+    // First pass: handle special patterns and build the result
+    char result[MAX_FORMAT_LENGTH] = "";
+    field_buffer_t out = {result, sizeof(result), 0};
+    const char *current = format;
+
+    while (*current != '\0') {
+        ts_error_t result_code;
+        if (strncmp(current, "%.S", 3) == 0) {
+            // %.S - seconds with subsecond resolution
+            result_code = tsi_field_buffer_append_seconds_micros(&out, tm_info->tm_sec, 2,
+                                                                 timestamp->nanoseconds);
+            current += 3;
+        } else if (strncmp(current, "%.s", 3) == 0) {
+            // %.s - unix timestamp with subsecond resolution
+            result_code = tsi_field_buffer_append_seconds_micros(&out, (long)timestamp->seconds, 0,
+                                                                 timestamp->nanoseconds);
+            current += 3;
+        } else if (strncmp(current, "%.T", 3) == 0) {
+            // %.T - time with subsecond resolution
+            result_code = tsi_field_buffer_append_decimal(&out, tm_info->tm_hour, 2);
+            if (result_code == TS_SUCCESS) {
+                result_code = tsi_field_buffer_append_char(&out, ':');
+            }
+            if (result_code == TS_SUCCESS) {
+                result_code = tsi_field_buffer_append_decimal(&out, tm_info->tm_min, 2);
+            }
+            if (result_code == TS_SUCCESS) {
+                result_code = tsi_field_buffer_append_char(&out, ':');
+            }
+            if (result_code == TS_SUCCESS) {
+                result_code = tsi_field_buffer_append_seconds_micros(&out, tm_info->tm_sec, 2,
+                                                                     timestamp->nanoseconds);
+            }
+            current += 3;
+        } else if (strncmp(current, "%N", 2) == 0) {
+            // %N - nanoseconds
+            result_code = tsi_field_buffer_append_decimal(&out, timestamp->nanoseconds, 9);
+            current += 2;
+        } else if (strncmp(current, "%s", 2) == 0) {
+            // %s - unix timestamp
+            result_code = tsi_field_buffer_append_decimal(&out, (long)timestamp->seconds, 0);
+            current += 2;
+        } else {
+            // Copy the character and continue
+            result_code = tsi_field_buffer_append_char(&out, *current);
+            current++;
+        }
+        if (result_code != TS_SUCCESS) {
+            return result_code;
+        }
+    }
+
+    // Second pass: if the result still contains strftime patterns, process them
+    if (memchr(result, '%', out.len) != NULL) {
+        if (strftime(temp_buffer, sizeof(temp_buffer), result, tm_info) == 0) {
+            return TS_ERROR_BUFFER_OVERFLOW;
+        }
+        size_t temp_len = strlen(temp_buffer);
+        if (temp_len >= buffer_size) {
+            return TS_ERROR_BUFFER_OVERFLOW;
+        }
+        memcpy(buffer, temp_buffer, temp_len + 1);
+    } else {
+        if (out.len >= buffer_size) {
+            return TS_ERROR_BUFFER_OVERFLOW;
+        }
+        memcpy(buffer, result, out.len + 1);
+    }
+
+    return TS_SUCCESS;
+}
+
+// Format timestamp with subsecond resolution.  The program formats through
+// a compiled format and its offset cache; this one-shot form stays
+// available to the test suites.
+#ifdef TS_TESTING
+ts_error_t format_timestamp_with_subsecond(char *buffer, size_t buffer_size,
+                                         const char *format, const high_res_time_t *timestamp) {
+    if (!buffer || !format || !timestamp) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+
+    utc_offset_cache_t utc_offset = {1, 0, 0, false, ""};
+    return format_timestamp_local(buffer, buffer_size, format, timestamp, &utc_offset);
+}
+#endif
+
+// Format a timestamp with a compiled format, via the dedicated renderer
+// when there is one and the generic strftime path otherwise
+ts_error_t tsi_format_timestamp_compiled(char *buffer, size_t buffer_size,
+                                         compiled_format_t *compiled, const high_res_time_t *timestamp) {
+    if (!buffer || !compiled || !timestamp) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+
+    if (compiled->fast != FAST_FORMAT_NONE) {
+        long offset;
+        if (lookup_utc_offset(&compiled->utc_offset, timestamp->seconds, &offset) == TS_SUCCESS &&
+            tsi_render_fast_format(buffer, buffer_size, compiled->fast,
+                                   (int64_t)timestamp->seconds + offset,
+                                   timestamp->nanoseconds) == TS_SUCCESS) {
+            return TS_SUCCESS;
+        }
+    }
+
+    return format_timestamp_local(buffer, buffer_size, compiled->format, timestamp,
+                                  &compiled->utc_offset);
+}
+
+
+// Kernel clocks selectable with --clock.  The coarse clocks return the
+// time of the last tick without reading the hardware counter, which makes
+// them several times cheaper at the cost of tick (typically 1-4 ms)
+// resolution.  BOOTTIME keeps counting across suspend; TAI runs ahead of
+// UTC by the kernel's TAI offset and does not step at leap seconds.
+static const struct {
+    const char *name;
+    clockid_t clock_id;
+} system_clocks[] = {
+    {"realtime", CLOCK_REALTIME},
+    {"monotonic", CLOCK_MONOTONIC},
+#ifdef HAVE_CLOCK_REALTIME_COARSE
+    {"realtime-coarse", CLOCK_REALTIME_COARSE},
+#endif
+#ifdef HAVE_CLOCK_MONOTONIC_COARSE
+    {"monotonic-coarse", CLOCK_MONOTONIC_COARSE},
+#endif
+#ifdef HAVE_CLOCK_BOOTTIME
+    {"boottime", CLOCK_BOOTTIME},
+#endif
+#ifdef HAVE_CLOCK_TAI
+    {"tai", CLOCK_TAI},
+#endif
+    {NULL, 0}
+};
+
+// Read a kernel clock into a high_res_time_t
+static inline high_res_time_t read_system_clock(clockid_t clock_id) {
+    high_res_time_t result = {0};
+    struct timespec ts;
+    if (clock_gettime(clock_id, &ts) == 0) {
+        result.seconds = ts.tv_sec;
+        result.nanoseconds = ts.tv_nsec;
+    }
+    return result;
+}
+
+// Advance a time by a non-negative step
+static high_res_time_t high_res_time_add(high_res_time_t time, const high_res_time_t *step) {
+    time.seconds += step->seconds;
+    time.nanoseconds += step->nanoseconds;
+    if (time.nanoseconds >= NANOSECONDS_PER_SECOND) {
+        time.seconds++;
+        time.nanoseconds -= NANOSECONDS_PER_SECOND;
+    }
+    return time;
+}
+
+// Check a /proc/cpuinfo "flags" line for an invariant TSC: one that ticks
+// at a constant rate (constant_tsc) and keeps ticking in deep C-states
+// (nonstop_tsc), so cycles convert to time with a single calibration
+#ifdef TS_TESTING
+bool tsc_flags_are_invariant(const char *flags) {
+#else
+static bool tsc_flags_are_invariant(const char *flags) {
+#endif
+    bool constant = false, nonstop = false;
+    const char *token = flags;
+    while (*token != '\0') {
+        token += strspn(token, " \t:\n");
+        size_t len = strcspn(token, " \t\n");
+        if (len == 12 && strncmp(token, "constant_tsc", len) == 0) {
+            constant = true;
+        } else if (len == 11 && strncmp(token, "nonstop_tsc", len) == 0) {
+            nonstop = true;
+        }
+        token += len;
+    }
+    return constant && nonstop;
+}
+
+#ifdef HAVE_RDTSC
+static bool tsc_is_invariant(void) {
+    FILE *cpuinfo = fopen("/proc/cpuinfo", "r");
+    if (!cpuinfo) {
+        return false;
+    }
+
+    char *line = NULL;
+    size_t line_size = 0;
+    bool invariant = false;
+    while (getline(&line, &line_size, cpuinfo) != -1) {
+        if (strncmp(line, "flags", 5) == 0) {
+            invariant = tsc_flags_are_invariant(line + 5);
+            break;
+        }
+    }
+    free(line);
+    fclose(cpuinfo);
+    return invariant;
+}
+
+static int64_t high_res_time_diff_ns(const high_res_time_t *later, const high_res_time_t *earlier) {
+    return (int64_t)(later->seconds - earlier->seconds) * NANOSECONDS_PER_SECOND +
+           (later->nanoseconds - earlier->nanoseconds);
+}
+
+static high_res_time_t high_res_time_add_ns(high_res_time_t time, int64_t ns) {
+    int64_t total = (int64_t)time.nanoseconds + ns;
+    int64_t seconds = floor_div(total, NANOSECONDS_PER_SECOND);
+    time.seconds += (time_t)seconds;
+    time.nanoseconds = (long)(total - seconds * NANOSECONDS_PER_SECOND);
+    return time;
+}
+
+// Pair a TSC reading with CLOCK_MONOTONIC, taking the TSC midpoint around
+// the clock read to halve the pairing error, and measure CLOCK_REALTIME's
+// offset from it the same way.  A pairing interrupted by preemption is
+// off by however long the thread was away, so the tightest of a few
+// tries is kept.
+static void tsc_sample(uint64_t *cycles, high_res_time_t *monotonic, high_res_time_t *time) {
+    uint64_t best_width = UINT64_MAX;
+    for (int i = 0; i < TSC_SAMPLE_TRIES; i++) {
+        uint64_t before = __rdtsc();
+        high_res_time_t now = read_system_clock(CLOCK_MONOTONIC);
+        uint64_t after = __rdtsc();
+        if (after - before < best_width) {
+            best_width = after - before;
+            *cycles = before + (after - before) / 2;
+            *monotonic = now;
+        }
+    }
+
+    int64_t best_span = INT64_MAX;
+    int64_t offset_ns = 0;
+    for (int i = 0; i < TSC_SAMPLE_TRIES; i++) {
+        high_res_time_t before = read_system_clock(CLOCK_MONOTONIC);
+        high_res_time_t wall = read_system_clock(CLOCK_REALTIME);
+        high_res_time_t after = read_system_clock(CLOCK_MONOTONIC);
+        int64_t span = high_res_time_diff_ns(&after, &before);
+        if (span < best_span) {
+            best_span = span;
+            high_res_time_t middle = high_res_time_add_ns(before, span / 2);
+            offset_ns = high_res_time_diff_ns(&wall, &middle);
+        }
+    }
+    *time = high_res_time_add_ns(*monotonic, offset_ns);
+}
+
+// Re-anchor and re-measure the TSC rate over the monotonic span since the
+// previous anchor, so conversion error stays bounded by the rate error
+// over at most one recalibration interval.  Steps of the wall clock
+// (settimeofday, NTP) only move the realtime offset, never the rate.
+static void tsc_recalibrate(tsc_calibration_t *tsc) {
+    uint64_t cycles;
+    high_res_time_t monotonic;
+    high_res_time_t time;
+    tsc_sample(&cycles, &monotonic, &time);
+
+    int64_t span_ns = high_res_time_diff_ns(&monotonic, &tsc->anchor_monotonic);
+    uint64_t span_cycles = cycles - tsc->anchor_cycles;
+    if (span_ns > 0 && span_cycles > 0) {
+        double ns_per_cycle = (double)span_ns / (double)span_cycles;
+        tsc->ns_per_cycle_q32 = (uint64_t)(ns_per_cycle * 4294967296.0);
+        tsc->recalibrate_cycles = (uint64_t)(TSC_RECALIBRATION_NS / ns_per_cycle);
+    }
+    tsc->anchor_cycles = cycles;
+    tsc->anchor_monotonic = monotonic;
+    tsc->anchor_time = time;
+}
+
+static ts_error_t tsc_calibrate(tsc_calibration_t *tsc) {
+    memset(tsc, 0, sizeof(*tsc));
+    tsc_sample(&tsc->anchor_cycles, &tsc->anchor_monotonic, &tsc->anchor_time);
+
+    struct timespec pause = {0, TSC_CALIBRATION_NS};
+    while (nanosleep(&pause, &pause) != 0 && errno == EINTR) {
+    }
+
+    tsc_recalibrate(tsc);
+    if (tsc->ns_per_cycle_q32 == 0 || tsc->recalibrate_cycles == 0) {
+        return TS_ERROR_SYSTEM;
+    }
+    tsc->last = tsc->anchor_time;
+    return TS_SUCCESS;
+}
+
+// Convert the current TSC to wall-clock time.  The product below stays
+// under 2^63 because deltas are capped at one recalibration interval.
+static high_res_time_t tsc_read(tsc_calibration_t *tsc) {
+    uint64_t delta = __rdtsc() - tsc->anchor_cycles;
+    if (delta >= tsc->recalibrate_cycles) {
+        tsc_recalibrate(tsc);
+        delta = 0;
+    }
+
+    uint64_t ns = (delta * tsc->ns_per_cycle_q32) >> 32;
+    high_res_time_t result = tsc->anchor_time;
+    result.seconds += (time_t)(ns / NANOSECONDS_PER_SECOND);
+    result.nanoseconds += (long)(ns % NANOSECONDS_PER_SECOND);
+    if (result.nanoseconds >= NANOSECONDS_PER_SECOND) {
+        result.seconds++;
+        result.nanoseconds -= NANOSECONDS_PER_SECOND;
+    }
+
+    // Re-anchoring can move the estimate back slightly; hold time steady instead
+    if (result.seconds < tsc->last.seconds ||
+        (result.seconds == tsc->last.seconds && result.nanoseconds < tsc->last.nanoseconds)) {
+        return tsc->last;
+    }
+    tsc->last = result;
+    return result;
+}
+#endif
+
+// Set up a clock source from a --clock value: a name from system_clocks,
+// "tsc", "fixed:START[+STEP]" or "replay:FILE"
+ts_error_t tsi_clock_source_open(clock_source_t *clock, const char *spec) {
+    if (!clock || !spec) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+
+    memset(clock, 0, sizeof(*clock));
+    for (int i = 0; system_clocks[i].name != NULL; i++) {
+        if (strcmp(spec, system_clocks[i].name) == 0) {
+            // Catch clocks the headers know but the running kernel lacks
+            struct timespec resolution;
+            if (clock_getres(system_clocks[i].clock_id, &resolution) != 0) {
+                return TS_ERROR_SYSTEM;
+            }
+            clock->kind = CLOCK_SOURCE_SYSTEM;
+            clock->clock_id = system_clocks[i].clock_id;
+            return TS_SUCCESS;
+        }
+    }
+
+    if (strcmp(spec, "tsc") == 0) {
+#ifdef HAVE_RDTSC
+        if (tsc_is_invariant() && tsc_calibrate(&clock->tsc) == TS_SUCCESS) {
+            clock->kind = CLOCK_SOURCE_TSC;
+            return TS_SUCCESS;
+        }
+#endif
+        fprintf(stderr, "Warning: invariant TSC not available, using CLOCK_REALTIME\n");
+        clock->kind = CLOCK_SOURCE_SYSTEM;
+        clock->clock_id = CLOCK_REALTIME;
+        return TS_SUCCESS;
+    }
+
+    if (strncmp(spec, "fixed:", 6) == 0) {
+        char start[MAX_TIME_STR_LENGTH];
+        const char *plus = strchr(spec + 6, '+');
+        size_t start_len = plus ? (size_t)(plus - (spec + 6)) : strlen(spec + 6);
+        if (start_len >= sizeof(start)) {
+            return TS_ERROR_INVALID_ARGUMENT;
+        }
+        memcpy(start, spec + 6, start_len);
+        start[start_len] = '\0';
+        if (tsi_parse_reference_time(start, &clock->next) != TS_SUCCESS ||
+            (plus && tsi_parse_reference_time(plus + 1, &clock->step) != TS_SUCCESS)) {
+            return TS_ERROR_INVALID_ARGUMENT;
+        }
+        clock->kind = CLOCK_SOURCE_FIXED;
+    } else if (strncmp(spec, "replay:", 7) == 0) {
+        clock->replay = fopen(spec + 7, "r");
+        if (!clock->replay) {
+            return TS_ERROR_SYSTEM;
+        }
+        clock->kind = CLOCK_SOURCE_REPLAY;
+    } else {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+
+    return TS_SUCCESS;
+}
+
+// Read the next arrival time from a replay sidecar.  Each line starts with
+// EPOCH[.FRAC] and anything after it is ignored, so the output of
+// ts "%.s" can be replayed as is.  Past the end of the sidecar, or on a
+// line without a time, the previous time repeats.
+void tsi_clock_source_read_replay(clock_source_t *clock) {
+    char record[MAX_LINE_LENGTH];
+    if (!fgets(record, sizeof(record), clock->replay)) {
+        return;
+    }
+    size_t len = strlen(record);
+    if (len > 0 && record[len - 1] != '\n') {
+        // Skip the rest of an overlong line
+        int c;
+        while ((c = fgetc(clock->replay)) != EOF && c != '\n') {
+        }
+    }
+
+    record[strcspn(record, " \t\r\n")] = '\0';
+    high_res_time_t arrival;
+    if (tsi_parse_reference_time(record, &arrival) == TS_SUCCESS) {
+        clock->next = arrival;
+    }
+}
+
+// Time of the next input line
+high_res_time_t tsi_clock_source_read(clock_source_t *clock) {
+    high_res_time_t result;
+    switch (clock->kind) {
+        case CLOCK_SOURCE_FIXED:
+            result = clock->next;
+            clock->next = high_res_time_add(clock->next, &clock->step);
+            return result;
+        case CLOCK_SOURCE_REPLAY:
+            if (!clock->replay_pending) {
+                tsi_clock_source_read_replay(clock);
+            }
+            clock->replay_pending = false;
+            return clock->next;
+#ifdef HAVE_RDTSC
+        case CLOCK_SOURCE_TSC:
+            return tsc_read(&clock->tsc);
+#endif
+        case CLOCK_SOURCE_SYSTEM:
+        default:
+            return read_system_clock(clock->clock_id);
+    }
+}
+
+
+void tsi_clock_source_close(clock_source_t *clock) {
+    if (clock->replay) {
+        fclose(clock->replay);
+        clock->replay = NULL;
+    }
+}
+
+// Library interface (libts.h)
+
+static inline high_res_time_t time_from_public(const ts_time_t *time) {
+    return (high_res_time_t){(time_t)time->seconds, time->nanoseconds};
+}
+
+ts_error_t ts_context_new(ts_context_t **context, const char *format, const char *clock) {
+    if (!context || (format && strlen(format) >= MAX_FORMAT_LENGTH)) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+    ts_context_t *created = calloc(1, sizeof(*created));
+    if (!created) {
+        return TS_ERROR_SYSTEM;
+    }
+    created->clock = (clock_source_t){.kind = CLOCK_SOURCE_SYSTEM, .clock_id = CLOCK_REALTIME};
+    if (clock && tsi_clock_source_open(&created->clock, clock) != TS_SUCCESS) {
+        free(created);
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+    tsi_compile_output_format(&created->format, format ? format : DEFAULT_FORMAT);
+    created->format_hint = -1;
+    high_res_time_t now = tsi_get_high_res_time(false);
+    if (tsi_reference_time_set(&created->reference, &now) != TS_SUCCESS) {
+        tsi_clock_source_close(&created->clock);
+        free(created);
+        return TS_ERROR_SYSTEM;
+    }
+    *context = created;
+    return TS_SUCCESS;
+}
+
+void ts_context_free(ts_context_t *context) {
+    if (context) {
+        tsi_clock_source_close(&context->clock);
+        free(context);
+    }
+}
+
+ts_error_t ts_now(ts_context_t *context, ts_time_t *time) {
+    if (!context || !time) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+    high_res_time_t now = tsi_clock_source_read(&context->clock);
+    *time = (ts_time_t){(int64_t)now.seconds, now.nanoseconds};
+    return TS_SUCCESS;
+}
+
+ts_error_t ts_format(ts_context_t *context, const ts_time_t *time, ts_buffer_t *out) {
+    if (!context || !time || !out || !out->data || out->size == 0) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+    high_res_time_t when = time_from_public(time);
+    ts_error_t result = tsi_format_timestamp_compiled(out->data, out->size, &context->format, &when);
+    if (result != TS_SUCCESS) {
+        out->data[0] = '\0';
+    }
+    out->len = result == TS_SUCCESS ? strlen(out->data) : 0;
+    return result;
+}
+
+ts_error_t ts_stamp_at(ts_context_t *context, const ts_time_t *time, ts_span_t line, ts_buffer_t *out) {
+    if (!line.data && line.len > 0) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+    ts_error_t result = ts_format(context, time, out);
+    if (result != TS_SUCCESS) {
+        return result;
+    }
+    if (out->size - out->len <= line.len + 1) {
+        out->len = 0;
+        out->data[0] = '\0';
+        return TS_ERROR_BUFFER_OVERFLOW;
+    }
+    out->data[out->len++] = ' ';
+    memcpy(out->data + out->len, line.data, line.len);
+    out->len += line.len;
+    out->data[out->len] = '\0';
+    return TS_SUCCESS;
+}
+
+ts_error_t ts_stamp(ts_context_t *context, ts_span_t line, ts_buffer_t *out) {
+    ts_time_t now;
+    ts_error_t result = ts_now(context, &now);
+    return result == TS_SUCCESS ? ts_stamp_at(context, &now, line, out) : result;
+}
+
+// Move the context's reference to now.  The local offsets it has looked
+// up stay cached across calls, so within the offset interval already
+// known this is only a lookup of now's year.
+static ts_error_t library_reference_move(reference_time_t *reference, const high_res_time_t *now) {
+    if (now->seconds != reference->now.seconds) {
+        struct tm now_tm;
+        if (tsi_local_time_at(&reference->utc_offset, now->seconds, &now_tm) != TS_SUCCESS) {
+            return TS_ERROR_SYSTEM;
+        }
+        reference->local_year = now_tm.tm_year;
+    }
+    reference->now = *now;
+    return TS_SUCCESS;
+}
+
+// Find the timestamp in line the way -r does, against the reference time
+// now, trying the format that matched last first.  The search sees at
+// most MAX_LINE_LENGTH - 1 bytes, as much as a ts input line holds.
+static ts_error_t library_find_timestamp(ts_context_t *context, ts_span_t line, const high_res_time_t *now,
+                                         time_t *seconds, long *microseconds, regmatch_t *match) {
+    char text[MAX_LINE_LENGTH];
+    if (!context || (!line.data && line.len > 0)) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+    size_t len = line.len < sizeof(text) ? line.len : sizeof(text) - 1;
+    memcpy(text, line.data, len);
+    text[len] = '\0';
+    if (library_reference_move(&context->reference, now) != TS_SUCCESS) {
+        return TS_ERROR_SYSTEM;
+    }
+    return tsi_parse_timestamp_in_line_hinted(text, &context->format_hint, seconds, microseconds,
+                                              &context->reference, match);
+}
+
+ts_error_t ts_parse(ts_context_t *context, ts_span_t line, ts_time_t *time, size_t *start, size_t *end) {
+    if (!time) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+    high_res_time_t now = tsi_get_high_res_time(false);
+    time_t seconds;
+    long microseconds = 0;
+    regmatch_t match;
+    ts_error_t result = library_find_timestamp(context, line, &now, &seconds, &microseconds, &match);
+    if (result == TS_SUCCESS) {
+        *time = (ts_time_t){(int64_t)seconds, microseconds * 1000};
+        if (start) {
+            *start = (size_t)match.rm_so;
+        }
+        if (end) {
+            *end = (size_t)match.rm_eo;
+        }
+    }
+    return result;
+}
+
+ts_error_t ts_relative(ts_context_t *context, ts_span_t line, const ts_time_t *now, ts_buffer_t *out) {
+    if (!out || !out->data || out->size == 0) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+    out->len = 0;
+    out->data[0] = '\0';
+    high_res_time_t reference_now = now ? time_from_public(now) : tsi_get_high_res_time(false);
+    time_t seconds;
+    long microseconds = 0;
+    regmatch_t match;
+    char relative[MAX_FORMAT_LENGTH];
+    ts_error_t result = library_find_timestamp(context, line, &reference_now, &seconds, &microseconds, &match);
+    if (result == TS_SUCCESS) {
+        result = tsi_format_relative_time(relative, sizeof(relative), seconds, microseconds, &context->reference);
+    }
+    if (result != TS_SUCCESS) {
+        return result;
+    }
+
+    // The text around the timestamp is copied from the span itself, so a
+    // line longer than the search limit is kept whole
+    size_t before = (size_t)match.rm_so;
+    size_t after = line.len - (size_t)match.rm_eo;
+    size_t relative_len = strlen(relative);
+    if (before + relative_len + after >= out->size) {
+        return TS_ERROR_BUFFER_OVERFLOW;
+    }
+    memcpy(out->data, line.data, before);
+    memcpy(out->data + before, relative, relative_len);
+    memcpy(out->data + before + relative_len, line.data + match.rm_eo, after);
+    out->len = before + relative_len + after;
+    out->data[out->len] = '\0';
+    return TS_SUCCESS;
+}
+
+const char *ts_strerror(ts_error_t error) {
+    switch (error) {
+        case TS_SUCCESS:
+            return "Success";
+        case TS_ERROR_INVALID_ARGUMENT:
+            return "Invalid argument";
+        case TS_ERROR_BUFFER_OVERFLOW:
+            return "Output buffer too small";
+        case TS_ERROR_REGEX_COMPILE:
+            return "Timestamp pattern does not compile";
+        case TS_ERROR_REGEX_EXEC:
+            return "Timestamp pattern match failed";
+        case TS_ERROR_TIME_PARSE:
+            return "No timestamp found";
+        case TS_ERROR_SYSTEM:
+            return "System error";
+    }
+    return "Unknown error";
+}
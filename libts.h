@@ -0,0 +1,123 @@
+/*
+ * libts.h - Timestamping library interface
+ *
+ * Copyright (C) 2025  Michael Rice <michael@riceclan.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// libts stamps lines the way the ts command does, from inside another
+// program.  A context holds an output format, compiled once, and a clock;
+// stamping and formatting then write into buffers the caller owns and
+// allocate nothing.  The parse and relative calls find the timestamps
+// that ts -r recognizes.
+//
+//     ts_context_t *ctx;
+//     char buf[4096];
+//     ts_buffer_t out = {buf, sizeof(buf), 0};
+//     if (ts_context_new(&ctx, "%Y-%m-%dT%H:%M:%.S", NULL) == TS_SUCCESS &&
+//         ts_stamp(ctx, (ts_span_t){line, line_len}, &out) == TS_SUCCESS) {
+//         fwrite(out.data, 1, out.len, stream);
+//     }
+//     ts_context_free(ctx);
+
+#ifndef LIBTS_H
+#define LIBTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Error codes
+typedef enum {
+    TS_SUCCESS = 0,
+    TS_ERROR_INVALID_ARGUMENT = -1,
+    TS_ERROR_BUFFER_OVERFLOW = -2,
+    TS_ERROR_REGEX_COMPILE = -3,
+    TS_ERROR_REGEX_EXEC = -4,
+    TS_ERROR_TIME_PARSE = -5,
+    TS_ERROR_SYSTEM = -6
+} ts_error_t;
+
+// Seconds since the epoch and nanoseconds into the second
+typedef struct {
+    int64_t seconds;
+    long nanoseconds;
+} ts_time_t;
+
+// Input bytes; need not be NUL-terminated
+typedef struct {
+    const char *data;
+    size_t len;
+} ts_span_t;
+
+// Output buffer owned by the caller.  Calls write from data[0], set len
+// to the bytes written and NUL-terminate; on TS_ERROR_BUFFER_OVERFLOW
+// len is 0 and data is the empty string.
+typedef struct {
+    char *data;
+    size_t size;
+    size_t len;
+} ts_buffer_t;
+
+// A compiled output format, a clock and the caches behind them.  A context
+// is not safe to share between threads, but contexts on different threads
+// run in parallel: the state they share (the local zone's transition
+// table and the timestamp patterns) is set up once and only read after.
+// Changing TZ while contexts are in use is not supported.
+typedef struct ts_context ts_context_t;
+
+// Create a context.  format is a strftime format with the ts extensions
+// (%.S, %.s, %.T, %N), NULL for the ts default "%b %d %H:%M:%S"; clock is
+// a ts --clock source such as "monotonic" or "fixed:START+STEP", NULL
+// for the real-time clock.
+ts_error_t ts_context_new(ts_context_t **context, const char *format, const char *clock);
+void ts_context_free(ts_context_t *context);
+
+// Read the context's clock
+ts_error_t ts_now(ts_context_t *context, ts_time_t *time);
+
+// Write the timestamp for time in the context's format
+ts_error_t ts_format(ts_context_t *context, const ts_time_t *time, ts_buffer_t *out);
+
+// Write line stamped as ts writes it: the timestamp for the clock's
+// current time, a space and the line.  ts_stamp_at stamps with time
+// instead of reading the clock.
+ts_error_t ts_stamp(ts_context_t *context, ts_span_t line, ts_buffer_t *out);
+ts_error_t ts_stamp_at(ts_context_t *context, const ts_time_t *time, ts_span_t line, ts_buffer_t *out);
+
+// Find a timestamp ts -r recognizes in line and parse it.  start and end,
+// either of which may be NULL, receive its byte range.  Times without a
+// year are placed relative to the current time.  The context remembers
+// which format matched and tries it first on the next line.  Returns
+// TS_ERROR_TIME_PARSE if line holds no timestamp.
+ts_error_t ts_parse(ts_context_t *context, ts_span_t line, ts_time_t *time, size_t *start, size_t *end);
+
+// Write line with its timestamp replaced by the time elapsed since then
+// as of now ("5m30s ago"), as ts -r does; now NULL for the current time.
+// Returns TS_ERROR_TIME_PARSE, writing nothing, if line holds no
+// timestamp.
+ts_error_t ts_relative(ts_context_t *context, ts_span_t line, const ts_time_t *now, ts_buffer_t *out);
+
+// Describe an error code
+const char *ts_strerror(ts_error_t error);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LIBTS_H
@@ -29,11 +29,16 @@
 #include <regex.h>
 #include <time.h>
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
 
 // Define TS_TESTING to make functions available for testing
-// Include the ts.c source directly for coverage testing
+#define TS_TESTING
+
+// Include the libts.c and ts.c sources directly for coverage testing
 // We need to define main as something else to avoid conflicts
 #define main ts_main
+#include "libts.c"
 #include "ts.c"
 #undef main
 
@@ -143,21 +148,21 @@ static test_result_t test_safe_snprintf() {
     return result;
 }
 
-// Test the get_high_res_time function
+// Test the tsi_get_high_res_time function
 static test_result_t test_get_high_res_time() {
     test_result_t result = {false, NULL};
     
     // Test realtime clock
-    high_res_time_t time1 = get_high_res_time(false);
+    high_res_time_t time1 = tsi_get_high_res_time(false);
     if (time1.seconds == 0 && time1.nanoseconds == 0) {
-        result.error_msg = "get_high_res_time failed to get realtime";
+        result.error_msg = "tsi_get_high_res_time failed to get realtime";
         return result;
     }
     
     // Test monotonic clock
-    high_res_time_t time2 = get_high_res_time(true);
+    high_res_time_t time2 = tsi_get_high_res_time(true);
     if (time2.seconds == 0 && time2.nanoseconds == 0) {
-        result.error_msg = "get_high_res_time failed to get monotonic time";
+        result.error_msg = "tsi_get_high_res_time failed to get monotonic time";
         return result;
     }
     
@@ -236,6 +241,145 @@ static test_result_t test_parse_unix_timestamp_fractional() {
     return result;
 }
 
+// Test the SWAR fixed-width digit parsers
+static test_result_t test_swar_digit_parsers() {
+    test_result_t result = {false, NULL};
+
+    unsigned long value;
+    time_t seconds;
+    long nanoseconds;
+
+    // Fixed-width fields of every supported width
+    if (parse_fixed_digits("2025", 4, &value) != TS_SUCCESS || value != 2025) {
+        result.error_msg = "parse_fixed_digits failed on 4-digit year";
+        return result;
+    }
+
+    if (parse_fixed_digits("09", 2, &value) != TS_SUCCESS || value != 9) {
+        result.error_msg = "parse_fixed_digits failed on 2-digit field";
+        return result;
+    }
+
+    if (parse_fixed_digits("12345678", 8, &value) != TS_SUCCESS || value != 12345678) {
+        result.error_msg = "parse_fixed_digits failed on 8-digit field";
+        return result;
+    }
+
+    // Every non-digit byte must be rejected in every position
+    for (int c = 0; c < 256; c++) {
+        if (c >= '0' && c <= '9') {
+            continue;
+        }
+        for (int pos = 0; pos < 4; pos++) {
+            char field[4] = {'1', '2', '3', '4'};
+            field[pos] = (char)c;
+            if (parse_fixed_digits(field, 4, &value) != TS_ERROR_TIME_PARSE) {
+                result.error_msg = "parse_fixed_digits accepted a non-digit byte";
+                return result;
+            }
+        }
+    }
+
+    if (parse_fixed_digits("123456789", 9, &value) != TS_ERROR_INVALID_ARGUMENT) {
+        result.error_msg = "parse_fixed_digits should reject fields wider than 8 digits";
+        return result;
+    }
+
+    // Epoch seconds across the 8-digit chunk boundaries
+    if (tsi_parse_epoch_digits("1755921813", 10, &seconds) != TS_SUCCESS || seconds != 1755921813) {
+        result.error_msg = "tsi_parse_epoch_digits failed on 10-digit epoch";
+        return result;
+    }
+
+    if (tsi_parse_epoch_digits("1234567890123456789", 19, &seconds) != TS_SUCCESS ||
+        seconds != 1234567890123456789LL) {
+        result.error_msg = "tsi_parse_epoch_digits failed on 19-digit value";
+        return result;
+    }
+
+    if (tsi_parse_epoch_digits("9999999999999999999", 19, &seconds) != TS_ERROR_TIME_PARSE) {
+        result.error_msg = "tsi_parse_epoch_digits should reject values beyond time_t";
+        return result;
+    }
+
+    if (tsi_parse_epoch_digits("17559218x3", 10, &seconds) != TS_ERROR_TIME_PARSE) {
+        result.error_msg = "tsi_parse_epoch_digits accepted a non-digit byte";
+        return result;
+    }
+
+    // Fractions are scaled to nanoseconds regardless of their width
+    if (tsi_parse_fraction_digits("5", 1, &nanoseconds) != TS_SUCCESS || nanoseconds != 500000000L) {
+        result.error_msg = "tsi_parse_fraction_digits failed on 1-digit fraction";
+        return result;
+    }
+
+    if (tsi_parse_fraction_digits("000123", 6, &nanoseconds) != TS_SUCCESS || nanoseconds != 123000L) {
+        result.error_msg = "tsi_parse_fraction_digits failed on 6-digit fraction";
+        return result;
+    }
+
+    if (tsi_parse_fraction_digits("123456789", 9, &nanoseconds) != TS_SUCCESS ||
+        nanoseconds != 123456789L) {
+        result.error_msg = "tsi_parse_fraction_digits failed on 9-digit fraction";
+        return result;
+    }
+
+    if (tsi_parse_fraction_digits("12345678x", 9, &nanoseconds) != TS_ERROR_TIME_PARSE) {
+        result.error_msg = "tsi_parse_fraction_digits accepted a non-digit ninth byte";
+        return result;
+    }
+
+    result.passed = true;
+    return result;
+}
+
+// Test the ISO-8601 fast path parser
+static test_result_t test_parse_iso8601_datetime() {
+    test_result_t result = {false, NULL};
+
+    struct tm tm_info = {0};
+    const char *iso = "2025-09-05T10:11:12.500000-0500";
+    ts_error_t ret = parse_iso8601_datetime(iso, strlen(iso), &tm_info);
+    if (ret != TS_SUCCESS) {
+        result.error_msg = "parse_iso8601_datetime failed on valid timestamp";
+        return result;
+    }
+
+    if (tm_info.tm_year != 125 || tm_info.tm_mon != 8 || tm_info.tm_mday != 5 ||
+        tm_info.tm_hour != 10 || tm_info.tm_min != 11 || tm_info.tm_sec != 12) {
+        result.error_msg = "parse_iso8601_datetime parsed wrong fields";
+        return result;
+    }
+
+    // Must agree with strptime on the fields it fills in
+    struct tm expected = {0};
+    strptime("2025-09-05T10:11:12", "%Y-%m-%dT%H:%M:%S", &expected);
+    if (mktime(&expected) != mktime(&tm_info)) {
+        result.error_msg = "parse_iso8601_datetime disagrees with strptime";
+        return result;
+    }
+
+    const char *bad_month = "2025-13-05T10:11:12";
+    if (parse_iso8601_datetime(bad_month, strlen(bad_month), &tm_info) != TS_ERROR_TIME_PARSE) {
+        result.error_msg = "parse_iso8601_datetime accepted month 13";
+        return result;
+    }
+
+    const char *bad_separator = "2025-09-05 10:11:12";
+    if (parse_iso8601_datetime(bad_separator, strlen(bad_separator), &tm_info) != TS_ERROR_TIME_PARSE) {
+        result.error_msg = "parse_iso8601_datetime accepted a space separator";
+        return result;
+    }
+
+    if (parse_iso8601_datetime("2025-09-05", 10, &tm_info) != TS_ERROR_TIME_PARSE) {
+        result.error_msg = "parse_iso8601_datetime accepted a date without time";
+        return result;
+    }
+
+    result.passed = true;
+    return result;
+}
+
 // Test the find_timestamp_match function
 static test_result_t test_find_timestamp_match() {
     test_result_t result = {false, NULL};
@@ -335,43 +479,163 @@ static test_result_t test_replace_timestamp_in_line() {
     return result;
 }
 
-// Test the format_relative_time function
+// Test the injectable clock sources
+static test_result_t test_clock_sources() {
+    test_result_t result = {false, NULL};
+    clock_source_t clock;
+
+    // Every kernel clock configure found can be selected and read
+    for (int i = 0; system_clocks[i].name != NULL; i++) {
+        if (tsi_clock_source_open(&clock, system_clocks[i].name) != TS_SUCCESS) {
+            continue;  // Known to the headers, not to this kernel
+        }
+        high_res_time_t now = tsi_clock_source_read(&clock);
+        if (clock.kind != CLOCK_SOURCE_SYSTEM || (now.seconds == 0 && now.nanoseconds == 0)) {
+            result.error_msg = "system clock source did not read its clock";
+            return result;
+        }
+    }
+
+    // Fixed start with a synthetic step, carrying into the next second
+    if (tsi_clock_source_open(&clock, "fixed:1755921813.75+0.5") != TS_SUCCESS) {
+        result.error_msg = "tsi_clock_source_open rejected a fixed clock";
+        return result;
+    }
+    high_res_time_t start = clock_source_start(&clock);
+    high_res_time_t first = tsi_clock_source_read(&clock);
+    high_res_time_t second = tsi_clock_source_read(&clock);
+    if (start.seconds != 1755921813 || start.nanoseconds != 750000000 ||
+        first.seconds != start.seconds || first.nanoseconds != start.nanoseconds ||
+        second.seconds != 1755921814 || second.nanoseconds != 250000000) {
+        result.error_msg = "fixed clock did not step from its start";
+        return result;
+    }
+    tsi_clock_source_close(&clock);
+
+    // Replay: one time per line, extra columns ignored, last time repeats
+    char path[] = "/tmp/ts_clock_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        result.error_msg = "Could not create sidecar file";
+        return result;
+    }
+    const char *sidecar = "100.5 first line\n101\n";
+    write(fd, sidecar, strlen(sidecar));
+    close(fd);
+
+    char spec[64];
+    snprintf(spec, sizeof(spec), "replay:%s", path);
+    ts_error_t ret = tsi_clock_source_open(&clock, spec);
+    unlink(path);
+    if (ret != TS_SUCCESS) {
+        result.error_msg = "tsi_clock_source_open rejected a replay clock";
+        return result;
+    }
+    start = clock_source_start(&clock);
+    first = tsi_clock_source_read(&clock);
+    second = tsi_clock_source_read(&clock);
+    high_res_time_t third = tsi_clock_source_read(&clock);
+    tsi_clock_source_close(&clock);
+    if (start.seconds != 100 || start.nanoseconds != 500000000 ||
+        first.seconds != 100 || first.nanoseconds != 500000000 ||
+        second.seconds != 101 || second.nanoseconds != 0 ||
+        third.seconds != 101 || third.nanoseconds != 0) {
+        result.error_msg = "replay clock did not follow its sidecar";
+        return result;
+    }
+
+    // TSC: invariant only with both flags; when usable it tracks the wall
+    // clock closely and never runs backwards.  Each reading is bracketed
+    // by wall-clock reads, so a preempted test thread only widens the
+    // bracket instead of showing up as drift.
+    if (!tsc_flags_are_invariant(": fpu tsc constant_tsc rep_good nonstop_tsc cpuid\n") ||
+        tsc_flags_are_invariant(": fpu tsc constant_tsc rep_good\n") ||
+        tsc_flags_are_invariant(": fpu tsc nonstop_tsc_x constant_tsc\n")) {
+        result.error_msg = "tsc_flags_are_invariant misread the cpuinfo flags";
+        return result;
+    }
+    if (tsi_clock_source_open(&clock, "tsc") != TS_SUCCESS) {
+        result.error_msg = "tsi_clock_source_open did not fall back from tsc";
+        return result;
+    }
+    high_res_time_t previous = tsi_clock_source_read(&clock);
+    for (int i = 0; i < 200; i++) {
+        struct timespec pause = {0, 1000000};
+        nanosleep(&pause, NULL);
+        high_res_time_t before = tsi_get_high_res_time(false);
+        high_res_time_t tsc_time = tsi_clock_source_read(&clock);
+        high_res_time_t after = tsi_get_high_res_time(false);
+        long long early = (long long)(before.seconds - tsc_time.seconds) * NANOSECONDS_PER_SECOND +
+                          (before.nanoseconds - tsc_time.nanoseconds);
+        long long late = (long long)(tsc_time.seconds - after.seconds) * NANOSECONDS_PER_SECOND +
+                         (tsc_time.nanoseconds - after.nanoseconds);
+        if (early > 1000000 || late > 1000000 ||
+            tsc_time.seconds < previous.seconds ||
+            (tsc_time.seconds == previous.seconds && tsc_time.nanoseconds < previous.nanoseconds)) {
+            result.error_msg = "tsc clock drifted from CLOCK_REALTIME or ran backwards";
+            return result;
+        }
+        previous = tsc_time;
+    }
+
+    if (tsi_clock_source_open(&clock, "fixed:soon") != TS_ERROR_INVALID_ARGUMENT ||
+        tsi_clock_source_open(&clock, "sundial") != TS_ERROR_INVALID_ARGUMENT ||
+        tsi_clock_source_open(&clock, "replay:/nonexistent/sidecar") != TS_ERROR_SYSTEM) {
+        result.error_msg = "tsi_clock_source_open accepted an invalid source";
+        return result;
+    }
+
+    result.passed = true;
+    return result;
+}
+
+// Test the tsi_format_relative_time function
 static test_result_t test_format_relative_time() {
     test_result_t result = {false, NULL};
     
     char buffer[100];
-    time_t now = time(NULL);
+    high_res_time_t frozen_now = {1755921813, 250000000};
+    reference_time_t reference;
+    tsi_reference_time_set(&reference, &frozen_now);
+    time_t now = frozen_now.seconds;
     time_t past_time = now - 3600; // 1 hour ago
     time_t future_time = now + 3600; // 1 hour from now
     
     // Test past time
-    ts_error_t ret = format_relative_time(buffer, sizeof(buffer), past_time, 0);
+    ts_error_t ret = tsi_format_relative_time(buffer, sizeof(buffer), past_time, 0, &reference);
     if (ret != TS_SUCCESS) {
-        result.error_msg = "format_relative_time failed on past time";
+        result.error_msg = "tsi_format_relative_time failed on past time";
         return result;
     }
     
-    if (!matches_pattern(buffer, ".*ago$")) {
-        result.error_msg = "format_relative_time should have produced 'ago' format";
+    if (!matches_pattern(buffer, "^1h ago$")) {
+        result.error_msg = "tsi_format_relative_time should have produced 'ago' format";
         return result;
     }
     
     // Test future time
-    ret = format_relative_time(buffer, sizeof(buffer), future_time, 0);
+    ret = tsi_format_relative_time(buffer, sizeof(buffer), future_time, 0, &reference);
     if (ret != TS_SUCCESS) {
-        result.error_msg = "format_relative_time failed on future time";
+        result.error_msg = "tsi_format_relative_time failed on future time";
         return result;
     }
     
-    if (!matches_pattern(buffer, "^in .*$")) {
-        result.error_msg = "format_relative_time should have produced 'in' format";
+    if (!matches_pattern(buffer, "^in 1h$")) {
+        result.error_msg = "tsi_format_relative_time should have produced 'in' format";
+        return result;
+    }
+
+    // Fractions are measured against the reference's own subseconds
+    ret = tsi_format_relative_time(buffer, sizeof(buffer), now - 75, 125000, &reference);
+    if (ret != TS_SUCCESS || strcmp(buffer, "1m15.125s ago") != 0) {
+        result.error_msg = "tsi_format_relative_time did not use the reference subseconds";
         return result;
     }
     
     // Test NULL buffer
-    ret = format_relative_time(NULL, 100, now, 0);
+    ret = tsi_format_relative_time(NULL, 100, now, 0, &reference);
     if (ret != TS_ERROR_INVALID_ARGUMENT) {
-        result.error_msg = "format_relative_time should have detected NULL buffer";
+        result.error_msg = "tsi_format_relative_time should have detected NULL buffer";
         return result;
     }
     
@@ -413,40 +677,702 @@ static test_result_t test_format_timestamp_with_subsecond() {
     return result;
 }
 
-// Test the process_line function
-static test_result_t test_process_line() {
+// Test the digit-pair formatter against printf over the whole nanosecond range
+static test_result_t test_format_padded_decimal() {
     test_result_t result = {false, NULL};
-    
-    high_res_time_t current_time = {1755921813, 0};
-    
-    // Test normal processing
-    ts_error_t ret = process_line("test line\n", "%Y-%m-%d %H:%M:%S", &current_time);
-    if (ret != TS_SUCCESS) {
-        result.error_msg = "process_line failed on normal line";
+
+    char expected[32];
+    char actual[32];
+    size_t len;
+
+    // Reference odometer for "%09ld", cross-checked against snprintf as it
+    // advances, so every value in [0, 1e9) is compared byte for byte
+    char odometer[10] = "000000000";
+    for (long ns = 0; ns < NANOSECONDS_PER_SECOND; ns++) {
+        if (ns % 9973 == 0 || ns < 100000) {
+            snprintf(expected, sizeof(expected), "%09ld", ns);
+            if (memcmp(expected, odometer, 10) != 0) {
+                result.error_msg = "reference odometer diverged from snprintf";
+                return result;
+            }
+        }
+
+        len = format_padded_decimal(actual, ns, 9);
+        if (len != 9 || memcmp(actual, odometer, 9) != 0) {
+            result.error_msg = "format_padded_decimal differs from %09ld";
+            return result;
+        }
+
+        // %06ld of the microseconds is the first six nanosecond digits
+        if (ns % 1000 == 0) {
+            len = format_padded_decimal(actual, ns / 1000, 6);
+            if (len != 6 || memcmp(actual, odometer, 6) != 0) {
+                result.error_msg = "format_padded_decimal differs from %06ld";
+                return result;
+            }
+        }
+
+        for (int i = 8; i >= 0 && ++odometer[i] > '9'; i--) {
+            odometer[i] = '0';
+        }
+    }
+
+    // Signs, widths and extremes follow printf exactly
+    const long samples[] = {0, 1, 9, 10, 99, 100, 59, 60, -1, -9, -10, -59, -100,
+                            1755921813L, -1755921813L, 999999999L, 1000000000L,
+                            LONG_MAX, LONG_MIN};
+    const int widths[] = {0, 1, 2, 6, 9, 12};
+    for (size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); i++) {
+        for (size_t j = 0; j < sizeof(widths) / sizeof(widths[0]); j++) {
+            snprintf(expected, sizeof(expected), "%0*ld", widths[j], samples[i]);
+            len = format_padded_decimal(actual, samples[i], widths[j]);
+            actual[len] = '\0';
+            if (strcmp(expected, actual) != 0) {
+                result.error_msg = "format_padded_decimal differs from printf on sign or width";
+                return result;
+            }
+        }
+    }
+
+    // Composite fields match the snprintf formats they replace
+    char buffer[MAX_FORMAT_LENGTH];
+    high_res_time_t timestamp = {1755921813, 7000};
+    format_timestamp_with_subsecond(buffer, sizeof(buffer), "%.s|%N|%s", &timestamp);
+    if (strcmp(buffer, "1755921813.000007|000007000|1755921813") != 0) {
+        result.error_msg = "format_timestamp_with_subsecond rendered wrong numeric fields";
         return result;
     }
-    
-    // Test NULL arguments
-    ret = process_line(NULL, "%Y", &current_time);
-    if (ret != TS_ERROR_INVALID_ARGUMENT) {
-        result.error_msg = "process_line should have detected NULL line";
+
+    compiled_format_t elapsed_format;
+    tsi_compile_output_format(&elapsed_format, "%.T");
+    format_elapsed_time(buffer, sizeof(buffer), &elapsed_format, 3723, 4500);
+    if (strcmp(buffer, "01:02:03.000004") != 0) {
+        result.error_msg = "format_elapsed_time rendered wrong %.T";
         return result;
     }
-    
+
+    tsi_compile_output_format(&elapsed_format, "%.S");
+    format_elapsed_time(buffer, sizeof(buffer), &elapsed_format, -1, 999999000);
+    snprintf(expected, sizeof(expected), "%02ld.%06ld", -1L, 999999L);
+    if (strcmp(buffer, expected) != 0) {
+        result.error_msg = "format_elapsed_time rendered a negative interval differently";
+        return result;
+    }
+
+    tsi_compile_output_format(&elapsed_format, "%.s");
+    if (format_elapsed_time(buffer, 8, &elapsed_format, 1755921813, 0) != TS_ERROR_BUFFER_OVERFLOW) {
+        result.error_msg = "format_elapsed_time should have detected buffer overflow";
+        return result;
+    }
+
     result.passed = true;
     return result;
 }
 
+// Compare the dedicated renderers with localtime/gmtime + strftime
+static bool fast_format_matches_strftime(const char *format, time_t t, long nanoseconds,
+                                         const char **error_msg) {
+    compiled_format_t compiled;
+    tsi_compile_output_format(&compiled, format);
+
+    char actual[MAX_FORMAT_LENGTH];
+    char expected[MAX_FORMAT_LENGTH];
+    high_res_time_t timestamp = {t, nanoseconds};
+    if (tsi_format_timestamp_compiled(actual, sizeof(actual), &compiled, &timestamp) != TS_SUCCESS ||
+        format_timestamp_with_subsecond(expected, sizeof(expected), format, &timestamp) != TS_SUCCESS) {
+        *error_msg = "tsi_format_timestamp_compiled failed";
+        return false;
+    }
+    if (strcmp(actual, expected) != 0) {
+        *error_msg = "tsi_format_timestamp_compiled differs from strftime";
+        return false;
+    }
+
+    return true;
+}
+
+// Test the pre-rendered fast formats and the cached UTC offset
+static test_result_t test_fast_formats() {
+    test_result_t result = {false, NULL};
+
+    const char *formats[] = {"%Y-%m-%dT%H:%M:%S", "%b %d %H:%M:%S", "%H:%M:%S", "%T", "%.T"};
+    // UTC, a northern zone with hourly DST, and a half-hour DST shift
+    const char *zones[] = {"UTC0", "EST5EDT,M3.2.0,M11.1.0", "LHST-10:30LHDT-11,M10.1.0,M4.1.0"};
+    char *saved_tz = getenv("TZ") ? strdup(getenv("TZ")) : NULL;
+    const char *error_msg = NULL;
+
+    compiled_format_t compiled;
+    tsi_compile_output_format(&compiled, "%b %d %H:%M:%S");
+    if (compiled.fast != FAST_FORMAT_SYSLOG) {
+        result.error_msg = "tsi_compile_output_format did not recognize the default format";
+        goto done;
+    }
+    tsi_compile_output_format(&compiled, "%Y-%m-%d %H:%M:%S");
+    if (compiled.fast != FAST_FORMAT_NONE) {
+        result.error_msg = "tsi_compile_output_format claimed an unrecognized format";
+        goto done;
+    }
+
+    for (size_t z = 0; z < sizeof(zones) / sizeof(zones[0]); z++) {
+        setenv("TZ", zones[z], 1);
+        tzset();
+
+        for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+            // Wide sweep: before 1970, leap days, centuries and far future
+            uint64_t state = 0x9E3779B97F4A7C15ULL;
+            for (int i = 0; i < 20000; i++) {
+                state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+                time_t t = (time_t)((int64_t)(state >> 20) % 8000000000LL) - 2000000000LL;
+                if (!fast_format_matches_strftime(formats[f], t, (long)(state % 1000000000ULL),
+                                                  &error_msg)) {
+                    result.error_msg = (char *)error_msg;
+                    goto done;
+                }
+            }
+
+            // Every minute across the 2025 spring-forward and fall-back windows,
+            // reusing one compiled format so the offset cache is exercised
+            compiled_format_t run_format;
+            tsi_compile_output_format(&run_format, formats[f]);
+            const time_t windows[] = {1741402800, 1762056000, 1759500000, 1743782400};
+            for (size_t w = 0; w < sizeof(windows) / sizeof(windows[0]); w++) {
+                for (time_t t = windows[w]; t < windows[w] + 2 * SECONDS_PER_DAY; t += 60) {
+                    char actual[MAX_FORMAT_LENGTH];
+                    char expected[MAX_FORMAT_LENGTH];
+                    high_res_time_t timestamp = {t, 0};
+                    tsi_format_timestamp_compiled(actual, sizeof(actual), &run_format, &timestamp);
+                    format_timestamp_with_subsecond(expected, sizeof(expected), formats[f], &timestamp);
+                    if (strcmp(actual, expected) != 0) {
+                        result.error_msg = "cached UTC offset went stale across a DST transition";
+                        goto done;
+                    }
+                }
+            }
+        }
+    }
+
+    result.passed = true;
+
+done:
+    if (saved_tz) {
+        setenv("TZ", saved_tz, 1);
+        free(saved_tz);
+    } else {
+        unsetenv("TZ");
+    }
+    tzset();
+    return result;
+}
+
+// Compare the time zone engine with localtime_r and mktime
+static test_result_t test_tz_engine() {
+    test_result_t result = {false, NULL};
+
+    // Zone files with hourly, half-hour and 45-minute offsets, southern
+    // and negative-time DST rules past 2037, plus a POSIX rule string and
+    // a leap-second zone, both answered by libc
+    const char *zones[] = {"UTC", "America/New_York", "Australia/Lord_Howe", "Asia/Kolkata",
+                           "Pacific/Chatham", "Europe/London", "America/Santiago",
+                           "America/Nuuk", "right/UTC", "EST5EDT,M3.2.0,M11.1.0"};
+    char *saved_tz = getenv("TZ") ? strdup(getenv("TZ")) : NULL;
+
+    tz_zone_t zone;
+    if (tz_load(&zone, "No/Such_Zone") == TS_SUCCESS || tz_load(&zone, "../etc/passwd") == TS_SUCCESS) {
+        result.error_msg = "tz_load accepted a missing zone";
+        goto done;
+    }
+
+    tz_rule_t rule;
+    if (tz_rule_parse(&rule, "<+1245>-12:45<+1345>,M9.5.0/2:45,M4.1.0/3:45") != TS_SUCCESS ||
+        rule.std.utc_offset != 45900 || rule.dst.utc_offset != 49500 ||
+        strcmp(rule.dst.abbreviation, "+1345") != 0 || rule.end.time != 13500 ||
+        tz_rule_parse(&rule, "EST5EDT") == TS_SUCCESS ||
+        tz_rule_parse(&rule, "EST5EDT,M13.1.0,M11.1.0") == TS_SUCCESS) {
+        result.error_msg = "tz_rule_parse misread a POSIX TZ rule";
+        goto done;
+    }
+
+    for (size_t z = 0; z < sizeof(zones) / sizeof(zones[0]); z++) {
+        char path[MAX_FORMAT_LENGTH];
+        snprintf(path, sizeof(path), "/usr/share/zoneinfo/%s", zones[z]);
+        if (strchr(zones[z], ',') == NULL && access(path, R_OK) != 0) {
+            continue;
+        }
+        setenv("TZ", zones[z], 1);
+        tz_refresh_local_zone();
+
+        utc_offset_cache_t cache = {1, 0, 0, false, ""};
+        uint64_t state = 0x2545F4914F6CDD1DULL;
+        for (int i = 0; i < 50000; i++) {
+            state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+            // 1900 to 2200, then every half hour around the 2025 transitions
+            time_t t = i < 40000 ? (time_t)((int64_t)(state >> 20) % 9500000000LL) - 2200000000LL
+                                 : 1741400000 + (time_t)(i - 40000) * 1800;
+
+            struct tm actual, expected;
+            if (tsi_local_time_at(&cache, t, &actual) != TS_SUCCESS || !localtime_r(&t, &expected)) {
+                result.error_msg = "tsi_local_time_at failed";
+                goto done;
+            }
+            char actual_str[MAX_FORMAT_LENGTH], expected_str[MAX_FORMAT_LENGTH];
+            strftime(actual_str, sizeof(actual_str), "%F %T %a %j %Z %z", &actual);
+            strftime(expected_str, sizeof(expected_str), "%F %T %a %j %Z %z", &expected);
+            if (strcmp(actual_str, expected_str) != 0 || actual.tm_isdst != expected.tm_isdst) {
+                result.error_msg = "tsi_local_time_at differs from localtime_r";
+                goto done;
+            }
+
+            // Wall-clock fields map back to the earliest instant showing them
+            time_t round_trip;
+            if (local_time_to_epoch(&cache, &expected, &round_trip) != TS_SUCCESS ||
+                round_trip > t || (round_trip < t && round_trip + 3 * SECONDS_PER_HOUR < t)) {
+                result.error_msg = "local_time_to_epoch did not invert tsi_local_time_at";
+                goto done;
+            }
+            struct tm check;
+            localtime_r(&round_trip, &check);
+            if (check.tm_hour != expected.tm_hour || check.tm_min != expected.tm_min ||
+                check.tm_sec != expected.tm_sec || check.tm_mday != expected.tm_mday) {
+                result.error_msg = "local_time_to_epoch landed on other wall-clock fields";
+                goto done;
+            }
+        }
+    }
+
+    result.passed = true;
+
+done:
+    if (saved_tz) {
+        setenv("TZ", saved_tz, 1);
+        free(saved_tz);
+    } else {
+        unsetenv("TZ");
+    }
+    tz_refresh_local_zone();
+    return result;
+}
+
+// Test JSON Lines escaping and record layout
+static test_result_t test_json_records() {
+    test_result_t result = {false, NULL};
+
+    // Every byte value at every offset of a 24-byte string, against a
+    // byte-at-a-time reference escaper; a lone byte from 0x80 up is never
+    // well-formed UTF-8
+    for (int byte = 0; byte < 256; byte++) {
+        for (size_t pos = 0; pos < 24; pos++) {
+            char input[24];
+            memset(input, 'a', sizeof(input));
+            input[pos] = (char)byte;
+
+            char expected[256];
+            size_t expected_len = 0;
+            for (size_t i = 0; i < sizeof(input); i++) {
+                unsigned char c = (unsigned char)input[i];
+                const char *named = c == '"' ? "\\\"" : c == '\\' ? "\\\\" : c == '\n' ? "\\n" :
+                                    c == '\t' ? "\\t" : c == '\r' ? "\\r" : c == '\b' ? "\\b" :
+                                    c == '\f' ? "\\f" : NULL;
+                if (named) {
+                    expected_len += (size_t)sprintf(expected + expected_len, "%s", named);
+                } else if (c < 0x20) {
+                    expected_len += (size_t)sprintf(expected + expected_len, "\\u%04x", c);
+                } else if (c >= 0x80) {
+                    expected_len += (size_t)sprintf(expected + expected_len, "\\ufffd");
+                } else {
+                    expected[expected_len++] = (char)c;
+                }
+            }
+            expected[expected_len] = '\0';
+
+            char actual[256];
+            field_buffer_t out = {actual, sizeof(actual), 0};
+            if (json_append_escaped(&out, input, sizeof(input)) != TS_SUCCESS ||
+                out.len != expected_len || memcmp(actual, expected, expected_len + 1) != 0) {
+                result.error_msg = "json_append_escaped differs from the reference escaper";
+                return result;
+            }
+        }
+    }
+
+    // Well-formed UTF-8 passes through, also across eight-byte words;
+    // truncated, overlong, surrogate and out-of-range sequences do not
+    const struct {
+        const char *input;
+        const char *expected;
+    } utf8_cases[] = {
+        {"caf\xc3\xa9 \xe2\x82\xac" "1234\xf0\x9f\x98\x80", "caf\xc3\xa9 \xe2\x82\xac" "1234\xf0\x9f\x98\x80"},
+        {"1234567\xc3\xa9", "1234567\xc3\xa9"},
+        {"ab\xe2\x82", "ab\\ufffd\\ufffd"},
+        {"\xc0\xaf", "\\ufffd\\ufffd"},
+        {"\xed\xa0\x80x", "\\ufffd\\ufffd\\ufffdx"},
+        {"\xf4\x90\x80\x80", "\\ufffd\\ufffd\\ufffd\\ufffd"},
+        {"\xc3\xa9\xff\"", "\xc3\xa9\\ufffd\\\""},
+    };
+    for (size_t i = 0; i < sizeof(utf8_cases) / sizeof(utf8_cases[0]); i++) {
+        char actual[256];
+        field_buffer_t out = {actual, sizeof(actual), 0};
+        if (json_append_escaped(&out, utf8_cases[i].input, strlen(utf8_cases[i].input)) != TS_SUCCESS ||
+            strcmp(actual, utf8_cases[i].expected) != 0) {
+            result.error_msg = "json_append_escaped mishandled UTF-8";
+            return result;
+        }
+    }
+
+    char small[8];
+    field_buffer_t tight = {small, sizeof(small), 0};
+    if (json_append_escaped(&tight, "\x01\x02", 2) != TS_ERROR_BUFFER_OVERFLOW) {
+        result.error_msg = "json_append_escaped should have detected buffer overflow";
+        return result;
+    }
+
+    // Optional members appear only when set; the trailing newline is dropped
+    char json[512];
+    field_buffer_t out = {json, sizeof(json), 0};
+    line_record_t record = {.time = {1755921813, 5}, .stamp = "Aug 23 04:03:33",
+                            .line = "say \"hi\"\n"};
+    if (format_json_record(&out, &record) != TS_SUCCESS ||
+        strcmp(json, "{\"sec\":1755921813,\"nsec\":5,\"stamp\":\"Aug 23 04:03:33\","
+                     "\"line\":\"say \\\"hi\\\"\"}\n") != 0) {
+        result.error_msg = "format_json_record rendered a stamped line wrong";
+        return result;
+    }
+
+    out.len = 0;
+    record = (line_record_t){.time = {100, 0}, .has_delta = true, .delta = {-1, 999999000},
+                             .has_source = true, .source = {90, 500}, .line = "x"};
+    if (format_json_record(&out, &record) != TS_SUCCESS ||
+        strcmp(json, "{\"sec\":100,\"nsec\":0,\"delta_sec\":-1,\"delta_nsec\":999999000,"
+                     "\"source_sec\":90,\"source_nsec\":500,\"line\":\"x\"}\n") != 0) {
+        result.error_msg = "format_json_record rendered the optional members wrong";
+        return result;
+    }
+
+    result.passed = true;
+    return result;
+}
+
+// Test binary record encoding and decoding
+static test_result_t test_binary_records() {
+    test_result_t result = {false, NULL};
+
+    // Round trip, including times before the epoch and a line without a newline
+    static const struct {
+        high_res_time_t time;
+        const char *line;
+    } cases[] = {
+        {{1755921813, 123456789}, "plain line\n"},
+        {{-1, 999999999}, "before the epoch\n"},
+        {{0, 0}, "\n"},
+        {{42, 1}, "no newline"},
+        {{7, 0}, "embedded\tcontrol\x01 bytes\n"}
+    };
+    char data[1024];
+    field_buffer_t out = {data, sizeof(data), 0};
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        line_record_t record = {.time = cases[i].time, .stamp = "ignored", .line = cases[i].line};
+        if (format_binary_record(&out, &record) != TS_SUCCESS) {
+            result.error_msg = "format_binary_record failed";
+            return result;
+        }
+    }
+    if (out.len != 5 * 16 + strlen("plain line") + strlen("before the epoch") + strlen("no newline") +
+                   strlen("embedded\tcontrol\x01 bytes")) {
+        result.error_msg = "format_binary_record wrote the wrong number of bytes";
+        return result;
+    }
+
+    const unsigned char *p = (const unsigned char *)data;
+    size_t left = out.len;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        char line[64];
+        high_res_time_t time;
+        size_t consumed;
+        if (parse_binary_record(p, left, line, sizeof(line), &time, &consumed) != TS_SUCCESS ||
+            consumed == 0 || strcmp(line, cases[i].line) != 0 ||
+            time.seconds != cases[i].time.seconds || time.nanoseconds != cases[i].time.nanoseconds) {
+            result.error_msg = "parse_binary_record did not round-trip a record";
+            return result;
+        }
+        // Every strict prefix of a record asks for more input
+        for (size_t prefix = 0; prefix < consumed; prefix++) {
+            size_t partial;
+            if (parse_binary_record(p, prefix, line, sizeof(line), &time, &partial) != TS_SUCCESS ||
+                partial != 0) {
+                result.error_msg = "parse_binary_record accepted a partial record";
+                return result;
+            }
+        }
+        p += consumed;
+        left -= consumed;
+    }
+
+    // Unknown flags and lines too long for the buffer are rejected
+    char line[8];
+    high_res_time_t time;
+    size_t consumed;
+    unsigned char header[16] = {0};
+    header[8] = 3;
+    header[12] = 0x2;
+    if (parse_binary_record(header, sizeof(header), line, sizeof(line), &time, &consumed) != TS_ERROR_INVALID_ARGUMENT) {
+        result.error_msg = "parse_binary_record accepted unknown flags";
+        return result;
+    }
+    header[8] = 7;
+    header[12] = 0x1;
+    if (parse_binary_record(header, sizeof(header), line, sizeof(line), &time, &consumed) != TS_ERROR_INVALID_ARGUMENT) {
+        result.error_msg = "parse_binary_record accepted a line longer than its buffer";
+        return result;
+    }
+
+    // The encoder reports lack of room and times outside the int64 range
+    char small[20];
+    field_buffer_t tight = {small, sizeof(small), 0};
+    line_record_t record = {.time = {1, 0}, .line = "too long\n"};
+    if (format_binary_record(&tight, &record) != TS_ERROR_BUFFER_OVERFLOW) {
+        result.error_msg = "format_binary_record overflowed its buffer";
+        return result;
+    }
+    if (sizeof(time_t) >= 8) {
+        record.time.seconds = (time_t)(INT64_MAX / 1000000000);
+        if (format_binary_record(&out, &record) != TS_ERROR_INVALID_ARGUMENT) {
+            result.error_msg = "format_binary_record accepted a time past 2262";
+            return result;
+        }
+    }
+
+    result.passed = true;
+    return result;
+}
+
+// Test the output index range lookup
+static test_result_t test_index_range() {
+    test_result_t result = {false, NULL};
+
+    // Entries as --index writes them: one per second, and two in second 12
+    const index_entry_t entries[] = {
+        {10000000000, 0}, {11000000000, 100}, {12000000000, 200}, {12500000000, 300}, {13000000000, 400}
+    };
+    const size_t count = sizeof(entries) / sizeof(entries[0]);
+    static const struct {
+        int64_t from;
+        int64_t to;
+        uint64_t start;
+        uint64_t end;
+    } cases[] = {
+        {11000000000, 12000000000, 0, 200},         // Whole block behind an exact boundary
+        {11500000000, 12600000000, 100, 400},       // Edges inside blocks
+        {12500000000, 12500000001, 200, 400},
+        {1000000000, 5000000000, 0, 0},             // Before everything
+        {14000000000, INT64_MAX, 400, UINT64_MAX},  // Open end
+        {INT64_MIN, INT64_MAX, 0, UINT64_MAX}
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        uint64_t start;
+        uint64_t end;
+        index_find_range(entries, count, cases[i].from, cases[i].to, &start, &end);
+        if (start != cases[i].start || end != cases[i].end) {
+            result.error_msg = "index_find_range returned the wrong byte range";
+            return result;
+        }
+    }
+
+    uint64_t start;
+    uint64_t end;
+    index_find_range(entries, 0, 0, 1, &start, &end);
+    if (start != 0 || end != UINT64_MAX) {
+        result.error_msg = "index_find_range should cover everything without entries";
+        return result;
+    }
+
+    result.passed = true;
+    return result;
+}
+
+// Test the --histogram buckets and percentiles
+static test_result_t test_histogram() {
+    test_result_t result = {false, NULL};
+
+    // Buckets cover the int64 range without gaps or overlaps
+    int64_t next = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        int64_t width;
+        int64_t low = histogram_bucket_low(i, &width);
+        if (low != next || histogram_index(low) != i || histogram_index(low + (width - 1)) != i ||
+            (low >= 2 * HISTOGRAM_SUB_BUCKETS && width > low / HISTOGRAM_SUB_BUCKETS)) {
+            result.error_msg = "Histogram buckets do not tile the value range";
+            return result;
+        }
+        next = low + (width - 1) + 1;
+    }
+    if (histogram_index(INT64_MAX) != HISTOGRAM_BUCKETS - 1 || histogram_index(-5) != 0) {
+        result.error_msg = "Histogram values out of range land in the wrong bucket";
+        return result;
+    }
+
+    histogram_t *histogram = calloc(1, sizeof(*histogram));
+    if (!histogram) {
+        result.error_msg = "Out of memory";
+        return result;
+    }
+    for (int64_t value = 1; value <= 100000; value++) {
+        histogram_record(histogram, value * 1000);
+    }
+    static const double fractions[] = {0.5, 0.9, 0.99};
+    for (size_t i = 0; i < sizeof(fractions) / sizeof(fractions[0]); i++) {
+        double exact = fractions[i] * 100000000.0;
+        double reported = (double)histogram_percentile(histogram, fractions[i]);
+        if (reported < exact || reported > exact * (1.0 + 1.0 / HISTOGRAM_SUB_BUCKETS)) {
+            free(histogram);
+            result.error_msg = "Histogram percentile off by more than a bucket";
+            return result;
+        }
+    }
+    if (histogram->total != 100000 || histogram_percentile(histogram, 1.0) != 100000000) {
+        free(histogram);
+        result.error_msg = "Histogram lost the count or the maximum";
+        return result;
+    }
+
+    // Small values are exact, and a constant is reported as itself
+    memset(histogram, 0, sizeof(*histogram));
+    histogram_record(histogram, 7);
+    histogram_record(histogram, 7);
+    if (histogram_percentile(histogram, 0.5) != 7) {
+        free(histogram);
+        result.error_msg = "Histogram small values are not exact";
+        return result;
+    }
+    memset(histogram, 0, sizeof(*histogram));
+    histogram_record(histogram, 1500000000);
+    if (histogram_percentile(histogram, 0.99) != 1500000000) {
+        free(histogram);
+        result.error_msg = "Histogram percentile exceeds the maximum";
+        return result;
+    }
+    free(histogram);
+
+    result.passed = true;
+    return result;
+}
+
+// Test binary search of a time-sorted log against a linear scan
+static test_result_t test_find_time_offset() {
+    test_result_t result = {false, NULL};
+
+    // 4000 lines 2.5ms apart, some followed by an untimed continuation
+    // line, with repeated times and a long untimed stretch in between
+    size_t size = 0;
+    size_t capacity = 512 * 1024;
+    char *data = malloc(capacity);
+    size_t *starts = malloc(4000 * sizeof(*starts));
+    long *times_us = malloc(4000 * sizeof(*times_us));
+    if (!data || !starts || !times_us) {
+        free(data);
+        free(starts);
+        free(times_us);
+        result.error_msg = "Out of memory";
+        return result;
+    }
+    for (int i = 0; i < 4000; i++) {
+        long time_us = (i / 2) * 5000L;
+        starts[i] = size;
+        times_us[i] = time_us;
+        size += (size_t)snprintf(data + size, capacity - size, "%ld.%06ld line %d\n",
+                                 1755921800L + time_us / 1000000, time_us % 1000000, i);
+        if (i % 7 == 3) {
+            size += (size_t)snprintf(data + size, capacity - size, "    continuation of %d\n", i);
+        }
+        if (i == 2500) {
+            for (int j = 0; j < 600; j++) {
+                size += (size_t)snprintf(data + size, capacity - size, "    untimed detail %d\n", j);
+            }
+        }
+    }
+
+    reference_time_t reference;
+    high_res_time_t now = {1755921900, 0};
+    tsi_reference_time_set(&reference, &now);
+    for (long target_us = -5000; target_us <= 10005000; target_us += 12500 + target_us % 7) {
+        high_res_time_t target = {1755921800L + target_us / 1000000, (target_us % 1000000) * 1000};
+        if (target.nanoseconds < 0) {
+            target.seconds--;
+            target.nanoseconds += 1000000000L;
+        }
+        size_t expected = size;
+        for (int i = 0; i < 4000; i++) {
+            if (times_us[i] >= target_us) {
+                expected = starts[i];
+                break;
+            }
+        }
+        if (find_time_offset(data, size, &target, &reference) != expected) {
+            result.error_msg = "find_time_offset disagrees with a linear scan";
+            break;
+        }
+    }
+    high_res_time_t target = {1755921800, 0};
+    if (!result.error_msg && find_time_offset("no timestamps\nhere\n", 19, &target, &reference) != 19) {
+        result.error_msg = "find_time_offset found a time in untimed input";
+    }
+
+    free(data);
+    free(starts);
+    free(times_us);
+    result.passed = result.error_msg == NULL;
+    return result;
+}
+
+// Test the text layouts of write_record, the path every mode writes through
+static test_result_t test_write_record() {
+    test_result_t result = {false, NULL};
+
+    char *text = NULL;
+    size_t text_size = 0;
+    FILE *stream = open_memstream(&text, &text_size);
+    if (!stream) {
+        result.error_msg = "open_memstream failed";
+        return result;
+    }
+
+    size_t written = 0;
+    line_record_t record = {.time = {1755921813, 0}, .stamp = "Aug 23 04:03:33", .line = "test line\n"};
+    written += write_record(stream, OUTPUT_FORMAT_TEXT, &record, NULL);
+    record.input = "app.log";
+    written += write_record(stream, OUTPUT_FORMAT_TEXT, &record, NULL);
+    record.stamp = NULL;
+    written += write_record(stream, OUTPUT_FORMAT_TEXT, &record, NULL);
+    record.input = NULL;
+    written += write_record(stream, OUTPUT_FORMAT_TEXT, &record, NULL);
+    written += write_record(stream, OUTPUT_FORMAT_TEXT, &record, "as assembled\n");
+    fclose(stream);
+
+    const char *expected = "Aug 23 04:03:33 test line\n"
+                           "Aug 23 04:03:33 app.log: test line\n"
+                           "app.log: test line\n"
+                           "test line\n"
+                           "as assembled\n";
+    if (!text || strcmp(text, expected) != 0 || written != strlen(expected)) {
+        result.error_msg = "write_record wrote the wrong text or byte count";
+    }
+    free(text);
+
+    result.passed = result.error_msg == NULL;
+    return result;
+}
+
 // Test the parse_timestamp_in_line_with_fractional function
 static test_result_t test_parse_timestamp_in_line_with_fractional() {
     test_result_t result = {false, NULL};
     
     time_t parsed_time;
     long fractional_seconds;
+    high_res_time_t now = tsi_get_high_res_time(false);
+    reference_time_t reference;
+    tsi_reference_time_set(&reference, &now);
     
     // Test Unix timestamp
     ts_error_t ret = parse_timestamp_in_line_with_fractional("1755921813 test", 
-                                                           &parsed_time, &fractional_seconds);
+                                                           &parsed_time, &fractional_seconds, &reference);
     if (ret != TS_SUCCESS) {
         result.error_msg = "parse_timestamp_in_line_with_fractional failed on Unix timestamp";
         return result;
@@ -459,30 +1385,65 @@ static test_result_t test_parse_timestamp_in_line_with_fractional() {
     
     // Test Unix fractional timestamp
     ret = parse_timestamp_in_line_with_fractional("1755921813.123456 test", 
-                                                 &parsed_time, &fractional_seconds);
+                                                 &parsed_time, &fractional_seconds, &reference);
     if (ret != TS_SUCCESS) {
         result.error_msg = "parse_timestamp_in_line_with_fractional failed on Unix fractional timestamp";
         return result;
     }
+
+    if (fractional_seconds != 123456) {
+        result.error_msg = "parse_timestamp_in_line_with_fractional parsed wrong fraction";
+        return result;
+    }
+
+    // Leading zeros in the fraction are significant
+    ret = parse_timestamp_in_line_with_fractional("1755921813.000123 test",
+                                                 &parsed_time, &fractional_seconds, &reference);
+    if (ret != TS_SUCCESS || fractional_seconds != 123) {
+        result.error_msg = "parse_timestamp_in_line_with_fractional mis-scaled a zero-padded fraction";
+        return result;
+    }
     
     // Test ISO-8601 timestamp
     ret = parse_timestamp_in_line_with_fractional("2025-12-22T22:25:23 test", 
-                                                 &parsed_time, &fractional_seconds);
+                                                 &parsed_time, &fractional_seconds, &reference);
     if (ret != TS_SUCCESS) {
         result.error_msg = "parse_timestamp_in_line_with_fractional failed on ISO-8601 timestamp";
         return result;
     }
     
+    // Test ISO-8601 with fraction and offset
+    ret = parse_timestamp_in_line_with_fractional("2025-09-05T10:10:10.124456-0500 test",
+                                                 &parsed_time, &fractional_seconds, &reference);
+    if (ret != TS_SUCCESS || parsed_time != 1757085010 || fractional_seconds != 124456) {
+        result.error_msg = "parse_timestamp_in_line_with_fractional mishandled ISO-8601 offset";
+        return result;
+    }
+
+    // Timestamps without a year land in the reference's year, or the one
+    // before when that would put them more than a month ahead
+    high_res_time_t january = {1736935200, 0};  // 2025-01-15
+    reference_time_t january_reference;
+    tsi_reference_time_set(&january_reference, &january);
+    struct tm expected_tm = {.tm_year = 124, .tm_mon = 11, .tm_mday = 22,
+                             .tm_hour = 22, .tm_min = 25, .tm_sec = 23, .tm_isdst = -1};
+    ret = parse_timestamp_in_line_with_fractional("Dec 22 22:25:23 test", &parsed_time,
+                                                 &fractional_seconds, &january_reference);
+    if (ret != TS_SUCCESS || parsed_time != mktime(&expected_tm)) {
+        result.error_msg = "parse_timestamp_in_line_with_fractional inferred the wrong year";
+        return result;
+    }
+
     // Test line without timestamp
     ret = parse_timestamp_in_line_with_fractional("no timestamp here", 
-                                                 &parsed_time, &fractional_seconds);
+                                                 &parsed_time, &fractional_seconds, &reference);
     if (ret != TS_ERROR_TIME_PARSE) {
         result.error_msg = "parse_timestamp_in_line_with_fractional should have failed on line without timestamp";
         return result;
     }
     
     // Test NULL arguments
-    ret = parse_timestamp_in_line_with_fractional(NULL, &parsed_time, &fractional_seconds);
+    ret = parse_timestamp_in_line_with_fractional(NULL, &parsed_time, &fractional_seconds, &reference);
     if (ret != TS_ERROR_INVALID_ARGUMENT) {
         result.error_msg = "parse_timestamp_in_line_with_fractional should have detected NULL line";
         return result;
@@ -492,6 +1453,179 @@ static test_result_t test_parse_timestamp_in_line_with_fractional() {
     return result;
 }
 
+// Test the libts interface: stamping into caller buffers, overflow,
+// parsing and relative rewriting
+static test_result_t test_library_interface() {
+    test_result_t result = {false, NULL};
+
+    ts_context_t *context;
+    if (ts_context_new(&context, "%Y-%m-%d %H:%M:%.S", "fixed:1700000000.25+1") != TS_SUCCESS) {
+        result.error_msg = "ts_context_new failed";
+        return result;
+    }
+
+    char buffer[128];
+    ts_buffer_t out = {buffer, sizeof(buffer), 0};
+    ts_span_t line = {"hello world", 5};    // Not NUL-terminated at len
+    struct tm expected_tm;
+    time_t expected_seconds = 1700000000;
+    char expected[128];
+    localtime_r(&expected_seconds, &expected_tm);
+    strftime(expected, sizeof(expected), "%Y-%m-%d %H:%M:%S.250000 hello", &expected_tm);
+    if (ts_stamp(context, line, &out) != TS_SUCCESS || strcmp(buffer, expected) != 0 ||
+        out.len != strlen(expected)) {
+        result.error_msg = "ts_stamp wrote the wrong line";
+        ts_context_free(context);
+        return result;
+    }
+
+    // The fixed clock steps once per stamp
+    ts_time_t now;
+    if (ts_now(context, &now) != TS_SUCCESS || now.seconds != 1700000001 || now.nanoseconds != 250000000) {
+        result.error_msg = "ts_now did not advance the fixed clock";
+        ts_context_free(context);
+        return result;
+    }
+
+    char small[8];
+    ts_buffer_t small_out = {small, sizeof(small), 0};
+    if (ts_stamp_at(context, &now, line, &small_out) != TS_ERROR_BUFFER_OVERFLOW || small_out.len != 0) {
+        result.error_msg = "ts_stamp_at should have reported overflow";
+        ts_context_free(context);
+        return result;
+    }
+    small[0] = 'x';
+    if (ts_format(context, &now, &small_out) != TS_ERROR_BUFFER_OVERFLOW || small_out.len != 0 ||
+        small[0] != '\0') {
+        result.error_msg = "ts_format should have left an empty string on overflow";
+        ts_context_free(context);
+        return result;
+    }
+
+    size_t start, end;
+    ts_span_t logged = {"at 1755921813.5 done", 20};
+    ts_time_t parsed;
+    if (ts_parse(context, logged, &parsed, &start, &end) != TS_SUCCESS || parsed.seconds != 1755921813 ||
+        parsed.nanoseconds != 500000000 || start != 3 || end != 15) {
+        result.error_msg = "ts_parse found the wrong timestamp";
+        ts_context_free(context);
+        return result;
+    }
+
+    ts_time_t later = {1755921813 + 330, 500000000};
+    if (ts_relative(context, logged, &later, &out) != TS_SUCCESS || strcmp(buffer, "at 5m30.000s ago done") != 0) {
+        result.error_msg = "ts_relative rewrote the line wrongly";
+        ts_context_free(context);
+        return result;
+    }
+
+    ts_span_t plain = {"nothing here", 12};
+    if (ts_parse(context, plain, &parsed, NULL, NULL) != TS_ERROR_TIME_PARSE ||
+        ts_relative(context, plain, NULL, &out) != TS_ERROR_TIME_PARSE || out.len != 0) {
+        result.error_msg = "ts_parse and ts_relative should fail without a timestamp";
+        ts_context_free(context);
+        return result;
+    }
+    ts_context_free(context);
+
+    if (ts_context_new(&context, NULL, "no-such-clock") != TS_ERROR_INVALID_ARGUMENT) {
+        result.error_msg = "ts_context_new accepted an unknown clock";
+        return result;
+    }
+
+    result.passed = true;
+    return result;
+}
+
+// Workers formatting and parsing at once, each through its own context.
+// Run under ThreadSanitizer by `make check-tsan`.
+#define PARALLEL_WORKERS 4
+#define PARALLEL_LINES 500
+
+typedef struct {
+    const char *format;
+    char (*expected)[MAX_FORMAT_LENGTH];
+    bool failed;
+} parallel_worker_t;
+
+// Stamp PARALLEL_LINES lines half an hour apart across the 2025 spring
+// DST change and parse each stamp back
+static bool parallel_run(const char *format, char (*lines)[MAX_FORMAT_LENGTH]) {
+    ts_context_t *context;
+    if (ts_context_new(&context, format, "fixed:1741400000+1800") != TS_SUCCESS) {
+        return false;
+    }
+    bool ok = true;
+    for (int i = 0; i < PARALLEL_LINES && ok; i++) {
+        char stamped[MAX_FORMAT_LENGTH];
+        ts_buffer_t out = {stamped, sizeof(stamped), 0};
+        ts_time_t parsed;
+        ok = ts_stamp(context, (ts_span_t){"x", 1}, &out) == TS_SUCCESS &&
+             ts_parse(context, (ts_span_t){stamped, out.len}, &parsed, NULL, NULL) == TS_SUCCESS &&
+             parsed.seconds == 1741400000 + (int64_t)i * 1800 &&
+             safe_snprintf(lines[i], MAX_FORMAT_LENGTH, "%s", stamped) == TS_SUCCESS;
+    }
+    ts_context_free(context);
+    return ok;
+}
+
+static void *parallel_worker(void *arg) {
+    parallel_worker_t *worker = arg;
+    char (*lines)[MAX_FORMAT_LENGTH] = calloc(PARALLEL_LINES, sizeof(*lines));
+    worker->failed = !lines || !parallel_run(worker->format, lines) ||
+                     memcmp(lines, worker->expected, PARALLEL_LINES * sizeof(*lines)) != 0;
+    free(lines);
+    return NULL;
+}
+
+static test_result_t test_parallel_contexts() {
+    test_result_t result = {false, NULL};
+
+    // The fast ISO-8601 renderer and the generic strftime path with %Z
+    const char *formats[] = {"%Y-%m-%dT%H:%M:%S", "%Y-%m-%dT%H:%M:%S %Z"};
+    char *saved_tz = getenv("TZ") ? strdup(getenv("TZ")) : NULL;
+    setenv("TZ", "America/New_York", 1);
+    tz_refresh_local_zone();
+
+    char (*expected)[PARALLEL_LINES][MAX_FORMAT_LENGTH] = calloc(2, sizeof(*expected));
+    if (!expected || !parallel_run(formats[0], expected[0]) || !parallel_run(formats[1], expected[1])) {
+        result.error_msg = "stamping and parsing back failed on one thread";
+        goto done;
+    }
+
+    pthread_t threads[PARALLEL_WORKERS];
+    parallel_worker_t workers[PARALLEL_WORKERS];
+    int started = 0;
+    for (; started < PARALLEL_WORKERS; started++) {
+        workers[started] = (parallel_worker_t){formats[started % 2], expected[started % 2], false};
+        if (pthread_create(&threads[started], NULL, parallel_worker, &workers[started]) != 0) {
+            break;
+        }
+    }
+    bool failed = started < PARALLEL_WORKERS;
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        failed = failed || workers[i].failed;
+    }
+    if (failed) {
+        result.error_msg = "parallel workers disagreed with the single-threaded run";
+        goto done;
+    }
+
+    result.passed = true;
+
+done:
+    free(expected);
+    if (saved_tz) {
+        setenv("TZ", saved_tz, 1);
+        free(saved_tz);
+    } else {
+        unsetenv("TZ");
+    }
+    tz_refresh_local_zone();
+    return result;
+}
+
 // Main test runner
 int main() {
     printf("Running ts coverage tests...\n");
@@ -522,14 +1656,14 @@ int main() {
         if (result.error_msg) free(result.error_msg);
     }
     
-    // Test get_high_res_time
+    // Test tsi_get_high_res_time
     total++;
     result = test_get_high_res_time();
     if (result.passed) {
-        printf("PASS: get_high_res_time\n");
+        printf("PASS: tsi_get_high_res_time\n");
         passed++;
     } else {
-        printf("FAIL: get_high_res_time - %s\n", result.error_msg);
+        printf("FAIL: tsi_get_high_res_time - %s\n", result.error_msg);
         if (result.error_msg) free(result.error_msg);
     }
     
@@ -555,6 +1689,26 @@ int main() {
         if (result.error_msg) free(result.error_msg);
     }
     
+    // Test SWAR digit parsers
+    total++;
+    result = test_swar_digit_parsers();
+    if (result.passed) {
+        printf("PASS: swar_digit_parsers\n");
+        passed++;
+    } else {
+        printf("FAIL: swar_digit_parsers - %s\n", result.error_msg);
+    }
+    
+    // Test parse_iso8601_datetime
+    total++;
+    result = test_parse_iso8601_datetime();
+    if (result.passed) {
+        printf("PASS: parse_iso8601_datetime\n");
+        passed++;
+    } else {
+        printf("FAIL: parse_iso8601_datetime - %s\n", result.error_msg);
+    }
+    
     // Test find_timestamp_match
     total++;
     result = test_find_timestamp_match();
@@ -577,14 +1731,24 @@ int main() {
         if (result.error_msg) free(result.error_msg);
     }
     
-    // Test format_relative_time
+    // Test clock sources
+    total++;
+    result = test_clock_sources();
+    if (result.passed) {
+        printf("PASS: clock_sources\n");
+        passed++;
+    } else {
+        printf("FAIL: clock_sources - %s\n", result.error_msg);
+    }
+    
+    // Test tsi_format_relative_time
     total++;
     result = test_format_relative_time();
     if (result.passed) {
-        printf("PASS: format_relative_time\n");
+        printf("PASS: tsi_format_relative_time\n");
         passed++;
     } else {
-        printf("FAIL: format_relative_time - %s\n", result.error_msg);
+        printf("FAIL: tsi_format_relative_time - %s\n", result.error_msg);
         if (result.error_msg) free(result.error_msg);
     }
     
@@ -599,14 +1763,84 @@ int main() {
         if (result.error_msg) free(result.error_msg);
     }
     
-    // Test process_line
+    // Test format_padded_decimal
+    total++;
+    result = test_format_padded_decimal();
+    if (result.passed) {
+        printf("PASS: format_padded_decimal\n");
+        passed++;
+    } else {
+        printf("FAIL: format_padded_decimal - %s\n", result.error_msg);
+    }
+    
+    // Test fast output formats
+    total++;
+    result = test_fast_formats();
+    if (result.passed) {
+        printf("PASS: fast_formats\n");
+        passed++;
+    } else {
+        printf("FAIL: fast_formats - %s\n", result.error_msg);
+    }
+    
+    // Test the local time zone engine
+    total++;
+    result = test_tz_engine();
+    if (result.passed) {
+        printf("PASS: tz_engine\n");
+        passed++;
+    } else {
+        printf("FAIL: tz_engine - %s\n", result.error_msg);
+    }
+    
+    // Test JSON Lines output
+    total++;
+    result = test_json_records();
+    if (result.passed) {
+        printf("PASS: json_records\n");
+        passed++;
+    } else {
+        printf("FAIL: json_records - %s\n", result.error_msg);
+    }
+    
+    // Test binary record output
+    total++;
+    result = test_binary_records();
+    if (result.passed) {
+        printf("PASS: binary_records\n");
+        passed++;
+    } else {
+        printf("FAIL: binary_records - %s\n", result.error_msg);
+    }
+    
+    // Test the output index range lookup
+    total++;
+    result = test_index_range();
+    if (result.passed) {
+        printf("PASS: index_range\n");
+        passed++;
+    } else {
+        printf("FAIL: index_range - %s\n", result.error_msg);
+    }
+    
+    // Test unindexed range search
     total++;
-    result = test_process_line();
+    result = test_find_time_offset();
     if (result.passed) {
-        printf("PASS: process_line\n");
+        printf("PASS: find_time_offset\n");
         passed++;
     } else {
-        printf("FAIL: process_line - %s\n", result.error_msg);
+        printf("FAIL: find_time_offset - %s\n", result.error_msg);
+    }
+    
+    // Test write_record
+    total++;
+    result = test_write_record();
+    if (result.passed) {
+        printf("PASS: write_record\n");
+        passed++;
+    } else {
+        printf("FAIL: write_record - %s\n", result.error_msg);
         if (result.error_msg) free(result.error_msg);
     }
     
@@ -620,6 +1854,36 @@ int main() {
         printf("FAIL: parse_timestamp_in_line_with_fractional - %s\n", result.error_msg);
         if (result.error_msg) free(result.error_msg);
     }
+
+    // Test the libts interface
+    total++;
+    result = test_library_interface();
+    if (result.passed) {
+        printf("PASS: library_interface\n");
+        passed++;
+    } else {
+        printf("FAIL: library_interface - %s\n", result.error_msg);
+    }
+
+    // Test the --histogram buckets and percentiles
+    total++;
+    result = test_histogram();
+    if (result.passed) {
+        printf("PASS: histogram\n");
+        passed++;
+    } else {
+        printf("FAIL: histogram - %s\n", result.error_msg);
+    }
+
+    // Test contexts used from several threads at once
+    total++;
+    result = test_parallel_contexts();
+    if (result.passed) {
+        printf("PASS: parallel_contexts\n");
+        passed++;
+    } else {
+        printf("FAIL: parallel_contexts - %s\n", result.error_msg);
+    }
     
     printf("\nResults: %d/%d tests passed\n", passed, total);
     
@@ -19,6 +19,8 @@
  * along with this program. If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include "config.h"
+
 /* Feature test macros to enable POSIX functions */
 #define _POSIX_C_SOURCE 200809L
 #define _GNU_SOURCE
@@ -77,36 +79,20 @@ static int count_output_lines(const char *output) {
     return count;
 }
 
-// Enhanced test runner with validation
-static test_result_t run_test_with_validation(const char *input,
-                                            const char *args, const char *expected_pattern,
-                                            int expected_lines) {
+// Run a shell command and check its output: expected_lines lines (unless
+// 0), one of them matching expected_pattern (unless NULL)
+static test_result_t run_command_with_validation(const char *cmd, const char *expected_pattern,
+                                                 int expected_lines) {
     test_result_t result = {false, NULL};
-    char cmd[512];
-    char input_file[] = "/tmp/ts_test_XXXXXX";
-
-    // Create temporary input file
-    int fd = mkstemp(input_file);
-    if (fd == -1) {
-        result.error_msg = "Could not create temp file";
-        return result;
-    }
-
-    write(fd, input, strlen(input));
-    close(fd);
-
-    // Build command
-    snprintf(cmd, sizeof(cmd), "./ts %s < %s", args ? args : "", input_file);
 
     // Run command and capture output
     FILE *pipe = popen(cmd, "r");
     if (!pipe) {
         result.error_msg = "Could not run command";
-        unlink(input_file);
         return result;
     }
 
-    char output[2048];
+    char output[8192];
     size_t total_read = 0;
     char buffer[256];
 
@@ -120,7 +106,6 @@ static test_result_t run_test_with_validation(const char *input,
 
     output[total_read] = '\0';
     pclose(pipe);
-    unlink(input_file);
 
     // Validate output
     if (strlen(output) == 0) {
@@ -140,24 +125,68 @@ static test_result_t run_test_with_validation(const char *input,
 
     // Check pattern if specified
     if (expected_pattern) {
+        size_t size = strlen(expected_pattern) + sizeof(output) + 64;
+        char *actual = strdup(output);
         if (!output_contains_pattern(output, expected_pattern)) {
-            result.error_msg = malloc(256);
-            snprintf(result.error_msg, 256, "Output does not match expected pattern: %s\nActual output: %s",
-                    expected_pattern, output);
+            result.error_msg = malloc(size);
+            snprintf(result.error_msg, size, "Output does not match expected pattern: %s\nActual output: %s",
+                    expected_pattern, actual ? actual : "");
+            free(actual);
             return result;
         }
+        free(actual);
     }
 
     result.passed = true;
     return result;
 }
 
+// Enhanced test runner with validation: ts with args, input on stdin
+static test_result_t run_test_with_validation(const char *input,
+                                            const char *args, const char *expected_pattern,
+                                            int expected_lines) {
+    test_result_t result = {false, NULL};
+    char cmd[512];
+    char input_file[] = "/tmp/ts_test_XXXXXX";
+
+    // Create temporary input file
+    int fd = mkstemp(input_file);
+    if (fd == -1) {
+        result.error_msg = "Could not create temp file";
+        return result;
+    }
+
+    write(fd, input, strlen(input));
+    close(fd);
+
+    // Build command
+    snprintf(cmd, sizeof(cmd), "./ts %s < %s", args ? args : "", input_file);
+    result = run_command_with_validation(cmd, expected_pattern, expected_lines);
+    unlink(input_file);
+    return result;
+}
+
+// Test runner for tests that need a pipeline or files around ts: script
+// runs under sh with stdin from /dev/null, and is checked as above
+static test_result_t run_shell_test(const char *script, const char *expected_pattern, int expected_lines) {
+    test_result_t result = {false, NULL};
+    size_t size = strlen(script) + 32;
+    char *cmd = malloc(size);
+    if (!cmd) {
+        result.error_msg = "Out of memory";
+        return result;
+    }
+    snprintf(cmd, size, "(%s) < /dev/null", script);
+    result = run_command_with_validation(cmd, expected_pattern, expected_lines);
+    free(cmd);
+    return result;
+}
 
 int main() {
     printf("Running comprehensive ts tests...\n");
 
     // Compile ts program
-    system("make clean && make");
+    system("make ts");
 
     if (access("./ts", X_OK) != 0) {
         printf("ERROR: ts executable not found\n");
@@ -420,6 +449,320 @@ int main() {
         if (result.error_msg) free(result.error_msg);
     }
 
+    // Test 22: ISO-8601 fractional with offset - should convert through UTC
+    total++;
+    result = run_test_with_validation("2025-09-05T10:10:10.124456-0500 verbose\n", "-r \"%s\"",
+                                    "^1757085010 verbose$", 1);
+    if (result.passed) {
+        printf("PASS: %s\n", "Relative mode ISO-8601 offset to epoch");
+        passed++;
+    } else {
+        printf("FAIL: %s - %s\n", "Relative mode ISO-8601 offset to epoch", result.error_msg);
+        if (result.error_msg) free(result.error_msg);
+    }
+
+    // Test 23: Since start with %.s - whole seconds render as at least one digit
+    total++;
+    result = run_test_with_validation("line1\nline2\n", "-s \"%.s\"",
+                                    "^[0-9]+\\.[0-9]{6} line[12]$", 2);
+    if (result.passed) {
+        printf("PASS: %s\n", "Since start subsecond epoch");
+        passed++;
+    } else {
+        printf("FAIL: %s - %s\n", "Since start subsecond epoch", result.error_msg);
+        if (result.error_msg) free(result.error_msg);
+    }
+
+    // Test 24: Local times inside DST keep their wall-clock hour
+    total++;
+    char *saved_tz = getenv("TZ") ? strdup(getenv("TZ")) : NULL;
+    setenv("TZ", "EST5EDT,M3.2.0,M11.1.0", 1);
+    result = run_test_with_validation("2025-07-01T12:00:00 summer\n", "-r \"%H:%M %Z\"",
+                                    "^12:00 EDT summer$", 1);
+    if (saved_tz) {
+        setenv("TZ", saved_tz, 1);
+        free(saved_tz);
+    } else {
+        unsetenv("TZ");
+    }
+    if (result.passed) {
+        printf("PASS: %s\n", "Relative mode local time in DST");
+        passed++;
+    } else {
+        printf("FAIL: %s - %s\n", "Relative mode local time in DST", result.error_msg);
+        if (result.error_msg) free(result.error_msg);
+    }
+
+    // Test 25: Frozen reference time makes relative output reproducible
+    total++;
+    result = run_test_with_validation("1755921813 one\n1755921813.123456 two\n",
+                                    "-r --now=1755921903.5",
+                                    "^(1m30s ago one|1m30.377s ago two)$", 2);
+    if (result.passed) {
+        printf("PASS: %s\n", "Relative mode with --now");
+        passed++;
+    } else {
+        printf("FAIL: %s - %s\n", "Relative mode with --now", result.error_msg);
+        if (result.error_msg) free(result.error_msg);
+    }
+
+    // Test 26: Synthetic clock makes stamped output reproducible
+    total++;
+    result = run_test_with_validation("a\nb\n", "--clock=fixed:1755921813+0.25 \"%.s\"",
+                                    "^(1755921813\\.000000 a|1755921813\\.250000 b)$", 2);
+    if (result.passed) {
+        printf("PASS: %s\n", "Fixed clock source");
+        passed++;
+    } else {
+        printf("FAIL: %s - %s\n", "Fixed clock source", result.error_msg);
+        if (result.error_msg) free(result.error_msg);
+    }
+
+    // Test 27: JSON Lines output with an interval and an escaped line
+    total++;
+    result = run_test_with_validation("say \"hi\"\n", "-s --clock=fixed:10+0.5 --output-format=json \"%.S\"",
+                                    "^\\{\"sec\":10,\"nsec\":0,\"stamp\":\"00\\.000000\",\"delta_sec\":0,"
+                                    "\"delta_nsec\":0,\"line\":\"say \\\\\"hi\\\\\"\"\\}$", 1);
+    if (result.passed) {
+        printf("PASS: %s\n", "JSON Lines output");
+        passed++;
+    } else {
+        printf("FAIL: %s - %s\n", "JSON Lines output", result.error_msg);
+        if (result.error_msg) free(result.error_msg);
+    }
+
+    // Test 28: Binary records decode back to text with a new format
+    total++;
+    result = run_shell_test("printf 'one\\ntwo\\n' | ./ts --clock=fixed:10+0.5 --output-format=binary"
+                            " | ./ts --decode -s \"%.S\"",
+                                    "^(00\\.000000 one|00\\.500000 two)$", 2);
+    if (result.passed) {
+        printf("PASS: %s\n", "Binary record round trip");
+        passed++;
+    } else {
+        printf("FAIL: %s - %s\n", "Binary record round trip", result.error_msg);
+        if (result.error_msg) free(result.error_msg);
+    }
+
+    // Test 29: An indexed file answers a time range query
+    total++;
+    result = run_shell_test("printf 'a\\nb\\nc\\nd\\ne\\nf\\ng\\n' |"
+                            " ./ts --clock=fixed:10+1 --index=ts_test_output.idx \"%.s\" > ts_test_output"
+                            " && ./ts --index=ts_test_output.idx --query=13,15 < ts_test_output;"
+                            " rm -f ts_test_output ts_test_output.idx",
+                                    "^(12\\.000000 c|13\\.000000 d|14\\.000000 e)$", 3);
+    if (result.passed) {
+        printf("PASS: %s\n", "Indexed time range query");
+        passed++;
+    } else {
+        printf("FAIL: %s - %s\n", "Indexed time range query", result.error_msg);
+        if (result.error_msg) free(result.error_msg);
+    }
+
+    // Test 30: A sorted log answers a range query without an index
+    total++;
+    result = run_test_with_validation("1755921810.5 a\n  detail\n1755921811.0 b\n1755921811.5 c\n1755921812.0 d\n",
+                                    "--query=1755921810.6,1755921812",
+                                    "^(1755921811\\.0 b|1755921811\\.5 c)$", 2);
+    if (result.passed) {
+        printf("PASS: %s\n", "Unindexed time range query");
+        passed++;
+    } else {
+        printf("FAIL: %s - %s\n", "Unindexed time range query", result.error_msg);
+        if (result.error_msg) free(result.error_msg);
+    }
+
+    // Test 31: Output files rotate on a new name and on size
+    total++;
+    result = run_shell_test("printf 'a\\nb\\nc\\n' | ./ts --clock=fixed:10+0.5 --output=ts_test_rotate_%S"
+                            " --rotate-size=1 \"%.s\" && grep -H . ts_test_rotate_*; rm -f ts_test_rotate_*",
+                                    "^(ts_test_rotate_10:10\\.000000 a|ts_test_rotate_10\\.1:10\\.500000 b"
+                                    "|ts_test_rotate_11:11\\.000000 c)$", 3);
+    if (result.passed) {
+        printf("PASS: %s\n", "Output file rotation");
+        passed++;
+    } else {
+        printf("FAIL: %s - %s\n", "Output file rotation", result.error_msg);
+        if (result.error_msg) free(result.error_msg);
+    }
+
+    // Test 32: Merging files orders lines by their timestamps, trailing
+    // lines without one staying with the line before
+    total++;
+    result = run_shell_test("printf '1755921813 a\\n  more a\\n1755921815 c\\n' > ts_test_merge_a;"
+                            " printf '1755921814 b\\n' > ts_test_merge_b;"
+                            " ./ts --merge ts_test_merge_a ts_test_merge_b | tr '\\n' '|'; echo;"
+                            " rm -f ts_test_merge_*",
+                                    "^ts_test_merge_a: 1755921813 a\\|ts_test_merge_a:   more a\\|"
+                                    "ts_test_merge_b: 1755921814 b\\|ts_test_merge_a: 1755921815 c\\|$", 1);
+    if (result.passed) {
+        printf("PASS: %s\n", "Merge by timestamp");
+        passed++;
+    } else {
+        printf("FAIL: %s - %s\n", "Merge by timestamp", result.error_msg);
+        if (result.error_msg) free(result.error_msg);
+    }
+
+#ifdef HAVE_ZLIB
+    // Test 33: Compressed output, in rotated files too, decompresses intact
+    total++;
+    result = run_shell_test("printf 'a\\nb\\nc\\n' | ./ts --clock=fixed:10+0.5 --compress=gzip \"%.s\""
+                            " | gzip -dc && printf 'd\\ne\\n' | ./ts --clock=fixed:20+0.5 --compress=gzip:1"
+                            " --output=ts_test_gzip_%S --rotate-size=1 \"%.s\""
+                            " && cat ts_test_gzip_20 ts_test_gzip_20.1 | gzip -dc;"
+                            " rm -f ts_test_gzip_*",
+                                    "^(10\\.000000 a|10\\.500000 b|11\\.000000 c|20\\.000000 d|20\\.500000 e)$", 5);
+    if (result.passed) {
+        printf("PASS: %s\n", "Compressed output");
+        passed++;
+    } else {
+        printf("FAIL: %s - %s\n", "Compressed output", result.error_msg);
+        if (result.error_msg) free(result.error_msg);
+    }
+
+    // Test 34: Relative mode reads gzip input, two members in a row, and
+    // warns about the garbage after them
+    total++;
+    result = run_shell_test("(echo 1755921813 one | gzip -c; echo 1755921813.123456 two | gzip -c;"
+                            " echo junk) | ./ts -r --now=1755921903.5 2>&1",
+                                    "^(1m30s ago one|1m30.377s ago two|Warning: Trailing garbage.*)$", 3);
+    if (result.passed) {
+        printf("PASS: %s\n", "Compressed input");
+        passed++;
+    } else {
+        printf("FAIL: %s - %s\n", "Compressed input", result.error_msg);
+        if (result.error_msg) free(result.error_msg);
+    }
+#endif
+
+    // Test 35: Follow stdin and a file appended to, until SIGTERM; the
+    // file's earlier contents are skipped and stdin's last line is ended
+    total++;
+    result = run_shell_test("echo old > ts_test_follow.log; printf 'in\\nlast' |"
+                            " ./ts --follow=- --follow=ts_test_follow.log --clock=fixed:100+1 %s"
+                            " > ts_test_follow.out & pid=$!;"
+                            " wait_for() { i=0; until grep -q \"$1\" ts_test_follow.out || [ $i -ge 200 ];"
+                            " do i=$((i + 1)); sleep 0.05; done; };"
+                            " wait_for '101 -: last'; echo new >> ts_test_follow.log; wait_for 'log: new';"
+                            " kill $pid; wait $pid; tr '\\n' '|' < ts_test_follow.out; echo;"
+                            " rm -f ts_test_follow.log ts_test_follow.out",
+                                    "^100 -: in\\|101 -: last\\|102 ts_test_follow.log: new\\|$", 1);
+    if (result.passed) {
+        printf("PASS: %s\n", "Follow several sources");
+        passed++;
+    } else {
+        printf("FAIL: %s - %s\n", "Follow several sources", result.error_msg);
+        if (result.error_msg) free(result.error_msg);
+    }
+
+    // Test 36: Reorder lines up to the window; a later straggler is flagged
+    total++;
+    result = run_shell_test("printf '1755921813 b\\n1755921812 a\\n  more a\\n"
+                            "1755921815 c\\n1755921820 d\\n1755921814 e\\n' |"
+                            " ./ts -r --reorder=2s --now=1755921900 --output-format=json 2> /dev/null"
+                            " | sed 's/.*\"late\":true.*/late/; s/.*\"line\":\"\\(.*\\)\"}/\\1/'"
+                            " | tr '\\n' '|'; echo",
+                                    "^1755921812 a\\|  more a\\|1755921813 b\\|1755921815 c\\|late\\|1755921820 d\\|$", 1);
+    if (result.passed) {
+        printf("PASS: %s\n", "Reorder window");
+        passed++;
+    } else {
+        printf("FAIL: %s - %s\n", "Reorder window", result.error_msg);
+        if (result.error_msg) free(result.error_msg);
+    }
+
+    // Test 37: Statistics count lines in and out and -r matches by format
+    total++;
+    result = run_shell_test("printf 'Aug 22 10:00:00 a\\nAug 22 10:00:00 a\\nplain\\n"
+                            "1755921813.5 b\\n' | ./ts -r -S --now=1755921900 2>&1 > /dev/null |"
+                            " grep -E '^ +(lines in|lines out|syslog|unix_fractional|none) ' |"
+                            " tr -s ' ' | tr '\\n' '|'; echo",
+                                    "^ lines in 4 \\(57 bytes\\)\\| lines out 4 \\([0-9]+ bytes\\)\\|"
+                                    " syslog 2\\| unix_fractional 1\\| none 1\\|$", 1);
+    if (result.passed) {
+        printf("PASS: %s\n", "Statistics report");
+        passed++;
+    } else {
+        printf("FAIL: %s - %s\n", "Statistics report", result.error_msg);
+        if (result.error_msg) free(result.error_msg);
+    }
+
+    // Test 38: Arrival histogram reports per interval and for the run
+    total++;
+    result = run_shell_test("seq 1 300 | ./ts --clock=fixed:100+0.01 --histogram=1s 2>&1 > /dev/null"
+                            " | tr '\\n' '|'; echo",
+                                    "^(ts: [12]\\.000s: 100 lines, 100\\.0 lines/s, gap p50 10\\.00ms p90 10\\.00ms"
+                                    " p99 10\\.00ms max 10\\.00ms\\|){2}ts: total 2\\.990s: 300 lines, 100\\.3 lines/s,"
+                                    " gap [^|]* max 10\\.00ms, since start p50 1\\.5[0-9]*s [^|]*\\|$", 1);
+    if (result.passed) {
+        printf("PASS: %s\n", "Arrival histogram");
+        passed++;
+    } else {
+        printf("FAIL: %s - %s\n", "Arrival histogram", result.error_msg);
+        if (result.error_msg) free(result.error_msg);
+    }
+
+    // Test 39: A merged input's last line without a newline is ended with one
+    total++;
+    result = run_shell_test("printf '1755921813 a\\n1755921815 a-last' > ts_test_merge_a;"
+                            " printf '1755921814 b\\n1755921816 b2\\n' > ts_test_merge_b;"
+                            " ./ts --merge ts_test_merge_a ts_test_merge_b | tr '\\n' '|'; echo;"
+                            " rm -f ts_test_merge_*",
+                            "^ts_test_merge_a: 1755921813 a\\|ts_test_merge_b: 1755921814 b\\|"
+                            "ts_test_merge_a: 1755921815 a-last\\|ts_test_merge_b: 1755921816 b2\\|$", 1);
+    if (result.passed) {
+        printf("PASS: %s\n", "Merge unterminated last line");
+        passed++;
+    } else {
+        printf("FAIL: %s - %s\n", "Merge unterminated last line", result.error_msg);
+        if (result.error_msg) free(result.error_msg);
+    }
+
+    // Test 40: Held lines go out once the input is idle for the window, and
+    // a late line is marked in text output too
+    total++;
+    result = run_shell_test("(echo 1755921813 a; sleep 1; cp ts_test_reorder.out ts_test_reorder.mid;"
+                            " echo 1755921812 b) | ./ts -r --reorder=0.2 --now=1755921900"
+                            " > ts_test_reorder.out 2> /dev/null;"
+                            " sed 's/^/idle: /' ts_test_reorder.mid; cat ts_test_reorder.out;"
+                            " rm -f ts_test_reorder.*",
+                                    "^(idle: 1m27s ago a|1m27s ago a|\\(late\\) 1m28s ago b)$", 3);
+    if (result.passed) {
+        printf("PASS: %s\n", "Reorder idle flush");
+        passed++;
+    } else {
+        printf("FAIL: %s - %s\n", "Reorder idle flush", result.error_msg);
+        if (result.error_msg) free(result.error_msg);
+    }
+
+    // Test 41: An interval report falls due while the input is stalled
+    total++;
+    result = run_shell_test("(echo a; sleep 1; cp ts_test_stall.err ts_test_stall.mid; echo b)"
+                            " | ./ts --histogram=0.4 > /dev/null 2> ts_test_stall.err;"
+                            " sed 's/^/stalled: /' ts_test_stall.mid; rm -f ts_test_stall.*",
+                            "^stalled: ts: 0\\.(400s: 1 line, .*|800s: 0 lines, 0\\.0 lines/s)$", 2);
+    if (result.passed) {
+        printf("PASS: %s\n", "Histogram report during stall");
+        passed++;
+    } else {
+        printf("FAIL: %s - %s\n", "Histogram report during stall", result.error_msg);
+        if (result.error_msg) free(result.error_msg);
+    }
+
+    // Test 42: Without --now, held lines are read against the current time,
+    // not the epoch, so a date without a year keeps this year
+    total++;
+    result = run_shell_test("(date -d '-2 hours -1 sec' '+%b %e %H:%M:%S a';"
+                            " date -d '-2 hours -2 sec' '+%b %e %H:%M:%S b') | ./ts -r --reorder=1s",
+                            "^(1h59m|2h) ago (a|b)$", 2);
+    if (result.passed) {
+        printf("PASS: %s\n", "Reorder against current time");
+        passed++;
+    } else {
+        printf("FAIL: %s - %s\n", "Reorder against current time", result.error_msg);
+        if (result.error_msg) free(result.error_msg);
+    }
+
     printf("\nResults: %d/%d tests passed\n", passed, total);
 
     if (passed == total) {
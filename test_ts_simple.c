@@ -33,9 +33,10 @@
 // Define TS_TESTING to make functions available for testing
 #define TS_TESTING
 
-// Include the ts.c source directly for coverage testing
+// Include the libts.c and ts.c sources directly for coverage testing
 // We need to define main as something else to avoid conflicts
 #define main ts_main
+#include "libts.c"
 #include "ts.c"
 #undef main
 
@@ -145,21 +146,21 @@ static test_result_t test_safe_snprintf() {
     return result;
 }
 
-// Test the get_high_res_time function
+// Test the tsi_get_high_res_time function
 static test_result_t test_get_high_res_time() {
     test_result_t result = {false, NULL};
     
     // Test realtime clock
-    high_res_time_t time1 = get_high_res_time(false);
+    high_res_time_t time1 = tsi_get_high_res_time(false);
     if (time1.seconds == 0 && time1.nanoseconds == 0) {
-        result.error_msg = "get_high_res_time failed to get realtime";
+        result.error_msg = "tsi_get_high_res_time failed to get realtime";
         return result;
     }
     
     // Test monotonic clock
-    high_res_time_t time2 = get_high_res_time(true);
+    high_res_time_t time2 = tsi_get_high_res_time(true);
     if (time2.seconds == 0 && time2.nanoseconds == 0) {
-        result.error_msg = "get_high_res_time failed to get monotonic time";
+        result.error_msg = "tsi_get_high_res_time failed to get monotonic time";
         return result;
     }
     
@@ -258,7 +259,7 @@ static test_result_t test_find_timestamp_match() {
     return result;
 }
 
-// Test the format_relative_time function
+// Test the tsi_format_relative_time function
 static test_result_t test_format_relative_time() {
     test_result_t result = {false, NULL};
     
@@ -268,33 +269,33 @@ static test_result_t test_format_relative_time() {
     time_t future_time = now + 3600; // 1 hour from now
     
     // Test past time
-    ts_error_t ret = format_relative_time(buffer, sizeof(buffer), past_time, 0);
+    ts_error_t ret = tsi_format_relative_time(buffer, sizeof(buffer), past_time, 0);
     if (ret != TS_SUCCESS) {
-        result.error_msg = "format_relative_time failed on past time";
+        result.error_msg = "tsi_format_relative_time failed on past time";
         return result;
     }
     
     if (!matches_pattern(buffer, ".*ago$")) {
-        result.error_msg = "format_relative_time should have produced 'ago' format";
+        result.error_msg = "tsi_format_relative_time should have produced 'ago' format";
         return result;
     }
     
     // Test future time
-    ret = format_relative_time(buffer, sizeof(buffer), future_time, 0);
+    ret = tsi_format_relative_time(buffer, sizeof(buffer), future_time, 0);
     if (ret != TS_SUCCESS) {
-        result.error_msg = "format_relative_time failed on future time";
+        result.error_msg = "tsi_format_relative_time failed on future time";
         return result;
     }
     
     if (!matches_pattern(buffer, "^in .*$")) {
-        result.error_msg = "format_relative_time should have produced 'in' format";
+        result.error_msg = "tsi_format_relative_time should have produced 'in' format";
         return result;
     }
     
     // Test NULL buffer
-    ret = format_relative_time(NULL, 100, now, 0);
+    ret = tsi_format_relative_time(NULL, 100, now, 0);
     if (ret != TS_ERROR_INVALID_ARGUMENT) {
-        result.error_msg = "format_relative_time should have detected NULL buffer";
+        result.error_msg = "tsi_format_relative_time should have detected NULL buffer";
         return result;
     }
     
@@ -332,14 +333,14 @@ int main() {
         if (result.error_msg) free(result.error_msg);
     }
     
-    // Test get_high_res_time
+    // Test tsi_get_high_res_time
     total++;
     result = test_get_high_res_time();
     if (result.passed) {
-        printf("PASS: get_high_res_time\n");
+        printf("PASS: tsi_get_high_res_time\n");
         passed++;
     } else {
-        printf("FAIL: get_high_res_time - %s\n", result.error_msg);
+        printf("FAIL: tsi_get_high_res_time - %s\n", result.error_msg);
         if (result.error_msg) free(result.error_msg);
     }
     
@@ -365,14 +366,14 @@ int main() {
         if (result.error_msg) free(result.error_msg);
     }
     
-    // Test format_relative_time
+    // Test tsi_format_relative_time
     total++;
     result = test_format_relative_time();
     if (result.passed) {
-        printf("PASS: format_relative_time\n");
+        printf("PASS: tsi_format_relative_time\n");
         passed++;
     } else {
-        printf("FAIL: format_relative_time - %s\n", result.error_msg);
+        printf("FAIL: tsi_format_relative_time - %s\n", result.error_msg);
         if (result.error_msg) free(result.error_msg);
     }
     
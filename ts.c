@@ -29,522 +29,491 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <regex.h>
 #include <errno.h>
 #include <assert.h>
 #include <stdarg.h>
 #include <stdbool.h>
-
-// Compile-time assertions for portability
-#ifdef HAVE_64BIT_TIME_T
-_Static_assert(sizeof(time_t) >= 8, "time_t must be at least 64 bits");
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
 #endif
-
-#ifdef HAVE_64BIT_LONG
-_Static_assert(sizeof(long) >= 8, "long must be at least 64 bits");
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "ts_internal.h"     // The libts engine
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_INOTIFY_H)
+#define HAVE_FOLLOW 1
+#include <sys/epoll.h>
+#include <sys/inotify.h>
 #endif
 
 // Configuration constants
-#define MAX_LINE_LENGTH 4096
-#define MAX_FORMAT_LENGTH 256
-#define MAX_TIMESTAMP_LENGTH 128
-#define MAX_TIME_STR_LENGTH 64
-#define SECONDS_PER_MINUTE 60
-#define SECONDS_PER_HOUR 3600
-#define SECONDS_PER_DAY 86400
-#define NANOSECONDS_PER_SECOND 1000000000L
-#define MICROSECONDS_PER_SECOND 1000000L
-#define FUTURE_THRESHOLD_DAYS 30
-
-// Error codes
+#define LINE_READER_BUFFER_SIZE 65536
+#define JSON_RECORD_MAX_LENGTH ((MAX_LINE_LENGTH + PATH_MAX) * 6 + 512)  // Line and input name, every byte as \u00XX
+#define BINARY_STREAM_MAGIC "TSREC01\n"   // First 8 bytes of a binary record stream
+#define BINARY_STREAM_MAGIC_LENGTH 8
+#define BINARY_RECORD_HEADER_SIZE 16    // int64 time in ns, uint32 length, uint32 flags
+#define BINARY_RECORD_NEWLINE 0x1u      // The line ended in a newline (not stored)
+#define INDEX_MAGIC "TSIDX01\n"          // First 8 bytes of an --index file
+#define INDEX_MAGIC_LENGTH 8
+#define INDEX_ENTRY_SIZE 16             // int64 time in ns, uint64 output offset
+#define INDEX_DEFAULT_LINES 4096        // Index entry at least this often
+#define INDEX_MAX_FILE_SIZE (256L * 1024 * 1024)
+#define RANGE_SCAN_BYTES 8192           // Unindexed --query: scan linearly below this span
+#define OUTPUT_PREALLOCATE_BYTES (16L * 1024 * 1024)   // fallocate() step for --output files
+#define OUTPUT_CLOSE_QUEUE 16           // Rotated-out files waiting for the closer thread
+#define COMPRESS_BLOCK_SIZE (256 * 1024)   // Output handed to the compressor thread at a time
+#define COMPRESS_BLOCKS 4                  // Blocks in flight before writers wait
+#define COMPRESS_OUT_SIZE 65536            // Compressed bytes written at a time
+#define DECOMPRESS_BLOCKS 8                // Decompressed blocks in flight
+#define DECOMPRESS_IN_SIZE 65536           // Compressed input read at a time
+#define GZIP_DEFAULT_LEVEL 6
+#define ZSTD_DEFAULT_LEVEL 3
+#define FOLLOW_EVENTS 64                   // epoll events handled per wakeup
+#define REORDER_MAX_BYTES (32L * 1024 * 1024)   // Lines --reorder holds back at most
+#define TEXT_LATE_MARK "(late) "                // Before a text line --reorder let out of order
+
+// How output lines are written
 typedef enum {
-    TS_SUCCESS = 0,
-    TS_ERROR_INVALID_ARGUMENT = -1,
-    TS_ERROR_BUFFER_OVERFLOW = -2,
-    TS_ERROR_REGEX_COMPILE = -3,
-    TS_ERROR_REGEX_EXEC = -4,
-    TS_ERROR_TIME_PARSE = -5,
-    TS_ERROR_SYSTEM = -6
-} ts_error_t;
-
-// High-resolution timestamp structure
-typedef struct {
-    time_t seconds;
-    long nanoseconds;
-} high_res_time_t;
+    OUTPUT_FORMAT_TEXT = 0,     // Timestamp, space, line (the classic ts output)
+    OUTPUT_FORMAT_JSON,         // One JSON object per line (JSON Lines)
+    OUTPUT_FORMAT_BINARY        // Fixed-header binary records, read back with --decode
+} output_format_t;
 
-// Timestamp format patterns for detection
+// One line of output as the modes produce it, before serialization
 typedef struct {
-    const char *pattern;
-    const char *format;
-    const char *name;
-} timestamp_format_t;
-
-// Common timestamp formats
-static const timestamp_format_t timestamp_formats[] = {
-    // syslog format: Dec 22 22:25:23
-    {"[A-Za-z]{3} [0-9]{1,2} [0-9]{2}:[0-9]{2}:[0-9]{2}", "%b %d %H:%M:%S", "syslog"},
-
-    // ISO-8601 with fractional seconds and timezone: 2025-09-05T10:10:10.124456-0500 (most specific, check first)
-    {"[0-9]{4}-[0-9]{2}-[0-9]{2}T[0-9]{2}:[0-9]{2}:[0-9]{2}\\.[0-9]{1,9}[+-][0-9]{4}", "%Y-%m-%dT%H:%M:%S.%f%z", "ISO-8601-fractional-tz"},
-
-    // ISO-8601 with fractional seconds (no timezone): 2025-09-05T10:10:10.500000 (second most specific)
-    {"[0-9]{4}-[0-9]{2}-[0-9]{2}T[0-9]{2}:[0-9]{2}:[0-9]{2}\\.[0-9]{1,9}", "%Y-%m-%dT%H:%M:%S.%f", "ISO-8601-fractional"},
-
-    // ISO-8601 with timezone: 2025-09-05T10:10:09-0500 (more specific, check third)
-    {"[0-9]{4}-[0-9]{2}-[0-9]{2}T[0-9]{2}:[0-9]{2}:[0-9]{2}[+-][0-9]{4}", "%Y-%m-%dT%H:%M:%S%z", "ISO-8601-tz"},
-
-    // ISO-8601: 2025-12-22T22:25:23.123Z
-    {"[0-9]{4}-[0-9]{2}-[0-9]{2}T[0-9]{2}:[0-9]{2}:[0-9]{2}", "%Y-%m-%dT%H:%M:%S", "ISO-8601"},
-
-    // RFC format: 16 Jun 94 07:29:35
-    {"[0-9]{1,2} [A-Za-z]{3} [0-9]{2} [0-9]{2}:[0-9]{2}:[0-9]{2}", "%d %b %y %H:%M:%S", "RFC"},
-
-    // lastlog format: Mon Dec 22 22:25
-    {"[A-Za-z]{3} [A-Za-z]{3} [0-9]{2} [0-9]{2}:[0-9]{2}", "%a %b %d %H:%M", "lastlog"},
-
-    // 21 dec 17:05 (with optional year)
-    {"[0-9]{2} [a-z]{3} [0-9]{2}:[0-9]{2}", "%d %b %H:%M", "short"},
-
-    // 22 dec/93 17:05:30 with year
-    {"[0-9]{2} [a-z]{3}/[0-9]{2} [0-9]{2}:[0-9]{2}:[0-9]{2}", "%d %b/%y %H:%M:%S", "short_with_year"},
-
-    // Unix timestamp with fractional seconds: 1755921813.123456
-    {"[0-9]{10,}\\.[0-9]{1,9}", NULL, "unix_fractional"},
-
-    // Plain Unix timestamp: 1755921813
-    {"[0-9]{10,}", NULL, "unix_plain"},
-
-    {NULL, NULL, NULL} // terminator
-};
-
-// Safe string concatenation with bounds checking
-#ifdef TS_TESTING
-ts_error_t safe_strcat(char *dest, size_t dest_size, const char *src) {
-#else
-static ts_error_t safe_strcat(char *dest, size_t dest_size, const char *src) {
-#endif
-    if (!dest || !src) {
-        return TS_ERROR_INVALID_ARGUMENT;
-    }
-
-    size_t dest_len = strnlen(dest, dest_size);
-    size_t src_len = strlen(src);
-
-    if (dest_len + src_len >= dest_size) {
-        return TS_ERROR_BUFFER_OVERFLOW;
-    }
-
-    memcpy(dest + dest_len, src, src_len + 1);
-    return TS_SUCCESS;
-}
+    high_res_time_t time;       // When the line was stamped (-r: the reference "now")
+    const char *stamp;          // Rendered timestamp, interval or -r replacement; NULL if none
+    bool has_delta;             // -i/-s: the interval in delta
+    high_res_time_t delta;
+    bool has_source;            // -r: the timestamp found in the line
+    high_res_time_t source;
+    const char *input;          // --merge: name of the input the line came from
+    bool late;                  // --reorder: came out after a later line
+    const char *line;           // Input line, newline included if it had one
+} line_record_t;
+
+// Sparse time to byte offset index written beside the output (--index).
+// An entry goes in before the first line of every new second and after
+// every_lines lines; entry times never decrease.
+typedef struct {
+    FILE *file;
+    unsigned long every_lines;
+    unsigned long lines_since_entry;
+    bool has_entry;
+    high_res_time_t last_time;      // Time of the last entry
+} output_index_t;
+
+// One index entry: the line written at offset has time time_ns
+typedef struct {
+    int64_t time_ns;
+    uint64_t offset;
+} index_entry_t;
 
-// Safe string formatting with bounds checking
-#ifdef TS_TESTING
-ts_error_t safe_snprintf(char *dest, size_t dest_size, const char *format, ...) {
-#else
-static ts_error_t safe_snprintf(char *dest, size_t dest_size, const char *format, ...) {
+// Compression methods of --compress and of compressed input
+typedef enum {
+    COMPRESSION_NONE = 0,
+    COMPRESSION_GZIP,
+    COMPRESSION_ZSTD
+} compression_t;
+
+// Decompression of gzip or zstd input on a separate thread, which fills
+// LINE_READER_BUFFER_SIZE blocks for the line reader to copy out, so
+// parsing overlaps with decompression.  Allocated by
+// input_decompressor_start(); if the reader stops before the end of input,
+// the thread frees it.
+typedef struct {
+    compression_t method;
+    int fd;                     // Compressed input
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    char blocks[DECOMPRESS_BLOCKS][LINE_READER_BUFFER_SIZE];
+    size_t lengths[DECOMPRESS_BLOCKS];
+    size_t head;                // Oldest filled block
+    size_t count;               // Filled blocks not yet fully read
+    size_t offset;              // Read position in the head block (reader only)
+    bool done;                  // The thread has finished (end of input or failure)
+    bool failed;                // Read error or corrupt or truncated input
+    bool abandoned;             // The reader stopped early; the thread frees this
+    char input[DECOMPRESS_IN_SIZE];   // Compressed bytes (thread only)
+    size_t input_len;           // Starts as the bytes read while detecting the method
+#ifdef HAVE_ZLIB
+    z_stream gzip;
 #endif
-    if (!dest || !format) {
-        return TS_ERROR_INVALID_ARGUMENT;
-    }
-
-    va_list args;
-    va_start(args, format);
-    int result = vsnprintf(dest, dest_size, format, args);
-    va_end(args);
-
-    if (result < 0 || (size_t)result >= dest_size) {
-        return TS_ERROR_BUFFER_OVERFLOW;
-    }
-
-    return TS_SUCCESS;
-}
-
-// Get high-resolution timestamp
-#ifdef TS_TESTING
-high_res_time_t get_high_res_time(bool monotonic_mode) {
-#else
-static high_res_time_t get_high_res_time(bool monotonic_mode) {
+#ifdef HAVE_ZSTD
+    ZSTD_DCtx *zstd;
 #endif
-    high_res_time_t result = {0};
-    struct timespec ts;
+} input_decompressor_t;
 
-#ifdef HAVE_CLOCK_MONOTONIC
-    clockid_t clock_id = monotonic_mode ? CLOCK_MONOTONIC : CLOCK_REALTIME;
-#else
-    clockid_t clock_id = CLOCK_REALTIME;
-    if (monotonic_mode) {
-        // Fallback to realtime if monotonic is not available
-        fprintf(stderr, "Warning: CLOCK_MONOTONIC not available, using CLOCK_REALTIME\n");
-    }
+// Buffered stdin reader that hands out lines the way fgets() does
+typedef struct {
+    int fd;
+    char buffer[LINE_READER_BUFFER_SIZE];
+    size_t start;
+    size_t end;
+    bool eof;
+    bool batch_pending;         // Buffered input not yet reported as a new batch
+    input_decompressor_t *decompressor;   // Read through this instead of fd
+    const struct run_stats *stats;   // -S: take SIGUSR1 while waiting for input
+} line_reader_t;
+
+// A line --reorder holds back, keyed by the timestamp in it
+typedef struct {
+    int64_t time_ns;            // Parsed from the line, or that of the line before
+    uint64_t sequence;          // Arrival order, for lines with the same time
+    bool has_source;            // The timestamp parsed from the line, kept for -r
+    high_res_time_t source;
+    char *line;
+    size_t line_size;           // Allocated for line
+} reorder_entry_t;
+
+// --reorder: a min-heap of lines by timestamp.  A line goes out once a
+// line window later has been read, or once the input has been idle for
+// window, so lines up to window out of order come out sorted; anything
+// later than that comes out as soon as it is read, marked late.  The held
+// lines never take more than REORDER_MAX_BYTES: past that, the earliest
+// goes out early.  Line buffers of lines gone out are kept in spare for
+// the next lines, so a steady stream allocates nothing.
+typedef struct {
+    int64_t window_ns;
+    reorder_entry_t *heap;
+    size_t count;
+    size_t capacity;
+    reorder_entry_t *spare;     // capacity entries; only line and line_size are used
+    size_t spare_count;
+    size_t bytes;               // Held lines and their heap entries
+    uint64_t sequence;
+    bool has_time;              // A timestamp has been read
+    int64_t last_ns;            // Time of the last line read
+    int64_t newest_ns;          // Latest time read
+    bool has_released;
+    int64_t released_ns;        // Latest time written out
+    bool eof;
+    bool idle;                  // No input for window since the last line
+    bool follow_clock;          // Without --now, each batch is read against the time it arrived
+    unsigned long late;         // Lines that came out late
+} reorder_buffer_t;
+
+// One input file of --merge and the line it has waiting to be merged
+typedef struct {
+    const char *name;
+    int fd;
+    line_reader_t reader;
+    char line[MAX_LINE_LENGTH];
+    high_res_time_t time;       // Parsed from the line, or that of the line before
+    bool has_time;              // False until the first timestamp; time sorts first
+    int format_hint;            // Timestamp format that matched last, -1 for none yet
+    bool cut;                   // line is a piece of a longer line; the rest follows
+} merge_input_t;
+
+// One source of --follow.  Regular files are read when inotify reports
+// them modified and reopened when a new file takes their name; pipes and
+// FIFOs are read when epoll reports them readable.
+typedef struct {
+    const char *name;
+    int fd;                     // -1 once the source has ended
+    bool is_file;
+    int watch;                  // inotify watch on the file
+    int dir_watch;              // ... and on its directory, for replacements
+    FILE *output;               // --follow-dir: this source's file; NULL: stdout
+    size_t partial_len;
+    char partial[MAX_LINE_LENGTH];   // Line read up to here, not yet ended
+} follow_source_t;
+
+// --follow: every source stamped from one event loop and one clock
+typedef struct {
+    follow_source_t *sources;
+    size_t count;
+    size_t live;                // Sources that can still produce lines
+    int epoll_fd;
+    int inotify_fd;
+    clock_source_t *clock;
+    compiled_format_t *format;
+    output_format_t output_format;
+    FILE *output;               // Where sources without a file of their own go
+    int stdin_flags;            // To restore once stdin is done with; -1 if untouched
+} follow_t;
+
+// Work on an output file for the closer thread, on a dup of the file's
+// descriptor that the thread closes when done
+typedef struct {
+    int fd;
+    bool retire;                // Close the file; otherwise reserve [size, preallocated)
+    uint64_t size;              // Bytes written; space past it was only preallocated
+    uint64_t preallocated;
+} file_job_t;
+
+// Background thread that reserves space ahead of the writer, and releases
+// unused preallocation, fsyncs and closes rotated-out files, so neither
+// writing nor rotation waits for the disk
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    file_job_t queue[OUTPUT_CLOSE_QUEUE];
+    size_t head;
+    size_t count;
+    bool running;
+    bool stopping;
+    bool preallocate_failed;    // The file system cannot reserve space
+} file_closer_t;
+
+// A block of output, or the end of a frame, queued for the compressor
+// thread
+typedef struct {
+    size_t length;              // Bytes in the block of the same slot
+    int fd;                     // Where the compressed data goes
+    bool end_frame;             // Then end the frame ...
+    bool end_empty;             // ... even if no data went into it
+    file_job_t retire;          // fd >= 0: then hand the file to the closer thread
+} compress_job_t;
+
+// Streaming compression of the output (--compress).  Writers use stdio on
+// stream, whose buffer is handed in COMPRESS_BLOCK_SIZE blocks to a thread
+// that compresses them and writes the result to each block's descriptor.
+typedef struct {
+    compression_t method;
+    int level;
+    FILE *stream;               // Output to compress goes here
+    int fd;                     // Descriptor for blocks queued from now on
+    file_closer_t *closer;      // Takes --output files after their last frame
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    char *blocks[COMPRESS_BLOCKS];
+    compress_job_t jobs[COMPRESS_BLOCKS];
+    size_t head;                // Oldest queued job
+    size_t count;               // Jobs waiting for the compressor thread
+    bool frame_open;            // Compressor thread only
+    bool failed;
+    bool stopping;
+#ifdef HAVE_ZLIB
+    z_stream gzip;
 #endif
-
-    if (clock_gettime(clock_id, &ts) == 0) {
-        result.seconds = ts.tv_sec;
-        result.nanoseconds = ts.tv_nsec;
-    }
-
-    return result;
-}
-
-// Parse Unix timestamp with fractional seconds
-#ifdef TS_TESTING
-ts_error_t parse_unix_timestamp_fractional(const char *timestamp_str, time_t *result) {
-#else
-static ts_error_t parse_unix_timestamp_fractional(const char *timestamp_str, time_t *result) {
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *zstd;
 #endif
-    if (!timestamp_str || !result) {
-        return TS_ERROR_INVALID_ARGUMENT;
-    }
-
-    char *dot_pos = strchr(timestamp_str, '.');
-    if (!dot_pos) {
-        return TS_ERROR_TIME_PARSE;
-    }
+} output_compressor_t;
 
-    // Temporarily null-terminate at the dot
-    *dot_pos = '\0';
-
-    char *endptr;
-    errno = 0;
-    unsigned long seconds = strtoul(timestamp_str, &endptr, 10);
-
-    // Restore the dot
-    *dot_pos = '.';
+// Output written straight to files (--output).  The file name is rendered
+// from each line's time with the output format engine, so a new name
+// starts a new file; --rotate-size adds .1, .2, ... under one name.
+typedef struct {
+    compiled_format_t name_format;
+    char base[PATH_MAX];        // Name rendered for name_second
+    char path[PATH_MAX];        // Current file: base, or base.N after size rotations
+    time_t name_second;
+    unsigned long sequence;     // N of base.N, 0 for base itself
+    bool open;
+    uint64_t size;              // Bytes in the current file
+    uint64_t rotate_size;       // 0: no size limit
+    uint64_t preallocated;      // fallocate()d up to here
+    output_format_t format;     // Binary streams start every file with the stream magic
+    output_compressor_t *compressor;   // Every file holds whole compressed frames
+    FILE *stream;               // Where lines go: stdout or the compressor's stream
+    file_closer_t closer;
+} output_file_t;
+
+// Stages of a line that -S times
+typedef enum {
+    STATS_STAGE_READ,
+    STATS_STAGE_CLOCK,
+    STATS_STAGE_DETECT,
+    STATS_STAGE_PARSE,
+    STATS_STAGE_FORMAT,
+    STATS_STAGE_WRITE,
+    STATS_STAGE_COUNT
+} stats_stage_t;
+
+// -S: counters for a run.  Stage times are CLOCK_MONOTONIC differences
+// taken at the end of each stage, so whatever runs between two stages
+// counts toward the second.
+typedef struct run_stats {
+    int64_t started_ns;
+    int64_t mark_ns;                // End of the last stage timed
+    unsigned long lines_in;
+    unsigned long bytes_in;
+    unsigned long lines_out;
+    unsigned long bytes_out;
+    unsigned long duplicates;       // Skipped by -u
+    unsigned long truncated;        // Split at MAX_LINE_LENGTH - 1 bytes
+    unsigned long matches[TIMESTAMP_FORMAT_COUNT];   // -r timestamps by tsi_timestamp_formats[] entry
+    unsigned long unmatched;        // -r lines without a timestamp
+    unsigned long parse_failures;   // Text a pattern matched that did not convert
+    int64_t stage_ns[STATS_STAGE_COUNT];
+} run_stats_t;
+
+// Log-linear histogram of nanosecond values, laid out as in HdrHistogram:
+// values below 2 * HISTOGRAM_SUB_BUCKETS have a bucket each, and every
+// power of two above that is split into HISTOGRAM_SUB_BUCKETS buckets.
+// A bucket is then at most 1/HISTOGRAM_SUB_BUCKETS of its values wide,
+// and the whole non-negative int64 range takes a fixed HISTOGRAM_BUCKETS
+// counts.
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS) * HISTOGRAM_SUB_BUCKETS)
 
-    if (errno == ERANGE || *endptr != '\0' || seconds == 0) {
-        return TS_ERROR_TIME_PARSE;
-    }
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    int64_t max;
+} histogram_t;
 
-    *result = (time_t)seconds;
-    return TS_SUCCESS;
-}
+// --histogram: how far apart input lines arrive and how far into the run,
+// by the same line times -i and -s report
+typedef struct {
+    int64_t interval_ns;        // Report every interval_ns of line time; 0 only at the end
+    FILE *output;               // stderr or --histogram-file
+    bool live;                  // Line time runs between lines, so reports fall due in a stall
+    bool started;
+    int64_t start_ns;           // Where -s counts from
+    int64_t last_ns;            // Time of the line before
+    int64_t report_start_ns;    // Since start, where the current report interval began
+    int64_t next_report_ns;     // Since start
+    unsigned long lines;
+    unsigned long interval_lines;
+    histogram_t gaps;
+    histogram_t interval_gaps;
+    histogram_t since_start;
+} arrival_stats_t;
 
-// Parse plain Unix timestamp
+// Detect and parse timestamp in a line with fractional seconds
 #ifdef TS_TESTING
-ts_error_t parse_unix_timestamp_plain(const char *timestamp_str, time_t *result) {
+ts_error_t parse_timestamp_in_line_with_fractional(const char *line, time_t *result, long *fractional_seconds,
+                                                  reference_time_t *reference) {
 #else
-static ts_error_t parse_unix_timestamp_plain(const char *timestamp_str, time_t *result) {
+static ts_error_t parse_timestamp_in_line_with_fractional(const char *line, time_t *result, long *fractional_seconds,
+                                                          reference_time_t *reference) {
 #endif
-    if (!timestamp_str || !result) {
-        return TS_ERROR_INVALID_ARGUMENT;
-    }
-
-    char *endptr;
-    errno = 0;
-    unsigned long seconds = strtoul(timestamp_str, &endptr, 10);
-
-    if (errno == ERANGE || *endptr != '\0' || seconds == 0) {
-        return TS_ERROR_TIME_PARSE;
-    }
-
-    *result = (time_t)seconds;
-    return TS_SUCCESS;
-}
-
-// Parse timestamp with fractional seconds using strptime
-static ts_error_t parse_timestamp_strptime_with_fractional(const char *timestamp_str, const char *format,
-                                                          time_t *result, long *fractional_seconds) {
-    if (!timestamp_str || !format || !result) {
+    if (!line || !result || !reference) {
         return TS_ERROR_INVALID_ARGUMENT;
     }
 
-    // Extract fractional seconds first
-    if (fractional_seconds) {
-        *fractional_seconds = 0;
-        const char *dot_pos = strchr(timestamp_str, '.');
-        if (dot_pos) {
-            const char *tz_pos = strpbrk(dot_pos, "+-Z");
-            if (tz_pos) {
-                // Extract fractional part between dot and timezone
-                char frac_str[16];
-                size_t frac_len = tz_pos - dot_pos - 1; // -1 to exclude the dot
-                if (frac_len > 0 && frac_len < sizeof(frac_str)) {
-                    strncpy(frac_str, dot_pos + 1, frac_len);
-                    frac_str[frac_len] = '\0';
-                    // Convert to microseconds (assuming up to 6 digits)
-                    long frac_val = 0;
-                    for (size_t i = 0; i < frac_len && i < 6; i++) {
-                        if (frac_str[i] >= '0' && frac_str[i] <= '9') {
-                            frac_val = frac_val * 10 + (frac_str[i] - '0');
-                        }
-                    }
-                    // Pad to microseconds if needed
-                    for (size_t i = frac_len; i < 6; i++) {
-                        frac_val *= 10;
-                    }
-                    *fractional_seconds = frac_val;
-                }
-            } else {
-                // No timezone, extract to end of string
-                char frac_str[16];
-                size_t frac_len = strlen(dot_pos + 1);
-                if (frac_len > 0 && frac_len < sizeof(frac_str)) {
-                    strncpy(frac_str, dot_pos + 1, frac_len);
-                    frac_str[frac_len] = '\0';
-                    // Convert to microseconds (assuming up to 6 digits)
-                    long frac_val = 0;
-                    for (size_t i = 0; i < frac_len && i < 6; i++) {
-                        if (frac_str[i] >= '0' && frac_str[i] <= '9') {
-                            frac_val = frac_val * 10 + (frac_str[i] - '0');
-                        }
-                    }
-                    // Pad to microseconds if needed
-                    for (size_t i = frac_len; i < 6; i++) {
-                        frac_val *= 10;
-                    }
-                    *fractional_seconds = frac_val;
-                }
-            }
-        }
-    }
-
-    // Extract timezone offset if present
-    int tz_offset_seconds = 0;
-    const char *tz_pos = strpbrk(timestamp_str, "+-");
-    if (tz_pos) {
-        // Parse timezone offset manually (e.g., "-0500" = -5 hours)
-        int sign = (*tz_pos == '-') ? -1 : 1;
-        int hours = 0, minutes = 0;
-        if (sscanf(tz_pos + 1, "%2d%2d", &hours, &minutes) == 2) {
-            tz_offset_seconds = sign * (hours * 3600 + minutes * 60);
-        }
-    }
-
-    // Create a modified format string without %f and %z for strptime
-    char modified_format[MAX_FORMAT_LENGTH];
-    char modified_timestamp[MAX_TIMESTAMP_LENGTH];
-
-    // Copy the format and remove %f and %z
-    strncpy(modified_format, format, sizeof(modified_format) - 1);
-    modified_format[sizeof(modified_format) - 1] = '\0';
-
-    // Remove %f from the format string
-    char *f_pos = strstr(modified_format, "%f");
-    if (f_pos) {
-        memmove(f_pos, f_pos + 2, strlen(f_pos + 2) + 1);
-    }
-
-    // Remove %z from the format string
-    char *z_pos = strstr(modified_format, "%z");
-    if (z_pos) {
-        memmove(z_pos, z_pos + 2, strlen(z_pos + 2) + 1);
-    }
-
-    // Copy the timestamp and remove fractional part and timezone
-    strncpy(modified_timestamp, timestamp_str, sizeof(modified_timestamp) - 1);
-    modified_timestamp[sizeof(modified_timestamp) - 1] = '\0';
-
-    // Find and remove fractional part
-    char *dot_pos = strchr(modified_timestamp, '.');
-    if (dot_pos) {
-        char *tz_pos_mod = strpbrk(dot_pos, "+-Z");
-        if (tz_pos_mod) {
-            // Remove fractional part and timezone
-            *dot_pos = '\0';
-        } else {
-            // Remove fractional part to end of string
-            *dot_pos = '\0';
-        }
-    } else {
-        // Remove timezone if no fractional part
-        char *tz_pos_mod = strpbrk(modified_timestamp, "+-Z");
-        if (tz_pos_mod) {
-            *tz_pos_mod = '\0';
-        }
-    }
-
-    struct tm tm_info = {0};
-    char *parse_result = strptime(modified_timestamp, modified_format, &tm_info);
-
-    if (!parse_result) {
-        return TS_ERROR_TIME_PARSE;
-    }
-
-
-    // Set default values for missing fields
-    if (tm_info.tm_year == 0) {
-        time_t now = time(NULL);
-        if (now == (time_t)-1) {
-            return TS_ERROR_SYSTEM;
-        }
-        struct tm *now_tm = localtime(&now);
-        if (!now_tm) {
-            return TS_ERROR_SYSTEM;
+    // Try each format pattern
+    for (int i = 0; tsi_timestamp_formats[i].pattern != NULL; i++) {
+        if (tsi_parse_timestamp_format(i, line, result, fractional_seconds, reference, NULL) == TS_SUCCESS) {
+            return TS_SUCCESS;
         }
-        tm_info.tm_year = now_tm->tm_year;
-    }
-
-    if (tm_info.tm_mon == 0) {
-        tm_info.tm_mon = 0; // January
     }
 
-    if (tm_info.tm_mday == 0) {
-        tm_info.tm_mday = 1; // First day
-    }
+    return TS_ERROR_TIME_PARSE; // No valid timestamp found
+}
 
-    *result = mktime(&tm_info);
-    if (*result == (time_t)-1) {
-        return TS_ERROR_TIME_PARSE;
-    }
+// SIGUSR1 asks -S for a report
+static volatile sig_atomic_t stats_requested = 0;
 
-    // Check if the parsed time is in the future (likely wrong year assumption)
-    time_t now = time(NULL);
-    if (now != (time_t)-1 && *result > now + SECONDS_PER_DAY * FUTURE_THRESHOLD_DAYS) {
-        // Try with previous year
-        tm_info.tm_year--;
-        *result = mktime(&tm_info);
-        if (*result == (time_t)-1) {
-            return TS_ERROR_TIME_PARSE;
-        }
-    }
+static void stats_request(int signum) {
+    (void)signum;
+    stats_requested = 1;
+}
 
-    // Apply timezone offset
-    // mktime assumes local time, but we want to convert from the specified timezone to local time
-    // The timezone offset tells us how far the timestamp is from UTC
-    // For example, -0500 means the timestamp is 5 hours behind UTC
-    // So we need to add the offset to convert to UTC, then mktime will convert to local time
-    *result += tz_offset_seconds;
+static const char *const stats_stage_names[STATS_STAGE_COUNT] = {
+    "read", "clock", "detect", "parse", "format", "write"
+};
 
-    return TS_SUCCESS;
+static int64_t stats_clock_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * NANOSECONDS_PER_SECOND + now.tv_nsec;
 }
 
-// Parse timestamp using strptime
-static ts_error_t parse_timestamp_strptime(const char *timestamp_str, const char *format, time_t *result) {
-    if (!timestamp_str || !format || !result) {
-        return TS_ERROR_INVALID_ARGUMENT;
-    }
+static void run_stats_start(run_stats_t *stats) {
+    *stats = (run_stats_t){0};
+    stats->started_ns = stats_clock_ns();
+    stats->mark_ns = stats->started_ns;
+}
 
-    struct tm tm_info = {0};
-    char *parse_result = strptime(timestamp_str, format, &tm_info);
+// Count the time since the last stage ended toward stage
+static void run_stats_stage(run_stats_t *stats, stats_stage_t stage) {
+    int64_t now = stats_clock_ns();
+    stats->stage_ns[stage] += now - stats->mark_ns;
+    stats->mark_ns = now;
+}
 
-    if (!parse_result) {
-        return TS_ERROR_TIME_PARSE;
+// Count a line read
+static void run_stats_input(run_stats_t *stats, const char *line) {
+    size_t len = strlen(line);
+    stats->lines_in++;
+    stats->bytes_in += len;
+    if (len == MAX_LINE_LENGTH - 1 && line[len - 1] != '\n') {
+        stats->truncated++;
     }
+}
 
-    // Set default values for missing fields
-    if (tm_info.tm_year == 0) {
-        time_t now = time(NULL);
-        if (now == (time_t)-1) {
-            return TS_ERROR_SYSTEM;
-        }
-        struct tm *now_tm = localtime(&now);
-        if (!now_tm) {
-            return TS_ERROR_SYSTEM;
+// Write the -S report to stderr
+static void run_stats_report(const run_stats_t *stats) {
+    double elapsed = (double)(stats_clock_ns() - stats->started_ns) / NANOSECONDS_PER_SECOND;
+    fprintf(stderr, "ts: statistics after %.3fs\n", elapsed);
+    fprintf(stderr, "  %-26s %lu (%lu bytes)\n", "lines in", stats->lines_in, stats->bytes_in);
+    fprintf(stderr, "  %-26s %lu (%lu bytes)\n", "lines out", stats->lines_out, stats->bytes_out);
+    fprintf(stderr, "  %-26s %lu\n", "duplicates (-u)", stats->duplicates);
+    fprintf(stderr, "  %-26s %lu\n", "truncated", stats->truncated);
+    fprintf(stderr, "  timestamps (-r)\n");
+    for (int i = 0; tsi_timestamp_formats[i].pattern != NULL; i++) {
+        if (stats->matches[i] > 0) {
+            fprintf(stderr, "    %-24s %lu\n", tsi_timestamp_formats[i].name, stats->matches[i]);
         }
-        tm_info.tm_year = now_tm->tm_year;
-    }
-
-    if (tm_info.tm_mon == 0) {
-        tm_info.tm_mon = 0; // January
-    }
-
-    if (tm_info.tm_mday == 0) {
-        tm_info.tm_mday = 1; // First day
-    }
-
-    *result = mktime(&tm_info);
-    if (*result == (time_t)-1) {
-        return TS_ERROR_TIME_PARSE;
     }
-
-    // Check if the parsed time is in the future (likely wrong year assumption)
-    time_t now = time(NULL);
-    if (now != (time_t)-1 && *result > now + SECONDS_PER_DAY * FUTURE_THRESHOLD_DAYS) {
-        // Try with previous year
-        tm_info.tm_year--;
-        *result = mktime(&tm_info);
-        if (*result == (time_t)-1) {
-            return TS_ERROR_TIME_PARSE;
-        }
+    fprintf(stderr, "    %-24s %lu\n", "none", stats->unmatched);
+    fprintf(stderr, "  %-26s %lu\n", "parse failures", stats->parse_failures);
+    fprintf(stderr, "  time\n");
+    for (int stage = 0; stage < STATS_STAGE_COUNT; stage++) {
+        fprintf(stderr, "    %-24s %.6fs (%.0f ns/line)\n", stats_stage_names[stage],
+                (double)stats->stage_ns[stage] / NANOSECONDS_PER_SECOND,
+                stats->lines_in > 0 ? (double)stats->stage_ns[stage] / (double)stats->lines_in : 0.0);
     }
-
-    return TS_SUCCESS;
 }
 
-// Detect and parse timestamp in a line with fractional seconds
-#ifdef TS_TESTING
-ts_error_t parse_timestamp_in_line_with_fractional(const char *line, time_t *result, long *fractional_seconds) {
-#else
-static ts_error_t parse_timestamp_in_line_with_fractional(const char *line, time_t *result, long *fractional_seconds) {
-#endif
-    if (!line || !result) {
-        return TS_ERROR_INVALID_ARGUMENT;
+// Report if SIGUSR1 has asked for it since the last check
+static void run_stats_poll(const run_stats_t *stats) {
+    if (stats_requested) {
+        stats_requested = 0;
+        run_stats_report(stats);
     }
+}
 
-    regex_t regex;
-    regmatch_t matches[1];
-    char timestamp_str[MAX_TIMESTAMP_LENGTH];
+// Block or unblock SIGUSR1 in the calling thread
+static void stats_signal_mask(int how) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(how, &signals, NULL);
+}
 
-    // Try each format pattern
-    for (int i = 0; timestamp_formats[i].pattern != NULL; i++) {
-        int compile_result = regcomp(&regex, timestamp_formats[i].pattern, REG_EXTENDED);
-        if (compile_result != 0) {
-            continue; // Skip invalid regex
+// parse_timestamp_in_line_with_fractional() for -S: the same search, with
+// each pattern's regexec() timed as detection and the conversion of what
+// it matched as parsing
+static ts_error_t parse_timestamp_in_line_counted(const char *line, time_t *result, long *fractional_seconds,
+                                                  reference_time_t *reference, run_stats_t *stats) {
+    for (int i = 0; tsi_timestamp_formats[i].pattern != NULL; i++) {
+        const regex_t *regex = tsi_timestamp_regex(i);
+        regmatch_t found;
+        bool matched = regex && regexec(regex, line, 1, &found, 0) == 0;
+        run_stats_stage(stats, STATS_STAGE_DETECT);
+        if (!matched) {
+            continue;
         }
-
-        int exec_result = regexec(&regex, line, 1, matches, 0);
-        if (exec_result == 0) {
-            // Found a match, extract the timestamp
-            size_t len = matches[0].rm_eo - matches[0].rm_so;
-            if (len >= MAX_TIMESTAMP_LENGTH) {
-                regfree(&regex);
-                continue; // Timestamp too long
-            }
-
-            memcpy(timestamp_str, line + matches[0].rm_so, len);
-            timestamp_str[len] = '\0';
-
-            ts_error_t parse_result = TS_ERROR_TIME_PARSE;
-
-            // Handle Unix timestamp patterns specially
-            if (strcmp(timestamp_formats[i].name, "unix_fractional") == 0) {
-                parse_result = parse_unix_timestamp_fractional(timestamp_str, result);
-                if (fractional_seconds) {
-                    // Extract fractional part from unix timestamp
-                    char *dot_pos = strchr(timestamp_str, '.');
-                    if (dot_pos) {
-                        char *endptr;
-                        *fractional_seconds = strtol(dot_pos + 1, &endptr, 10);
-                        // Convert to microseconds (pad to 6 digits)
-                        while (*fractional_seconds < 1000000 && *fractional_seconds > 0) {
-                            *fractional_seconds *= 10;
-                        }
-                    } else {
-                        *fractional_seconds = 0;
-                    }
-                }
-            } else if (strcmp(timestamp_formats[i].name, "unix_plain") == 0) {
-                parse_result = parse_unix_timestamp_plain(timestamp_str, result);
-                if (fractional_seconds) {
-                    *fractional_seconds = 0;
-                }
-            } else if (timestamp_formats[i].format != NULL) {
-                // Check if this format has fractional seconds
-                if (strstr(timestamp_formats[i].format, "%f") != NULL) {
-                    parse_result = parse_timestamp_strptime_with_fractional(timestamp_str, timestamp_formats[i].format, result, fractional_seconds);
-                } else {
-                    parse_result = parse_timestamp_strptime(timestamp_str, timestamp_formats[i].format, result);
-                    if (fractional_seconds) {
-                        *fractional_seconds = 0;
-                    }
-                }
-            }
-
-            regfree(&regex);
-
-            if (parse_result == TS_SUCCESS) {
-                return TS_SUCCESS;
-            }
-        } else {
-            regfree(&regex);
+        ts_error_t parse_result = tsi_parse_timestamp_matched(i, line, &found, result, fractional_seconds, reference);
+        run_stats_stage(stats, STATS_STAGE_PARSE);
+        if (parse_result == TS_SUCCESS) {
+            stats->matches[i]++;
+            return TS_SUCCESS;
         }
+        stats->parse_failures++;
     }
-
-    return TS_ERROR_TIME_PARSE; // No valid timestamp found
+    stats->unmatched++;
+    return TS_ERROR_TIME_PARSE;
 }
 
 
@@ -558,19 +527,18 @@ static ts_error_t find_timestamp_match(const char *line, int *start_pos, int *en
         return TS_ERROR_INVALID_ARGUMENT;
     }
 
-    regex_t regex;
     regmatch_t matches[1];
     int best_match_start = -1;
     int best_match_end = -1;
 
     // Try each format pattern to find the timestamp
-    for (int i = 0; timestamp_formats[i].pattern != NULL; i++) {
-        int compile_result = regcomp(&regex, timestamp_formats[i].pattern, REG_EXTENDED);
-        if (compile_result != 0) {
+    for (int i = 0; tsi_timestamp_formats[i].pattern != NULL; i++) {
+        const regex_t *regex = tsi_timestamp_regex(i);
+        if (!regex) {
             continue;
         }
 
-        int exec_result = regexec(&regex, line, 1, matches, 0);
+        int exec_result = regexec(regex, line, 1, matches, 0);
         if (exec_result == 0) {
             // Found a match, check if it's the leftmost one
             if (best_match_start == -1 || matches[0].rm_so < best_match_start) {
@@ -578,7 +546,6 @@ static ts_error_t find_timestamp_match(const char *line, int *start_pos, int *en
                 best_match_end = matches[0].rm_eo;
             }
         }
-        regfree(&regex);
     }
 
     if (best_match_start != -1) {
@@ -639,250 +606,2589 @@ static ts_error_t replace_timestamp_in_line(char *output, size_t output_size,
     return TS_SUCCESS;
 }
 
-// Format time difference as "X ago" or "in X" with optional fractional seconds
+// Format an elapsed interval for the -i and -s modes
 #ifdef TS_TESTING
-ts_error_t format_relative_time(char *buffer, size_t buffer_size, time_t timestamp, long fractional_seconds) {
+ts_error_t format_elapsed_time(char *buffer, size_t buffer_size, const compiled_format_t *compiled,
+                               long diff_sec, long diff_nsec) {
 #else
-static ts_error_t format_relative_time(char *buffer, size_t buffer_size, time_t timestamp, long fractional_seconds) {
+static ts_error_t format_elapsed_time(char *buffer, size_t buffer_size, const compiled_format_t *compiled,
+                                      long diff_sec, long diff_nsec) {
 #endif
-    if (!buffer) {
+    if (!buffer || !compiled) {
         return TS_ERROR_INVALID_ARGUMENT;
     }
 
-    time_t now = time(NULL);
-    if (now == (time_t)-1) {
-        return TS_ERROR_SYSTEM;
+    const char *format = compiled->format;
+    field_buffer_t out = {buffer, buffer_size, 0};
+    ts_error_t result_code;
+
+    if (strstr(format, "%.s") != NULL) {
+        result_code = tsi_field_buffer_append_seconds_micros(&out, diff_sec, 0, diff_nsec);
+    } else if (strstr(format, "%.S") != NULL) {
+        result_code = tsi_field_buffer_append_seconds_micros(&out, diff_sec % 60, 2, diff_nsec);
+    } else if (strstr(format, "%.T") != NULL) {
+        long hours = diff_sec / SECONDS_PER_HOUR;
+        long minutes = (diff_sec % SECONDS_PER_HOUR) / SECONDS_PER_MINUTE;
+        long seconds = diff_sec % SECONDS_PER_MINUTE;
+        result_code = tsi_field_buffer_append_decimal(&out, hours, 2);
+        if (result_code == TS_SUCCESS) {
+            result_code = tsi_field_buffer_append_char(&out, ':');
+        }
+        if (result_code == TS_SUCCESS) {
+            result_code = tsi_field_buffer_append_decimal(&out, minutes, 2);
+        }
+        if (result_code == TS_SUCCESS) {
+            result_code = tsi_field_buffer_append_char(&out, ':');
+        }
+        if (result_code == TS_SUCCESS) {
+            result_code = tsi_field_buffer_append_seconds_micros(&out, seconds, 2, diff_nsec);
+        }
+    } else if (compiled->fast == FAST_FORMAT_CLOCK) {
+        // Same wrap-around at 24 hours as gmtime
+        result_code = tsi_render_fast_format(buffer, buffer_size, FAST_FORMAT_CLOCK, diff_sec, 0);
+    } else {
+        time_t diff_time = (time_t)diff_sec;
+        struct tm tm_info;
+        if (!gmtime_r(&diff_time, &tm_info) || strftime(buffer, buffer_size, format, &tm_info) == 0) {
+            return TS_ERROR_BUFFER_OVERFLOW;
+        }
+        result_code = TS_SUCCESS;
+    }
+
+    return result_code;
+}
+
+// Time the run starts at, for -s.  Synthetic clocks start where their
+// first line is, without consuming it.
+#ifdef TS_TESTING
+high_res_time_t clock_source_start(clock_source_t *clock) {
+#else
+static high_res_time_t clock_source_start(clock_source_t *clock) {
+#endif
+    if (clock->kind == CLOCK_SOURCE_FIXED) {
+        return clock->next;
     }
+    if (clock->kind == CLOCK_SOURCE_REPLAY) {
+        tsi_clock_source_read_replay(clock);
+        clock->replay_pending = true;
+        return clock->next;
+    }
+    return tsi_clock_source_read(clock);
+}
+
+// JSON string escaping.  The table gives each ASCII byte's escape: 0 to
+// copy it as is, 'u' for a \u00XX escape, otherwise the letter after the
+// backslash.  Bytes from 0x80 up are checked as UTF-8: well-formed
+// sequences are copied unchanged and every other byte becomes \ufffd, so
+// records stay valid JSON whatever the input encoding.
+static const char json_escapes[256] = {
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    ['"'] = '"', ['\\'] = '\\'
+};
+
+#define SWAR_ONES 0x0101010101010101ULL
+#define SWAR_HIGH_BITS 0x8080808080808080ULL
+
+// Flag (in the high bit of each byte lane) bytes that need escaping or
+// UTF-8 checking: controls below 0x20, '"', '\\' and bytes from 0x80 up.
+// Borrows only run upward, so the lowest flag is always exact.
+static inline uint64_t swar_json_specials(uint64_t word) {
+    uint64_t quotes = word ^ (SWAR_ONES * '"');
+    uint64_t backslashes = word ^ (SWAR_ONES * '\\');
+    uint64_t controls = (word - SWAR_ONES * 0x20) & ~word;
+    uint64_t quote_hits = (quotes - SWAR_ONES) & ~quotes;
+    uint64_t backslash_hits = (backslashes - SWAR_ONES) & ~backslashes;
+    return (controls | quote_hits | backslash_hits | word) & SWAR_HIGH_BITS;
+}
+
+// Length of the well-formed UTF-8 sequence starting at str[0], or 0 when
+// there is none.  Overlong forms, surrogates and code points past
+// U+10FFFF are not well-formed (RFC 3629).
+static size_t utf8_sequence_length(const unsigned char *str, size_t len) {
+    unsigned char lead = str[0];
+    unsigned char low = 0x80, high = 0xBF;  // Range of the second byte
+    size_t need;
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        need = 2;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        need = 3;
+        low = lead == 0xE0 ? 0xA0 : 0x80;
+        high = lead == 0xED ? 0x9F : 0xBF;
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        need = 4;
+        low = lead == 0xF0 ? 0x90 : 0x80;
+        high = lead == 0xF4 ? 0x8F : 0xBF;
+    } else {
+        return 0;
+    }
+    if (len < need || str[1] < low || str[1] > high) {
+        return 0;
+    }
+    for (size_t i = 2; i < need; i++) {
+        if ((str[i] & 0xC0) != 0x80) {
+            return 0;
+        }
+    }
+    return need;
+}
 
-    time_t diff = now - timestamp;
+// Append str[0..len) as the body of a JSON string.  Clean runs are
+// scanned eight bytes at a time and copied with memcpy.
+#ifdef TS_TESTING
+ts_error_t json_append_escaped(field_buffer_t *out, const char *str, size_t len) {
+#else
+static ts_error_t json_append_escaped(field_buffer_t *out, const char *str, size_t len) {
+#endif
+    // Worst case every byte becomes \u00XX; checking once keeps the loop branch-light
+    if (!field_buffer_reserve(out, len * 6)) {
+        return TS_ERROR_BUFFER_OVERFLOW;
+    }
 
-    // If we have fractional seconds, we need to be more precise
-    bool has_fractional = (fractional_seconds > 0);
-    double precise_diff = (double)diff;
+    char *dst = out->data + out->len;
+    size_t pos = 0;
+    while (pos < len) {
+        size_t run = pos;
+        while (run + 8 <= len) {
+            uint64_t specials = swar_json_specials(swar_load_eight(str + run));
+            if (specials != 0) {
+                run += (size_t)__builtin_ctzll(specials) / 8;
+                break;
+            }
+            run += 8;
+        }
+        if (run + 8 > len) {
+            while (run < len && (unsigned char)str[run] < 0x80 &&
+                   json_escapes[(unsigned char)str[run]] == 0) {
+                run++;
+            }
+        }
+        memcpy(dst, str + pos, run - pos);
+        dst += run - pos;
+        pos = run;
+        if (pos == len) {
+            break;
+        }
 
-    if (has_fractional) {
-        // Get current time with fractional seconds
-        struct timespec ts;
-        if (clock_gettime(CLOCK_REALTIME, &ts) == 0) {
-            double current_fractional = (double)ts.tv_nsec / 1000000000.0;
-            double timestamp_fractional = (double)fractional_seconds / 1000000.0;
-            precise_diff = (double)diff + current_fractional - timestamp_fractional;
+        unsigned char c = (unsigned char)str[pos];
+        if (c >= 0x80) {
+            size_t sequence = utf8_sequence_length((const unsigned char *)str + pos, len - pos);
+            if (sequence > 0) {
+                memcpy(dst, str + pos, sequence);
+                dst += sequence;
+                pos += sequence;
+            } else {
+                memcpy(dst, "\\ufffd", 6);
+                dst += 6;
+                pos++;
+            }
+            continue;
+        }
+        pos++;
+        char escape = json_escapes[c];
+        *dst++ = '\\';
+        if (escape == 'u') {
+            memcpy(dst, "u00", 3);
+            dst[3] = "0123456789abcdef"[c >> 4];
+            dst[4] = "0123456789abcdef"[c & 0xF];
+            dst += 5;
+        } else {
+            *dst++ = escape;
         }
     }
 
-    if (diff < 0) {
-        // Future time
-        diff = -diff;
-        if (diff < SECONDS_PER_MINUTE) {
-            if (has_fractional) {
-                return safe_snprintf(buffer, buffer_size, "in %.3fs", -precise_diff);
-            } else {
-                return safe_snprintf(buffer, buffer_size, "in %lds", diff);
-            }
-        } else if (diff < SECONDS_PER_HOUR) {
-            long minutes = diff / SECONDS_PER_MINUTE;
-            long seconds = diff % SECONDS_PER_MINUTE;
-            if (seconds > 0) {
-                if (has_fractional) {
-                    double remaining_seconds = -precise_diff - (minutes * SECONDS_PER_MINUTE);
-                    return safe_snprintf(buffer, buffer_size, "in %ldm%.3fs", minutes, remaining_seconds);
-                } else {
-                    return safe_snprintf(buffer, buffer_size, "in %ldm%lds", minutes, seconds);
+    out->len = (size_t)(dst - out->data);
+    out->data[out->len] = '\0';
+    return TS_SUCCESS;
+}
+
+static ts_error_t field_buffer_append_literal(field_buffer_t *out, const char *literal) {
+    size_t len = strlen(literal);
+    if (!field_buffer_reserve(out, len)) {
+        return TS_ERROR_BUFFER_OVERFLOW;
+    }
+    memcpy(out->data + out->len, literal, len + 1);
+    out->len += len;
+    return TS_SUCCESS;
+}
+
+// Append ,"<name>_sec":S,"<name>_nsec":N
+static ts_error_t json_append_time(field_buffer_t *out, const char *sec_key, const char *nsec_key,
+                                   const high_res_time_t *time) {
+    ts_error_t result = field_buffer_append_literal(out, sec_key);
+    if (result == TS_SUCCESS) {
+        result = tsi_field_buffer_append_decimal(out, (long)time->seconds, 0);
+    }
+    if (result == TS_SUCCESS) {
+        result = field_buffer_append_literal(out, nsec_key);
+    }
+    if (result == TS_SUCCESS) {
+        result = tsi_field_buffer_append_decimal(out, time->nanoseconds, 0);
+    }
+    return result;
+}
+
+// Serialize a record as one JSON Lines object, newline included:
+// {"sec":S,"nsec":N,"stamp":"...","delta_sec":S,"delta_nsec":N,
+//  "source_sec":S,"source_nsec":N,"input":"...","late":true,"line":"..."}
+// with the stamp, delta, source, input and late members present only
+// when known.
+#ifdef TS_TESTING
+ts_error_t format_json_record(field_buffer_t *out, const line_record_t *record) {
+#else
+static ts_error_t format_json_record(field_buffer_t *out, const line_record_t *record) {
+#endif
+    if (!out || !record || !record->line) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+
+    size_t line_len = strlen(record->line);
+    if (line_len > 0 && record->line[line_len - 1] == '\n') {
+        line_len--;
+    }
+
+    ts_error_t result = json_append_time(out, "{\"sec\":", ",\"nsec\":", &record->time);
+    if (result == TS_SUCCESS && record->stamp) {
+        result = field_buffer_append_literal(out, ",\"stamp\":\"");
+        if (result == TS_SUCCESS) {
+            result = json_append_escaped(out, record->stamp, strlen(record->stamp));
+        }
+        if (result == TS_SUCCESS) {
+            result = tsi_field_buffer_append_char(out, '"');
+        }
+    }
+    if (result == TS_SUCCESS && record->has_delta) {
+        result = json_append_time(out, ",\"delta_sec\":", ",\"delta_nsec\":", &record->delta);
+    }
+    if (result == TS_SUCCESS && record->has_source) {
+        result = json_append_time(out, ",\"source_sec\":", ",\"source_nsec\":", &record->source);
+    }
+    if (result == TS_SUCCESS && record->input) {
+        result = field_buffer_append_literal(out, ",\"input\":\"");
+        if (result == TS_SUCCESS) {
+            result = json_append_escaped(out, record->input, strlen(record->input));
+        }
+        if (result == TS_SUCCESS) {
+            result = tsi_field_buffer_append_char(out, '"');
+        }
+    }
+    if (result == TS_SUCCESS && record->late) {
+        result = field_buffer_append_literal(out, ",\"late\":true");
+    }
+    if (result == TS_SUCCESS) {
+        result = field_buffer_append_literal(out, ",\"line\":\"");
+    }
+    if (result == TS_SUCCESS) {
+        result = json_append_escaped(out, record->line, line_len);
+    }
+    if (result == TS_SUCCESS) {
+        result = field_buffer_append_literal(out, "\"}\n");
+    }
+    return result;
+}
+
+// Binary records: BINARY_STREAM_MAGIC once, then per line a 16-byte
+// little-endian header (int64 nanoseconds since the epoch, uint32 line
+// length, uint32 flags) followed by the raw line bytes.  A trailing
+// newline is not stored; BINARY_RECORD_NEWLINE records that there was one.
+
+static void write_le32(unsigned char *p, uint32_t value) {
+    p[0] = (unsigned char)value;
+    p[1] = (unsigned char)(value >> 8);
+    p[2] = (unsigned char)(value >> 16);
+    p[3] = (unsigned char)(value >> 24);
+}
+
+static uint32_t read_le32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void write_le64(unsigned char *p, uint64_t value) {
+    write_le32(p, (uint32_t)value);
+    write_le32(p + 4, (uint32_t)(value >> 32));
+}
+
+static uint64_t read_le64(const unsigned char *p) {
+    return (uint64_t)read_le32(p) | ((uint64_t)read_le32(p + 4) << 32);
+}
+
+// Nanoseconds since the epoch; false outside what int64 covers (1677 to 2262)
+static bool high_res_time_to_ns(const high_res_time_t *time, int64_t *ns) {
+    const int64_t seconds = (int64_t)time->seconds;
+    if (seconds > INT64_MAX / NANOSECONDS_PER_SECOND - 1 ||
+        seconds < INT64_MIN / NANOSECONDS_PER_SECOND + 1) {
+        return false;
+    }
+    *ns = seconds * NANOSECONDS_PER_SECOND + time->nanoseconds;
+    return true;
+}
+
+static high_res_time_t high_res_time_from_ns(int64_t ns) {
+    high_res_time_t time;
+    time.seconds = (time_t)floor_div(ns, NANOSECONDS_PER_SECOND);
+    time.nanoseconds = (long)(ns - (int64_t)time.seconds * NANOSECONDS_PER_SECOND);
+    return time;
+}
+
+#ifdef TS_TESTING
+ts_error_t format_binary_record(field_buffer_t *out, const line_record_t *record) {
+#else
+static ts_error_t format_binary_record(field_buffer_t *out, const line_record_t *record) {
+#endif
+    if (!out || !record || !record->line) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+
+    int64_t nanoseconds;
+    if (!high_res_time_to_ns(&record->time, &nanoseconds)) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+
+    size_t line_len = strlen(record->line);
+    uint32_t flags = 0;
+    if (line_len > 0 && record->line[line_len - 1] == '\n') {
+        line_len--;
+        flags |= BINARY_RECORD_NEWLINE;
+    }
+    if (!field_buffer_reserve(out, BINARY_RECORD_HEADER_SIZE + line_len)) {
+        return TS_ERROR_BUFFER_OVERFLOW;
+    }
+
+    unsigned char *header = (unsigned char *)out->data + out->len;
+    write_le64(header, (uint64_t)nanoseconds);
+    write_le32(header + 8, (uint32_t)line_len);
+    write_le32(header + 12, flags);
+    memcpy(header + BINARY_RECORD_HEADER_SIZE, record->line, line_len);
+    out->len += BINARY_RECORD_HEADER_SIZE + line_len;
+    out->data[out->len] = '\0';
+    return TS_SUCCESS;
+}
+
+// Decode the record at the start of data[0..size) into line (newline
+// restored) and time.  *consumed is the record's size, or 0 when data
+// does not hold all of it yet.  A line that does not fit line_size, or
+// flags this version does not know, are rejected as invalid input.
+#ifdef TS_TESTING
+ts_error_t parse_binary_record(const unsigned char *data, size_t size, char *line, size_t line_size,
+                               high_res_time_t *time, size_t *consumed) {
+#else
+static ts_error_t parse_binary_record(const unsigned char *data, size_t size, char *line, size_t line_size,
+                                      high_res_time_t *time, size_t *consumed) {
+#endif
+    if (!data || !line || line_size == 0 || !time || !consumed) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+
+    *consumed = 0;
+    if (size < BINARY_RECORD_HEADER_SIZE) {
+        return TS_SUCCESS;
+    }
+    int64_t nanoseconds = (int64_t)read_le64(data);
+    uint32_t line_len = read_le32(data + 8);
+    uint32_t flags = read_le32(data + 12);
+    size_t text_len = (size_t)line_len + ((flags & BINARY_RECORD_NEWLINE) ? 1 : 0);
+    if ((flags & ~BINARY_RECORD_NEWLINE) != 0 || text_len >= line_size) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+    if (size - BINARY_RECORD_HEADER_SIZE < line_len) {
+        return TS_SUCCESS;
+    }
+
+    memcpy(line, data + BINARY_RECORD_HEADER_SIZE, line_len);
+    if (flags & BINARY_RECORD_NEWLINE) {
+        line[line_len] = '\n';
+    }
+    line[text_len] = '\0';
+    *time = high_res_time_from_ns(nanoseconds);
+    *consumed = BINARY_RECORD_HEADER_SIZE + line_len;
+    return TS_SUCCESS;
+}
+
+// Output index: INDEX_MAGIC, then 16-byte little-endian entries (int64
+// nanoseconds since the epoch, uint64 byte offset into the output).
+
+// Start an index for stdout.  Offsets are positions in the output file,
+// so it has to be one; output appended to an existing file (>>) appends
+// to its index as well.
+static ts_error_t output_index_open(output_index_t *index, const char *path, unsigned long every_lines) {
+    int flags = fcntl(STDOUT_FILENO, F_GETFL);
+    bool append = flags >= 0 && (flags & O_APPEND);
+    if ((append && fseeko(stdout, 0, SEEK_END) != 0) || ftello(stdout) < 0) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+
+    *index = (output_index_t){.every_lines = every_lines};
+    index->file = fopen(path, append ? "ab" : "wb");
+    if (!index->file) {
+        return TS_ERROR_SYSTEM;
+    }
+    if (fseeko(index->file, 0, SEEK_END) == 0 && ftello(index->file) == 0) {
+        fwrite(INDEX_MAGIC, 1, INDEX_MAGIC_LENGTH, index->file);
+    }
+    return TS_SUCCESS;
+}
+
+// Called before each line is written with the line's time.  Lines whose
+// time went backwards (a stepped clock) get no entry until time catches up.
+static void output_index_note(output_index_t *index, const high_res_time_t *time) {
+    bool due = !index->has_entry || index->lines_since_entry >= index->every_lines ||
+               time->seconds != index->last_time.seconds;
+    bool ordered = !index->has_entry || time->seconds > index->last_time.seconds ||
+                   (time->seconds == index->last_time.seconds &&
+                    time->nanoseconds >= index->last_time.nanoseconds);
+    int64_t nanoseconds;
+    off_t offset;
+    index->lines_since_entry++;
+    if (!due || !ordered || !high_res_time_to_ns(time, &nanoseconds) ||
+        (offset = ftello(stdout)) < 0) {
+        return;
+    }
+
+    unsigned char entry[INDEX_ENTRY_SIZE];
+    write_le64(entry, (uint64_t)nanoseconds);
+    write_le64(entry + 8, (uint64_t)offset);
+    fwrite(entry, 1, sizeof(entry), index->file);
+    index->has_entry = true;
+    index->last_time = *time;
+    index->lines_since_entry = 1;
+}
+
+static ts_error_t output_index_close(output_index_t *index) {
+    if (!index->file) {
+        return TS_SUCCESS;
+    }
+    bool failed = ferror(index->file) != 0;
+    failed |= fclose(index->file) != 0;
+    index->file = NULL;
+    return failed ? TS_ERROR_SYSTEM : TS_SUCCESS;
+}
+
+// Read a whole index file into a freshly allocated entry array
+static ts_error_t index_load(const char *path, index_entry_t **entries, size_t *count) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return TS_ERROR_SYSTEM;
+    }
+    unsigned char *data = NULL;
+    ts_error_t result = TS_ERROR_INVALID_ARGUMENT;
+    long size;
+    if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) >= INDEX_MAGIC_LENGTH &&
+        size <= INDEX_MAX_FILE_SIZE && fseek(file, 0, SEEK_SET) == 0 &&
+        (data = malloc((size_t)size)) != NULL && fread(data, 1, (size_t)size, file) == (size_t)size &&
+        memcmp(data, INDEX_MAGIC, INDEX_MAGIC_LENGTH) == 0) {
+        // A partly written last entry (the writer was killed) is ignored
+        *count = ((size_t)size - INDEX_MAGIC_LENGTH) / INDEX_ENTRY_SIZE;
+        *entries = malloc((*count ? *count : 1) * sizeof(**entries));
+        if (*entries) {
+            for (size_t i = 0; i < *count; i++) {
+                const unsigned char *p = data + INDEX_MAGIC_LENGTH + i * INDEX_ENTRY_SIZE;
+                (*entries)[i].time_ns = (int64_t)read_le64(p);
+                (*entries)[i].offset = read_le64(p + 8);
+            }
+            result = TS_SUCCESS;
+        } else {
+            result = TS_ERROR_SYSTEM;
+        }
+    }
+    free(data);
+    fclose(file);
+    return result;
+}
+
+// Number of entries before the first one at or after time_ns
+static size_t index_lower_bound(const index_entry_t *entries, size_t count, int64_t time_ns) {
+    size_t low = 0;
+    size_t high = count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (entries[mid].time_ns < time_ns) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Byte range of the output that holds every line timed in [from_ns,
+// to_ns): from the last entry before from_ns (or the start) to the first
+// entry at or after to_ns (UINT64_MAX: to the end).  Lines in the blocks
+// at either edge may fall outside the range.
+#ifdef TS_TESTING
+void index_find_range(const index_entry_t *entries, size_t count, int64_t from_ns, int64_t to_ns,
+                      uint64_t *start, uint64_t *end) {
+#else
+static void index_find_range(const index_entry_t *entries, size_t count, int64_t from_ns, int64_t to_ns,
+                             uint64_t *start, uint64_t *end) {
+#endif
+    size_t first = index_lower_bound(entries, count, from_ns);
+    size_t last = index_lower_bound(entries, count, to_ns);
+    *start = first > 0 ? entries[first - 1].offset : 0;
+    *end = last < count ? entries[last].offset : UINT64_MAX;
+}
+
+// Write a record to stream in the selected output format.  Text output is
+// the stamp, a space and the line, with the input name and a colon
+// between them for --merge and --follow, or text_line as is when the mode
+// already assembled it (-r replaces the timestamp inside the line), after
+// TEXT_LATE_MARK if --reorder let it out of order.  Returns the number of
+// bytes written.
+static size_t write_record(FILE *stream, output_format_t output_format, const line_record_t *record,
+                           const char *text_line) {
+    if (output_format == OUTPUT_FORMAT_JSON) {
+        char json[JSON_RECORD_MAX_LENGTH];
+        field_buffer_t out = {json, sizeof(json), 0};
+        if (format_json_record(&out, record) == TS_SUCCESS) {
+            return fwrite(json, 1, out.len, stream);
+        }
+        fprintf(stderr, "Error: Failed to format JSON record\n");
+        return 0;
+    } else if (output_format == OUTPUT_FORMAT_BINARY) {
+        char binary[BINARY_RECORD_HEADER_SIZE + MAX_LINE_LENGTH + 1];
+        field_buffer_t out = {binary, sizeof(binary), 0};
+        if (format_binary_record(&out, record) == TS_SUCCESS) {
+            return fwrite(binary, 1, out.len, stream);
+        }
+        fprintf(stderr, "Error: Failed to encode binary record\n");
+        return 0;
+    }
+
+    size_t marked = 0;
+    if (record->late && fputs(TEXT_LATE_MARK, stream) >= 0) {
+        marked = sizeof(TEXT_LATE_MARK) - 1;
+    }
+    int written;
+    if (text_line) {
+        written = fputs(text_line, stream) < 0 ? -1 : (int)strlen(text_line);
+    } else if (record->stamp && record->input) {
+        written = fprintf(stream, "%s %s: %s", record->stamp, record->input, record->line);
+    } else if (record->stamp || record->input) {
+        written = fprintf(stream, record->stamp ? "%s %s" : "%s: %s",
+                          record->stamp ? record->stamp : record->input, record->line);
+    } else {
+        written = fputs(record->line, stream) < 0 ? -1 : (int)strlen(record->line);
+    }
+    return marked + (written > 0 ? (size_t)written : 0);
+}
+
+// Write all of data to fd, retrying short writes
+static bool write_fully(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        len -= (size_t)written;
+    }
+    return true;
+}
+
+// Give back space preallocated past the end of a rotated-out file, then
+// flush it to disk and close it
+static void retired_file_finish(const file_job_t *file) {
+    // Truncating to the current size frees blocks past the end; ext4 does
+    // not punch holes there.  The size is read fresh in case another
+    // writer appended to the file too.
+    struct stat st;
+    if (file->preallocated > file->size && fstat(file->fd, &st) == 0 &&
+        ftruncate(file->fd, st.st_size) != 0) {
+        // The file is intact; only the spare space stays allocated
+        fprintf(stderr, "Warning: Failed to release preallocated space: %s\n", strerror(errno));
+    }
+    fsync(file->fd);
+    close(file->fd);
+}
+
+// Reserve [size, preallocated) of a file without changing its size, so
+// O_APPEND writes keep landing at the end.  False when the file system
+// cannot.
+static bool file_job_preallocate(const file_job_t *job) {
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+    bool reserved = fallocate(job->fd, FALLOC_FL_KEEP_SIZE, (off_t)job->size,
+                              (off_t)(job->preallocated - job->size)) == 0;
+#else
+    bool reserved = false;
+#endif
+    close(job->fd);
+    return reserved;
+}
+
+static bool file_job_run(const file_job_t *job) {
+    if (job->retire) {
+        retired_file_finish(job);
+        return true;
+    }
+    return file_job_preallocate(job);
+}
+
+static void *file_closer_main(void *arg) {
+    file_closer_t *closer = arg;
+    pthread_mutex_lock(&closer->lock);
+    while (true) {
+        while (closer->count == 0 && !closer->stopping) {
+            pthread_cond_wait(&closer->changed, &closer->lock);
+        }
+        if (closer->count == 0) {
+            break;
+        }
+        file_job_t job = closer->queue[closer->head];
+        closer->head = (closer->head + 1) % OUTPUT_CLOSE_QUEUE;
+        closer->count--;
+        pthread_cond_broadcast(&closer->changed);
+        pthread_mutex_unlock(&closer->lock);
+        bool done = file_job_run(&job);
+        pthread_mutex_lock(&closer->lock);
+        if (!done) {
+            closer->preallocate_failed = true;
+        }
+    }
+    pthread_mutex_unlock(&closer->lock);
+    return NULL;
+}
+
+static ts_error_t file_closer_start(file_closer_t *closer) {
+    if (pthread_mutex_init(&closer->lock, NULL) != 0) {
+        return TS_ERROR_SYSTEM;
+    }
+    if (pthread_cond_init(&closer->changed, NULL) != 0) {
+        pthread_mutex_destroy(&closer->lock);
+        return TS_ERROR_SYSTEM;
+    }
+    if (pthread_create(&closer->thread, NULL, file_closer_main, closer) != 0) {
+        pthread_cond_destroy(&closer->changed);
+        pthread_mutex_destroy(&closer->lock);
+        return TS_ERROR_SYSTEM;
+    }
+    closer->running = true;
+    return TS_SUCCESS;
+}
+
+// Hand a job to the closer thread, or run it here when there is none.
+// Only blocks if OUTPUT_CLOSE_QUEUE jobs are already waiting.  Returns
+// false, without queueing, for preallocation once it has failed.
+static bool file_closer_submit(file_closer_t *closer, const file_job_t *job) {
+    if (!closer->running) {
+        return file_job_run(job);
+    }
+    pthread_mutex_lock(&closer->lock);
+    bool accepted = job->retire || !closer->preallocate_failed;
+    if (accepted) {
+        while (closer->count == OUTPUT_CLOSE_QUEUE) {
+            pthread_cond_wait(&closer->changed, &closer->lock);
+        }
+        closer->queue[(closer->head + closer->count) % OUTPUT_CLOSE_QUEUE] = *job;
+        closer->count++;
+        pthread_cond_broadcast(&closer->changed);
+    } else {
+        close(job->fd);
+    }
+    pthread_mutex_unlock(&closer->lock);
+    return accepted;
+}
+
+// Wait for every submitted file to be closed and end the thread
+static void file_closer_stop(file_closer_t *closer) {
+    if (!closer->running) {
+        return;
+    }
+    pthread_mutex_lock(&closer->lock);
+    closer->stopping = true;
+    pthread_cond_broadcast(&closer->changed);
+    pthread_mutex_unlock(&closer->lock);
+    pthread_join(closer->thread, NULL);
+    pthread_cond_destroy(&closer->changed);
+    pthread_mutex_destroy(&closer->lock);
+    closer->running = false;
+}
+
+// Compress len bytes of data into the current frame, or end the frame,
+// and write what the compressor produces to fd
+static bool output_compressor_run(output_compressor_t *compressor, int fd, const char *data,
+                                  size_t len, bool end) {
+    char out[COMPRESS_OUT_SIZE];
+#ifdef HAVE_ZLIB
+    if (compressor->method == COMPRESSION_GZIP) {
+        z_stream *gzip = &compressor->gzip;
+        int status;
+        gzip->next_in = (Bytef *)data;
+        gzip->avail_in = (uInt)len;
+        do {
+            gzip->next_out = (Bytef *)out;
+            gzip->avail_out = sizeof(out);
+            status = deflate(gzip, end ? Z_FINISH : Z_NO_FLUSH);
+            if (status == Z_STREAM_ERROR ||
+                !write_fully(fd, out, sizeof(out) - gzip->avail_out)) {
+                return false;
+            }
+        } while (end ? status != Z_STREAM_END : gzip->avail_out == 0);
+        return !end || deflateReset(gzip) == Z_OK;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (compressor->method == COMPRESSION_ZSTD) {
+        ZSTD_inBuffer in = {data, len, 0};
+        size_t remaining;
+        do {
+            ZSTD_outBuffer zout = {out, sizeof(out), 0};
+            remaining = ZSTD_compressStream2(compressor->zstd, &zout, &in,
+                                             end ? ZSTD_e_end : ZSTD_e_continue);
+            if (ZSTD_isError(remaining) || !write_fully(fd, out, zout.pos)) {
+                return false;
+            }
+        } while (end ? remaining != 0 : in.pos < in.size);
+        return true;
+    }
+#endif
+    (void)out;
+    (void)fd;
+    (void)data;
+    (void)len;
+    (void)end;
+    return false;
+}
+
+// Compressor thread: work through the queue in order, compressing each
+// block into the current frame, ending frames where asked, and passing
+// files whose last frame is out on to the closer thread
+static void *output_compressor_main(void *arg) {
+    output_compressor_t *compressor = arg;
+    pthread_mutex_lock(&compressor->lock);
+    while (true) {
+        while (compressor->count == 0 && !compressor->stopping) {
+            pthread_cond_wait(&compressor->changed, &compressor->lock);
+        }
+        if (compressor->count == 0) {
+            break;
+        }
+        size_t slot = compressor->head;
+        compress_job_t job = compressor->jobs[slot];
+        pthread_mutex_unlock(&compressor->lock);
+
+        bool ok = true;
+        if (job.length > 0) {
+            ok = output_compressor_run(compressor, job.fd, compressor->blocks[slot], job.length, false);
+            compressor->frame_open = true;
+        }
+        if (job.end_frame) {
+            if (compressor->frame_open || job.end_empty) {
+                ok = output_compressor_run(compressor, job.fd, NULL, 0, true) && ok;
+            }
+            compressor->frame_open = false;
+        }
+        if (job.retire.fd >= 0) {
+            file_closer_submit(compressor->closer, &job.retire);
+        }
+
+        pthread_mutex_lock(&compressor->lock);
+        compressor->failed |= !ok;
+        compressor->head = (compressor->head + 1) % COMPRESS_BLOCKS;
+        compressor->count--;
+        pthread_cond_broadcast(&compressor->changed);
+    }
+    pthread_mutex_unlock(&compressor->lock);
+    return NULL;
+}
+
+// Claim the next queue slot, waiting only while COMPRESS_BLOCKS jobs are
+// already queued.  Called with the lock held; the job is filled in and
+// counted by the caller.
+static size_t output_compressor_claim(output_compressor_t *compressor) {
+    while (compressor->count == COMPRESS_BLOCKS) {
+        pthread_cond_wait(&compressor->changed, &compressor->lock);
+    }
+    return (compressor->head + compressor->count) % COMPRESS_BLOCKS;
+}
+
+// Write function of the compressed stream: copy the stdio buffer into
+// free blocks for the compressor thread
+static ssize_t output_compressor_write(void *cookie, const char *data, size_t size) {
+    output_compressor_t *compressor = cookie;
+    size_t done = 0;
+    pthread_mutex_lock(&compressor->lock);
+    while (done < size && !compressor->failed) {
+        size_t slot = output_compressor_claim(compressor);
+        size_t take = size - done < COMPRESS_BLOCK_SIZE ? size - done : COMPRESS_BLOCK_SIZE;
+        pthread_mutex_unlock(&compressor->lock);
+        memcpy(compressor->blocks[slot], data + done, take);
+        pthread_mutex_lock(&compressor->lock);
+        compressor->jobs[slot] = (compress_job_t){take, compressor->fd, false, false, {.fd = -1}};
+        compressor->count++;
+        done += take;
+        pthread_cond_broadcast(&compressor->changed);
+    }
+    bool failed = compressor->failed;
+    pthread_mutex_unlock(&compressor->lock);
+    return failed ? -1 : (ssize_t)size;
+}
+
+// Flush the stream and queue the end of the frame after everything
+// written so far, so the output up to there can be decompressed on its
+// own.  empty_frame writes a frame even if nothing was written since the
+// last one.  A retire job (fd >= 0) goes to the closer thread once the
+// frame is written.  Does not wait for the compressor thread.
+static void output_compressor_queue_end(output_compressor_t *compressor, bool empty_frame,
+                                        const file_job_t *retire) {
+    fflush(compressor->stream);
+    pthread_mutex_lock(&compressor->lock);
+    size_t slot = output_compressor_claim(compressor);
+    compressor->jobs[slot] = (compress_job_t){0, compressor->fd, true, empty_frame, {.fd = -1}};
+    if (retire) {
+        compressor->jobs[slot].retire = *retire;
+    }
+    compressor->count++;
+    pthread_cond_broadcast(&compressor->changed);
+    pthread_mutex_unlock(&compressor->lock);
+}
+
+// Wait until the compressor thread has worked through the queue
+static ts_error_t output_compressor_drain(output_compressor_t *compressor) {
+    pthread_mutex_lock(&compressor->lock);
+    while (compressor->count > 0) {
+        pthread_cond_wait(&compressor->changed, &compressor->lock);
+    }
+    bool failed = compressor->failed;
+    pthread_mutex_unlock(&compressor->lock);
+    return failed ? TS_ERROR_SYSTEM : TS_SUCCESS;
+}
+
+static void output_compressor_free(output_compressor_t *compressor) {
+#ifdef HAVE_ZLIB
+    if (compressor->method == COMPRESSION_GZIP) {
+        deflateEnd(&compressor->gzip);
+    }
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(compressor->zstd);
+    compressor->zstd = NULL;
+#endif
+    free(compressor->blocks[0]);
+    compressor->blocks[0] = NULL;
+}
+
+// Start compressing with the method and level already set in compressor.
+// Output written to compressor->stream comes out compressed on standard
+// output.
+static ts_error_t output_compressor_start(output_compressor_t *compressor) {
+    char *blocks = malloc((size_t)COMPRESS_BLOCKS * COMPRESS_BLOCK_SIZE);
+    if (!blocks) {
+        return TS_ERROR_SYSTEM;
+    }
+    for (int i = 0; i < COMPRESS_BLOCKS; i++) {
+        compressor->blocks[i] = blocks + (size_t)i * COMPRESS_BLOCK_SIZE;
+    }
+    bool ready = false;
+#ifdef HAVE_ZLIB
+    if (compressor->method == COMPRESSION_GZIP) {
+        // Window bits 15 + 16: gzip header and trailer instead of zlib's
+        memset(&compressor->gzip, 0, sizeof(compressor->gzip));
+        ready = deflateInit2(&compressor->gzip, compressor->level, Z_DEFLATED, 15 + 16, 8,
+                             Z_DEFAULT_STRATEGY) == Z_OK;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (compressor->method == COMPRESSION_ZSTD) {
+        compressor->zstd = ZSTD_createCCtx();
+        ready = compressor->zstd &&
+                !ZSTD_isError(ZSTD_CCtx_setParameter(compressor->zstd, ZSTD_c_compressionLevel,
+                                                     compressor->level));
+    }
+#endif
+    if (!ready) {
+        output_compressor_free(compressor);
+        return TS_ERROR_SYSTEM;
+    }
+
+#ifdef HAVE_FOPENCOOKIE
+    cookie_io_functions_t io = {.write = output_compressor_write};
+    compressor->stream = fopencookie(compressor, "w", io);
+#endif
+    if (!compressor->stream) {
+        output_compressor_free(compressor);
+        return TS_ERROR_SYSTEM;
+    }
+    setvbuf(compressor->stream, NULL, _IOFBF, COMPRESS_BLOCK_SIZE);
+    if (pthread_mutex_init(&compressor->lock, NULL) != 0 ||
+        pthread_cond_init(&compressor->changed, NULL) != 0 ||
+        pthread_create(&compressor->thread, NULL, output_compressor_main, compressor) != 0) {
+        // Not reached in practice; the stream never saw a write
+        fclose(compressor->stream);
+        output_compressor_free(compressor);
+        return TS_ERROR_SYSTEM;
+    }
+
+    fflush(stdout);
+    compressor->fd = STDOUT_FILENO;
+    return TS_SUCCESS;
+}
+
+// End the last frame and stop the thread.  empty_frame as for
+// output_compressor_queue_end().
+static ts_error_t output_compressor_stop(output_compressor_t *compressor, bool empty_frame) {
+    output_compressor_queue_end(compressor, empty_frame, NULL);
+    ts_error_t result = output_compressor_drain(compressor);
+    pthread_mutex_lock(&compressor->lock);
+    compressor->stopping = true;
+    pthread_cond_broadcast(&compressor->changed);
+    pthread_mutex_unlock(&compressor->lock);
+    pthread_join(compressor->thread, NULL);
+
+    fclose(compressor->stream);
+    pthread_cond_destroy(&compressor->changed);
+    pthread_mutex_destroy(&compressor->lock);
+    output_compressor_free(compressor);
+    return result;
+}
+
+// Once the writer is within half a step of the reserved space, have the
+// closer thread reserve the next OUTPUT_PREALLOCATE_BYTES of the current
+// file (no further than rotate_size), so fallocate() runs ahead of the
+// writes instead of in their way
+static void output_file_preallocate(output_file_t *output) {
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+    uint64_t limit = output->rotate_size > 0 ? output->rotate_size : UINT64_MAX;
+    uint64_t start = output->preallocated > output->size ? output->preallocated : output->size;
+    if (start >= limit || output->size + OUTPUT_PREALLOCATE_BYTES / 2 < output->preallocated) {
+        return;
+    }
+    uint64_t length = limit - start < OUTPUT_PREALLOCATE_BYTES ? limit - start : OUTPUT_PREALLOCATE_BYTES;
+    file_job_t job = {dup(STDOUT_FILENO), false, start, start + length};
+    if (job.fd >= 0 && file_closer_submit(&output->closer, &job)) {
+        output->preallocated = job.preallocated;
+        return;
+    }
+#endif
+    // Not supported here; stop asking
+    output->preallocated = UINT64_MAX;
+}
+
+// Hand the current file to the closer thread once everything written so
+// far is in it.  Compressed output gets there through the compressor
+// thread, which ends the file's last frame first; neither waits here.
+static void output_file_retire(output_file_t *output) {
+    file_job_t file = {-1, true, output->size, output->preallocated};
+    if (output->compressor) {
+        file.fd = output->compressor->fd;
+        output_compressor_queue_end(output->compressor, false, &file);
+    } else {
+        fflush(output->stream);
+        file.fd = dup(STDOUT_FILENO);
+        if (file.fd >= 0) {
+            file_closer_submit(&output->closer, &file);
+        }
+    }
+}
+
+// Make path the current output file, appending if it exists.  The old
+// file is retired first, so it gets everything written to it so far.
+// The compressor thread writes each file through a descriptor of its own.
+static ts_error_t output_file_switch(output_file_t *output, const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    struct stat st;
+    if (fd < 0) {
+        return TS_ERROR_SYSTEM;
+    }
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return TS_ERROR_SYSTEM;
+    }
+
+    if (output->open) {
+        output_file_retire(output);
+        output->open = false;
+    }
+    if (dup2(fd, STDOUT_FILENO) < 0) {
+        close(fd);
+        return TS_ERROR_SYSTEM;
+    }
+    close(fd);
+    if (output->compressor && (output->compressor->fd = dup(STDOUT_FILENO)) < 0) {
+        return TS_ERROR_SYSTEM;
+    }
+
+    output->open = true;
+    output->size = (uint64_t)st.st_size;
+    output->preallocated = output->size;
+    snprintf(output->path, sizeof(output->path), "%s", path);
+    if (output->format == OUTPUT_FORMAT_BINARY && output->size == 0) {
+        output->size += fwrite(BINARY_STREAM_MAGIC, 1, BINARY_STREAM_MAGIC_LENGTH, output->stream);
+    }
+    output_file_preallocate(output);
+    return TS_SUCCESS;
+}
+
+// Called before each line is written with the line's time: move to a new
+// file when the name rendered for the time changes or the current file
+// has reached rotate_size.  Names are rendered once per second.
+static ts_error_t output_file_prepare(output_file_t *output, const high_res_time_t *time) {
+    bool rotate = false;
+    if (!output->open || time->seconds != output->name_second) {
+        char base[PATH_MAX];
+        high_res_time_t name_time = {time->seconds, 0};
+        if (tsi_format_timestamp_compiled(base, sizeof(base), &output->name_format, &name_time) != TS_SUCCESS ||
+            base[0] == '\0') {
+            return TS_ERROR_INVALID_ARGUMENT;
+        }
+        output->name_second = time->seconds;
+        if (!output->open || strcmp(base, output->base) != 0) {
+            memcpy(output->base, base, sizeof(base));
+            output->sequence = 0;
+            rotate = true;
+        }
+    }
+    if (!rotate && !(output->rotate_size > 0 && output->size >= output->rotate_size)) {
+        output_file_preallocate(output);
+        return TS_SUCCESS;
+    }
+
+    // Skip past files a previous run already filled
+    if (!rotate) {
+        output->sequence++;
+    }
+    while (true) {
+        char path[PATH_MAX];
+        int written = output->sequence == 0
+                          ? snprintf(path, sizeof(path), "%s", output->base)
+                          : snprintf(path, sizeof(path), "%s.%lu", output->base, output->sequence);
+        if (written < 0 || (size_t)written >= sizeof(path)) {
+            return TS_ERROR_BUFFER_OVERFLOW;
+        }
+        ts_error_t result = output_file_switch(output, path);
+        if (result != TS_SUCCESS || output->rotate_size == 0 || output->size < output->rotate_size) {
+            return result;
+        }
+        output->sequence++;
+    }
+}
+
+// Set up --output; the first file is opened for the first line
+static void output_file_open(output_file_t *output, const char *pattern, uint64_t rotate_size,
+                             output_format_t format, output_compressor_t *compressor) {
+    *output = (output_file_t){.rotate_size = rotate_size, .format = format, .compressor = compressor,
+                              .stream = compressor ? compressor->stream : stdout};
+    if (compressor) {
+        compressor->closer = &output->closer;
+    }
+    tsi_compile_output_format(&output->name_format, pattern);
+    // Without a closer thread rotated files are closed in line
+    file_closer_start(&output->closer);
+}
+
+// Retire the last file and wait for the closer thread.  The compressor
+// thread hands files over, so it has to be done first.
+static void output_file_close(output_file_t *output) {
+    if (output->open) {
+        output_file_retire(output);
+        output->open = false;
+    }
+    if (output->compressor) {
+        output_compressor_drain(output->compressor);
+        output->compressor->fd = STDOUT_FILENO;
+    }
+    file_closer_stop(&output->closer);
+}
+
+// Compression method of data that starts with a gzip or zstd magic number
+static compression_t detect_compression(const unsigned char *data, size_t len) {
+    if (len >= 2 && data[0] == 0x1f && data[1] == 0x8b) {
+        return COMPRESSION_GZIP;
+    }
+    if (len >= 4 && data[0] == 0x28 && data[1] == 0xb5 && data[2] == 0x2f && data[3] == 0xfd) {
+        return COMPRESSION_ZSTD;
+    }
+    return COMPRESSION_NONE;
+}
+
+// Whether data, len bytes of it, could still grow into a gzip or zstd
+// magic number, so that more must be read before deciding
+static bool compression_magic_prefix(const unsigned char *data, size_t len) {
+    static const unsigned char gzip_magic[] = {0x1f, 0x8b};
+    static const unsigned char zstd_magic[] = {0x28, 0xb5, 0x2f, 0xfd};
+    return (len < sizeof(gzip_magic) && memcmp(data, gzip_magic, len) == 0) ||
+           (len < sizeof(zstd_magic) && memcmp(data, zstd_magic, len) == 0);
+}
+
+// Decompress from in into out.  *in_frame tracks whether a gzip member or
+// zstd frame has begun but not ended, which at the end of input means it
+// was cut short.  Concatenated members and frames decompress as one; bytes
+// after a gzip member that do not start another set *trailing, as gzip -d
+// ignores them.
+static bool input_decompressor_run(input_decompressor_t *decompressor, const char *in, size_t in_len,
+                                   char *out, size_t out_len, size_t *consumed, size_t *produced,
+                                   bool *in_frame, bool *trailing) {
+#ifdef HAVE_ZLIB
+    if (decompressor->method == COMPRESSION_GZIP) {
+        z_stream *gzip = &decompressor->gzip;
+        // Between members, anything but another gzip header ends the input
+        if (!*in_frame && in_len > 0 &&
+            ((unsigned char)in[0] != 0x1f || (in_len > 1 && (unsigned char)in[1] != 0x8b))) {
+            *consumed = in_len;
+            *produced = 0;
+            *trailing = true;
+            return true;
+        }
+        gzip->next_in = (Bytef *)in;
+        gzip->avail_in = (uInt)in_len;
+        gzip->next_out = (Bytef *)out;
+        gzip->avail_out = (uInt)out_len;
+        int status = inflate(gzip, Z_NO_FLUSH);
+        *consumed = in_len - gzip->avail_in;
+        *produced = out_len - gzip->avail_out;
+        *in_frame = true;
+        if (status == Z_STREAM_END) {
+            *in_frame = false;
+            return inflateReset(gzip) == Z_OK;
+        }
+        // Z_BUF_ERROR only means there was nothing to do
+        return status == Z_OK || status == Z_BUF_ERROR;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (decompressor->method == COMPRESSION_ZSTD) {
+        ZSTD_inBuffer zin = {in, in_len, 0};
+        ZSTD_outBuffer zout = {out, out_len, 0};
+        size_t hint = ZSTD_decompressStream(decompressor->zstd, &zout, &zin);
+        *consumed = zin.pos;
+        *produced = zout.pos;
+        *in_frame = hint != 0;
+        return !ZSTD_isError(hint);
+    }
+#endif
+    (void)in;
+    (void)in_len;
+    (void)out;
+    (void)out_len;
+    (void)consumed;
+    (void)produced;
+    (void)in_frame;
+    (void)trailing;
+    return false;
+}
+
+static void input_decompressor_free(input_decompressor_t *decompressor) {
+#ifdef HAVE_ZLIB
+    if (decompressor->method == COMPRESSION_GZIP) {
+        inflateEnd(&decompressor->gzip);
+    }
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_freeDCtx(decompressor->zstd);
+#endif
+    free(decompressor);
+}
+
+// Wait for a free block; NULL once the reader has stopped
+static char *input_decompressor_claim(input_decompressor_t *decompressor) {
+    char *block = NULL;
+    pthread_mutex_lock(&decompressor->lock);
+    while (decompressor->count == DECOMPRESS_BLOCKS && !decompressor->abandoned) {
+        pthread_cond_wait(&decompressor->changed, &decompressor->lock);
+    }
+    if (!decompressor->abandoned) {
+        block = decompressor->blocks[(decompressor->head + decompressor->count) % DECOMPRESS_BLOCKS];
+    }
+    pthread_mutex_unlock(&decompressor->lock);
+    return block;
+}
+
+// Hand the claimed block, holding len bytes, to the reader
+static void input_decompressor_publish(input_decompressor_t *decompressor, size_t len) {
+    pthread_mutex_lock(&decompressor->lock);
+    decompressor->lengths[(decompressor->head + decompressor->count) % DECOMPRESS_BLOCKS] = len;
+    decompressor->count++;
+    pthread_cond_broadcast(&decompressor->changed);
+    pthread_mutex_unlock(&decompressor->lock);
+}
+
+// Decompressor thread.  A partly filled block is handed over before each
+// read of more compressed input, so lines arriving slowly through a pipe
+// are not held back.
+static void *input_decompressor_main(void *arg) {
+    input_decompressor_t *decompressor = arg;
+    size_t in_pos = 0;
+    bool input_eof = false;
+    bool in_frame = false;
+    bool trailing = false;
+    bool output_pending = false;    // The last call filled the block; it may have more
+    bool ok = true;
+    char *block = NULL;
+    size_t block_len = 0;
+
+    while (ok) {
+        if (!block) {
+            block = input_decompressor_claim(decompressor);
+            block_len = 0;
+            if (!block) {
+                break;
+            }
+        }
+        if (in_pos == decompressor->input_len && !output_pending) {
+            if (block_len > 0 || input_eof) {
+                if (block_len > 0) {
+                    input_decompressor_publish(decompressor, block_len);
+                    block = NULL;
+                }
+                if (input_eof) {
+                    ok = !in_frame;
+                    break;
+                }
+                continue;
+            }
+            ssize_t bytes_read = read(decompressor->fd, decompressor->input, sizeof(decompressor->input));
+            if (bytes_read < 0 && errno == EINTR) {
+                continue;
+            }
+            ok = bytes_read >= 0;
+            input_eof = bytes_read == 0;
+            decompressor->input_len = bytes_read > 0 ? (size_t)bytes_read : 0;
+            in_pos = 0;
+            continue;
+        }
+
+        size_t consumed;
+        size_t produced;
+        ok = input_decompressor_run(decompressor, decompressor->input + in_pos,
+                                    decompressor->input_len - in_pos, block + block_len,
+                                    LINE_READER_BUFFER_SIZE - block_len, &consumed, &produced, &in_frame,
+                                    &trailing);
+        if (trailing) {
+            fprintf(stderr, "Warning: Trailing garbage after compressed input ignored\n");
+            input_eof = true;
+            decompressor->input_len = 0;
+            in_pos = 0;
+            output_pending = false;
+            continue;
+        }
+        output_pending = produced == LINE_READER_BUFFER_SIZE - block_len;
+        in_pos += consumed;
+        block_len += produced;
+        if (ok && block_len == LINE_READER_BUFFER_SIZE) {
+            input_decompressor_publish(decompressor, block_len);
+            block = NULL;
+        }
+    }
+
+    pthread_mutex_lock(&decompressor->lock);
+    decompressor->done = true;
+    decompressor->failed = !ok;
+    bool abandoned = decompressor->abandoned;
+    pthread_cond_broadcast(&decompressor->changed);
+    pthread_mutex_unlock(&decompressor->lock);
+    if (abandoned) {
+        input_decompressor_free(decompressor);
+    }
+    return NULL;
+}
+
+// Copy up to size decompressed bytes into buffer.  Returns 0 at the end
+// of input, including after a failure.
+static size_t input_decompressor_read(input_decompressor_t *decompressor, char *buffer, size_t size) {
+    pthread_mutex_lock(&decompressor->lock);
+    while (decompressor->count == 0 && !decompressor->done) {
+        pthread_cond_wait(&decompressor->changed, &decompressor->lock);
+    }
+    if (decompressor->count == 0) {
+        pthread_mutex_unlock(&decompressor->lock);
+        return 0;
+    }
+    size_t slot = decompressor->head;
+    pthread_mutex_unlock(&decompressor->lock);
+
+    size_t take = decompressor->lengths[slot] - decompressor->offset;
+    if (take > size) {
+        take = size;
+    }
+    memcpy(buffer, decompressor->blocks[slot] + decompressor->offset, take);
+    decompressor->offset += take;
+    if (decompressor->offset == decompressor->lengths[slot]) {
+        decompressor->offset = 0;
+        pthread_mutex_lock(&decompressor->lock);
+        decompressor->head = (decompressor->head + 1) % DECOMPRESS_BLOCKS;
+        decompressor->count--;
+        pthread_cond_broadcast(&decompressor->changed);
+        pthread_mutex_unlock(&decompressor->lock);
+    }
+    return take;
+}
+
+// Wait up to timeout_ns for decompressed input; true once there is some,
+// or the input has ended
+static bool input_decompressor_wait(input_decompressor_t *decompressor, int64_t timeout_ns) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    int64_t seconds = timeout_ns / NANOSECONDS_PER_SECOND;
+    deadline.tv_sec = seconds > INT32_MAX ? deadline.tv_sec + INT32_MAX : deadline.tv_sec + (time_t)seconds;
+    deadline.tv_nsec += (long)(timeout_ns % NANOSECONDS_PER_SECOND);
+    if (deadline.tv_nsec >= NANOSECONDS_PER_SECOND) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= NANOSECONDS_PER_SECOND;
+    }
+    pthread_mutex_lock(&decompressor->lock);
+    while (decompressor->count == 0 && !decompressor->done &&
+           pthread_cond_timedwait(&decompressor->changed, &decompressor->lock, &deadline) != ETIMEDOUT) {
+    }
+    bool ready = decompressor->count > 0 || decompressor->done;
+    pthread_mutex_unlock(&decompressor->lock);
+    return ready;
+}
+
+// Start decompressing fd with method on a new thread.  pending holds the
+// first len compressed bytes, already read from fd.
+static ts_error_t input_decompressor_start(input_decompressor_t **started, compression_t method, int fd,
+                                           const char *pending, size_t len) {
+    input_decompressor_t *decompressor = calloc(1, sizeof(*decompressor));
+    if (!decompressor) {
+        return TS_ERROR_SYSTEM;
+    }
+    decompressor->method = method;
+    decompressor->fd = fd;
+    memcpy(decompressor->input, pending, len);
+    decompressor->input_len = len;
+
+    ts_error_t result = TS_ERROR_INVALID_ARGUMENT;   // Not built in
+#ifdef HAVE_ZLIB
+    if (method == COMPRESSION_GZIP) {
+        // Window bits 15 + 16: gzip members only
+        result = inflateInit2(&decompressor->gzip, 15 + 16) == Z_OK ? TS_SUCCESS : TS_ERROR_SYSTEM;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (method == COMPRESSION_ZSTD) {
+        decompressor->zstd = ZSTD_createDCtx();
+        result = decompressor->zstd ? TS_SUCCESS : TS_ERROR_SYSTEM;
+    }
+#endif
+    if (result != TS_SUCCESS) {
+        decompressor->method = COMPRESSION_NONE;
+        input_decompressor_free(decompressor);
+        return result;
+    }
+    if (pthread_mutex_init(&decompressor->lock, NULL) != 0 ||
+        pthread_cond_init(&decompressor->changed, NULL) != 0 ||
+        pthread_create(&decompressor->thread, NULL, input_decompressor_main, decompressor) != 0) {
+        input_decompressor_free(decompressor);
+        return TS_ERROR_SYSTEM;
+    }
+    *started = decompressor;
+    return TS_SUCCESS;
+}
+
+// Stop decompressing and release the decompressor.  Returns
+// TS_ERROR_INVALID_ARGUMENT if the input was corrupt or cut short, or could
+// not be read.  A thread still running (the reader stopped early) is left
+// to notice and free the decompressor itself.
+static ts_error_t input_decompressor_stop(input_decompressor_t *decompressor) {
+    pthread_mutex_lock(&decompressor->lock);
+    if (!decompressor->done) {
+        pthread_t thread = decompressor->thread;
+        decompressor->abandoned = true;
+        pthread_cond_broadcast(&decompressor->changed);
+        pthread_mutex_unlock(&decompressor->lock);
+        pthread_detach(thread);
+        return TS_SUCCESS;
+    }
+    bool failed = decompressor->failed;
+    pthread_mutex_unlock(&decompressor->lock);
+    pthread_join(decompressor->thread, NULL);
+    pthread_cond_destroy(&decompressor->changed);
+    pthread_mutex_destroy(&decompressor->lock);
+    input_decompressor_free(decompressor);
+    return failed ? TS_ERROR_INVALID_ARGUMENT : TS_SUCCESS;
+}
+
+// Read more input into buffer, decompressed if the input is compressed.
+// Returns 0 at the end of input.
+static ssize_t line_reader_read(line_reader_t *reader, char *buffer, size_t size) {
+    if (reader->decompressor) {
+        return (ssize_t)input_decompressor_read(reader->decompressor, buffer, size);
+    }
+    while (true) {
+        // With -S, SIGUSR1 is only let through here, so that a report can
+        // be asked for while input is idle and nothing else sees EINTR
+        if (reader->stats) {
+            stats_signal_mask(SIG_UNBLOCK);
+        }
+        ssize_t bytes_read = read(reader->fd, buffer, size);
+        int read_errno = errno;
+        if (reader->stats) {
+            stats_signal_mask(SIG_BLOCK);
+            run_stats_poll(reader->stats);
+        }
+        if (bytes_read >= 0 || read_errno != EINTR) {
+            errno = read_errno;
+            return bytes_read;
+        }
+    }
+}
+
+// Read the first batch of input and, with detect, decompress the rest on
+// a thread if it starts with a gzip or zstd magic number.  A first read
+// that stops partway through a magic number is topped up first.  Returns
+// TS_ERROR_INVALID_ARGUMENT, with *method set, when this build cannot
+// decompress it.
+static ts_error_t line_reader_open(line_reader_t *reader, int fd, bool detect, compression_t *method) {
+    *reader = (line_reader_t){.fd = fd};
+    *method = COMPRESSION_NONE;
+    ssize_t bytes_read = line_reader_read(reader, reader->buffer, sizeof(reader->buffer));
+    if (bytes_read <= 0) {
+        reader->eof = true;
+        return TS_SUCCESS;
+    }
+    reader->end = (size_t)bytes_read;
+    reader->batch_pending = true;
+    if (!detect) {
+        return TS_SUCCESS;
+    }
+    while (compression_magic_prefix((const unsigned char *)reader->buffer, reader->end)) {
+        bytes_read = line_reader_read(reader, reader->buffer + reader->end,
+                                      sizeof(reader->buffer) - reader->end);
+        if (bytes_read <= 0) {
+            reader->eof = true;
+            return TS_SUCCESS;
+        }
+        reader->end += (size_t)bytes_read;
+    }
+
+    *method = detect_compression((const unsigned char *)reader->buffer, reader->end);
+    if (*method == COMPRESSION_NONE) {
+        return TS_SUCCESS;
+    }
+    ts_error_t result = input_decompressor_start(&reader->decompressor, *method, fd,
+                                                 reader->buffer, reader->end);
+    if (result == TS_SUCCESS) {
+        reader->end = 0;
+        reader->batch_pending = false;
+    }
+    return result;
+}
+
+// Wait up to timeout_ns for the next line of input to start arriving; true
+// once it has, or the input has ended.  A line already buffered is ready.
+static bool line_reader_wait(line_reader_t *reader, int64_t timeout_ns) {
+    if (reader->eof || memchr(reader->buffer + reader->start, '\n', reader->end - reader->start)) {
+        return true;
+    }
+    if (reader->decompressor) {
+        return input_decompressor_wait(reader->decompressor, timeout_ns);
+    }
+    int64_t timeout_ms = (timeout_ns + 999999) / 1000000;
+    struct pollfd input = {.fd = reader->fd, .events = POLLIN};
+    while (true) {
+        // SIGUSR1 gets through as it does while reading
+        if (reader->stats) {
+            stats_signal_mask(SIG_UNBLOCK);
+        }
+        int ready = poll(&input, 1, timeout_ms > INT_MAX ? INT_MAX : (int)timeout_ms);
+        int poll_errno = errno;
+        if (reader->stats) {
+            stats_signal_mask(SIG_BLOCK);
+            run_stats_poll(reader->stats);
+        }
+        // An error is for the read to report
+        if (ready >= 0 || poll_errno != EINTR) {
+            return ready != 0;
+        }
+    }
+}
+
+// Read the next line of input into line, splitting lines longer than
+// line_size - 1 bytes exactly where fgets() would.  Input is taken in large
+// read(2) batches; *new_batch reports that this line needed a fresh read,
+// i.e. that it arrived after the lines before it.  Returns false at end of
+// input.
+static bool line_reader_next(line_reader_t *reader, char *line, size_t line_size,
+                             bool *new_batch) {
+    size_t len = 0;
+    *new_batch = reader->batch_pending;
+    reader->batch_pending = false;
+
+    while (true) {
+        const char *available = reader->buffer + reader->start;
+        size_t take = reader->end - reader->start;
+        if (take > line_size - 1 - len) {
+            take = line_size - 1 - len;
+        }
+        const char *newline = memchr(available, '\n', take);
+        if (newline) {
+            take = (size_t)(newline - available) + 1;
+        }
+        memcpy(line + len, available, take);
+        len += take;
+        reader->start += take;
+        if (newline || len == line_size - 1 || reader->eof) {
+            break;
+        }
+
+        // The buffer is used up; wait for the next batch
+        ssize_t bytes_read = line_reader_read(reader, reader->buffer, sizeof(reader->buffer));
+        reader->start = 0;
+        reader->end = bytes_read > 0 ? (size_t)bytes_read : 0;
+        reader->eof = bytes_read <= 0;
+        *new_batch = bytes_read > 0;
+    }
+
+    line[len] = '\0';
+    return len > 0;
+}
+
+// Read more input behind what is still buffered, moving that to the front
+// of the buffer first.  Returns false at end of input.
+static bool line_reader_refill(line_reader_t *reader) {
+    size_t left = reader->end - reader->start;
+    memmove(reader->buffer, reader->buffer + reader->start, left);
+    reader->start = 0;
+    reader->end = left;
+
+    if (reader->eof) {
+        return false;
+    }
+    ssize_t bytes_read = line_reader_read(reader, reader->buffer + reader->end,
+                                          sizeof(reader->buffer) - reader->end);
+    reader->eof = bytes_read <= 0;
+    if (bytes_read > 0) {
+        reader->end += (size_t)bytes_read;
+        return true;
+    }
+    return false;
+}
+
+// Check the stream magic at the start of --decode input.  Empty input is
+// an empty stream.
+static ts_error_t binary_stream_start(line_reader_t *reader) {
+    while (reader->end - reader->start < BINARY_STREAM_MAGIC_LENGTH) {
+        if (!line_reader_refill(reader)) {
+            return reader->end == reader->start ? TS_SUCCESS : TS_ERROR_INVALID_ARGUMENT;
+        }
+    }
+    if (memcmp(reader->buffer + reader->start, BINARY_STREAM_MAGIC, BINARY_STREAM_MAGIC_LENGTH) != 0) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+    reader->start += BINARY_STREAM_MAGIC_LENGTH;
+    return TS_SUCCESS;
+}
+
+// Read the next binary record into line and time, the --decode
+// counterpart of line_reader_next().  *have_record is false at the end of
+// input; a record cut short by the end of input is an error.
+static ts_error_t binary_record_next(line_reader_t *reader, char *line, size_t line_size,
+                                     high_res_time_t *time, bool *have_record, bool *new_batch) {
+    *have_record = false;
+    *new_batch = reader->batch_pending;
+    reader->batch_pending = false;
+
+    while (true) {
+        size_t consumed;
+        ts_error_t result = parse_binary_record((const unsigned char *)reader->buffer + reader->start,
+                                                reader->end - reader->start, line, line_size,
+                                                time, &consumed);
+        if (result != TS_SUCCESS) {
+            return result;
+        }
+        if (consumed > 0) {
+            reader->start += consumed;
+            *have_record = true;
+            return TS_SUCCESS;
+        }
+        if (!line_reader_refill(reader)) {
+            return reader->end == reader->start ? TS_SUCCESS : TS_ERROR_INVALID_ARGUMENT;
+        }
+        *new_batch = true;
+    }
+}
+
+// Start of the line holding byte pos: pos itself when a line starts there,
+// otherwise the start of the next line (size if there is none)
+static size_t mapped_line_start(const char *data, size_t size, size_t pos) {
+    if (pos == 0 || pos >= size) {
+        return pos < size ? pos : size;
+    }
+    const char *newline = memchr(data + pos - 1, '\n', size - pos + 1);
+    return newline ? (size_t)(newline - data) + 1 : size;
+}
+
+// Time of the first line starting in [*pos, limit) whose timestamp -r
+// can detect, moving *pos to that line's start
+static bool mapped_line_time(const char *data, size_t size, size_t limit, size_t *pos,
+                             reference_time_t *reference, high_res_time_t *time) {
+    char line[MAX_LINE_LENGTH];
+    while (*pos < limit) {
+        const char *start = data + *pos;
+        const char *newline = memchr(start, '\n', size - *pos);
+        size_t len = newline ? (size_t)(newline - start) + 1 : size - *pos;
+        size_t copy = len < sizeof(line) ? len : sizeof(line) - 1;
+        memcpy(line, start, copy);
+        line[copy] = '\0';
+
+        time_t parsed;
+        long fraction = 0;
+        if (parse_timestamp_in_line_with_fractional(line, &parsed, &fraction, reference) == TS_SUCCESS) {
+            *time = (high_res_time_t){parsed, fraction * 1000};
+            return true;
+        }
+        *pos += len;
+    }
+    return false;
+}
+
+static inline bool high_res_time_before(const high_res_time_t *a, const high_res_time_t *b) {
+    return a->seconds < b->seconds || (a->seconds == b->seconds && a->nanoseconds < b->nanoseconds);
+}
+
+// Start of the first line timed at or after target in data[0..size), a
+// log sorted by time, or size if there is none.  Lines without a timestamp
+// belong to the timed line before them.  Binary search probes resync to
+// the next line start and take the first timestamp found from there;
+// the last RANGE_SCAN_BYTES are scanned line by line.
+#ifdef TS_TESTING
+size_t find_time_offset(const char *data, size_t size, const high_res_time_t *target,
+                        reference_time_t *reference) {
+#else
+static size_t find_time_offset(const char *data, size_t size, const high_res_time_t *target,
+                               reference_time_t *reference) {
+#endif
+    // Timed lines starting before low are all earlier than target; the
+    // first timed line starting at or after high (if any) is not
+    size_t low = 0;
+    size_t high = size;
+    while (high - low > RANGE_SCAN_BYTES) {
+        size_t mid = low + (high - low) / 2;
+        size_t pos = mapped_line_start(data, size, mid);
+        high_res_time_t time;
+        if (mapped_line_time(data, size, high, &pos, reference, &time) &&
+            high_res_time_before(&time, target)) {
+            low = pos;
+        } else {
+            high = mid;
+        }
+    }
+
+    size_t pos = mapped_line_start(data, size, low);
+    high_res_time_t time;
+    while (mapped_line_time(data, size, size, &pos, reference, &time)) {
+        if (!high_res_time_before(&time, target)) {
+            return pos;
+        }
+        pos = mapped_line_start(data, size, pos + 1);
+    }
+    return size;
+}
+
+// --query without an index: binary-search stdin, a time-sorted text file
+// such as ts output, for the lines timed in [from, to) and copy them out
+static ts_error_t run_range_query(const high_res_time_t *from, const high_res_time_t *to,
+                                  reference_time_t *reference) {
+    struct stat st;
+    if (fstat(STDIN_FILENO, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Error: --query needs a file as input\n");
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+    if (st.st_size == 0) {
+        return TS_SUCCESS;
+    }
+
+    size_t size = (size_t)st.st_size;
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Error: Cannot map input: %s\n", strerror(errno));
+        return TS_ERROR_SYSTEM;
+    }
+    ts_error_t result = TS_SUCCESS;
+    if (size >= BINARY_STREAM_MAGIC_LENGTH &&
+        memcmp(data, BINARY_STREAM_MAGIC, BINARY_STREAM_MAGIC_LENGTH) == 0) {
+        fprintf(stderr, "Error: Binary record streams need --index for --query\n");
+        result = TS_ERROR_INVALID_ARGUMENT;
+    } else if (detect_compression((const unsigned char *)data, size) != COMPRESSION_NONE) {
+        fprintf(stderr, "Error: --query needs uncompressed input\n");
+        result = TS_ERROR_INVALID_ARGUMENT;
+    } else {
+        // Probes touch a page or two each; read-ahead would only waste I/O
+        madvise(data, size, MADV_RANDOM);
+        size_t start = find_time_offset(data, size, from, reference);
+        size_t end = to ? find_time_offset(data, size, to, reference) : size;
+        if (end > start) {
+            madvise(data + start, end - start, MADV_SEQUENTIAL);
+            fwrite(data + start, 1, end - start, stdout);
+        }
+    }
+    munmap(data, size);
+    return result;
+}
+
+// A --query bound: EPOCH[.FRAC] or any timestamp format -r recognizes
+static ts_error_t parse_query_time(const char *str, reference_time_t *reference,
+                                   high_res_time_t *time) {
+    if (tsi_parse_reference_time(str, time) == TS_SUCCESS) {
+        return TS_SUCCESS;
+    }
+    time_t parsed;
+    long fraction = 0;
+    ts_error_t result = parse_timestamp_in_line_with_fractional(str, &parsed, &fraction, reference);
+    if (result == TS_SUCCESS) {
+        *time = (high_res_time_t){parsed, fraction * 1000};
+    }
+    return result;
+}
+
+// A byte count with an optional K, M or G (binary) suffix
+static ts_error_t parse_size(const char *str, uint64_t *bytes) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(str, &end, 10);
+    if (errno != 0 || end == str || str[0] == '-') {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+    unsigned shift = 0;
+    switch (*end) {
+        case 'K': case 'k': shift = 10; end++; break;
+        case 'M': case 'm': shift = 20; end++; break;
+        case 'G': case 'g': shift = 30; end++; break;
+        default: break;
+    }
+    if (*end != '\0' || value > (UINT64_MAX >> shift)) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+    *bytes = (uint64_t)value << shift;
+    return TS_SUCCESS;
+}
+
+// Parse a --compress argument, METHOD[:LEVEL].  Returns TS_ERROR_SYSTEM
+// for a method this build was configured without.
+static ts_error_t parse_compression(const char *str, compression_t *method, int *level) {
+    const char *colon = strchr(str, ':');
+    size_t name_len = colon ? (size_t)(colon - str) : strlen(str);
+    int min_level = 1;
+    int max_level;
+    bool available = false;
+    if (name_len == 4 && strncmp(str, "gzip", 4) == 0) {
+        *method = COMPRESSION_GZIP;
+        *level = GZIP_DEFAULT_LEVEL;
+        max_level = 9;
+#ifdef HAVE_ZLIB
+        available = true;
+#endif
+    } else if (name_len == 4 && strncmp(str, "zstd", 4) == 0) {
+        *method = COMPRESSION_ZSTD;
+        *level = ZSTD_DEFAULT_LEVEL;
+        max_level = 19;
+#ifdef HAVE_ZSTD
+        max_level = ZSTD_maxCLevel();
+        available = true;
+#endif
+    } else {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+    if (colon) {
+        char *end;
+        errno = 0;
+        long value = strtol(colon + 1, &end, 10);
+        if (errno != 0 || end == colon + 1 || *end != '\0' || value < min_level || value > max_level) {
+            return TS_ERROR_INVALID_ARGUMENT;
+        }
+        *level = (int)value;
+    }
+#ifndef HAVE_FOPENCOOKIE
+    available = false;
+#endif
+    return available ? TS_SUCCESS : TS_ERROR_SYSTEM;
+}
+
+// --query: copy the part of stdin, a file written with --index, that holds
+// the lines timed in [from, to).  Text output is copied a whole index block
+// at a time; binary record streams are trimmed to the exact range and come
+// out as a stream --decode reads.
+static ts_error_t run_query(const char *index_path, const high_res_time_t *from, const high_res_time_t *to) {
+    int64_t from_ns;
+    int64_t to_ns = INT64_MAX;
+    if (!high_res_time_to_ns(from, &from_ns) || (to && !high_res_time_to_ns(to, &to_ns))) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+
+    index_entry_t *entries;
+    size_t count;
+    ts_error_t result = index_load(index_path, &entries, &count);
+    if (result != TS_SUCCESS) {
+        fprintf(stderr, "Error: Cannot read index %s\n", index_path);
+        return result;
+    }
+    uint64_t start;
+    uint64_t end;
+    index_find_range(entries, count, from_ns, to_ns, &start, &end);
+    free(entries);
+
+    unsigned char magic[BINARY_STREAM_MAGIC_LENGTH];
+    ssize_t magic_len = pread(STDIN_FILENO, magic, sizeof(magic), 0);
+    bool binary = magic_len == (ssize_t)sizeof(magic) &&
+                  memcmp(magic, BINARY_STREAM_MAGIC, sizeof(magic)) == 0;
+    if (magic_len > 0 && detect_compression(magic, (size_t)magic_len) != COMPRESSION_NONE) {
+        fprintf(stderr, "Error: --query needs uncompressed input\n");
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+    if (binary && start < BINARY_STREAM_MAGIC_LENGTH) {
+        start = BINARY_STREAM_MAGIC_LENGTH;
+    }
+    if (lseek(STDIN_FILENO, (off_t)start, SEEK_SET) < 0) {
+        fprintf(stderr, "Error: --query needs the indexed file as input\n");
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+
+    line_reader_t *reader = malloc(sizeof(*reader));
+    if (!reader) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return TS_ERROR_SYSTEM;
+    }
+    *reader = (line_reader_t){.fd = STDIN_FILENO};
+    if (binary) {
+        fwrite(BINARY_STREAM_MAGIC, 1, BINARY_STREAM_MAGIC_LENGTH, stdout);
+        while (true) {
+            char line[MAX_LINE_LENGTH];
+            high_res_time_t time;
+            bool have_record;
+            bool new_batch;
+            result = binary_record_next(reader, line, sizeof(line), &time, &have_record, &new_batch);
+            if (result != TS_SUCCESS) {
+                fprintf(stderr, "Error: Corrupt binary record stream\n");
+            }
+            int64_t time_ns;
+            if (result != TS_SUCCESS || !have_record || !high_res_time_to_ns(&time, &time_ns) ||
+                time_ns >= to_ns) {
+                break;
+            }
+            if (time_ns >= from_ns) {
+                line_record_t record = {.time = time, .line = line};
+                write_record(stdout, OUTPUT_FORMAT_BINARY, &record, NULL);
+            }
+        }
+    } else {
+        uint64_t left = end - start;
+        while (left > 0) {
+            size_t want = left < sizeof(reader->buffer) ? (size_t)left : sizeof(reader->buffer);
+            ssize_t bytes_read = read(STDIN_FILENO, reader->buffer, want);
+            if (bytes_read < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_read <= 0) {
+                break;
+            }
+            fwrite(reader->buffer, 1, (size_t)bytes_read, stdout);
+            left -= (uint64_t)bytes_read;
+        }
+    }
+    free(reader);
+    return result;
+}
+
+// Parse a --reorder window: a number with an optional fraction and a
+// unit of s (the default), ms, us or ns
+static ts_error_t parse_duration(const char *str, int64_t *ns) {
+    static const struct {
+        const char *suffix;
+        int64_t scale;
+    } units[] = {{"", NANOSECONDS_PER_SECOND}, {"s", NANOSECONDS_PER_SECOND}, {"ms", 1000000},
+                 {"us", 1000}, {"ns", 1}};
+    size_t whole_len = strspn(str, "0123456789");
+    const char *end = str + whole_len;
+    size_t fraction_len = 0;
+    time_t whole;
+    long fraction = 0;
+    if (*end == '.') {
+        fraction_len = strspn(end + 1, "0123456789");
+        if (fraction_len == 0 || tsi_parse_fraction_digits(end + 1, fraction_len, &fraction) != TS_SUCCESS) {
+            return TS_ERROR_INVALID_ARGUMENT;
+        }
+        end += fraction_len + 1;
+    }
+    if (tsi_parse_epoch_digits(str, whole_len, &whole) != TS_SUCCESS) {
+        return TS_ERROR_INVALID_ARGUMENT;
+    }
+    for (size_t i = 0; i < sizeof(units) / sizeof(units[0]); i++) {
+        if (strcmp(end, units[i].suffix) == 0) {
+            if ((int64_t)whole > INT64_MAX / units[i].scale - 1) {
+                return TS_ERROR_INVALID_ARGUMENT;
+            }
+            *ns = (int64_t)whole * units[i].scale + fraction / (NANOSECONDS_PER_SECOND / units[i].scale);
+            return TS_SUCCESS;
+        }
+    }
+    return TS_ERROR_INVALID_ARGUMENT;
+}
+
+static inline bool reorder_before(const reorder_entry_t *a, const reorder_entry_t *b) {
+    return a->time_ns < b->time_ns || (a->time_ns == b->time_ns && a->sequence < b->sequence);
+}
+
+// Hold line back until its turn.  Lines without a timestamp take the time
+// of the line before them, so they stay behind it.  The timestamp found
+// goes in record as well, so that a line let through on failure has it.
+static ts_error_t reorder_push(reorder_buffer_t *buffer, const char *line, line_record_t *record,
+                               reference_time_t *reference, run_stats_t *stats) {
+    time_t parsed;
+    long fraction = 0;
+    ts_error_t parse_result = stats ? parse_timestamp_in_line_counted(line, &parsed, &fraction, reference, stats)
+                                    : parse_timestamp_in_line_with_fractional(line, &parsed, &fraction, reference);
+    record->has_source = parse_result == TS_SUCCESS;
+    if (record->has_source) {
+        record->source = (high_res_time_t){parsed, fraction * 1000};
+        if (high_res_time_to_ns(&record->source, &buffer->last_ns)) {
+            buffer->newest_ns = !buffer->has_time || buffer->last_ns > buffer->newest_ns
+                                    ? buffer->last_ns : buffer->newest_ns;
+            buffer->has_time = true;
+        }
+    }
+    if (buffer->count == buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity * 2 : 256;
+        reorder_entry_t *heap = realloc(buffer->heap, capacity * sizeof(*heap));
+        if (!heap) {
+            return TS_ERROR_SYSTEM;
+        }
+        buffer->heap = heap;
+        reorder_entry_t *spare = realloc(buffer->spare, capacity * sizeof(*spare));
+        if (!spare) {
+            return TS_ERROR_SYSTEM;
+        }
+        buffer->spare = spare;
+        buffer->capacity = capacity;
+    }
+    size_t length = strlen(line) + 1;
+    reorder_entry_t entry = {buffer->has_time ? buffer->last_ns : INT64_MIN, buffer->sequence++,
+                             record->has_source, record->source, NULL, 0};
+    if (buffer->spare_count > 0) {
+        buffer->spare_count--;
+        entry.line = buffer->spare[buffer->spare_count].line;
+        entry.line_size = buffer->spare[buffer->spare_count].line_size;
+    }
+    if (entry.line_size < length) {
+        char *grown = realloc(entry.line, length);
+        if (!grown) {
+            free(entry.line);
+            return TS_ERROR_SYSTEM;
+        }
+        entry.line = grown;
+        entry.line_size = length;
+    }
+    memcpy(entry.line, line, length);
+    buffer->bytes += length + sizeof(entry);
+
+    // Sift up
+    size_t pos = buffer->count++;
+    while (pos > 0 && reorder_before(&entry, &buffer->heap[(pos - 1) / 2])) {
+        buffer->heap[pos] = buffer->heap[(pos - 1) / 2];
+        pos = (pos - 1) / 2;
+    }
+    buffer->heap[pos] = entry;
+    return TS_SUCCESS;
+}
+
+// Whether the earliest held line may go out: a line window later than it
+// has been read, the input has ended or been idle, or the buffer is full
+static bool reorder_ready(const reorder_buffer_t *buffer) {
+    if (buffer->count == 0) {
+        return false;
+    }
+    return buffer->eof || buffer->idle || buffer->bytes > REORDER_MAX_BYTES || !buffer->has_time ||
+           buffer->heap[0].time_ns <= buffer->newest_ns - buffer->window_ns;
+}
+
+// Take the earliest held line out into line, with its timestamp and
+// lateness in record
+static void reorder_pop(reorder_buffer_t *buffer, char *line, size_t line_size, line_record_t *record) {
+    reorder_entry_t top = buffer->heap[0];
+    reorder_entry_t last = buffer->heap[--buffer->count];
+    size_t pos = 0;
+    while (true) {
+        size_t child = 2 * pos + 1;
+        if (child >= buffer->count) {
+            break;
+        }
+        if (child + 1 < buffer->count && reorder_before(&buffer->heap[child + 1], &buffer->heap[child])) {
+            child++;
+        }
+        if (!reorder_before(&buffer->heap[child], &last)) {
+            break;
+        }
+        buffer->heap[pos] = buffer->heap[child];
+        pos = child;
+    }
+    if (buffer->count > 0) {
+        buffer->heap[pos] = last;
+    }
+
+    size_t length = strlen(top.line) + 1;
+    snprintf(line, line_size, "%s", top.line);
+    buffer->bytes -= length + sizeof(top);
+    buffer->spare[buffer->spare_count++] = top;
+    record->has_source = top.has_source;
+    record->source = top.source;
+    record->late = buffer->has_released && top.time_ns < buffer->released_ns;
+    if (record->late) {
+        buffer->late++;
+    } else {
+        buffer->has_released = true;
+        buffer->released_ns = top.time_ns;
+    }
+}
+
+// Next line in timestamp order for -r --reorder, reading ahead as far as
+// the window needs, with the timestamp parsed from it and whether it is
+// late in record.  new_batch tells whether the input was read at the
+// batch boundary, as line_reader_next() does.  Returns false once every
+// line has gone out.
+static bool reorder_next(reorder_buffer_t *buffer, line_reader_t *reader, char *line, size_t line_size,
+                         bool *new_batch, line_record_t *record, reference_time_t *reference,
+                         run_stats_t *stats) {
+    bool batch = false;
+    while (!reorder_ready(buffer)) {
+        bool read_batch;
+        if (!buffer->eof && buffer->count > 0 && !line_reader_wait(reader, buffer->window_ns)) {
+            // Nothing arrived for a whole window: what is held goes out
+            // rather than waiting on the input indefinitely
+            buffer->idle = true;
+            continue;
+        }
+        if (buffer->eof || !line_reader_next(reader, line, line_size, &read_batch)) {
+            buffer->eof = true;
+            if (buffer->count == 0) {
+                return false;
+            }
+            continue;
+        }
+        batch = batch || read_batch;
+        buffer->idle = false;
+        if (read_batch && buffer->follow_clock) {
+            // As the main loop does for -r, but before the line is parsed
+            high_res_time_t now = tsi_get_high_res_time(false);
+            tsi_reference_time_set(reference, &now);
+            if (stats) {
+                run_stats_stage(stats, STATS_STAGE_CLOCK);
+            }
+        }
+        if (reorder_push(buffer, line, record, reference, stats) != TS_SUCCESS) {
+            // Out of memory: let this line through as it is, out of order
+            *new_batch = batch;
+            record->late = true;
+            buffer->late++;
+            return true;
+        }
+    }
+    *new_batch = batch;
+    reorder_pop(buffer, line, line_size, record);
+    return true;
+}
+
+static void reorder_free(reorder_buffer_t *buffer) {
+    for (size_t i = 0; i < buffer->count; i++) {
+        free(buffer->heap[i].line);
+    }
+    for (size_t i = 0; i < buffer->spare_count; i++) {
+        free(buffer->spare[i].line);
+    }
+    free(buffer->heap);
+    free(buffer->spare);
+    buffer->heap = NULL;
+    buffer->spare = NULL;
+    buffer->count = 0;
+    buffer->spare_count = 0;
+}
+
+// Read the next line of a --merge input and its time.  Lines without a
+// timestamp, such as the rest of a stack trace, keep the time of the line
+// before them so they stay with it; lines before the first timestamp sort
+// first.  Lines of different inputs interleave, so a line cut at the
+// length limit or missing its newline at the end of the input is ended
+// with one; the pieces of a cut line keep its time.  Returns false at the
+// end of the input.
+static bool merge_input_advance(merge_input_t *input, reference_time_t *reference) {
+    bool new_batch;
+    bool continued = input->cut;
+    if (!line_reader_next(&input->reader, input->line, sizeof(input->line) - 1, &new_batch)) {
+        return false;
+    }
+    size_t len = strlen(input->line);
+    input->cut = false;
+    if (input->line[len - 1] != '\n') {
+        input->cut = len == sizeof(input->line) - 2;
+        input->line[len] = '\n';
+        input->line[len + 1] = '\0';
+    }
+    if (continued) {
+        return true;
+    }
+    time_t parsed;
+    long fraction = 0;
+    if (tsi_parse_timestamp_in_line_hinted(input->line, &input->format_hint, &parsed, &fraction,
+                                           reference, NULL) == TS_SUCCESS) {
+        input->time = (high_res_time_t){parsed, fraction * 1000};
+        input->has_time = true;
+    }
+    return true;
+}
+
+// Heap order: earlier time first, and the input named first on ties, which
+// keeps each input's lines in their own order
+static inline bool merge_before(const merge_input_t *inputs, size_t a, size_t b) {
+    return high_res_time_before(&inputs[a].time, &inputs[b].time) ||
+           (!high_res_time_before(&inputs[b].time, &inputs[a].time) && a < b);
+}
+
+static void merge_heap_sift_down(size_t *heap, size_t count, size_t pos, const merge_input_t *inputs) {
+    while (true) {
+        size_t first = pos;
+        size_t left = 2 * pos + 1;
+        size_t right = left + 1;
+        if (left < count && merge_before(inputs, heap[left], heap[first])) {
+            first = left;
+        }
+        if (right < count && merge_before(inputs, heap[right], heap[first])) {
+            first = right;
+        }
+        if (first == pos) {
+            return;
+        }
+        size_t swap = heap[pos];
+        heap[pos] = heap[first];
+        heap[first] = swap;
+        pos = first;
+    }
+}
+
+// --merge: interleave the lines of several files into one timeline by the
+// timestamp each line carries, with a k-way heap merge that holds one line
+// per input.  Every line is written to output tagged with the file it
+// came from.  Compressed files are decompressed as they are read.
+static ts_error_t run_merge(char *const *names, size_t count, output_format_t output_format,
+                            reference_time_t *reference, FILE *output) {
+    merge_input_t *inputs = calloc(count, sizeof(*inputs));
+    size_t *heap = calloc(count, sizeof(*heap));
+    size_t opened = 0;
+    size_t heap_count = 0;
+    ts_error_t result = inputs && heap ? TS_SUCCESS : TS_ERROR_SYSTEM;
+    if (result != TS_SUCCESS) {
+        fprintf(stderr, "Error: Out of memory\n");
+    }
+
+    for (; result == TS_SUCCESS && opened < count; opened++) {
+        merge_input_t *input = &inputs[opened];
+        compression_t method;
+        input->name = names[opened];
+        input->time = (high_res_time_t){TIME_T_MIN, 0};
+        input->format_hint = -1;
+        input->fd = open(input->name, O_RDONLY | O_CLOEXEC);
+        if (input->fd < 0) {
+            fprintf(stderr, "Error: Cannot open %s: %s\n", input->name, strerror(errno));
+            result = TS_ERROR_SYSTEM;
+            break;
+        }
+        if (line_reader_open(&input->reader, input->fd, true, &method) != TS_SUCCESS) {
+            fprintf(stderr, "Error: Cannot decompress %s\n", input->name);
+            result = TS_ERROR_INVALID_ARGUMENT;
+        } else if (merge_input_advance(input, reference)) {
+            heap[heap_count++] = opened;
+        }
+    }
+
+    if (result == TS_SUCCESS) {
+        for (size_t i = heap_count / 2; i-- > 0;) {
+            merge_heap_sift_down(heap, heap_count, i, inputs);
+        }
+        while (heap_count > 0) {
+            merge_input_t *input = &inputs[heap[0]];
+            bool cut;
+            bool more;
+            // The pieces of a cut line go out together
+            do {
+                line_record_t record = {
+                    .time = input->has_time ? input->time : (high_res_time_t){0, 0},
+                    .input = input->name,
+                    .line = input->line
+                };
+                write_record(output, output_format, &record, NULL);
+                cut = input->cut;
+                more = merge_input_advance(input, reference);
+            } while (more && cut);
+            if (!more) {
+                heap[0] = heap[--heap_count];
+            }
+            merge_heap_sift_down(heap, heap_count, 0, inputs);
+        }
+    }
+
+    for (size_t i = 0; i < opened; i++) {
+        if (inputs[i].reader.decompressor &&
+            input_decompressor_stop(inputs[i].reader.decompressor) != TS_SUCCESS && result == TS_SUCCESS) {
+            fprintf(stderr, "Error: %s is corrupt or truncated\n", inputs[i].name);
+            result = TS_ERROR_INVALID_ARGUMENT;
+        }
+        close(inputs[i].fd);
+    }
+    free(inputs);
+    free(heap);
+    return result;
+}
+
+#ifdef HAVE_FOLLOW
+static volatile sig_atomic_t follow_stopping = 0;
+
+static void follow_stop(int signum) {
+    (void)signum;
+    follow_stopping = 1;
+}
+
+static const char *follow_base_name(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+// Stamp the line source has pending and write it, labelled with the
+// source unless it goes to a file of its own.  Lines of different sources
+// interleave, so a cut or unfinished line is ended with a newline too.
+static void follow_emit(follow_t *follow, follow_source_t *source) {
+    char timestamp[MAX_FORMAT_LENGTH];
+    high_res_time_t now = tsi_clock_source_read(follow->clock);
+    if (source->partial[source->partial_len - 1] != '\n') {
+        source->partial[source->partial_len++] = '\n';
+    }
+    source->partial[source->partial_len] = '\0';
+    line_record_t record = {
+        .time = now,
+        .input = source->output ? NULL : source->name,
+        .line = source->partial
+    };
+    if (tsi_format_timestamp_compiled(timestamp, sizeof(timestamp), follow->format, &now) == TS_SUCCESS) {
+        record.stamp = timestamp;
+    } else {
+        fprintf(stderr, "Error: Failed to process line\n");
+    }
+    write_record(source->output ? source->output : follow->output, follow->output_format, &record, NULL);
+    source->partial_len = 0;
+}
+
+// Split data read from source into lines, stamping each as it completes.
+// Longer lines are cut, leaving room for the newline follow_emit() adds.
+static void follow_consume(follow_t *follow, follow_source_t *source, const char *data, size_t len) {
+    while (len > 0) {
+        size_t room = MAX_LINE_LENGTH - 2 - source->partial_len;
+        size_t span = len < room ? len : room;
+        const char *newline = memchr(data, '\n', span);
+        size_t take = newline ? (size_t)(newline - data) + 1 : span;
+        memcpy(source->partial + source->partial_len, data, take);
+        source->partial_len += take;
+        data += take;
+        len -= take;
+        if (newline || source->partial_len == MAX_LINE_LENGTH - 2) {
+            follow_emit(follow, source);
+        }
+    }
+}
+
+// Read everything source has for now.  A file that shrank was truncated
+// in place and is read again from its start.  Returns false once a pipe
+// has ended or the source cannot be read.
+static bool follow_read(follow_t *follow, follow_source_t *source) {
+    char buffer[LINE_READER_BUFFER_SIZE];
+    if (source->is_file) {
+        struct stat st;
+        off_t offset = lseek(source->fd, 0, SEEK_CUR);
+        if (fstat(source->fd, &st) == 0 && offset > st.st_size) {
+            lseek(source->fd, 0, SEEK_SET);
+        }
+    }
+    while (true) {
+        ssize_t got = read(source->fd, buffer, sizeof(buffer));
+        if (got > 0) {
+            follow_consume(follow, source, buffer, (size_t)got);
+        } else if (got < 0 && errno == EINTR) {
+            continue;
+        } else if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        } else {
+            return got == 0 && source->is_file;
+        }
+    }
+}
+
+// Stop reading source, writing out a last line that had no newline
+static void follow_finish(follow_t *follow, follow_source_t *source) {
+    if (source->partial_len > 0) {
+        follow_emit(follow, source);
+    }
+    if (source->fd == STDIN_FILENO && follow->stdin_flags >= 0) {
+        fcntl(STDIN_FILENO, F_SETFL, follow->stdin_flags);
+    }
+    close(source->fd);
+    source->fd = -1;
+    follow->live--;
+}
+
+// Open and watch the file source is named after.  from_end skips what it
+// holds already, as tail -f does; a file that replaced it is read whole.
+static ts_error_t follow_open_file(follow_t *follow, follow_source_t *source, bool from_end) {
+    int fd = open(source->name, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        return TS_ERROR_SYSTEM;
+    }
+    int watch = inotify_add_watch(follow->inotify_fd, source->name, IN_MODIFY);
+    if (watch < 0 || (from_end && lseek(fd, 0, SEEK_END) < 0)) {
+        close(fd);
+        return TS_ERROR_SYSTEM;
+    }
+    source->fd = fd;
+    source->watch = watch;
+    return TS_SUCCESS;
+}
+
+// A file was created or moved in under the name source follows.  Unless
+// it is the file being read, read that to its end and switch over, the
+// way logrotate's rename-and-create expects.
+static void follow_replace(follow_t *follow, follow_source_t *source) {
+    struct stat current;
+    struct stat named;
+    if (stat(source->name, &named) != 0 || !S_ISREG(named.st_mode) ||
+        (fstat(source->fd, &current) == 0 && current.st_dev == named.st_dev &&
+         current.st_ino == named.st_ino)) {
+        return;
+    }
+    follow_read(follow, source);
+    if (source->partial_len > 0) {
+        follow_emit(follow, source);
+    }
+    int old_fd = source->fd;
+    int old_watch = source->watch;
+    if (follow_open_file(follow, source, false) != TS_SUCCESS) {
+        fprintf(stderr, "Error: Cannot reopen %s: %s; still reading the old file\n", source->name,
+                strerror(errno));
+        return;
+    }
+    close(old_fd);
+    if (old_watch != source->watch) {
+        inotify_rm_watch(follow->inotify_fd, old_watch);
+    }
+    follow_read(follow, source);
+}
+
+// Act on what inotify reports: modified files are read, and new files
+// under followed names replace the old ones.  Overflowed events lose
+// track of which file changed, so every file is read.
+static void follow_inotify(follow_t *follow) {
+    union {
+        struct inotify_event event;
+        char bytes[sizeof(struct inotify_event) + NAME_MAX + 1];
+    } buffer;
+    ssize_t got;
+    while ((got = read(follow->inotify_fd, &buffer, sizeof(buffer))) > 0) {
+        for (char *next = buffer.bytes; next < buffer.bytes + got;) {
+            const struct inotify_event *event = (const struct inotify_event *)next;
+            next += sizeof(*event) + event->len;
+            for (size_t i = 0; i < follow->count; i++) {
+                follow_source_t *source = &follow->sources[i];
+                if (source->fd < 0 || !source->is_file) {
+                    continue;
+                }
+                if (event->wd == source->watch || (event->mask & IN_Q_OVERFLOW)) {
+                    follow_read(follow, source);
+                } else if (event->wd == source->dir_watch && event->len > 0 &&
+                           strcmp(event->name, follow_base_name(source->name)) == 0) {
+                    follow_replace(follow, source);
                 }
-            } else {
-                return safe_snprintf(buffer, buffer_size, "in %ldm", minutes);
-            }
-        } else if (diff < SECONDS_PER_DAY) {
-            long hours = diff / SECONDS_PER_HOUR;
-            long minutes = (diff % SECONDS_PER_HOUR) / SECONDS_PER_MINUTE;
-            if (minutes > 0) {
-                return safe_snprintf(buffer, buffer_size, "in %ldh%ldm", hours, minutes);
-            } else {
-                return safe_snprintf(buffer, buffer_size, "in %ldh", hours);
-            }
-        } else {
-            long days = diff / SECONDS_PER_DAY;
-            long hours = (diff % SECONDS_PER_DAY) / SECONDS_PER_HOUR;
-            if (hours > 0) {
-                return safe_snprintf(buffer, buffer_size, "in %ldd%ldh", days, hours);
-            } else {
-                return safe_snprintf(buffer, buffer_size, "in %ldd", days);
             }
         }
+    }
+}
+
+// Start following source: regular files through inotify, everything else
+// through epoll.  A FIFO is opened for writing too, so it never reads as
+// ended while writers come and go.  Standard input redirected from a file
+// cannot be polled and is read to its end right away.
+static ts_error_t follow_source_open(follow_t *follow, follow_source_t *source) {
+    if (strcmp(source->name, "-") == 0) {
+        int flags = fcntl(STDIN_FILENO, F_GETFL);
+        if (flags < 0 || fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK) < 0) {
+            return TS_ERROR_SYSTEM;
+        }
+        follow->stdin_flags = flags;
+        source->fd = STDIN_FILENO;
     } else {
-        // Past time
-        if (diff < SECONDS_PER_MINUTE) {
-            if (has_fractional) {
-                return safe_snprintf(buffer, buffer_size, "%.3fs ago", precise_diff);
-            } else {
-                return safe_snprintf(buffer, buffer_size, "%lds ago", diff);
-            }
-        } else if (diff < SECONDS_PER_HOUR) {
-            long minutes = diff / SECONDS_PER_MINUTE;
-            long seconds = diff % SECONDS_PER_MINUTE;
-            if (seconds > 0) {
-                if (has_fractional) {
-                    double remaining_seconds = precise_diff - (minutes * SECONDS_PER_MINUTE);
-                    return safe_snprintf(buffer, buffer_size, "%ldm%.3fs ago", minutes, remaining_seconds);
-                } else {
-                    return safe_snprintf(buffer, buffer_size, "%ldm%lds ago", minutes, seconds);
-                }
-            } else {
-                return safe_snprintf(buffer, buffer_size, "%ldm ago", minutes);
-            }
-        } else if (diff < SECONDS_PER_DAY) {
-            long hours = diff / SECONDS_PER_HOUR;
-            long minutes = (diff % SECONDS_PER_HOUR) / SECONDS_PER_MINUTE;
-            if (minutes > 0) {
-                return safe_snprintf(buffer, buffer_size, "%ldh%ldm ago", hours, minutes);
-            } else {
-                return safe_snprintf(buffer, buffer_size, "%ldh ago", hours);
+        struct stat st;
+        if (stat(source->name, &st) != 0) {
+            return TS_ERROR_SYSTEM;
+        }
+        if (S_ISREG(st.st_mode)) {
+            char dir[PATH_MAX];
+            size_t dir_len = (size_t)(follow_base_name(source->name) - source->name);
+            if (dir_len >= sizeof(dir)) {
+                errno = ENAMETOOLONG;
+                return TS_ERROR_SYSTEM;
             }
-        } else {
-            long days = diff / SECONDS_PER_DAY;
-            long hours = (diff % SECONDS_PER_DAY) / SECONDS_PER_HOUR;
-            if (hours > 0) {
-                return safe_snprintf(buffer, buffer_size, "%ldd%ldh ago", days, hours);
-            } else {
-                return safe_snprintf(buffer, buffer_size, "%ldd ago", days);
+            memcpy(dir, source->name, dir_len);
+            strcpy(dir + dir_len, dir_len == 0 ? "." : "");
+            source->dir_watch = inotify_add_watch(follow->inotify_fd, dir, IN_CREATE | IN_MOVED_TO | IN_ONLYDIR);
+            if (source->dir_watch < 0 || follow_open_file(follow, source, true) != TS_SUCCESS) {
+                return TS_ERROR_SYSTEM;
             }
+            source->is_file = true;
+            follow->live++;
+            return TS_SUCCESS;
+        }
+        source->fd = open(source->name, (S_ISFIFO(st.st_mode) ? O_RDWR : O_RDONLY) | O_NONBLOCK | O_CLOEXEC);
+        if (source->fd < 0) {
+            return TS_ERROR_SYSTEM;
+        }
+    }
+    follow->live++;
+    struct epoll_event event = {.events = EPOLLIN, .data.u64 = (uint64_t)(source - follow->sources)};
+    if (epoll_ctl(follow->epoll_fd, EPOLL_CTL_ADD, source->fd, &event) != 0) {
+        if (errno != EPERM) {
+            return TS_ERROR_SYSTEM;
+        }
+        while (follow_read(follow, source)) {
         }
+        follow_finish(follow, source);
     }
+    return TS_SUCCESS;
 }
 
-// Format timestamp with subsecond resolution
-#ifdef TS_TESTING
-ts_error_t format_timestamp_with_subsecond(char *buffer, size_t buffer_size,
-                                         const char *format, const high_res_time_t *timestamp) {
-#else
-static ts_error_t format_timestamp_with_subsecond(char *buffer, size_t buffer_size,
-                                                 const char *format, const high_res_time_t *timestamp) {
-#endif
-    if (!buffer || !format || !timestamp) {
+// Open the --follow-dir file of source: DIR/NAME after the base name of
+// the source, appended to
+static ts_error_t follow_output_open(follow_source_t *source, const char *output_dir) {
+    char path[PATH_MAX];
+    const char *base = strcmp(source->name, "-") == 0 ? "stdin" : follow_base_name(source->name);
+    int written = snprintf(path, sizeof(path), "%s/%s", output_dir, base);
+    if (written < 0 || (size_t)written >= sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return TS_ERROR_SYSTEM;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return TS_ERROR_SYSTEM;
+    }
+    struct stat output_st;
+    struct stat source_st;
+    if (fstat(fd, &output_st) == 0 && stat(source->name, &source_st) == 0 &&
+        output_st.st_dev == source_st.st_dev && output_st.st_ino == source_st.st_ino) {
+        close(fd);
         return TS_ERROR_INVALID_ARGUMENT;
     }
-
-    char temp_buffer[MAX_FORMAT_LENGTH];
-    struct tm *tm_info = localtime(&timestamp->seconds);
-    if (!tm_info) {
+    source->output = fdopen(fd, "a");
+    if (!source->output) {
+        close(fd);
         return TS_ERROR_SYSTEM;
     }
+    return TS_SUCCESS;
+}
 
-    // First pass: handle special patterns and build the result
-    char result[MAX_FORMAT_LENGTH] = "";
-    const char *current = format;
+// --follow: stamp the lines of several live sources as they arrive, in
+// one epoll loop reading one clock, so lines from different sources are
+// stamped against the same time line.  Files are followed from their end
+// through rotation and truncation, FIFOs across writers; pipes and
+// standard input drop out when they end.  Runs until no source is left
+// or SIGINT or SIGTERM arrives, then writes out unfinished lines.
+static ts_error_t run_follow(char *const *names, size_t count, const char *output_dir,
+                             clock_source_t *clock, compiled_format_t *format,
+                             output_format_t output_format, FILE *output) {
+    follow_t follow = {
+        .count = count,
+        .clock = clock,
+        .format = format,
+        .output_format = output_format,
+        .output = output,
+        .stdin_flags = -1
+    };
+    ts_error_t result = TS_SUCCESS;
+    follow.sources = calloc(count, sizeof(*follow.sources));
+    follow.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    follow.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    struct epoll_event inotify_event = {.events = EPOLLIN, .data.u64 = UINT64_MAX};
+    if (!follow.sources || follow.epoll_fd < 0 || follow.inotify_fd < 0 ||
+        epoll_ctl(follow.epoll_fd, EPOLL_CTL_ADD, follow.inotify_fd, &inotify_event) != 0) {
+        fprintf(stderr, "Error: Cannot set up --follow: %s\n", strerror(errno));
+        result = TS_ERROR_SYSTEM;
+        count = follow.sources ? count : 0;
+    }
+    for (size_t i = 0; i < count; i++) {
+        follow.sources[i] = (follow_source_t){.name = names[i], .fd = -1, .watch = -1, .dir_watch = -1};
+    }
 
-    while (*current != '\0') {
-        if (strncmp(current, "%.S", 3) == 0) {
-            // %.S - seconds with subsecond resolution
-            ts_error_t result_code = safe_snprintf(result + strlen(result),
-                                                 sizeof(result) - strlen(result),
-                                                 "%02d.%06ld", tm_info->tm_sec,
-                                                 timestamp->nanoseconds / 1000);
-            if (result_code != TS_SUCCESS) {
-                return result_code;
-            }
-            current += 3;
-        } else if (strncmp(current, "%.s", 3) == 0) {
-            // %.s - unix timestamp with subsecond resolution
-            ts_error_t result_code = safe_snprintf(result + strlen(result),
-                                                 sizeof(result) - strlen(result),
-                                                 "%ld.%06ld", timestamp->seconds,
-                                                 timestamp->nanoseconds / 1000);
-            if (result_code != TS_SUCCESS) {
-                return result_code;
-            }
-            current += 3;
-        } else if (strncmp(current, "%.T", 3) == 0) {
-            // %.T - time with subsecond resolution
-            char time_str[MAX_TIME_STR_LENGTH];
-            if (strftime(time_str, sizeof(time_str), "%H:%M:%S", tm_info) == 0) {
-                return TS_ERROR_BUFFER_OVERFLOW;
-            }
-            ts_error_t result_code = safe_snprintf(result + strlen(result),
-                                                 sizeof(result) - strlen(result),
-                                                 "%s.%06ld", time_str,
-                                                 timestamp->nanoseconds / 1000);
-            if (result_code != TS_SUCCESS) {
-                return result_code;
-            }
-            current += 3;
-        } else if (strncmp(current, "%N", 2) == 0) {
-            // %N - nanoseconds
-            ts_error_t result_code = safe_snprintf(result + strlen(result),
-                                                 sizeof(result) - strlen(result),
-                                                 "%09ld", timestamp->nanoseconds);
-            if (result_code != TS_SUCCESS) {
-                return result_code;
+    // SIGINT and SIGTERM are only let through while waiting for events
+    sigset_t stop_signals;
+    sigset_t wait_mask;
+    struct sigaction action = {.sa_handler = follow_stop};
+    sigemptyset(&action.sa_mask);
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &stop_signals, &wait_mask);
+    sigdelset(&wait_mask, SIGINT);
+    sigdelset(&wait_mask, SIGTERM);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    for (size_t i = 0; result == TS_SUCCESS && i < count; i++) {
+        follow_source_t *source = &follow.sources[i];
+        ts_error_t open_result = output_dir ? follow_output_open(source, output_dir) : TS_SUCCESS;
+        if (open_result == TS_ERROR_INVALID_ARGUMENT) {
+            fprintf(stderr, "Error: --follow-dir would write the stamped %s into itself\n", source->name);
+        } else if (open_result != TS_SUCCESS) {
+            fprintf(stderr, "Error: Cannot open %s/%s: %s\n", output_dir, follow_base_name(source->name),
+                    strerror(errno));
+        } else if ((open_result = follow_source_open(&follow, source)) != TS_SUCCESS) {
+            fprintf(stderr, "Error: Cannot follow %s: %s\n", source->name, strerror(errno));
+        }
+        result = open_result;
+    }
+
+    while (result == TS_SUCCESS && follow.live > 0 && !follow_stopping) {
+        fflush(output);
+        for (size_t i = 0; i < count; i++) {
+            if (follow.sources[i].output) {
+                fflush(follow.sources[i].output);
             }
-            current += 2;
-        } else if (strncmp(current, "%s", 2) == 0) {
-            // %s - unix timestamp
-            ts_error_t result_code = safe_snprintf(result + strlen(result),
-                                                 sizeof(result) - strlen(result),
-                                                 "%ld", timestamp->seconds);
-            if (result_code != TS_SUCCESS) {
-                return result_code;
+        }
+        struct epoll_event events[FOLLOW_EVENTS];
+        int ready = epoll_pwait(follow.epoll_fd, events, FOLLOW_EVENTS, -1, &wait_mask);
+        if (ready < 0 && errno != EINTR) {
+            fprintf(stderr, "Error: Waiting for input failed: %s\n", strerror(errno));
+            result = TS_ERROR_SYSTEM;
+        }
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.u64 == UINT64_MAX) {
+                follow_inotify(&follow);
+                continue;
             }
-            current += 2;
-        } else {
-            // Copy the character and continue
-            char temp[2] = {*current, '\0'};
-            ts_error_t result_code = safe_strcat(result, sizeof(result), temp);
-            if (result_code != TS_SUCCESS) {
-                return result_code;
+            follow_source_t *source = &follow.sources[events[i].data.u64];
+            if (source->fd >= 0 && !follow_read(&follow, source)) {
+                follow_finish(&follow, source);
             }
-            current++;
         }
     }
 
-    // Second pass: if the result still contains strftime patterns, process them
-    if (strstr(result, "%") != NULL) {
-        if (strftime(temp_buffer, sizeof(temp_buffer), result, tm_info) == 0) {
-            return TS_ERROR_BUFFER_OVERFLOW;
-        }
-        size_t temp_len = strlen(temp_buffer);
-        if (temp_len >= buffer_size) {
-            return TS_ERROR_BUFFER_OVERFLOW;
+    for (size_t i = 0; i < count; i++) {
+        follow_source_t *source = &follow.sources[i];
+        if (source->fd >= 0) {
+            follow_finish(&follow, source);
         }
-        memcpy(buffer, temp_buffer, temp_len + 1);
-    } else {
-        size_t result_len = strlen(result);
-        if (result_len >= buffer_size) {
-            return TS_ERROR_BUFFER_OVERFLOW;
+        if (source->output && fclose(source->output) != 0 && result == TS_SUCCESS) {
+            fprintf(stderr, "Error: Failed to write output for %s\n", source->name);
+            result = TS_ERROR_SYSTEM;
         }
-        memcpy(buffer, result, result_len + 1);
     }
-
-    return TS_SUCCESS;
-}
-
-// Process a single line with timestamp
-#ifdef TS_TESTING
-ts_error_t process_line(const char *line, const char *format,
-                       const high_res_time_t *current_time) {
-#else
-static ts_error_t process_line(const char *line, const char *format,
-                              const high_res_time_t *current_time) {
-#endif
-    if (!line || !format || !current_time) {
-        return TS_ERROR_INVALID_ARGUMENT;
+    if (follow.inotify_fd >= 0) {
+        close(follow.inotify_fd);
     }
-
-    char timestamp[MAX_FORMAT_LENGTH];
-    ts_error_t result = format_timestamp_with_subsecond(timestamp, sizeof(timestamp),
-                                                       format, current_time);
-    if (result != TS_SUCCESS) {
-        return result;
+    if (follow.epoll_fd >= 0) {
+        close(follow.epoll_fd);
     }
-
-    printf("%s %s", timestamp, line);
-    return TS_SUCCESS;
+    sigprocmask(SIG_UNBLOCK, &stop_signals, NULL);
+    free(follow.sources);
+    return result;
 }
+#endif
 
 // Print usage information
 static void print_usage(const char *program_name) {
-    fprintf(stderr, "Usage: %s [-r] [-i | -s] [-m] [-u] [format]\n", program_name);
+    fprintf(stderr, "Usage: %s [-r [--now=EPOCH] [--reorder=WINDOW]] [-i | -s] [-m | --clock=SOURCE | --decode] [-u] [-S] [format]\n", program_name);
+    fprintf(stderr, "       %s --merge [--now=EPOCH] FILE...\n", program_name);
+    fprintf(stderr, "       %s --follow=FILE... [--follow-dir=DIR] [-m | --clock=SOURCE] [format]\n", program_name);
     fprintf(stderr, "Add timestamps to the beginning of each line of input.\n");
     fprintf(stderr, "\nOptions:\n");
     fprintf(stderr, "  -r    Convert existing timestamps to relative times\n");
@@ -890,7 +3196,53 @@ static void print_usage(const char *program_name) {
     fprintf(stderr, "  -s    Report incremental timestamps (time since start)\n");
     fprintf(stderr, "  -m    Use monotonic clock\n");
     fprintf(stderr, "  -u    Only output lines that are unique (different from previous line)\n");
+    fprintf(stderr, "  -S    Report line, byte and timestamp counts and the time spent in each stage\n");
+    fprintf(stderr, "        to stderr at exit and on SIGUSR1\n");
     fprintf(stderr, "  -h    Show this help message\n");
+    fprintf(stderr, "  -V    Show version information\n");
+    fprintf(stderr, "  --clock=SOURCE\n");
+    fprintf(stderr, "        Take line times from SOURCE: realtime (default), monotonic (same as -m),\n");
+    fprintf(stderr, "        realtime-coarse, monotonic-coarse, boottime, tai, tsc,\n");
+    fprintf(stderr, "        fixed:START[+STEP] or replay:FILE (one EPOCH[.FRAC] per input line)\n");
+    fprintf(stderr, "  --output-format=text|json|binary\n");
+    fprintf(stderr, "        Write plain text (default), one JSON object per line, or binary\n");
+    fprintf(stderr, "        records of arrival time and raw line for --decode\n");
+    fprintf(stderr, "  --decode\n");
+    fprintf(stderr, "        Read binary records instead of text; lines keep their recorded times\n");
+    fprintf(stderr, "  --output=PATTERN\n");
+    fprintf(stderr, "        Append to files named by strftime PATTERN for each line's time instead\n");
+    fprintf(stderr, "        of stdout; a new name starts a new file\n");
+    fprintf(stderr, "  --rotate-size=SIZE[K|M|G]\n");
+    fprintf(stderr, "        With --output, continue in PATTERN.1, .2, ... once a file reaches SIZE\n");
+    fprintf(stderr, "  --compress=gzip|zstd[:LEVEL]\n");
+    fprintf(stderr, "        Compress the output on a separate thread\n");
+    fprintf(stderr, "  --decompress\n");
+    fprintf(stderr, "        Decompress gzip or zstd input without -r or --decode, which detect it\n");
+    fprintf(stderr, "  --index=FILE\n");
+    fprintf(stderr, "        Write a time to byte offset index of the output file to FILE, with an\n");
+    fprintf(stderr, "        entry every new second and every --index-lines=N lines (default 4096)\n");
+    fprintf(stderr, "  --query=FROM[,TO]\n");
+    fprintf(stderr, "        Copy the lines timed from FROM up to TO out of the file on stdin instead\n");
+    fprintf(stderr, "        of stamping, using its --index or, without one, a binary search of the\n");
+    fprintf(stderr, "        time-sorted file\n");
+    fprintf(stderr, "  --merge FILE...\n");
+    fprintf(stderr, "        Interleave the lines of the files by the timestamps in them, each tagged\n");
+    fprintf(stderr, "        with its file name\n");
+    fprintf(stderr, "  --follow=FILE\n");
+    fprintf(stderr, "        Stamp lines from FILE as they arrive, labelled with its name; repeat\n");
+    fprintf(stderr, "        for more sources.  Files are followed from their end like tail -F;\n");
+    fprintf(stderr, "        FIFOs, pipes and - (stdin) are read as written.  Stops on SIGINT/SIGTERM\n");
+    fprintf(stderr, "  --follow-dir=DIR\n");
+    fprintf(stderr, "        Append each source's lines to DIR/NAME, without the label, not stdout\n");
+    fprintf(stderr, "  --now=EPOCH[.FRAC]\n");
+    fprintf(stderr, "        Measure -r relative times from this Unix time instead of the clock\n");
+    fprintf(stderr, "  --reorder=WINDOW[s|ms|us|ns]\n");
+    fprintf(stderr, "        With -r, emit lines up to WINDOW out of order sorted by their timestamps\n");
+    fprintf(stderr, "  --histogram[=INTERVAL[s|ms|us|ns]]\n");
+    fprintf(stderr, "        Report lines/s and the p50/p90/p99/max gap between input lines to stderr\n");
+    fprintf(stderr, "        every INTERVAL of line time, and for the whole run at the end\n");
+    fprintf(stderr, "  --histogram-file=FILE\n");
+    fprintf(stderr, "        Append the --histogram reports to FILE instead of stderr\n");
     fprintf(stderr, "\nFormat is a strftime format string. Default: \"%%b %%d %%H:%%M:%%S\"\n");
     fprintf(stderr, "Special extensions:\n");
     fprintf(stderr, "  %%.S    seconds with subsecond resolution\n");
@@ -900,22 +3252,275 @@ static void print_usage(const char *program_name) {
     fprintf(stderr, "  %%N     nanoseconds (compatible with date command)\n");
 }
 
+// Bucket of a histogram value; negative values count as 0
+static int histogram_index(int64_t value) {
+    uint64_t v = value > 0 ? (uint64_t)value : 0;
+    if (v < 2 * HISTOGRAM_SUB_BUCKETS) {
+        return (int)v;
+    }
+    int bits = 63 - __builtin_clzll(v);
+    return 2 * HISTOGRAM_SUB_BUCKETS + (bits - HISTOGRAM_SUB_BITS - 1) * HISTOGRAM_SUB_BUCKETS +
+           (int)((v >> (bits - HISTOGRAM_SUB_BITS)) - HISTOGRAM_SUB_BUCKETS);
+}
+
+// Lowest value of a histogram bucket, and its width
+static int64_t histogram_bucket_low(int index, int64_t *width) {
+    if (index < 2 * HISTOGRAM_SUB_BUCKETS) {
+        *width = 1;
+        return index;
+    }
+    int shift = (index - 2 * HISTOGRAM_SUB_BUCKETS) / HISTOGRAM_SUB_BUCKETS + 1;
+    int sub = (index - 2 * HISTOGRAM_SUB_BUCKETS) % HISTOGRAM_SUB_BUCKETS;
+    *width = (int64_t)1 << shift;
+    return (int64_t)(HISTOGRAM_SUB_BUCKETS + sub) << shift;
+}
+
+#ifdef TS_TESTING
+void histogram_record(histogram_t *histogram, int64_t value) {
+#else
+static void histogram_record(histogram_t *histogram, int64_t value) {
+#endif
+    histogram->counts[histogram_index(value)]++;
+    histogram->total++;
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+// The value fraction of the recorded values are at or below, as the top
+// of its bucket (as HdrHistogram reports it) and never more than the
+// largest value recorded
+#ifdef TS_TESTING
+int64_t histogram_percentile(const histogram_t *histogram, double fraction) {
+#else
+static int64_t histogram_percentile(const histogram_t *histogram, double fraction) {
+#endif
+    uint64_t rank = (uint64_t)(fraction * (double)histogram->total + 0.5);
+    uint64_t seen = 0;
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            int64_t width;
+            int64_t value = histogram_bucket_low(i, &width) + width - 1;
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+// Write a duration for a --histogram report: 850ns, 12.3us, 4.56ms, 1.234s
+static void format_report_duration(char *buffer, size_t size, int64_t ns) {
+    if (ns < 1000) {
+        snprintf(buffer, size, "%ldns", (long)ns);
+    } else if (ns < 1000000) {
+        snprintf(buffer, size, "%.1fus", (double)ns / 1000);
+    } else if (ns < NANOSECONDS_PER_SECOND) {
+        snprintf(buffer, size, "%.2fms", (double)ns / 1000000);
+    } else {
+        snprintf(buffer, size, "%.3fs", (double)ns / NANOSECONDS_PER_SECOND);
+    }
+}
+
+// Write one --histogram report line: lines seen over span_ns, ending
+// at_ns into the run, the percentiles of gaps and, at the end, of the
+// times since start
+static void arrival_stats_write(const arrival_stats_t *arrivals, const char *label, int64_t at_ns,
+                                int64_t span_ns, unsigned long lines, const histogram_t *gaps) {
+    static const double fractions[] = {0.50, 0.90, 0.99};
+    char value[32];
+    fprintf(arrivals->output, "ts: %s%.3fs: %lu line%s, %.1f lines/s", label,
+            (double)at_ns / NANOSECONDS_PER_SECOND, lines, lines == 1 ? "" : "s",
+            span_ns > 0 ? (double)lines * NANOSECONDS_PER_SECOND / (double)span_ns : 0.0);
+    if (gaps->total > 0) {
+        fprintf(arrivals->output, ", gap");
+        for (size_t i = 0; i < sizeof(fractions) / sizeof(fractions[0]); i++) {
+            format_report_duration(value, sizeof(value), histogram_percentile(gaps, fractions[i]));
+            fprintf(arrivals->output, " p%.0f %s", fractions[i] * 100, value);
+        }
+        format_report_duration(value, sizeof(value), gaps->max);
+        fprintf(arrivals->output, " max %s", value);
+    }
+    if (gaps == &arrivals->gaps && arrivals->since_start.total > 0) {
+        fprintf(arrivals->output, ", since start");
+        for (size_t i = 0; i < sizeof(fractions) / sizeof(fractions[0]); i++) {
+            format_report_duration(value, sizeof(value), histogram_percentile(&arrivals->since_start,
+                                                                              fractions[i]));
+            fprintf(arrivals->output, " p%.0f %s", fractions[i] * 100, value);
+        }
+    }
+    fputc('\n', arrivals->output);
+}
+
+// Report the interval since_start has passed the end of, folding in any
+// intervals after it that have also ended
+static void arrival_stats_report_due(arrival_stats_t *arrivals, int64_t since_start) {
+    if (arrivals->interval_ns > 0 && since_start >= arrivals->next_report_ns) {
+        int64_t end = since_start - since_start % arrivals->interval_ns;
+        arrival_stats_write(arrivals, "", end, end - arrivals->report_start_ns, arrivals->interval_lines,
+                            &arrivals->interval_gaps);
+        memset(&arrivals->interval_gaps, 0, sizeof(arrivals->interval_gaps));
+        arrivals->interval_lines = 0;
+        arrivals->report_start_ns = end;
+        arrivals->next_report_ns = end + arrivals->interval_ns;
+    }
+}
+
+// Count a line arriving at time, start being where -s counts from.  Once
+// a line is at or past the end of the report interval, the interval
+// before it is reported.  Without a live clock, intervals without lines
+// are folded into the next report.
+static void arrival_stats_note(arrival_stats_t *arrivals, const high_res_time_t *start,
+                               const high_res_time_t *time) {
+    int64_t start_ns;
+    int64_t now_ns;
+    if (!high_res_time_to_ns(start, &start_ns) || !high_res_time_to_ns(time, &now_ns)) {
+        return;
+    }
+    if (!arrivals->started) {
+        // The first gap is from the start, as with -i
+        arrivals->started = true;
+        arrivals->last_ns = start_ns;
+        arrivals->next_report_ns = arrivals->interval_ns;
+    }
+    arrivals->start_ns = start_ns;
+
+    int64_t since_start = now_ns > start_ns ? now_ns - start_ns : 0;
+    arrival_stats_report_due(arrivals, since_start);
+
+    // A clock that steps back makes a gap of 0
+    int64_t gap = now_ns > arrivals->last_ns ? now_ns - arrivals->last_ns : 0;
+    histogram_record(&arrivals->gaps, gap);
+    histogram_record(&arrivals->interval_gaps, gap);
+    histogram_record(&arrivals->since_start, since_start);
+    arrivals->lines++;
+    arrivals->interval_lines++;
+    arrivals->last_ns = now_ns;
+}
+
+// Wait for the next line of input, writing each interval report as it
+// falls due meanwhile, as the read wait lets -S answer SIGUSR1: a stall
+// then shows up while it lasts, as intervals without lines.
+static void arrival_stats_wait(arrival_stats_t *arrivals, line_reader_t *reader, clock_source_t *clock) {
+    if (!arrivals->live || !arrivals->started || arrivals->interval_ns <= 0) {
+        return;
+    }
+    while (true) {
+        high_res_time_t now = tsi_clock_source_read(clock);
+        int64_t now_ns;
+        if (!high_res_time_to_ns(&now, &now_ns)) {
+            return;
+        }
+        int64_t since_start = now_ns > arrivals->start_ns ? now_ns - arrivals->start_ns : 0;
+        arrival_stats_report_due(arrivals, since_start);
+        if (line_reader_wait(reader, arrivals->next_report_ns - since_start)) {
+            return;
+        }
+    }
+}
+
+// Write the --histogram report for the whole run
+static void arrival_stats_finish(const arrival_stats_t *arrivals) {
+    int64_t span = arrivals->last_ns > arrivals->start_ns ? arrivals->last_ns - arrivals->start_ns : 0;
+    arrival_stats_write(arrivals, "total ", span, span, arrivals->lines, &arrivals->gaps);
+}
+
+// write_record() for the main loop.  With -S, the time since the last
+// stage counts as formatting and the write as writing.
+static size_t write_record_counted(FILE *stream, run_stats_t *stats, output_format_t output_format,
+                                   const line_record_t *record, const char *line) {
+    if (!stats) {
+        return write_record(stream, output_format, record, line);
+    }
+    run_stats_stage(stats, STATS_STAGE_FORMAT);
+    size_t written = write_record(stream, output_format, record, line);
+    run_stats_stage(stats, STATS_STAGE_WRITE);
+    stats->lines_out++;
+    stats->bytes_out += written;
+    return written;
+}
+
 // Main function
 int main(int argc, char *argv[]) {
     char line[MAX_LINE_LENGTH];
-    char format[MAX_FORMAT_LENGTH] = "%b %d %H:%M:%S";
+    char format[MAX_FORMAT_LENGTH] = DEFAULT_FORMAT;
     int opt;
     bool relative_mode = false;
     bool incremental_mode = false;
     bool since_start_mode = false;
-    bool monotonic_mode = false;
+    clock_source_t clock = {.kind = CLOCK_SOURCE_SYSTEM, .clock_id = CLOCK_REALTIME};
+    bool clock_selected = false;
     bool unique_mode = false;
+    bool decode_mode = false;
+    bool decompress = false;        // Detect compressed input without -r or --decode
+    output_format_t output_format = OUTPUT_FORMAT_TEXT;
+    bool now_frozen = false;
+    high_res_time_t frozen_now = {0};
     high_res_time_t start_time;
     high_res_time_t last_time;
     char last_line[MAX_LINE_LENGTH] = "";
+    int exit_status = EXIT_SUCCESS;
+    const char *index_path = NULL;
+    unsigned long index_lines = INDEX_DEFAULT_LINES;
+    const char *query = NULL;
+    output_index_t index = {0};
+    const char *output_pattern = NULL;
+    uint64_t rotate_size = 0;
+    output_file_t output = {0};
+    bool output_failed = false;
+    output_compressor_t compressor = {0};
+    bool merge_mode = false;
+    char **follow_names = NULL;
+    size_t follow_count = 0;
+    const char *follow_dir = NULL;
+    const char *reorder_window = NULL;
+    reorder_buffer_t reorder = {0};
+    run_stats_t stats_counters;
+    run_stats_t *stats = NULL;      // -S; NULL leaves every count and timer out
+    bool histogram = false;
+    int64_t histogram_interval = 0;
+    const char *histogram_path = NULL;
+    arrival_stats_t *arrivals = NULL;
+
+    enum {
+        OPTION_NOW = 256, OPTION_CLOCK, OPTION_OUTPUT_FORMAT, OPTION_DECODE,
+        OPTION_INDEX, OPTION_INDEX_LINES, OPTION_QUERY, OPTION_OUTPUT, OPTION_ROTATE_SIZE,
+        OPTION_COMPRESS, OPTION_MERGE, OPTION_FOLLOW, OPTION_FOLLOW_DIR, OPTION_REORDER,
+        OPTION_HISTOGRAM, OPTION_HISTOGRAM_FILE, OPTION_DECOMPRESS
+    };
+    static const struct option long_options[] = {
+        {"relative", no_argument, NULL, 'r'},
+        {"incremental", no_argument, NULL, 'i'},
+        {"since", no_argument, NULL, 's'},
+        {"monotonic", no_argument, NULL, 'm'},
+        {"unique", no_argument, NULL, 'u'},
+        {"stats", no_argument, NULL, 'S'},
+        {"help", no_argument, NULL, 'h'},
+        {"version", no_argument, NULL, 'V'},
+        {"now", required_argument, NULL, OPTION_NOW},
+        {"clock", required_argument, NULL, OPTION_CLOCK},
+        {"output-format", required_argument, NULL, OPTION_OUTPUT_FORMAT},
+        {"decode", no_argument, NULL, OPTION_DECODE},
+        {"index", required_argument, NULL, OPTION_INDEX},
+        {"index-lines", required_argument, NULL, OPTION_INDEX_LINES},
+        {"query", required_argument, NULL, OPTION_QUERY},
+        {"output", required_argument, NULL, OPTION_OUTPUT},
+        {"rotate-size", required_argument, NULL, OPTION_ROTATE_SIZE},
+        {"compress", required_argument, NULL, OPTION_COMPRESS},
+        {"decompress", no_argument, NULL, OPTION_DECOMPRESS},
+        {"merge", no_argument, NULL, OPTION_MERGE},
+        {"follow", required_argument, NULL, OPTION_FOLLOW},
+        {"follow-dir", required_argument, NULL, OPTION_FOLLOW_DIR},
+        {"reorder", required_argument, NULL, OPTION_REORDER},
+        {"histogram", optional_argument, NULL, OPTION_HISTOGRAM},
+        {"histogram-file", required_argument, NULL, OPTION_HISTOGRAM_FILE},
+        {NULL, 0, NULL, 0}
+    };
 
     // Parse command line options
-    while ((opt = getopt(argc, argv, "rismuh")) != -1) {
+    while ((opt = getopt_long(argc, argv, "rismuShV", long_options, NULL)) != -1) {
         switch (opt) {
             case 'r':
                 relative_mode = true;
@@ -931,94 +3536,558 @@ int main(int argc, char *argv[]) {
                 format[sizeof(format) - 1] = '\0';
                 break;
             case 'm':
-                monotonic_mode = true;
+                tsi_clock_source_close(&clock);
+                tsi_clock_source_open(&clock, "monotonic");
+                clock_selected = true;
                 break;
             case 'u':
                 unique_mode = true;
                 break;
+            case 'S':
+                stats = &stats_counters;
+                break;
             case 'h':
                 print_usage(argv[0]);
                 return EXIT_SUCCESS;
+            case 'V':
+                printf("%s\n", PACKAGE_STRING);
+                return EXIT_SUCCESS;
+            case OPTION_NOW:
+                if (tsi_parse_reference_time(optarg, &frozen_now) != TS_SUCCESS) {
+                    fprintf(stderr, "Error: Invalid --now time: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                now_frozen = true;
+                break;
+            case OPTION_CLOCK:
+                tsi_clock_source_close(&clock);
+                if (tsi_clock_source_open(&clock, optarg) != TS_SUCCESS) {
+                    fprintf(stderr, "Error: Invalid --clock source: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                clock_selected = true;
+                break;
+            case OPTION_OUTPUT_FORMAT:
+                if (strcmp(optarg, "text") == 0) {
+                    output_format = OUTPUT_FORMAT_TEXT;
+                } else if (strcmp(optarg, "json") == 0) {
+                    output_format = OUTPUT_FORMAT_JSON;
+                } else if (strcmp(optarg, "binary") == 0) {
+                    output_format = OUTPUT_FORMAT_BINARY;
+                } else {
+                    fprintf(stderr, "Error: Invalid --output-format: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPTION_DECODE:
+                decode_mode = true;
+                break;
+            case OPTION_DECOMPRESS:
+                decompress = true;
+                break;
+            case OPTION_INDEX:
+                index_path = optarg;
+                break;
+            case OPTION_INDEX_LINES: {
+                char *end;
+                errno = 0;
+                index_lines = strtoul(optarg, &end, 10);
+                if (errno != 0 || end == optarg || *end != '\0' || index_lines == 0) {
+                    fprintf(stderr, "Error: Invalid --index-lines: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+            case OPTION_QUERY:
+                query = optarg;
+                break;
+            case OPTION_OUTPUT:
+                output_pattern = optarg;
+                break;
+            case OPTION_ROTATE_SIZE:
+                if (parse_size(optarg, &rotate_size) != TS_SUCCESS || rotate_size == 0) {
+                    fprintf(stderr, "Error: Invalid --rotate-size: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPTION_MERGE:
+                merge_mode = true;
+                break;
+            case OPTION_FOLLOW:
+                // At most one source per argument
+                if (!follow_names && !(follow_names = calloc((size_t)argc, sizeof(*follow_names)))) {
+                    fprintf(stderr, "Error: Out of memory\n");
+                    return EXIT_FAILURE;
+                }
+                follow_names[follow_count++] = optarg;
+                break;
+            case OPTION_FOLLOW_DIR:
+                follow_dir = optarg;
+                break;
+            case OPTION_REORDER:
+                if (parse_duration(optarg, &reorder.window_ns) != TS_SUCCESS) {
+                    fprintf(stderr, "Error: Invalid --reorder window: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                reorder_window = optarg;
+                break;
+            case OPTION_HISTOGRAM:
+                if (optarg && (parse_duration(optarg, &histogram_interval) != TS_SUCCESS ||
+                               histogram_interval == 0)) {
+                    fprintf(stderr, "Error: Invalid --histogram interval: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                histogram = true;
+                break;
+            case OPTION_HISTOGRAM_FILE:
+                histogram_path = optarg;
+                break;
+            case OPTION_COMPRESS: {
+                ts_error_t compress_result = parse_compression(optarg, &compressor.method,
+                                                               &compressor.level);
+                if (compress_result != TS_SUCCESS) {
+                    fprintf(stderr, compress_result == TS_ERROR_SYSTEM
+                                        ? "Error: --compress=%s is not available in this build\n"
+                                        : "Error: Invalid --compress: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
             default:
                 print_usage(argv[0]);
                 return EXIT_FAILURE;
         }
     }
 
-    // Check for format argument
-    if (optind < argc) {
+    // Check for format argument; --merge takes input files instead
+    if (optind < argc && !merge_mode) {
         strncpy(format, argv[optind], sizeof(format) - 1);
         format[sizeof(format) - 1] = '\0';
     }
 
+    // Binary records hold arrival times only; -r, -i and -s apply when they
+    // are decoded, which in turn takes the times from the records
+    if (output_format == OUTPUT_FORMAT_BINARY && (relative_mode || incremental_mode || since_start_mode)) {
+        fprintf(stderr, "Error: -r, -i and -s apply when decoding binary records, not when writing them\n");
+        return EXIT_FAILURE;
+    }
+    if (reorder_window && (!relative_mode || decode_mode)) {
+        fprintf(stderr, "Error: --reorder sorts by the timestamps -r finds in text lines; it needs -r\n");
+        return EXIT_FAILURE;
+    }
+    if (decode_mode && clock_selected) {
+        fprintf(stderr, "Error: --decode takes line times from the records; -m and --clock do not apply\n");
+        return EXIT_FAILURE;
+    }
+
+    if (stats && (query || merge_mode || follow_count > 0)) {
+        fprintf(stderr, "Error: -S reports on stamping; it does not apply to --query, --merge or --follow\n");
+        return EXIT_FAILURE;
+    }
+    if (histogram_path && !histogram) {
+        fprintf(stderr, "Error: --histogram-file needs --histogram\n");
+        return EXIT_FAILURE;
+    }
+    if (histogram && (relative_mode || query || merge_mode || follow_count > 0)) {
+        fprintf(stderr, "Error: --histogram measures when lines arrive; it does not apply to -r, --query,\n"
+                        "--merge or --follow\n");
+        return EXIT_FAILURE;
+    }
+    if (query && compressor.method != COMPRESSION_NONE) {
+        fprintf(stderr, "Error: --compress applies when stamping, not to --query\n");
+        return EXIT_FAILURE;
+    }
+    if (query) {
+        char from_str[MAX_TIMESTAMP_LENGTH];
+        const char *comma = strchr(query, ',');
+        size_t from_len = comma ? (size_t)(comma - query) : strlen(query);
+        high_res_time_t now = tsi_get_high_res_time(false);
+        reference_time_t query_reference;
+        high_res_time_t from;
+        high_res_time_t to;
+        bool valid = from_len < sizeof(from_str) &&
+                     tsi_reference_time_set(&query_reference, &now) == TS_SUCCESS;
+        if (valid) {
+            memcpy(from_str, query, from_len);
+            from_str[from_len] = '\0';
+            valid = parse_query_time(from_str, &query_reference, &from) == TS_SUCCESS &&
+                    (!comma || parse_query_time(comma + 1, &query_reference, &to) == TS_SUCCESS);
+        }
+        if (!valid) {
+            fprintf(stderr, "Error: Invalid --query range: %s\n", query);
+            return EXIT_FAILURE;
+        }
+        ts_error_t query_result = index_path ? run_query(index_path, &from, comma ? &to : NULL)
+                                             : run_range_query(&from, comma ? &to : NULL, &query_reference);
+        return query_result == TS_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (follow_dir && follow_count == 0) {
+        fprintf(stderr, "Error: --follow-dir needs --follow\n");
+        return EXIT_FAILURE;
+    }
+    if (follow_count > 0) {
+#ifdef HAVE_FOLLOW
+        if (merge_mode || relative_mode || incremental_mode || since_start_mode || unique_mode ||
+            decode_mode || index_path || output_pattern || output_format == OUTPUT_FORMAT_BINARY) {
+            fprintf(stderr, "Error: --follow stamps lines as they arrive; --merge, -r, -i, -s, -u, --decode,\n"
+                            "--index, --output and binary output do not apply\n");
+            return EXIT_FAILURE;
+        }
+        if (follow_dir && compressor.method != COMPRESSION_NONE) {
+            fprintf(stderr, "Error: --compress applies to standard output, not to --follow-dir files\n");
+            return EXIT_FAILURE;
+        }
+        compiled_format_t follow_format;
+        tsi_compile_output_format(&follow_format, format);
+        clock_source_start(&clock);
+        if (compressor.method != COMPRESSION_NONE && output_compressor_start(&compressor) != TS_SUCCESS) {
+            fprintf(stderr, "Error: Cannot start output compression\n");
+            return EXIT_FAILURE;
+        }
+        ts_error_t follow_result = run_follow(follow_names, follow_count, follow_dir, &clock,
+                                              &follow_format, output_format,
+                                              compressor.method != COMPRESSION_NONE ? compressor.stream : stdout);
+        tsi_clock_source_close(&clock);
+        if (compressor.method != COMPRESSION_NONE &&
+            output_compressor_stop(&compressor, true) != TS_SUCCESS) {
+            fprintf(stderr, "Error: Failed to write compressed output\n");
+            follow_result = TS_ERROR_SYSTEM;
+        }
+        free(follow_names);
+        return follow_result == TS_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+#else
+        fprintf(stderr, "Error: --follow is not available in this build\n");
+        return EXIT_FAILURE;
+#endif
+    }
+    if (merge_mode) {
+        if (optind == argc) {
+            fprintf(stderr, "Error: --merge needs input files\n");
+            return EXIT_FAILURE;
+        }
+        if (relative_mode || incremental_mode || since_start_mode || unique_mode || clock_selected ||
+            decode_mode || index_path || output_pattern || output_format == OUTPUT_FORMAT_BINARY) {
+            fprintf(stderr, "Error: --merge orders lines by their own timestamps; -r, -i, -s, -u, -m, --clock,\n"
+                            "--decode, --index, --output and binary output do not apply\n");
+            return EXIT_FAILURE;
+        }
+        // Timestamps without a year are placed relative to now, as with -r
+        high_res_time_t now = now_frozen ? frozen_now : tsi_get_high_res_time(false);
+        reference_time_t merge_reference;
+        if (tsi_reference_time_set(&merge_reference, &now) != TS_SUCCESS) {
+            fprintf(stderr, "Error: Failed to convert reference time\n");
+            return EXIT_FAILURE;
+        }
+        if (compressor.method != COMPRESSION_NONE && output_compressor_start(&compressor) != TS_SUCCESS) {
+            fprintf(stderr, "Error: Cannot start output compression\n");
+            return EXIT_FAILURE;
+        }
+        ts_error_t merge_result = run_merge(argv + optind, (size_t)(argc - optind), output_format,
+                                            &merge_reference,
+                                            compressor.method != COMPRESSION_NONE ? compressor.stream : stdout);
+        if (compressor.method != COMPRESSION_NONE &&
+            output_compressor_stop(&compressor, true) != TS_SUCCESS) {
+            fprintf(stderr, "Error: Failed to write compressed output\n");
+            merge_result = TS_ERROR_SYSTEM;
+        }
+        return merge_result == TS_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (rotate_size > 0 && !output_pattern) {
+        fprintf(stderr, "Error: --rotate-size needs --output\n");
+        return EXIT_FAILURE;
+    }
+    if (index_path && output_pattern) {
+        fprintf(stderr, "Error: --index needs a single output file; redirect stdout instead of --output\n");
+        return EXIT_FAILURE;
+    }
+    if (index_path && compressor.method != COMPRESSION_NONE) {
+        fprintf(stderr, "Error: --index offsets are into uncompressed output; it does not work with --compress\n");
+        return EXIT_FAILURE;
+    }
+    if (index_path) {
+        if (relative_mode) {
+            fprintf(stderr, "Error: --index needs stamping times; it does not work with -r\n");
+            return EXIT_FAILURE;
+        }
+        ts_error_t index_result = output_index_open(&index, index_path, index_lines);
+        if (index_result != TS_SUCCESS) {
+            fprintf(stderr, index_result == TS_ERROR_INVALID_ARGUMENT
+                                ? "Error: --index needs the output redirected to a file\n"
+                                : "Error: Cannot create index %s\n", index_path);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Stamp through a libts context: the output format compiled once for
+    // the whole run, and the clock the options chose
+    ts_context_t *context;
+    ts_error_t context_result = ts_context_new(&context, format, NULL);
+    if (context_result != TS_SUCCESS) {
+        fprintf(stderr, "Error: Cannot set up stamping: %s\n", ts_strerror(context_result));
+        return EXIT_FAILURE;
+    }
+    context->clock = clock;
+
     // Initialize timing
-    start_time = get_high_res_time(monotonic_mode);
+    start_time = clock_source_start(&context->clock);
     last_time = start_time;
+    reference_time_t reference;
+    if (tsi_reference_time_set(&reference, &frozen_now) != TS_SUCCESS) {
+        fprintf(stderr, "Error: Failed to convert reference time\n");
+        return EXIT_FAILURE;
+    }
+    reorder.follow_clock = !now_frozen;
+
+    if (histogram) {
+        arrivals = calloc(1, sizeof(*arrivals));
+        if (!arrivals) {
+            fprintf(stderr, "Error: Out of memory\n");
+            return EXIT_FAILURE;
+        }
+        arrivals->interval_ns = histogram_interval;
+        arrivals->output = stderr;
+        // Fixed, replayed and decoded times only move with the lines
+        arrivals->live = clock.kind == CLOCK_SOURCE_SYSTEM && !decode_mode;
+        if (histogram_path) {
+            arrivals->output = fopen(histogram_path, "a");
+            if (!arrivals->output) {
+                fprintf(stderr, "Error: Cannot open --histogram-file %s: %s\n", histogram_path, strerror(errno));
+                free(arrivals);
+                return EXIT_FAILURE;
+            }
+            // Each report is one line; let a tail -f see it at once
+            setvbuf(arrivals->output, NULL, _IOLBF, 0);
+        }
+    }
+
+    // SIGUSR1 asks -S for a report.  It is blocked, here and in the
+    // threads started below, except while waiting for input.
+    if (stats) {
+        struct sigaction action = {.sa_handler = stats_request};
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGUSR1, &action, NULL);
+        stats_signal_mask(SIG_BLOCK);
+        run_stats_start(stats);
+    }
 
     // Process input line by line
-    while (fgets(line, sizeof(line), stdin)) {
+    line_reader_t reader;
+    compression_t input_compression;
+    ts_error_t open_result = line_reader_open(&reader, STDIN_FILENO,
+                                              relative_mode || decode_mode || decompress, &input_compression);
+    if (open_result != TS_SUCCESS) {
+        const char *method_name = input_compression == COMPRESSION_GZIP ? "gzip" : "zstd";
+        if (open_result == TS_ERROR_INVALID_ARGUMENT) {
+            fprintf(stderr, "Error: Input is %s-compressed and this build cannot decompress it\n",
+                    method_name);
+        } else {
+            fprintf(stderr, "Error: Cannot start %s decompression\n", method_name);
+        }
+        return EXIT_FAILURE;
+    }
+    reader.stats = stats;
+    if (decode_mode && binary_stream_start(&reader) != TS_SUCCESS) {
+        fprintf(stderr, "Error: Input is not a binary record stream\n");
+        return EXIT_FAILURE;
+    }
+    if (compressor.method != COMPRESSION_NONE && output_compressor_start(&compressor) != TS_SUCCESS) {
+        fprintf(stderr, "Error: Cannot start output compression\n");
+        return EXIT_FAILURE;
+    }
+    // Lines go to stdout, or through the compressor
+    FILE *out = compressor.method != COMPRESSION_NONE ? compressor.stream : stdout;
+    if (output_pattern) {
+        output_file_open(&output, output_pattern, rotate_size, output_format,
+                         compressor.method != COMPRESSION_NONE ? &compressor : NULL);
+    } else if (output_format == OUTPUT_FORMAT_BINARY) {
+        fwrite(BINARY_STREAM_MAGIC, 1, BINARY_STREAM_MAGIC_LENGTH, out);
+    }
+    bool new_batch;
+    line_record_t reordered = {0};  // --reorder: what it found out about the line
+    bool first_line = true;
+    while (true) {
+        // Stamping modes read the clock for the lines they write, after
+        // -u has dropped duplicates.  Synthetic clocks advance per input
+        // line, so they, and --histogram, which times every arrival, read
+        // it for skipped lines too, keeping replayed arrival times with
+        // their lines.  Decoded lines bring their time along, and -s
+        // counts from the first one.  -r measures lines read together
+        // against the same "now".
+        high_res_time_t current_time = {0};
+        bool clock_pending = false;
+        if (stats) {
+            run_stats_poll(stats);
+        }
+        if (arrivals) {
+            arrival_stats_wait(arrivals, &reader, &context->clock);
+        }
+        if (decode_mode) {
+            bool have_record;
+            if (binary_record_next(&reader, line, sizeof(line), &current_time,
+                                   &have_record, &new_batch) != TS_SUCCESS) {
+                fprintf(stderr, "Error: Corrupt binary record stream\n");
+                exit_status = EXIT_FAILURE;
+                break;
+            }
+            if (!have_record) {
+                break;
+            }
+            if (first_line) {
+                start_time = current_time;
+                last_time = current_time;
+            }
+        } else if (reorder_window ? !reorder_next(&reorder, &reader, line, sizeof(line), &new_batch,
+                                                  &reordered, &reference, stats)
+                                  : !line_reader_next(&reader, line, sizeof(line), &new_batch)) {
+            break;
+        } else if (!relative_mode) {
+            clock_pending = true;
+        }
+        first_line = false;
+        if (stats) {
+            run_stats_stage(stats, STATS_STAGE_READ);
+            run_stats_input(stats, line);
+        }
+        if (clock_pending && (arrivals || context->clock.kind == CLOCK_SOURCE_FIXED ||
+                              context->clock.kind == CLOCK_SOURCE_REPLAY)) {
+            current_time = tsi_clock_source_read(&context->clock);
+            clock_pending = false;
+            if (stats) {
+                run_stats_stage(stats, STATS_STAGE_CLOCK);
+            }
+        }
+        if (arrivals) {
+            arrival_stats_note(arrivals, &start_time, &current_time);
+        }
+        if (relative_mode && new_batch && !now_frozen) {
+            high_res_time_t now = tsi_get_high_res_time(false);
+            tsi_reference_time_set(&reference, &now);
+            if (stats) {
+                run_stats_stage(stats, STATS_STAGE_CLOCK);
+            }
+        }
+
         // Check if line is unique (different from previous line)
         if (unique_mode && strcmp(line, last_line) == 0) {
+            if (stats) {
+                stats->duplicates++;
+            }
             continue; // Skip duplicate lines
         }
+        if (clock_pending) {
+            current_time = tsi_clock_source_read(&context->clock);
+            if (stats) {
+                run_stats_stage(stats, STATS_STAGE_CLOCK);
+            }
+        }
+
+        if (index.file) {
+            output_index_note(&index, &current_time);
+        }
+
+        if (output_pattern) {
+            // Files are named after the time the line is stamped with
+            ts_error_t output_result = output_file_prepare(&output, relative_mode ? &reference.now
+                                                                                  : &current_time);
+            if (output_result != TS_SUCCESS && !output.open) {
+                fprintf(stderr, "Error: Cannot open output file for %s: %s\n", output_pattern,
+                        output_result == TS_ERROR_SYSTEM ? strerror(errno) : "invalid name");
+                exit_status = EXIT_FAILURE;
+                break;
+            }
+            if (output_result != TS_SUCCESS && !output_failed) {
+                fprintf(stderr, "Error: Cannot rotate output file %s; still writing to it\n", output.path);
+                output_failed = true;
+            }
+        }
 
-        high_res_time_t current_time = get_high_res_time(monotonic_mode);
+        line_record_t record = {.time = current_time, .late = reordered.late, .line = line};
 
         if (relative_mode) {
             // Parse existing timestamp in the line with fractional seconds
-            time_t parsed_time;
-            long fractional_seconds = 0;
-            ts_error_t parse_result = parse_timestamp_in_line_with_fractional(line, &parsed_time, &fractional_seconds);
+            time_t parsed_time = reordered.source.seconds;
+            long fractional_seconds = reordered.source.nanoseconds / 1000;
+            ts_error_t parse_result;
+            if (reorder_window) {
+                // Parsed once already, when the line was held back
+                parse_result = reordered.has_source ? TS_SUCCESS : TS_ERROR_TIME_PARSE;
+            } else {
+                parse_result =
+                    stats ? parse_timestamp_in_line_counted(line, &parsed_time, &fractional_seconds, &reference, stats)
+                          : parse_timestamp_in_line_with_fractional(line, &parsed_time, &fractional_seconds, &reference);
+            }
+            record.time = reference.now;
 
             if (parse_result == TS_SUCCESS) {
+                record.has_source = true;
+                record.source.seconds = parsed_time;
+                record.source.nanoseconds = fractional_seconds * 1000;
                 // Found a timestamp
                 if (optind < argc) {
                     // Custom format specified, convert to that format
                     char formatted_time[MAX_FORMAT_LENGTH];
                     char replaced_line[MAX_LINE_LENGTH];
-                    struct tm *tm_info = localtime(&parsed_time);
-                    if (!tm_info) {
-                        fprintf(stderr, "Error: Failed to convert timestamp\n");
-                        continue;
-                    }
-                    if (strftime(formatted_time, sizeof(formatted_time), format, tm_info) == 0) {
-                        fprintf(stderr, "Error: Format string too long\n");
-                        continue;
+                    // Plain strftime formats only: -r does not expand the ts extensions
+                    high_res_time_t parsed = {parsed_time, 0};
+                    bool rendered = context->format.fast != FAST_FORMAT_NONE &&
+                                    context->format.fast != FAST_FORMAT_CLOCK_SUBSEC &&
+                                    tsi_format_timestamp_compiled(formatted_time, sizeof(formatted_time),
+                                                                  &context->format, &parsed) == TS_SUCCESS;
+                    if (!rendered) {
+                        struct tm tm_info;
+                        if (tsi_local_time_at(&context->format.utc_offset, parsed_time,
+                                              &tm_info) != TS_SUCCESS) {
+                            fprintf(stderr, "Error: Failed to convert timestamp\n");
+                            continue;
+                        }
+                        if (strftime(formatted_time, sizeof(formatted_time), format, &tm_info) == 0) {
+                            fprintf(stderr, "Error: Format string too long\n");
+                            continue;
+                        }
                     }
                     ts_error_t replace_result = replace_timestamp_in_line(replaced_line,
                                                                         sizeof(replaced_line),
                                                                         line, formatted_time);
+                    record.stamp = formatted_time;
                     if (replace_result == TS_SUCCESS) {
-                        printf("%s", replaced_line);
+                        output.size += write_record_counted(out, stats, output_format, &record, replaced_line);
                     } else {
                         fprintf(stderr, "Error: Failed to replace timestamp\n");
-                        printf("%s", line);
+                        output.size += write_record_counted(out, stats, output_format, &record, line);
                     }
                 } else {
                     // No format specified, convert to relative time
                     char relative_time[MAX_FORMAT_LENGTH];
                     char replaced_line[MAX_LINE_LENGTH];
-                    ts_error_t format_result = format_relative_time(relative_time,
+                    ts_error_t format_result = tsi_format_relative_time(relative_time,
                                                                   sizeof(relative_time),
-                                                                  parsed_time, fractional_seconds);
+                                                                  parsed_time, fractional_seconds,
+                                                                  &reference);
                     if (format_result == TS_SUCCESS) {
                         ts_error_t replace_result = replace_timestamp_in_line(replaced_line,
                                                                             sizeof(replaced_line),
                                                                             line, relative_time);
+                        record.stamp = relative_time;
                         if (replace_result == TS_SUCCESS) {
-                            printf("%s", replaced_line);
+                            output.size += write_record_counted(out, stats, output_format, &record, replaced_line);
                         } else {
                             fprintf(stderr, "Error: Failed to replace timestamp\n");
-                            printf("%s", line);
+                            output.size += write_record_counted(out, stats, output_format, &record, line);
                         }
                     } else {
                         fprintf(stderr, "Error: Failed to format relative time\n");
-                        printf("%s", line);
+                        output.size += write_record_counted(out, stats, output_format, &record, line);
                     }
                 }
             } else {
                 // No timestamp found, pass through the line
-                printf("%s", line);
+                output.size += write_record_counted(out, stats, output_format, &record, line);
+            }
+            if (reorder.idle && reorder.count == 0) {
+                // The input went quiet: show what was held back now, not
+                // when the stdio buffer next fills
+                fflush(out);
             }
         } else if (incremental_mode) {
             // Time since last timestamp
@@ -1031,35 +4100,18 @@ int main(int argc, char *argv[]) {
             }
 
             char timestamp[MAX_FORMAT_LENGTH];
-            ts_error_t format_result = TS_ERROR_BUFFER_OVERFLOW;
-
-            if (strstr(format, "%.s") != NULL) {
-                format_result = safe_snprintf(timestamp, sizeof(timestamp),
-                                            "%ld.%06ld", diff_sec, diff_nsec / 1000);
-            } else if (strstr(format, "%.S") != NULL) {
-                long total_seconds = diff_sec % 60;
-                format_result = safe_snprintf(timestamp, sizeof(timestamp),
-                                            "%02ld.%06ld", total_seconds, diff_nsec / 1000);
-            } else if (strstr(format, "%.T") != NULL) {
-                long hours = diff_sec / SECONDS_PER_HOUR;
-                long minutes = (diff_sec % SECONDS_PER_HOUR) / SECONDS_PER_MINUTE;
-                long seconds = diff_sec % SECONDS_PER_MINUTE;
-                format_result = safe_snprintf(timestamp, sizeof(timestamp),
-                                            "%02ld:%02ld:%02ld.%06ld", hours, minutes,
-                                            seconds, diff_nsec / 1000);
-            } else {
-                struct tm *tm_info = gmtime(&diff_sec);
-                if (tm_info && strftime(timestamp, sizeof(timestamp), format, tm_info) > 0) {
-                    format_result = TS_SUCCESS;
-                }
-            }
+            ts_error_t format_result = format_elapsed_time(timestamp, sizeof(timestamp),
+                                                           &context->format, diff_sec, diff_nsec);
+            record.has_delta = true;
+            record.delta.seconds = diff_sec;
+            record.delta.nanoseconds = diff_nsec;
 
             if (format_result == TS_SUCCESS) {
-                printf("%s %s", timestamp, line);
+                record.stamp = timestamp;
             } else {
                 fprintf(stderr, "Error: Failed to format timestamp\n");
-                printf("%s", line);
             }
+            output.size += write_record_counted(out, stats, output_format, &record, NULL);
 
             if (unique_mode) {
                 strncpy(last_line, line, sizeof(last_line) - 1);
@@ -1077,46 +4129,45 @@ int main(int argc, char *argv[]) {
             }
 
             char timestamp[MAX_FORMAT_LENGTH];
-            ts_error_t format_result = TS_ERROR_BUFFER_OVERFLOW;
-
-            if (strstr(format, "%.s") != NULL) {
-                format_result = safe_snprintf(timestamp, sizeof(timestamp),
-                                            "%ld.%06ld", diff_sec, diff_nsec / 1000);
-            } else if (strstr(format, "%.S") != NULL) {
-                long total_seconds = diff_sec % 60;
-                format_result = safe_snprintf(timestamp, sizeof(timestamp),
-                                            "%02ld.%06ld", total_seconds, diff_nsec / 1000);
-            } else if (strstr(format, "%.T") != NULL) {
-                long hours = diff_sec / SECONDS_PER_HOUR;
-                long minutes = (diff_sec % SECONDS_PER_HOUR) / SECONDS_PER_MINUTE;
-                long seconds = diff_sec % SECONDS_PER_MINUTE;
-                format_result = safe_snprintf(timestamp, sizeof(timestamp),
-                                            "%02ld:%02ld:%02ld.%06ld", hours, minutes,
-                                            seconds, diff_nsec / 1000);
-            } else {
-                struct tm *tm_info = gmtime(&diff_sec);
-                if (tm_info && strftime(timestamp, sizeof(timestamp), format, tm_info) > 0) {
-                    format_result = TS_SUCCESS;
-                }
-            }
+            ts_error_t format_result = format_elapsed_time(timestamp, sizeof(timestamp),
+                                                           &context->format, diff_sec, diff_nsec);
+            record.has_delta = true;
+            record.delta.seconds = diff_sec;
+            record.delta.nanoseconds = diff_nsec;
 
             if (format_result == TS_SUCCESS) {
-                printf("%s %s", timestamp, line);
+                record.stamp = timestamp;
             } else {
                 fprintf(stderr, "Error: Failed to format timestamp\n");
-                printf("%s", line);
             }
+            output.size += write_record_counted(out, stats, output_format, &record, NULL);
 
             if (unique_mode) {
                 strncpy(last_line, line, sizeof(last_line) - 1);
                 last_line[sizeof(last_line) - 1] = '\0';
             }
         } else {
-            // Default absolute timestamp mode
-            ts_error_t result = process_line(line, format, &current_time);
+            // Default absolute timestamp mode, stamped by libts.  The time
+            // was read above rather than by ts_stamp(), as --output names
+            // and --index entries take it too.  Binary records carry the
+            // time itself; the stamp is rendered when they are decoded.
+            ts_time_t when = {(int64_t)current_time.seconds, current_time.nanoseconds};
+            char stamped[MAX_FORMAT_LENGTH + MAX_LINE_LENGTH];
+            ts_buffer_t stamp_buffer = {stamped, sizeof(stamped), 0};
+            ts_error_t result = TS_SUCCESS;
+            if (output_format == OUTPUT_FORMAT_TEXT) {
+                result = ts_stamp_at(context, &when, (ts_span_t){line, strlen(line)}, &stamp_buffer);
+            } else if (output_format == OUTPUT_FORMAT_JSON) {
+                result = ts_format(context, &when, &stamp_buffer);
+                record.stamp = stamped;
+            }
+            if (result == TS_SUCCESS) {
+                output.size += write_record_counted(out, stats, output_format, &record,
+                                                    output_format == OUTPUT_FORMAT_TEXT ? stamped : NULL);
+            }
             if (result != TS_SUCCESS) {
                 fprintf(stderr, "Error: Failed to process line\n");
-                printf("%s", line);
+                output.size += write_record_counted(out, stats, output_format, &record, line);
             }
             if (unique_mode) {
                 strncpy(last_line, line, sizeof(last_line) - 1);
@@ -1125,5 +4176,42 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+    if (reader.decompressor && input_decompressor_stop(reader.decompressor) != TS_SUCCESS) {
+        fprintf(stderr, "Error: Compressed input is corrupt or truncated\n");
+        exit_status = EXIT_FAILURE;
+    }
+    if (reorder.late > 0) {
+        fprintf(stderr, "Warning: %lu line%s arrived more than --reorder=%s late and went out of order\n",
+                reorder.late, reorder.late == 1 ? "" : "s", reorder_window);
+    }
+    reorder_free(&reorder);
+    ts_context_free(context);
+    if (output_pattern) {
+        output_file_close(&output);
+    }
+    // A compressed stream is written even for empty input, except into
+    // --output files, of which there are none then
+    if (compressor.method != COMPRESSION_NONE &&
+        output_compressor_stop(&compressor, !output_pattern) != TS_SUCCESS) {
+        fprintf(stderr, "Error: Failed to write compressed output\n");
+        exit_status = EXIT_FAILURE;
+    }
+    if (output_index_close(&index) != TS_SUCCESS) {
+        fprintf(stderr, "Error: Failed to write index %s\n", index_path);
+        exit_status = EXIT_FAILURE;
+    }
+    if (arrivals) {
+        arrival_stats_finish(arrivals);
+        if (arrivals->output != stderr && fclose(arrivals->output) != 0) {
+            fprintf(stderr, "Error: Failed to write --histogram-file %s\n", histogram_path);
+            exit_status = EXIT_FAILURE;
+        }
+        free(arrivals);
+    }
+    if (stats) {
+        fflush(stdout);
+        run_stats_stage(stats, STATS_STAGE_WRITE);
+        run_stats_report(stats);
+    }
+    return exit_status;
+}
@@ -0,0 +1,222 @@
+/*
+ * ts_internal.h - Engine interface shared by libts and the ts command
+ *
+ * Copyright (C) 2025  Michael Rice <michael@riceclan.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// The timestamping engine behind libts.h, as the ts command uses it.  ts
+// links against the same objects as libts, through a convenience library,
+// so the functions declared here are not static; libts exports only its
+// ts_* interface.  They and the engine's other globals are named tsi_*,
+// so that libts.a, which keeps them, adds no generic names to a program.
+
+#ifndef TS_INTERNAL_H
+#define TS_INTERNAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <regex.h>
+#include "libts.h"       // ts_error_t and the library interface
+
+// Compile-time assertions for portability
+#ifdef HAVE_64BIT_TIME_T
+_Static_assert(sizeof(time_t) >= 8, "time_t must be at least 64 bits");
+#endif
+
+#ifdef HAVE_64BIT_LONG
+_Static_assert(sizeof(long) >= 8, "long must be at least 64 bits");
+#endif
+
+// Configuration constants
+#define MAX_LINE_LENGTH 4096
+#define MAX_FORMAT_LENGTH 256
+#define DEFAULT_FORMAT "%b %d %H:%M:%S"
+#define MAX_TIMESTAMP_LENGTH 128
+#define MAX_TIME_STR_LENGTH 64
+#define SECONDS_PER_MINUTE 60
+#define SECONDS_PER_HOUR 3600
+#define SECONDS_PER_DAY 86400
+#define NANOSECONDS_PER_SECOND 1000000000L
+#define MICROSECONDS_PER_SECOND 1000000L
+#define FUTURE_THRESHOLD_DAYS 30
+#define MAX_EPOCH_DIGITS 19
+#define MAX_FRACTION_DIGITS 9
+#define ISO8601_DATETIME_LENGTH 19
+#define TIME_T_MAX ((time_t)(sizeof(time_t) >= 8 ? INT64_MAX : INT32_MAX))
+#define TIME_T_MIN ((time_t)(sizeof(time_t) >= 8 ? INT64_MIN : INT32_MIN))
+#define TZ_MAX_ABBREVIATION 16
+
+// High-resolution timestamp structure
+typedef struct {
+    time_t seconds;
+    long nanoseconds;
+} high_res_time_t;
+
+// Output formats with a dedicated renderer that bypasses strftime
+typedef enum {
+    FAST_FORMAT_NONE = 0,
+    FAST_FORMAT_ISO8601,        // %Y-%m-%dT%H:%M:%S
+    FAST_FORMAT_SYSLOG,         // %b %d %H:%M:%S (the default)
+    FAST_FORMAT_CLOCK,          // %H:%M:%S (the -i/-s default)
+    FAST_FORMAT_CLOCK_SUBSEC    // %.T
+} fast_format_t;
+
+// Local UTC offset, known to hold for [valid_from, valid_until)
+typedef struct {
+    time_t valid_from;
+    time_t valid_until;
+    long offset;
+    bool is_dst;
+    char abbreviation[TZ_MAX_ABBREVIATION]; // Zone name from the zone table, "" when unknown
+} utc_offset_cache_t;
+
+// Bounded output cursor for assembling a timestamp field by field
+typedef struct {
+    char *data;
+    size_t size;
+    size_t len;
+} field_buffer_t;
+
+// Where stamping modes take the time of each line from
+typedef enum {
+    CLOCK_SOURCE_SYSTEM = 0,    // clock_gettime() on clock_id
+    CLOCK_SOURCE_FIXED,         // START, then START + STEP per line
+    CLOCK_SOURCE_REPLAY,        // Arrival times read from a sidecar file
+    CLOCK_SOURCE_TSC            // Invariant TSC calibrated against CLOCK_MONOTONIC
+} clock_kind_t;
+
+// TSC to wall-clock conversion: time = anchor_time + (tsc - anchor_cycles)
+// * ns_per_cycle_q32 / 2^32, re-anchored once recalibrate_cycles pass.
+// The rate is measured against CLOCK_MONOTONIC, which never steps, and
+// anchor_time is the anchor's monotonic time plus the realtime offset.
+typedef struct {
+    uint64_t anchor_cycles;
+    high_res_time_t anchor_monotonic;
+    high_res_time_t anchor_time;
+    uint64_t ns_per_cycle_q32;
+    uint64_t recalibrate_cycles;
+    high_res_time_t last;       // Never hand out a time before this one
+} tsc_calibration_t;
+
+typedef struct {
+    clock_kind_t kind;
+    clockid_t clock_id;         // System: which kernel clock
+    tsc_calibration_t tsc;      // TSC: current calibration
+    high_res_time_t next;       // Fixed and replay: time of the next line
+    high_res_time_t step;       // Fixed: increment per line
+    FILE *replay;               // Replay: one arrival time per input line
+    bool replay_pending;        // Replay: next was read but not handed out
+} clock_source_t;
+
+// Run-level "now" for relative mode, sampled once per input batch or
+// frozen with --now, and the local offsets its parsers have looked up.
+// Each thread that parses needs its own.
+typedef struct {
+    high_res_time_t now;
+    int local_year;             // tm_year of now in local time
+    utc_offset_cache_t utc_offset;
+} reference_time_t;
+
+// Output format compiled once per run
+typedef struct {
+    char format[MAX_FORMAT_LENGTH];
+    fast_format_t fast;
+    utc_offset_cache_t utc_offset;
+} compiled_format_t;
+
+// Timestamp format patterns for detection
+typedef struct {
+    const char *pattern;
+    const char *format;
+    const char *name;
+} timestamp_format_t;
+
+// Common timestamp formats, in the order they are tried, and a NULL
+// terminator
+#define TIMESTAMP_FORMAT_COUNT 12
+extern const timestamp_format_t tsi_timestamp_formats[TIMESTAMP_FORMAT_COUNT];
+
+// A libts context: the ts command stamps through one too
+struct ts_context {
+    compiled_format_t format;
+    clock_source_t clock;
+    reference_time_t reference;     // For ts_parse and ts_relative
+    int format_hint;                // Timestamp format that matched last, -1 for none yet
+};
+
+// Floor division for epoch arithmetic on times before 1970
+static inline int64_t floor_div(int64_t value, int64_t divisor) {
+    int64_t quotient = value / divisor;
+    return quotient - ((value % divisor) < 0);
+}
+
+// Load eight bytes of str into a word, the first in the lowest byte, for
+// the SWAR (SIMD within a register) digit and escape scans
+static inline uint64_t swar_load_eight(const char *str) {
+    uint64_t word;
+    memcpy(&word, str, sizeof(word));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+static inline bool field_buffer_reserve(const field_buffer_t *out, size_t n) {
+    // Keep room for the terminating NUL, as safe_snprintf does
+    return out->len + n < out->size;
+}
+
+// Clocks
+high_res_time_t tsi_get_high_res_time(bool monotonic_mode);
+ts_error_t tsi_clock_source_open(clock_source_t *clock, const char *spec);
+high_res_time_t tsi_clock_source_read(clock_source_t *clock);
+void tsi_clock_source_read_replay(clock_source_t *clock);
+void tsi_clock_source_close(clock_source_t *clock);
+
+// Local time
+ts_error_t tsi_local_time_at(utc_offset_cache_t *cache, time_t t, struct tm *tm_info);
+ts_error_t tsi_reference_time_set(reference_time_t *reference, const high_res_time_t *now);
+ts_error_t tsi_parse_reference_time(const char *str, high_res_time_t *now);
+
+// Output formats
+void tsi_compile_output_format(compiled_format_t *compiled, const char *format);
+ts_error_t tsi_format_timestamp_compiled(char *buffer, size_t buffer_size,
+                                         compiled_format_t *compiled, const high_res_time_t *timestamp);
+ts_error_t tsi_render_fast_format(char *buffer, size_t buffer_size, fast_format_t kind,
+                                  int64_t wall_seconds, long nanoseconds);
+ts_error_t tsi_format_relative_time(char *buffer, size_t buffer_size, time_t timestamp, long fractional_seconds,
+                                    reference_time_t *reference);
+ts_error_t tsi_field_buffer_append_decimal(field_buffer_t *out, long value, int width);
+ts_error_t tsi_field_buffer_append_char(field_buffer_t *out, char c);
+ts_error_t tsi_field_buffer_append_seconds_micros(field_buffer_t *out, long seconds,
+                                                  int seconds_width, long nanoseconds);
+
+// Timestamps in input lines
+ts_error_t tsi_parse_epoch_digits(const char *str, size_t len, time_t *result);
+ts_error_t tsi_parse_fraction_digits(const char *str, size_t len, long *nanoseconds);
+const regex_t *tsi_timestamp_regex(int index);
+ts_error_t tsi_parse_timestamp_matched(int i, const char *line, const regmatch_t *found, time_t *result,
+                                       long *fractional_seconds, reference_time_t *reference);
+ts_error_t tsi_parse_timestamp_format(int i, const char *line, time_t *result, long *fractional_seconds,
+                                      reference_time_t *reference, regmatch_t *match);
+ts_error_t tsi_parse_timestamp_in_line_hinted(const char *line, int *format_hint, time_t *result,
+                                              long *fractional_seconds, reference_time_t *reference,
+                                              regmatch_t *match);
+
+#endif // TS_INTERNAL_H
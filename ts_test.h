@@ -38,17 +38,17 @@
 #include <assert.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
-// Error codes
-typedef enum {
-    TS_SUCCESS = 0,
-    TS_ERROR_INVALID_ARGUMENT = -1,
-    TS_ERROR_BUFFER_OVERFLOW = -2,
-    TS_ERROR_REGEX_COMPILE = -3,
-    TS_ERROR_REGEX_EXEC = -4,
-    TS_ERROR_TIME_PARSE = -5,
-    TS_ERROR_SYSTEM = -6
-} ts_error_t;
+#include "libts.h"       // ts_error_t and the library interface
 
 // High-resolution timestamp structure
 typedef struct {
@@ -56,20 +56,311 @@ typedef struct {
     long nanoseconds;
 } high_res_time_t;
 
+// Output formats with a dedicated renderer that bypasses strftime
+typedef enum {
+    FAST_FORMAT_NONE = 0,
+    FAST_FORMAT_ISO8601,        // %Y-%m-%dT%H:%M:%S
+    FAST_FORMAT_SYSLOG,         // %b %d %H:%M:%S (the default)
+    FAST_FORMAT_CLOCK,          // %H:%M:%S (the -i/-s default)
+    FAST_FORMAT_CLOCK_SUBSEC    // %.T
+} fast_format_t;
+
+// Local UTC offset, known to hold for [valid_from, valid_until)
+typedef struct {
+    time_t valid_from;
+    time_t valid_until;
+    long offset;
+    bool is_dst;
+    char abbreviation[16];      // Zone name from the zone table, "" when unknown
+} utc_offset_cache_t;
+
+// One local time type of a zone: offset, DST flag and abbreviation
+typedef struct {
+    long utc_offset;
+    bool is_dst;
+    char abbreviation[16];
+} tz_type_t;
+
+// A day of the year in a POSIX TZ rule and the local time it takes effect
+typedef struct {
+    char kind;                  // 'J' for Jn, 'D' for zero-based n, 'M' for Mm.w.d
+    int day;                    // Day of the year, or weekday (0 = Sunday) for Mm.w.d
+    int week;                   // Week of the month for Mm.w.d, 5 = last
+    int month;
+    long time;                  // Seconds past local midnight, may be negative or past 24h
+} tz_rule_date_t;
+
+// A POSIX TZ rule with DST, e.g. "CET-1CEST,M3.5.0,M10.5.0/3"
+typedef struct {
+    tz_type_t std;
+    tz_type_t dst;
+    tz_rule_date_t start;       // Into DST, in standard local time
+    tz_rule_date_t end;         // Back to standard time, in DST local time
+} tz_rule_t;
+
+// A zone's transition table, loaded from its TZif file
+typedef struct {
+    bool loaded;
+    bool rules_after_table;     // Footer has DST rules past the last transition
+    tz_rule_t rule;             // Those rules, when rules_after_table
+    bool tz_set;                // TZ was set (to source) when loaded
+    char source[256];
+    int64_t *transitions;
+    uint8_t *transition_types;
+    size_t transition_count;
+    tz_type_t *types;
+    size_t type_count;
+} tz_zone_t;
+
+// Bounded output cursor for assembling a timestamp field by field
+typedef struct {
+    char *data;
+    size_t size;
+    size_t len;
+} field_buffer_t;
+
+// How output lines are written
+typedef enum {
+    OUTPUT_FORMAT_TEXT = 0,     // Timestamp, space, line (the classic ts output)
+    OUTPUT_FORMAT_JSON,         // One JSON object per line (JSON Lines)
+    OUTPUT_FORMAT_BINARY        // Fixed-header binary records, read back with --decode
+} output_format_t;
+
+// One line of output as the modes produce it, before serialization
+typedef struct {
+    high_res_time_t time;       // When the line was stamped (-r: the reference "now")
+    const char *stamp;          // Rendered timestamp, interval or -r replacement; NULL if none
+    bool has_delta;             // -i/-s: the interval in delta
+    high_res_time_t delta;
+    bool has_source;            // -r: the timestamp found in the line
+    high_res_time_t source;
+    const char *input;          // --merge: name of the input the line came from
+    bool late;                  // --reorder: came out after a later line
+    const char *line;           // Input line, newline included if it had one
+} line_record_t;
+
+// Sparse time to byte offset index written beside the output (--index).
+// An entry goes in before the first line of every new second and after
+// every_lines lines; entry times never decrease.
+typedef struct {
+    FILE *file;
+    unsigned long every_lines;
+    unsigned long lines_since_entry;
+    bool has_entry;
+    high_res_time_t last_time;      // Time of the last entry
+} output_index_t;
+
+// One index entry: the line written at offset has time time_ns
+typedef struct {
+    int64_t time_ns;
+    uint64_t offset;
+} index_entry_t;
+
+// Where stamping modes take the time of each line from
+typedef enum {
+    CLOCK_SOURCE_SYSTEM = 0,    // clock_gettime() on clock_id
+    CLOCK_SOURCE_FIXED,         // START, then START + STEP per line
+    CLOCK_SOURCE_REPLAY,        // Arrival times read from a sidecar file
+    CLOCK_SOURCE_TSC            // Invariant TSC calibrated against CLOCK_REALTIME
+} clock_kind_t;
+
+// TSC to wall-clock conversion: time = anchor_time + (tsc - anchor_cycles)
+// * ns_per_cycle_q32 / 2^32, re-anchored once recalibrate_cycles pass.
+// The rate is measured against CLOCK_MONOTONIC, which never steps, and
+// anchor_time is the anchor's monotonic time plus the realtime offset.
+typedef struct {
+    uint64_t anchor_cycles;
+    high_res_time_t anchor_monotonic;
+    high_res_time_t anchor_time;
+    uint64_t ns_per_cycle_q32;
+    uint64_t recalibrate_cycles;
+    high_res_time_t last;       // Never hand out a time before this one
+} tsc_calibration_t;
+
+typedef struct {
+    clock_kind_t kind;
+    clockid_t clock_id;         // System: which kernel clock
+    tsc_calibration_t tsc;      // TSC: current calibration
+    high_res_time_t next;       // Fixed and replay: time of the next line
+    high_res_time_t step;       // Fixed: increment per line
+    FILE *replay;               // Replay: one arrival time per input line
+    bool replay_pending;        // Replay: next was read but not handed out
+} clock_source_t;
+
+// Run-level "now" for relative mode, sampled once per input batch or
+// frozen with --now
+typedef struct {
+    high_res_time_t now;
+    int local_year;             // tm_year of now in local time
+} reference_time_t;
+
+// Output format compiled once per run
+typedef struct {
+    char format[256];
+    fast_format_t fast;
+    utc_offset_cache_t utc_offset;
+} compiled_format_t;
+
+// Work on an output file for the closer thread, on a dup of the file's
+// descriptor that the thread closes when done
+typedef struct {
+    int fd;
+    bool retire;                // Close the file; otherwise reserve [size, preallocated)
+    uint64_t size;              // Bytes written; space past it was only preallocated
+    uint64_t preallocated;
+} file_job_t;
+
+// Background thread that reserves space ahead of the writer, and releases
+// unused preallocation, fsyncs and closes rotated-out files, so neither
+// writing nor rotation waits for the disk
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    file_job_t queue[OUTPUT_CLOSE_QUEUE];
+    size_t head;
+    size_t count;
+    bool running;
+    bool stopping;
+    bool preallocate_failed;    // The file system cannot reserve space
+} file_closer_t;
+
+// Compression methods of --compress and of compressed input
+typedef enum {
+    COMPRESSION_NONE = 0,
+    COMPRESSION_GZIP,
+    COMPRESSION_ZSTD
+} compression_t;
+
+// A block of output, or the end of a frame, queued for the compressor
+// thread
+typedef struct {
+    size_t length;              // Bytes in the block of the same slot
+    int fd;                     // Where the compressed data goes
+    bool end_frame;             // Then end the frame ...
+    bool end_empty;             // ... even if no data went into it
+    file_job_t retire;          // fd >= 0: then hand the file to the closer thread
+} compress_job_t;
+
+// Streaming compression of the output (--compress).  Writers use stdio on
+// stream, whose buffer is handed in COMPRESS_BLOCK_SIZE blocks to a thread
+// that compresses them and writes the result to each block's descriptor.
+typedef struct {
+    compression_t method;
+    int level;
+    FILE *stream;               // Output to compress goes here
+    int fd;                     // Descriptor for blocks queued from now on
+    file_closer_t *closer;      // Takes --output files after their last frame
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    char *blocks[COMPRESS_BLOCKS];
+    compress_job_t jobs[COMPRESS_BLOCKS];
+    size_t head;                // Oldest queued job
+    size_t count;               // Jobs waiting for the compressor thread
+    bool frame_open;            // Compressor thread only
+    bool failed;
+    bool stopping;
+#ifdef HAVE_ZLIB
+    z_stream gzip;
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *zstd;
+#endif
+} output_compressor_t;
+
+// Decompression of gzip or zstd input on a separate thread, which fills
+// LINE_READER_BUFFER_SIZE blocks for the line reader to copy out, so
+// parsing overlaps with decompression.  Allocated by
+// input_decompressor_start(); if the reader stops before the end of input,
+// the thread frees it.
+typedef struct {
+    compression_t method;
+    int fd;                     // Compressed input
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    char blocks[DECOMPRESS_BLOCKS][LINE_READER_BUFFER_SIZE];
+    size_t lengths[DECOMPRESS_BLOCKS];
+    size_t head;                // Oldest filled block
+    size_t count;               // Filled blocks not yet fully read
+    size_t offset;              // Read position in the head block (reader only)
+    bool done;                  // The thread has finished (end of input or failure)
+    bool failed;                // Read error or corrupt or truncated input
+    bool abandoned;             // The reader stopped early; the thread frees this
+    char input[DECOMPRESS_IN_SIZE];   // Compressed bytes (thread only)
+    size_t input_len;           // Starts as the bytes read while detecting the method
+#ifdef HAVE_ZLIB
+    z_stream gzip;
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_DCtx *zstd;
+#endif
+} input_decompressor_t;
+
+// Output written straight to files (--output).  The file name is rendered
+// from each line's time with the output format engine, so a new name
+// starts a new file; --rotate-size adds .1, .2, ... under one name.
+typedef struct {
+    compiled_format_t name_format;
+    char base[PATH_MAX];        // Name rendered for name_second
+    char path[PATH_MAX];        // Current file: base, or base.N after size rotations
+    time_t name_second;
+    unsigned long sequence;     // N of base.N, 0 for base itself
+    bool open;
+    uint64_t size;              // Bytes in the current file
+    uint64_t rotate_size;       // 0: no size limit
+    uint64_t preallocated;      // fallocate()d up to here
+    output_format_t format;     // Binary streams start every file with the stream magic
+    output_compressor_t *compressor;   // Every file holds whole compressed frames
+    file_closer_t closer;
+} output_file_t;
+
 // Function declarations for testing
 ts_error_t safe_strcat(char *dest, size_t dest_size, const char *src);
 ts_error_t safe_snprintf(char *dest, size_t dest_size, const char *format, ...);
-high_res_time_t get_high_res_time(bool monotonic_mode);
+high_res_time_t tsi_get_high_res_time(bool monotonic_mode);
+bool tsc_flags_are_invariant(const char *flags);
+ts_error_t tsi_clock_source_open(clock_source_t *clock, const char *spec);
+high_res_time_t tsi_clock_source_read(clock_source_t *clock);
+high_res_time_t clock_source_start(clock_source_t *clock);
+void tsi_clock_source_close(clock_source_t *clock);
+ts_error_t parse_fixed_digits(const char *str, size_t len, unsigned long *value);
+ts_error_t tsi_parse_epoch_digits(const char *str, size_t len, time_t *result);
+ts_error_t tsi_parse_fraction_digits(const char *str, size_t len, long *nanoseconds);
+ts_error_t parse_iso8601_datetime(const char *str, size_t len, struct tm *tm_info);
 ts_error_t parse_unix_timestamp_fractional(const char *timestamp_str, time_t *result);
 ts_error_t parse_unix_timestamp_plain(const char *timestamp_str, time_t *result);
 ts_error_t find_timestamp_match(const char *line, int *start_pos, int *end_pos);
 ts_error_t replace_timestamp_in_line(char *output, size_t output_size,
                                    const char *line, const char *new_timestamp);
-ts_error_t format_relative_time(char *buffer, size_t buffer_size, time_t timestamp, long fractional_seconds);
+ts_error_t tsi_reference_time_set(reference_time_t *reference, const high_res_time_t *now);
+ts_error_t tsi_format_relative_time(char *buffer, size_t buffer_size, time_t timestamp, long fractional_seconds,
+                                    const reference_time_t *reference);
 ts_error_t format_timestamp_with_subsecond(char *buffer, size_t buffer_size,
                                          const char *format, const high_res_time_t *timestamp);
-ts_error_t process_line(const char *line, const char *format,
-                       const high_res_time_t *current_time);
-ts_error_t parse_timestamp_in_line_with_fractional(const char *line, time_t *result, long *fractional_seconds);
+size_t format_padded_decimal(char *dst, long value, int width);
+ts_error_t tz_rule_parse(tz_rule_t *rule, const char *p);
+ts_error_t tz_load(tz_zone_t *zone, const char *tz);
+void tz_refresh_local_zone(void);
+ts_error_t lookup_utc_offset(utc_offset_cache_t *cache, time_t t, long *offset);
+ts_error_t tsi_local_time_at(utc_offset_cache_t *cache, time_t t, struct tm *tm_info);
+ts_error_t local_time_to_epoch(utc_offset_cache_t *cache, const struct tm *tm_info, time_t *result);
+void tsi_compile_output_format(compiled_format_t *compiled, const char *format);
+ts_error_t tsi_format_timestamp_compiled(char *buffer, size_t buffer_size,
+                                         compiled_format_t *compiled, const high_res_time_t *timestamp);
+ts_error_t format_elapsed_time(char *buffer, size_t buffer_size, const compiled_format_t *compiled,
+                               long diff_sec, long diff_nsec);
+ts_error_t json_append_escaped(field_buffer_t *out, const char *str, size_t len);
+ts_error_t format_json_record(field_buffer_t *out, const line_record_t *record);
+ts_error_t format_binary_record(field_buffer_t *out, const line_record_t *record);
+ts_error_t parse_binary_record(const unsigned char *data, size_t size, char *line, size_t line_size,
+                               high_res_time_t *time, size_t *consumed);
+size_t find_time_offset(const char *data, size_t size, const high_res_time_t *target,
+                        const reference_time_t *reference);
+void index_find_range(const index_entry_t *entries, size_t count, int64_t from_ns, int64_t to_ns,
+                      uint64_t *start, uint64_t *end);
+ts_error_t parse_timestamp_in_line_with_fractional(const char *line, time_t *result, long *fractional_seconds,
+                                                  const reference_time_t *reference);
 
 #endif /* TS_TEST_H */